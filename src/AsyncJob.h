@@ -0,0 +1,89 @@
+/*
+ * AsyncJob.h is part of Brewtarget, and is Copyright the following
+ * authors 2009-2016
+ *
+ * Brewtarget is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Brewtarget is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _ASYNCJOB_H
+#define _ASYNCJOB_H
+
+#include <functional>
+#include <QFuture>
+#include <QFutureInterface>
+#include <QFutureWatcher>
+#include <QObject>
+#include <QRunnable>
+#include <QString>
+
+#include "brewtarget.h"
+
+/*!
+ * \class AsyncJob
+ *
+ * \brief Runs a function on a QThreadPool and hands its result to a QFuture.
+ *
+ * Our database code reports errors by throwing a QString. If the function
+ * does, the error is logged and the future gets \b failed instead.
+ */
+template<class T> class AsyncJob : public QRunnable
+{
+public:
+   AsyncJob( std::function<T()> job, T const& failed = T() )
+      : _job(job), _failed(failed)
+   {
+      _interface.reportStarted();
+   }
+
+   //! \returns the future that gets the result. Take it before starting the job.
+   QFuture<T> future()
+   {
+      return _interface.future();
+   }
+
+   //! Reimplemented from QRunnable.
+   void run()
+   {
+      T result = _failed;
+      try {
+         result = _job();
+      }
+      catch (QString e) {
+         Brewtarget::logE( QString("%1 %2").arg(Q_FUNC_INFO).arg(e));
+      }
+      _interface.reportResult(result);
+      _interface.reportFinished();
+   }
+
+private:
+   std::function<T()> _job;
+   T _failed;
+   QFutureInterface<T> _interface;
+};
+
+/*!
+ * Call \b fn with the result of \b future once it is done. \b fn runs on the
+ * thread of \b context, and not at all if \b context is deleted first.
+ */
+template<class T, class F> void whenFinished( QFuture<T> future, QObject* context, F fn )
+{
+   QFutureWatcher<T>* watcher = new QFutureWatcher<T>(context);
+   QObject::connect( watcher, &QFutureWatcherBase::finished, context, [watcher, fn]() mutable {
+      fn( watcher->result() );
+      watcher->deleteLater();
+   });
+   watcher->setFuture(future);
+}
+
+#endif   /* _ASYNCJOB_H */
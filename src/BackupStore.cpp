@@ -0,0 +1,261 @@
+/*
+ * BackupStore.cpp is part of Brewtarget, and is Copyright the following
+ * authors 2009-2016
+ *
+ * Brewtarget is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Brewtarget is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "BackupStore.h"
+
+#include <QCryptographicHash>
+#include <QDirIterator>
+#include <QFile>
+#include <QFileInfo>
+#include <QSet>
+#include <QTextStream>
+
+#include "brewtarget.h"
+
+QString const BackupStore::manifestSuffix(".manifest");
+
+// First line of every manifest, so we can change the format later.
+static QString const manifestMagic("brewtarget backup 1");
+
+BackupStore::BackupStore( QString const& dir )
+   : _dir(dir),
+     _chunksWritten(0),
+     _chunksReused(0)
+{
+}
+
+bool BackupStore::isManifest( QString const& fileName )
+{
+   return fileName.endsWith(manifestSuffix);
+}
+
+QString BackupStore::chunkPath( QDir const& dir, QString const& hash )
+{
+   // Spread the pages over subdirectories, so none of them gets too big.
+   return dir.filePath( QString("chunks/%1/%2").arg(hash.left(2)).arg(hash) );
+}
+
+QStringList BackupStore::manifests() const
+{
+   return _dir.entryList( QStringList() << QString("*%1").arg(manifestSuffix), QDir::Files );
+}
+
+bool BackupStore::add( QString const& dbFileName, QString const& manifestName )
+{
+   _chunksWritten = 0;
+   _chunksReused = 0;
+
+   QFile db(dbFileName);
+   if ( ! db.open(QIODevice::ReadOnly) ) {
+      Brewtarget::logW( QString("%1 : could not read %2").arg(Q_FUNC_INFO).arg(dbFileName));
+      return false;
+   }
+
+   // Cut along the SQLite page size, from the file header, so an unchanged
+   // page always hashes the same. 1 means 65536.
+   int chunkSize = 4096;
+   QByteArray header = db.peek(100);
+   if ( header.size() == 100 && header.startsWith("SQLite format 3") ) {
+      int pageSize = (static_cast<uchar>(header.at(16)) << 8) | static_cast<uchar>(header.at(17));
+      chunkSize = pageSize == 1 ? 65536 : pageSize;
+   }
+   if ( chunkSize < 512 )
+      chunkSize = 4096;
+
+   QStringList hashes;
+   while ( ! db.atEnd() ) {
+      QByteArray chunk = db.read(chunkSize);
+      if ( chunk.isEmpty() ) {
+         Brewtarget::logW( QString("%1 : error reading %2 (%3)").arg(Q_FUNC_INFO).arg(dbFileName).arg(db.errorString()));
+         return false;
+      }
+
+      QString hash = QCryptographicHash::hash(chunk, QCryptographicHash::Sha1).toHex();
+      QString path = chunkPath(_dir, hash);
+      hashes.append(hash);
+
+      if ( QFile::exists(path) ) {
+         ++_chunksReused;
+         continue;
+      }
+
+      // Write under a temporary name, so a page is either whole or absent.
+      QDir().mkpath( QFileInfo(path).absolutePath() );
+      QFile out( QString("%1.part").arg(path) );
+      if ( ! out.open(QIODevice::WriteOnly | QIODevice::Truncate) || out.write(chunk) != chunk.size() ) {
+         Brewtarget::logW( QString("%1 : could not write %2 (%3)").arg(Q_FUNC_INFO).arg(path).arg(out.errorString()));
+         out.remove();
+         return false;
+      }
+      out.close();
+      if ( ! out.rename(path) ) {
+         out.remove();
+         return false;
+      }
+      ++_chunksWritten;
+   }
+
+   // The manifest goes last, once every page it lists is in the store.
+   QString manifestPath = _dir.filePath(manifestName);
+   QFile manifest( QString("%1.part").arg(manifestPath) );
+   if ( ! manifest.open(QIODevice::WriteOnly | QIODevice::Truncate | QIODevice::Text) ) {
+      Brewtarget::logW( QString("%1 : could not write %2").arg(Q_FUNC_INFO).arg(manifestPath));
+      return false;
+   }
+   {
+      QTextStream out(&manifest);
+      out << manifestMagic << "\n";
+      out << "size " << db.size() << "\n";
+      out << "chunk " << chunkSize << "\n";
+      foreach( QString const& hash, hashes )
+         out << hash << "\n";
+   }
+   manifest.close();
+
+   QFile::remove(manifestPath);
+   return manifest.rename(manifestPath);
+}
+
+bool BackupStore::readManifest( QString const& fileName, QStringList& hashes, qint64& size, int& chunkSize )
+{
+   QFile manifest(fileName);
+   if ( ! manifest.open(QIODevice::ReadOnly | QIODevice::Text) )
+      return false;
+
+   QTextStream in(&manifest);
+   if ( in.readLine() != manifestMagic )
+      return false;
+
+   QStringList sizeLine = in.readLine().split(' ');
+   QStringList chunkLine = in.readLine().split(' ');
+   if ( sizeLine.size() != 2 || sizeLine.at(0) != "size" ||
+        chunkLine.size() != 2 || chunkLine.at(0) != "chunk" )
+      return false;
+
+   size = sizeLine.at(1).toLongLong();
+   chunkSize = chunkLine.at(1).toInt();
+
+   hashes.clear();
+   while ( ! in.atEnd() ) {
+      QString hash = in.readLine().trimmed();
+      if ( ! hash.isEmpty() )
+         hashes.append(hash);
+   }
+   return true;
+}
+
+bool BackupStore::restore( QString const& manifestFileName, QString const& destFileName )
+{
+   QStringList hashes;
+   qint64 size;
+   int chunkSize;
+   if ( ! readManifest(manifestFileName, hashes, size, chunkSize) ) {
+      Brewtarget::logW( QString("%1 : %2 is not a backup manifest").arg(Q_FUNC_INFO).arg(manifestFileName));
+      return false;
+   }
+
+   QDir dir = QFileInfo(manifestFileName).absoluteDir();
+   QFile out(destFileName);
+   if ( ! out.open(QIODevice::WriteOnly | QIODevice::Truncate) )
+      return false;
+
+   foreach( QString const& hash, hashes ) {
+      QFile chunk( chunkPath(dir, hash) );
+      QByteArray data;
+      if ( chunk.open(QIODevice::ReadOnly) )
+         data = chunk.readAll();
+
+      // A missing or damaged page makes the whole backup useless.
+      if ( data.isEmpty() || QCryptographicHash::hash(data, QCryptographicHash::Sha1).toHex() != hash ) {
+         Brewtarget::logW( QString("%1 : page %2 is missing or damaged").arg(Q_FUNC_INFO).arg(hash));
+         out.remove();
+         return false;
+      }
+      out.write(data);
+   }
+   out.close();
+
+   if ( out.size() != size ) {
+      Brewtarget::logW( QString("%1 : rebuilt %2 bytes, expected %3").arg(Q_FUNC_INFO).arg(out.size()).arg(size));
+      out.remove();
+      return false;
+   }
+   return true;
+}
+
+bool BackupStore::remove( QString const& manifestName )
+{
+   if ( ! QFile::remove(_dir.filePath(manifestName)) )
+      return false;
+
+   // Collect every page the remaining backups still need. Anything else,
+   // including pages left half written, can go.
+   QSet<QString> inUse;
+   foreach( QString const& name, manifests() ) {
+      QStringList hashes;
+      qint64 size;
+      int chunkSize;
+      if ( readManifest(_dir.filePath(name), hashes, size, chunkSize) )
+         inUse.unite( hashes.toSet() );
+   }
+
+   QDirIterator it( _dir.filePath("chunks"), QDir::Files, QDirIterator::Subdirectories );
+   while ( it.hasNext() ) {
+      it.next();
+      if ( ! inUse.contains(it.fileName()) )
+         QFile::remove(it.filePath());
+   }
+   return true;
+}
+
+int BackupStore::chunksWritten() const
+{
+   return _chunksWritten;
+}
+
+int BackupStore::chunksReused() const
+{
+   return _chunksReused;
+}
+
+qint64 BackupStore::logicalBytes() const
+{
+   qint64 total = 0;
+   foreach( QString const& name, manifests() ) {
+      QStringList hashes;
+      qint64 size;
+      int chunkSize;
+      if ( readManifest(_dir.filePath(name), hashes, size, chunkSize) )
+         total += size;
+   }
+   return total;
+}
+
+qint64 BackupStore::storedBytes() const
+{
+   qint64 total = 0;
+   foreach( QString const& name, manifests() )
+      total += QFileInfo(_dir.filePath(name)).size();
+
+   QDirIterator it( _dir.filePath("chunks"), QDir::Files, QDirIterator::Subdirectories );
+   while ( it.hasNext() ) {
+      it.next();
+      total += it.fileInfo().size();
+   }
+   return total;
+}
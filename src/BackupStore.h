@@ -0,0 +1,85 @@
+/*
+ * BackupStore.h is part of Brewtarget, and is Copyright the following
+ * authors 2009-2016
+ *
+ * Brewtarget is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Brewtarget is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _BACKUPSTORE_H
+#define _BACKUPSTORE_H
+
+class BackupStore;
+
+#include <QByteArray>
+#include <QDir>
+#include <QString>
+#include <QStringList>
+
+/*!
+ * \class BackupStore
+ *
+ * \brief Keeps database backups as content-addressed pages.
+ *
+ * Each backup is a small manifest listing the SHA-1 of every page of the
+ * database file. The pages themselves live once each under chunks/ in the
+ * backup directory, named by their hash, so a new backup only writes the
+ * pages that changed since any earlier one.
+ */
+class BackupStore
+{
+public:
+   //! \param dir is the backup directory the store lives in.
+   BackupStore( QString const& dir );
+
+   //! The extension given to manifests.
+   static QString const manifestSuffix;
+
+   //! \returns true if \b fileName is a manifest rather than a plain copy.
+   static bool isManifest( QString const& fileName );
+
+   /*!
+    * Store the database file \b dbFileName as the backup \b manifestName,
+    * which should end in \b manifestSuffix. \b dbFileName must not change
+    * while we read it.
+    */
+   bool add( QString const& dbFileName, QString const& manifestName );
+
+   //! Rebuild the database described by \b manifestFileName into \b destFileName.
+   static bool restore( QString const& manifestFileName, QString const& destFileName );
+
+   //! Remove the backup \b manifestName, and any pages no other backup uses.
+   bool remove( QString const& manifestName );
+
+   //! Pages the last add() had to write.
+   int chunksWritten() const;
+   //! Pages the last add() found already stored.
+   int chunksReused() const;
+
+   //! \returns how much space the backups would take as plain copies.
+   qint64 logicalBytes() const;
+   //! \returns how much space the store actually takes.
+   qint64 storedBytes() const;
+
+private:
+   //! Reads the page hashes, the database size and the page size out of a manifest.
+   static bool readManifest( QString const& fileName, QStringList& hashes, qint64& size, int& chunkSize );
+   static QString chunkPath( QDir const& dir, QString const& hash );
+   QStringList manifests() const;
+
+   QDir _dir;
+   int _chunksWritten;
+   int _chunksReused;
+};
+
+#endif   /* _BACKUPSTORE_H */
@@ -295,6 +295,9 @@ void BeerXMLElement::setInventory( const char* prop_name, const char* col_name,
     // Get the meta property.
     int ndx = metaObject()->indexOfProperty(prop_name);
 
+    // Inventory hangs off rows of ours, not the library's.
+    Database::instance().materialize(this);
+
     int invkey = Database::instance().getInventoryID(_table, _key);
     Brewtarget::DBTable invtable = Database::instance().getInventoryTable(_table);
     if(invkey == 0){ //no inventory row in the database so lets make one
@@ -102,6 +102,11 @@ bool BtTreeFilterProxyModel::lessThanRecipe(BtTreeModel* model, const QModelInde
             return false;
          else
             return leftRecipe->style()->name() < rightRecipe->style()->name();
+      case BtTreeItem::RECIPEOGCOL:
+      case BtTreeItem::RECIPEIBUCOL:
+      case BtTreeItem::RECIPEABVCOL:
+      case BtTreeItem::RECIPECOLORCOL:
+         return model->recipeStat(leftRecipe, left.column()).toDouble() < model->recipeStat(rightRecipe, left.column()).toDouble();
    }
    // Default will be to just do a name sort. This doesn't likely make sense,
    // but it will prevent a lot of warnings.
@@ -71,6 +71,14 @@ public:
       RECIPEBREWDATECOL, 
       //! Recipe style
       RECIPESTYLECOL, 
+      //! Recipe OG
+      RECIPEOGCOL,
+      //! Recipe IBU
+      RECIPEIBUCOL,
+      //! Recipe ABV
+      RECIPEABVCOL,
+      //! Recipe color
+      RECIPECOLORCOL,
       //! the number of columns available for recipes
       RECIPENUMCOLS 
    };
@@ -27,12 +27,14 @@
 #include <QStringBuilder>
 #include <QMimeData>
 
+#include "AsyncJob.h"
 #include "brewtarget.h"
 #include "BtTreeItem.h"
 #include "BtTreeModel.h"
 #include "BtTreeView.h"
 #include "RecipeFormatter.h"
 #include "database.h"
+#include "TransactionScope.h"
 #include "equipment.h"
 #include "fermentable.h"
 #include "hop.h"
@@ -41,13 +43,15 @@
 #include "yeast.h"
 #include "brewnote.h"
 #include "style.h"
+#include "unit.h"
 
 // =========================================================================
 // ============================ CLASS STUFF ================================
 // =========================================================================
 
 BtTreeModel::BtTreeModel(BtTreeView *parent, TypeMasks type)
-   : QAbstractItemModel(parent)
+   : QAbstractItemModel(parent),
+     _statsRunning(false)
 {
    // Initialize the tree structure
    int items = 0;
@@ -62,6 +66,19 @@ BtTreeModel::BtTreeModel(BtTreeView *parent, TypeMasks type)
          // Brewnotes need love too!
          connect( &(Database::instance()), SIGNAL(newBrewNoteSignal(BrewNote*)),this, SLOT(elementAdded(BrewNote*)));
          connect( &(Database::instance()), SIGNAL(deletedSignal(BrewNote*)),this, SLOT(elementRemoved(BrewNote*)));
+         connect( &(Database::instance()), SIGNAL(brewNotesUnloading(Recipe*)),this, SLOT(brewNotesUnloading(Recipe*)));
+         // The stat columns are calculated for all the recipes at once when
+         // they are loaded, imported or deleted. An edited recipe only
+         // redoes its own row.
+         _statsTimer.setSingleShot(true);
+         _statsTimer.setInterval(500);
+         connect( &_statsTimer, SIGNAL(timeout()), this, SLOT(calculateStats()));
+         connect( &(Database::instance()), SIGNAL(newRecipeSignal(Recipe*)), &_statsTimer, SLOT(start()));
+         connect( &(Database::instance()), SIGNAL(deletedSignal(Recipe*)), &_statsTimer, SLOT(start()));
+         _statsTimer.start();
+         _dirtyStatsTimer.setSingleShot(true);
+         _dirtyStatsTimer.setInterval(0);
+         connect( &_dirtyStatsTimer, SIGNAL(timeout()), this, SLOT(updateChangedStats()));
          _type = BtTreeItem::RECIPE;
          _mimeType = "application/x-brewtarget-recipe";
          break;
@@ -146,6 +163,35 @@ int BtTreeModel::rowCount(const QModelIndex &parent) const
    return item(parent)->childCount();
 }
 
+bool BtTreeModel::hasChildren(const QModelIndex &parent) const
+{
+   if ( canFetchMore(parent) )
+      return Database::instance().brewNoteCount( item(parent)->recipe() ) > 0;
+
+   return rowCount(parent) > 0;
+}
+
+// Brew notes are only put in the tree when their recipe is expanded. There
+// can be tens of thousands, and most are never looked at.
+bool BtTreeModel::canFetchMore(const QModelIndex &parent) const
+{
+   if ( ! parent.isValid() || ! (treeMask & RECIPEMASK) )
+      return false;
+
+   BtTreeItem* pItem = item(parent);
+   return pItem->type() == BtTreeItem::RECIPE && pItem->recipe() && ! _notesFetched.contains(pItem->recipe());
+}
+
+void BtTreeModel::fetchMore(const QModelIndex &parent)
+{
+   if ( ! canFetchMore(parent) )
+      return;
+
+   BtTreeItem* pItem = item(parent);
+   _notesFetched.insert(pItem->recipe());
+   addBrewNoteSubTree(pItem->recipe(), pItem->childNumber(), pItem->parent());
+}
+
 int BtTreeModel::columnCount( const QModelIndex &parent) const
 {
    switch(treeMask)
@@ -281,6 +327,9 @@ QVariant BtTreeModel::data(const QModelIndex &index, int role) const
          return QVariant();
    }
 
+   if ( treeMask == RECIPEMASK && index.column() >= BtTreeItem::RECIPEOGCOL )
+      return role == Qt::DisplayRole ? recipeStatData(itm->recipe(), index.column()) : QVariant();
+
    return itm->data(index.column());
 }
 
@@ -311,6 +360,112 @@ QVariant BtTreeModel::toolTipData(const QModelIndex &index) const
 
 }
 
+QVariant BtTreeModel::recipeStat(Recipe* rec, int column) const
+{
+   int row = rec ? _recipeStats.row(rec->key()) : -1;
+   if ( row < 0 )
+      return QVariant();
+
+   switch(column)
+   {
+   case BtTreeItem::RECIPEOGCOL:
+      return _recipeStats.value(row, RecipeStatsTable::OgColumn);
+   case BtTreeItem::RECIPEIBUCOL:
+      return _recipeStats.value(row, RecipeStatsTable::IBUColumn);
+   case BtTreeItem::RECIPEABVCOL:
+      return _recipeStats.value(row, RecipeStatsTable::ABVColumn);
+   case BtTreeItem::RECIPECOLORCOL:
+      return _recipeStats.value(row, RecipeStatsTable::ColorColumn);
+   }
+   return QVariant();
+}
+
+QVariant BtTreeModel::recipeStatData(Recipe* rec, int column) const
+{
+   QVariant stat = recipeStat(rec, column);
+   if ( ! stat.isValid() )
+      return stat;
+
+   switch(column)
+   {
+   case BtTreeItem::RECIPEOGCOL:
+      return Brewtarget::displayAmount(stat.toDouble(), Units::sp_grav, 3);
+   case BtTreeItem::RECIPECOLORCOL:
+      return Brewtarget::displayAmount(stat.toDouble(), Units::srm, 1);
+   default:
+      return Brewtarget::displayAmount(stat.toDouble(), 0, 1);
+   }
+}
+
+void BtTreeModel::calculateStats()
+{
+   // One at a time. Whatever changes meanwhile is caught by the next one.
+   if ( _statsRunning )
+   {
+      _statsTimer.start();
+      return;
+   }
+
+   _statsRunning = true;
+   whenFinished( Database::instance().recipeStatsAsync(), this, [this](RecipeStatsTable stats) {
+      _statsRunning = false;
+      _recipeStats = stats;
+      statsChanged(QModelIndex());
+      // Edits made while it ran may not be in it.
+      updateChangedStats();
+   });
+}
+
+void BtTreeModel::recipeChanged()
+{
+   Recipe* rec = qobject_cast<Recipe*>(sender());
+   if ( ! rec )
+      return;
+
+   // A change usually comes with several more, so take them all at once.
+   _statsDirty.insert(rec->key(), rec);
+   _dirtyStatsTimer.start();
+}
+
+void BtTreeModel::updateChangedStats()
+{
+   // The full pass picks these up when it is done.
+   if ( _statsRunning )
+      return;
+
+   QHash< int, QPointer<Recipe> > dirty = _statsDirty;
+   _statsDirty.clear();
+   foreach( QPointer<Recipe> rec, dirty )
+   {
+      if ( ! rec )
+         continue;
+
+      _recipeStats.update(rec->key(), rec->snapshot());
+
+      QModelIndex ndx = findElement(rec);
+      if ( ndx.isValid() )
+         emit dataChanged( index(ndx.row(), BtTreeItem::RECIPEOGCOL, ndx.parent()),
+                           index(ndx.row(), BtTreeItem::RECIPECOLORCOL, ndx.parent()) );
+   }
+}
+
+void BtTreeModel::statsChanged(const QModelIndex &parent)
+{
+   int rows = rowCount(parent);
+   if ( rows == 0 )
+      return;
+
+   emit dataChanged( index(0, BtTreeItem::RECIPEOGCOL, parent), index(rows-1, BtTreeItem::RECIPECOLORCOL, parent) );
+
+   // Recipes only have brew notes under them, so only folders are worth a look.
+   for ( int i = 0; i < rows; ++i )
+   {
+      QModelIndex child = index(i, 0, parent);
+      if ( ! recipe(child) )
+         statsChanged(child);
+   }
+}
+
 // This is much better, assuming the rest can be made to work
 QVariant BtTreeModel::headerData(int section, Qt::Orientation orientation, int role) const
 {
@@ -350,6 +505,14 @@ QVariant BtTreeModel::recipeHeader(int section) const
       return QVariant(tr("Brew Date"));
    case BtTreeItem::RECIPESTYLECOL:
       return QVariant(tr("Style"));
+   case BtTreeItem::RECIPEOGCOL:
+      return QVariant(tr("OG"));
+   case BtTreeItem::RECIPEIBUCOL:
+      return QVariant(tr("IBU"));
+   case BtTreeItem::RECIPEABVCOL:
+      return QVariant(tr("ABV"));
+   case BtTreeItem::RECIPECOLORCOL:
+      return QVariant(tr("Color"));
    }
 
    Brewtarget::logW( QString("BtTreeModel::getRecipeHeader Bad column: %1").arg(section));
@@ -623,10 +786,7 @@ void BtTreeModel::loadTreeModel()
          continue;
       }
 
-      // If we have brewnotes, set them up here.
-      if ( treeMask & RECIPEMASK )
-         addBrewNoteSubTree(qobject_cast<Recipe*>(elem),i,local);
-      
+      // Brewnotes wait until the recipe is expanded. See fetchMore().
       observeElement(elem);
    }
 }
@@ -851,6 +1011,9 @@ void BtTreeModel::copySelected(QList< QPair<QModelIndex, QString> > toBeCopied)
 void BtTreeModel::deleteSelected(QModelIndexList victims)
 {
    QModelIndexList toBeDeleted = victims; // trust me
+   // Deleting a folder deletes everything in it. Either all of it goes, or
+   // nothing does.
+   TransactionScope scope;
 
    while ( ! toBeDeleted.isEmpty() ) 
    {
@@ -890,6 +1053,7 @@ void BtTreeModel::deleteSelected(QModelIndexList victims)
             Brewtarget::logW(QString("deleteSelected:: unknown type %1").arg(type(ndx)));
       }
    }
+   scope.commit();
 }
 
 // =========================================================================
@@ -950,9 +1114,9 @@ void BtTreeModel::folderChanged(QString name)
       Brewtarget::logW("folderChanged:: could not insert row");
       return;
    }
-   // If we have brewnotes, set them up here.
+   // The brewnotes went with the old row. They come back when expanded.
    if ( treeMask & RECIPEMASK )
-      addBrewNoteSubTree(qobject_cast<Recipe*>(test),j,local);
+      _notesFetched.remove(qobject_cast<Recipe*>(test));
 
    if ( expand )
       emit expandFolder(treeMask,newNdx);
@@ -1248,6 +1412,13 @@ void BtTreeModel::elementAdded(BeerXMLElement* victim)
    {
       pIdx = findElement(Database::instance().getParentRecipe(qobject_cast<BrewNote*>(victim)));
       lType = BtTreeItem::BREWNOTE;
+
+      // Loading the recipe's notes picks this one up too.
+      if ( canFetchMore(pIdx) )
+      {
+         fetchMore(pIdx);
+         return;
+      }
    }
    else
       pIdx = createIndex(0,0,rootItem->child(0));
@@ -1257,23 +1428,11 @@ void BtTreeModel::elementAdded(BeerXMLElement* victim)
 
    int breadth = rowCount(pIdx);
 
+   // An imported recipe's brewnotes are fetched when it is expanded, like
+   // any other.
    if ( ! insertRow(breadth,pIdx,victim,lType) )
       return;
 
-   // We need some special processing here to add brewnotes on a recipe import
-   if ( qobject_cast<Recipe*>(victim) ) {
-      Recipe* parent = qobject_cast<Recipe*>(victim);
-      QList<BrewNote*> notes = parent->brewNotes();
-
-      if ( notes.size() )
-      {
-         pIdx = findElement(parent);
-         lType = BtTreeItem::BREWNOTE;
-         int row = 0;
-         foreach (BrewNote* note, notes)
-            insertRow(row++,pIdx,note,lType);
-      }
-   }
    observeElement(victim);
 }
 
@@ -1293,6 +1452,9 @@ void BtTreeModel::elementRemoved(BeerXMLElement* victim)
    if ( ! victim )
       return;
 
+   if ( qobject_cast<Recipe*>(victim) )
+      _notesFetched.remove(qobject_cast<Recipe*>(victim));
+
    index = findElement(victim);
    if ( ! index.isValid() )
       return;
@@ -1307,6 +1469,23 @@ void BtTreeModel::elementRemoved(BeerXMLElement* victim)
    disconnect( victim, 0, this, 0 );
 }
 
+void BtTreeModel::brewNotesUnloading(Recipe* rec)
+{
+   if ( ! _notesFetched.remove(rec) )
+      return;
+
+   QModelIndex index = findElement(rec);
+   if ( ! index.isValid() )
+      return;
+
+   int notes = rowCount(index);
+   for( int i = 0; i < notes; ++i )
+      disconnect( item(index)->child(i)->thing(), 0, this, 0 );
+
+   if ( notes > 0 )
+      removeRows(0, notes, index);
+}
+
 void BtTreeModel::observeElement(BeerXMLElement* d)
 {
    if ( ! d )
@@ -1319,6 +1498,9 @@ void BtTreeModel::observeElement(BeerXMLElement* d)
       connect( d, SIGNAL(changedName(QString)), this, SLOT(elementChanged()) );
       connect( d, SIGNAL(changedFolder(QString)), this, SLOT(folderChanged(QString)));
    }
+
+   if ( qobject_cast<Recipe*>(d) )
+      connect( d, SIGNAL(changed(QMetaProperty,QVariant)), this, SLOT(recipeChanged()) );
 }
 
 
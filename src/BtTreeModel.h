@@ -25,11 +25,17 @@ class BtTreeModel;
 #include <QModelIndex>
 #include <QVariant>
 #include <QList>
+#include <QSet>
 #include <QAbstractItemModel>
 #include <QMetaProperty>
 #include <QVariant>
 #include <QObject>
 #include <QSqlRelationalTableModel>
+#include <QTimer>
+#include <QPointer>
+#include <QHash>
+
+#include "RecipeStatsTable.h"
 
 // Forward declarations
 class BeerXMLElement;
@@ -163,6 +169,8 @@ public:
    BtFolder* folder(const QModelIndex &index) const;
    //! \brief Get BeerXMLElement at \c index.
    BeerXMLElement* thing(const QModelIndex &index) const;
+   //! \brief Get the stat shown in recipe \c column for \c rec. Invalid until it has been calculated.
+   QVariant recipeStat(Recipe* rec, int column) const;
 
    //! \brief one find method to find them all, and in darkness bind them
    QModelIndex findElement(BeerXMLElement* thing, BtTreeItem* parent = NULL);
@@ -179,6 +187,13 @@ public:
    bool removeFolder(QModelIndex ndx);
 
    QModelIndexList allChildren(QModelIndex parent);
+
+   //! \brief recipes have children before their brew notes are loaded
+   bool hasChildren(const QModelIndex &parent = QModelIndex()) const;
+   //! \brief true for recipes whose brew notes are not in the tree yet
+   bool canFetchMore(const QModelIndex &parent) const;
+   //! \brief loads the brew notes of the recipe at \c parent
+   void fetchMore(const QModelIndex &parent);
    // !\brief accept a drop action.
    bool dropMimeData(const QMimeData* data, Qt::DropAction action, int row, int column, const QModelIndex &parent);
    // !\brief what our supported drop actions are. Don't know if I need the drag option or not?
@@ -213,6 +228,16 @@ private slots:
    void elementRemoved(Yeast* victim);
    void elementRemoved(BrewNote* victim);
 
+   //! \brief drops the brew notes of \c rec from the tree before they are unloaded
+   void brewNotesUnloading(Recipe* rec);
+
+   //! \brief recalculates the stat columns of every recipe in the background
+   void calculateStats();
+   //! \brief queues the stat columns of the recipe that sent it for recalculation
+   void recipeChanged();
+   //! \brief recalculates the stat columns of the recipes changed since the last time
+   void updateChangedStats();
+
 signals:
    void expandFolder(BtTreeModel::TypeMasks kindofThing, QModelIndex fIdx);
 
@@ -249,6 +274,10 @@ private:
 
    //! \brief get a tooltip
    QVariant toolTipData(const QModelIndex &index) const;
+   //! \brief the stat in recipe \c column for \c rec, formatted for display
+   QVariant recipeStatData(Recipe* rec, int column) const;
+   //! \brief tells the views the stat columns under \c parent have changed
+   void statsChanged(const QModelIndex &parent);
 
    //! \brief Returns the list of things in a tree (e.g., recipes) as a list
    //! of BeerXMLElements. It's a convenience method to make loadTree()
@@ -262,6 +291,16 @@ private:
 
    BtTreeItem* rootItem;
    BtTreeView *parentTree;
+   //! Recipes whose brew notes are in the tree
+   QSet<Recipe*> _notesFetched;
+   //! The stats of every recipe, for the stat columns of the recipe tree
+   RecipeStatsTable _recipeStats;
+   //! Holds calculateStats() off until recipes stop coming and going
+   QTimer _statsTimer;
+   bool _statsRunning;
+   //! The recipes edited since updateChangedStats() last ran, by key
+   QHash< int, QPointer<Recipe> > _statsDirty;
+   QTimer _dirtyStatsTimer;
    TypeMasks treeMask;
    int _type;
    QString _mimeType;
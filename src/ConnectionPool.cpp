@@ -0,0 +1,340 @@
+/*
+ * ConnectionPool.cpp is part of Brewtarget, and is Copyright the following
+ * authors 2009-2016
+ *
+ * Brewtarget is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Brewtarget is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "ConnectionPool.h"
+
+#include <QMutexLocker>
+#include <QSqlError>
+#include <QSqlQuery>
+#include <QThread>
+
+ConnectionPool::ConnectionPool()
+   : _maxLeases(0),
+     _healthCheck_ms(30000),
+     _port(-1)
+{
+   _metrics.opens = 0;
+   _metrics.reuses = 0;
+   _metrics.leases = 0;
+   _metrics.leaseWaits = 0;
+   _metrics.leaseWait_ms = 0;
+   _metrics.threadExits = 0;
+   _metrics.healthChecks = 0;
+   _metrics.reconnects = 0;
+   _metrics.open = 0;
+   _metrics.peakOpen = 0;
+   setMaxLeases(4);
+}
+
+void ConnectionPool::configure( QString const& driver, QString const& databaseName,
+                                QString const& hostName, QString const& userName,
+                                QString const& password, int port,
+                                QString const& connectOptions )
+{
+   QMutexLocker locker(&_mutex);
+   _driver = driver;
+   _databaseName = databaseName;
+   _hostName = hostName;
+   _userName = userName;
+   _password = password;
+   _port = port;
+   _connectOptions = connectOptions;
+}
+
+void ConnectionPool::setMaxLeases( int n )
+{
+   n = qMax(1, n);
+   if ( n > _maxLeases )
+      _leases.release(n - _maxLeases);
+   else if ( n < _maxLeases )
+      _leases.acquire(_maxLeases - n);
+   _maxLeases = n;
+}
+
+int ConnectionPool::maxLeases() const
+{
+   return _maxLeases;
+}
+
+void ConnectionPool::setHealthCheckInterval( int ms )
+{
+   QMutexLocker locker(&_mutex);
+   _healthCheck_ms = ms;
+}
+
+void ConnectionPool::setCloseHook( std::function<void(QString const&)> hook )
+{
+   QMutexLocker locker(&_mutex);
+   _closeHook = hook;
+}
+
+void ConnectionPool::setOpenHook( std::function<void(QSqlDatabase)> hook )
+{
+   QMutexLocker locker(&_mutex);
+   _openHook = hook;
+}
+
+void ConnectionPool::adopt( QSqlDatabase const& db )
+{
+   QMutexLocker locker(&_mutex);
+   Entry entry;
+   entry.name = db.connectionName();
+   entry.lastUsed.start();
+   _connections.insert(QThread::currentThread(), entry);
+   _metrics.peakOpen = qMax( _metrics.peakOpen, ++_metrics.open );
+}
+
+QSqlDatabase ConnectionPool::connection()
+{
+   QThread* t = QThread::currentThread();
+   QString conName;
+   bool check = false;
+
+   {
+      QMutexLocker locker(&_mutex);
+      QHash<QThread*,Entry>::iterator i = _connections.find(t);
+      if ( i != _connections.end() ) {
+         ++_metrics.reuses;
+         conName = i->name;
+         check = _healthCheck_ms >= 0 && i->lastUsed.elapsed() > _healthCheck_ms;
+         i->lastUsed.restart();
+      }
+   }
+
+   if ( conName.isEmpty() ) {
+      // Create a unique connection name, just containing the addy of the thread.
+      conName = QString("0x%1").arg(reinterpret_cast<quintptr>(t), 0, 16);
+      QSqlDatabase db = open(conName);
+
+      Entry entry;
+      entry.name = conName;
+      entry.lastUsed.start();
+      // finished() comes from the exiting thread itself, which is the only
+      // one allowed to close the connection.
+      entry.onExit = QObject::connect( t, &QThread::finished, [this]() {
+         QThread* exiting = QThread::currentThread();
+         Entry gone;
+         {
+            QMutexLocker locker(&_mutex);
+            if ( ! _connections.contains(exiting) )
+               return;
+            gone = _connections.take(exiting);
+            ++_metrics.threadExits;
+         }
+         close(gone);
+      });
+
+      QMutexLocker locker(&_mutex);
+      _connections.insert(t, entry);
+      _metrics.peakOpen = qMax( _metrics.peakOpen, ++_metrics.open );
+      return db;
+   }
+
+   QSqlDatabase db = QSqlDatabase::database(conName, false);
+   // Our own connection, so nobody else can use it while we look.
+   if ( check ) {
+      {
+         QMutexLocker locker(&_mutex);
+         ++_metrics.healthChecks;
+      }
+      if ( ! healthy(db) && reconnect() )
+         db = QSqlDatabase::database(conName, false);
+   }
+   return db;
+}
+
+QString ConnectionPool::connectionName() const
+{
+   QMutexLocker locker(&_mutex);
+   return _connections.value(QThread::currentThread()).name;
+}
+
+bool ConnectionPool::reconnect()
+{
+   QString conName;
+   std::function<void(QString const&)> hook;
+   std::function<void(QSqlDatabase)> openHook;
+   {
+      QMutexLocker locker(&_mutex);
+      QHash<QThread*,Entry>::const_iterator i = _connections.constFind(QThread::currentThread());
+      if ( i == _connections.constEnd() )
+         return false;
+      conName = i->name;
+      hook = _closeHook;
+      openHook = _openHook;
+   }
+
+   // Statements prepared on the old session are no good on the new one.
+   if ( hook )
+      hook(conName);
+
+   QSqlDatabase db = QSqlDatabase::database(conName, false);
+   db.close();
+   bool ok = db.open();
+   if ( ok && openHook ) {
+      try {
+         openHook(db);
+      }
+      catch (QString) {
+         ok = false;
+      }
+   }
+
+   QMutexLocker locker(&_mutex);
+   ++_metrics.reconnects;
+   if ( ok )
+      ++_metrics.opens;
+   return ok;
+}
+
+void ConnectionPool::release()
+{
+   Entry entry;
+   {
+      QMutexLocker locker(&_mutex);
+      if ( ! _connections.contains(QThread::currentThread()) )
+         return;
+      entry = _connections.take(QThread::currentThread());
+   }
+   QObject::disconnect(entry.onExit);
+   close(entry);
+}
+
+bool ConnectionPool::lease( int timeout_ms )
+{
+   bool waited = false;
+   QElapsedTimer timer;
+   timer.start();
+
+   if ( ! _leases.tryAcquire() ) {
+      waited = true;
+      if ( timeout_ms < 0 )
+         _leases.acquire();
+      else if ( ! _leases.tryAcquire(1, timeout_ms) ) {
+         QMutexLocker locker(&_mutex);
+         ++_metrics.leaseWaits;
+         _metrics.leaseWait_ms += timer.elapsed();
+         return false;
+      }
+   }
+
+   QMutexLocker locker(&_mutex);
+   ++_metrics.leases;
+   if ( waited ) {
+      ++_metrics.leaseWaits;
+      _metrics.leaseWait_ms += timer.elapsed();
+   }
+   return true;
+}
+
+void ConnectionPool::endLease()
+{
+   _leases.release();
+}
+
+ConnectionPool::Metrics ConnectionPool::metrics() const
+{
+   QMutexLocker locker(&_mutex);
+   return _metrics;
+}
+
+QSqlDatabase ConnectionPool::open( QString const& conName )
+{
+   QString driver, databaseName, hostName, userName, password, connectOptions;
+   int port;
+   std::function<void(QSqlDatabase)> hook;
+   {
+      QMutexLocker locker(&_mutex);
+      driver = _driver;
+      databaseName = _databaseName;
+      hostName = _hostName;
+      userName = _userName;
+      password = _password;
+      port = _port;
+      connectOptions = _connectOptions;
+      hook = _openHook;
+   }
+
+   // A thread at the same address as one long gone may find its name taken.
+   if ( QSqlDatabase::contains(conName) )
+      QSqlDatabase::removeDatabase(conName);
+
+   QSqlDatabase db = QSqlDatabase::addDatabase(driver, conName);
+   db.setDatabaseName(databaseName);
+   db.setConnectOptions(connectOptions);
+   if ( ! hostName.isEmpty() ) {
+      db.setHostName(hostName);
+      db.setUserName(userName);
+      db.setPassword(password);
+      db.setPort(port);
+   }
+
+   if ( ! db.open() ) {
+      QString error = db.lastError().text();
+      db = QSqlDatabase();
+      QSqlDatabase::removeDatabase(conName);
+      throw QString("Could not open %1 for reading.\n%2")
+         .arg( hostName.isEmpty() ? databaseName : hostName ).arg(error);
+   }
+
+   if ( hook ) {
+      try {
+         hook(db);
+      }
+      catch (QString) {
+         db.close();
+         db = QSqlDatabase();
+         QSqlDatabase::removeDatabase(conName);
+         throw;
+      }
+   }
+
+   QMutexLocker locker(&_mutex);
+   ++_metrics.opens;
+   return db;
+}
+
+bool ConnectionPool::healthy( QSqlDatabase db )
+{
+   if ( ! db.isOpen() )
+      return false;
+
+   // A file does not go away on us. A server does, and the driver only
+   // notices when it next talks to it.
+   if ( db.driverName() != "QPSQL" )
+      return true;
+
+   QSqlQuery q(db);
+   return q.exec("SELECT 1");
+}
+
+void ConnectionPool::close( Entry const& entry )
+{
+   std::function<void(QString const&)> hook;
+   {
+      QMutexLocker locker(&_mutex);
+      hook = _closeHook;
+      --_metrics.open;
+   }
+
+   if ( hook )
+      hook(entry.name);
+
+   QSqlDatabase::database( entry.name, false ).close();
+   QSqlDatabase::removeDatabase( entry.name );
+}
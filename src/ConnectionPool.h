@@ -0,0 +1,170 @@
+/*
+ * ConnectionPool.h is part of Brewtarget, and is Copyright the following
+ * authors 2009-2016
+ *
+ * Brewtarget is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Brewtarget is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CONNECTIONPOOL_H
+#define _CONNECTIONPOOL_H
+
+class ConnectionPool;
+class ConnectionLease;
+
+#include <functional>
+#include <QElapsedTimer>
+#include <QHash>
+#include <QMetaObject>
+#include <QMutex>
+#include <QSemaphore>
+#include <QSqlDatabase>
+#include <QString>
+
+class QThread;
+
+/*!
+ * \class ConnectionPool
+ *
+ * \brief Hands each thread its own database connection, and takes it back
+ * when the thread exits.
+ *
+ * Qt will not let a connection be used from any thread but the one that
+ * opened it, so connections are kept per thread rather than passed around.
+ * What the pool adds:
+ *
+ *  - a connection is closed and removed when its thread finishes, instead
+ *    of staying registered forever;
+ *  - background jobs take a ConnectionLease. At most maxLeases() of them
+ *    work against the database at once, and the rest wait;
+ *  - a connection idle for a while is checked before it is handed out, and
+ *    reopened if the server went away. reconnect() does the same on demand.
+ *
+ * A lease does not stop a thread from opening a connection; it only makes
+ * it wait its turn. The GUI thread never takes one.
+ *
+ * All methods are thread-safe.
+ */
+class ConnectionPool
+{
+public:
+   typedef struct
+   {
+      //! Connections opened, including reopened ones.
+      quint64 opens;
+      //! Times a thread got its already open connection back.
+      quint64 reuses;
+      //! Leases granted.
+      quint64 leases;
+      //! Leases that had to wait for a free slot, and how long they waited.
+      quint64 leaseWaits;
+      qint64 leaseWait_ms;
+      //! Connections closed because their thread finished.
+      quint64 threadExits;
+      //! Health checks run, and how many reconnects they or reconnect() did.
+      quint64 healthChecks;
+      quint64 reconnects;
+      //! Connections open now, and the most ever open at once.
+      int open;
+      int peakOpen;
+   } Metrics;
+
+   ConnectionPool();
+
+   //! Sets what new connections connect to. Connections already open are kept.
+   void configure( QString const& driver, QString const& databaseName,
+                   QString const& hostName = QString(), QString const& userName = QString(),
+                   QString const& password = QString(), int port = -1,
+                   QString const& connectOptions = QString() );
+   //! At most \b n leases at once. Only call this while nothing is leased.
+   void setMaxLeases( int n );
+   int maxLeases() const;
+   //! Connections idle longer than \b ms are checked before being handed out.
+   void setHealthCheckInterval( int ms );
+   //! \b hook gets the name of every connection just before it is closed.
+   void setCloseHook( std::function<void(QString const&)> hook );
+   /*! \b hook gets every connection just after it is opened or reopened.
+    * It may throw a QString, which fails the open.
+    */
+   void setOpenHook( std::function<void(QSqlDatabase)> hook );
+
+   //! Make the already open \b db the calling thread's connection.
+   void adopt( QSqlDatabase const& db );
+   //! \returns the calling thread's connection, opening it if needed. Throws a QString if that fails.
+   QSqlDatabase connection();
+   //! \returns the name of the calling thread's connection, or an empty string. Never opens one.
+   QString connectionName() const;
+   //! Close and reopen the calling thread's connection. \returns true if it is open again.
+   bool reconnect();
+   //! Close the calling thread's connection, if it has one.
+   void release();
+
+   /*! Wait for a free slot, at most \b timeout_ms (-1 is forever).
+    * \returns false on timeout. Prefer ConnectionLease.
+    */
+   bool lease( int timeout_ms = -1 );
+   void endLease();
+
+   Metrics metrics() const;
+
+private:
+   typedef struct
+   {
+      QString name;
+      QElapsedTimer lastUsed;
+      QMetaObject::Connection onExit;
+   } Entry;
+
+   //! Opens a new connection called \b conName. Throws a QString if that fails.
+   QSqlDatabase open( QString const& conName );
+   //! \returns true if \b db still answers.
+   bool healthy( QSqlDatabase db );
+   //! Close and remove \b entry, which must no longer be in _connections.
+   void close( Entry const& entry );
+
+   mutable QMutex _mutex;
+   QHash< QThread*, Entry > _connections;
+   QSemaphore _leases;
+   int _maxLeases;
+   int _healthCheck_ms;
+   std::function<void(QString const&)> _closeHook;
+   std::function<void(QSqlDatabase)> _openHook;
+
+   QString _driver;
+   QString _databaseName;
+   QString _hostName;
+   QString _userName;
+   QString _password;
+   int _port;
+   QString _connectOptions;
+
+   Metrics _metrics;
+};
+
+/*!
+ * \class ConnectionLease
+ *
+ * \brief Holds one of the pool's slots for as long as it lives.
+ */
+class ConnectionLease
+{
+public:
+   ConnectionLease( ConnectionPool& pool ) : _pool(pool) { _pool.lease(); }
+   ~ConnectionLease() { _pool.endLease(); }
+
+private:
+   Q_DISABLE_COPY(ConnectionLease)
+   ConnectionPool& _pool;
+};
+
+#endif   /* _CONNECTIONPOOL_H */
@@ -0,0 +1,219 @@
+/*
+ * DatabaseBackup.cpp is part of Brewtarget, and is Copyright the following
+ * authors 2009-2016
+ *
+ * Brewtarget is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Brewtarget is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "DatabaseBackup.h"
+
+#include <QFile>
+#include <QSqlDriver>
+#include <QSqlQuery>
+#include <QVariant>
+
+#include "brewtarget.h"
+
+#ifdef HAVE_SQLITE3_BACKUP
+//! \returns the sqlite3 handle under a QSQLITE connection, or 0.
+static sqlite3* sourceHandle( QSqlDatabase db )
+{
+   if ( ! db.isOpen() || ! db.driver() )
+      return 0;
+
+   QVariant v = db.driver()->handle();
+   if ( ! v.isValid() || qstrcmp(v.typeName(), "sqlite3*") != 0 )
+      return 0;
+
+   return *static_cast<sqlite3**>(v.data());
+}
+#endif
+
+DatabaseBackup::DatabaseBackup( QSqlDatabase source, QString const& destFileName, int pagesPerStep, QObject* parent )
+   : QObject(parent),
+     _source(source),
+     _destFileName(destFileName),
+     _partFileName(QString("%1.part").arg(destFileName)),
+     _pagesPerStep(pagesPerStep),
+     _running(false),
+     _success(false)
+#ifdef HAVE_SQLITE3_BACKUP
+     , _dest(0),
+     _backup(0)
+#endif
+{
+   // Give the event loop a moment between steps, so the user gets a turn.
+   _stepTimer.setInterval(10);
+   connect( &_stepTimer, &QTimer::timeout, this, &DatabaseBackup::step );
+}
+
+DatabaseBackup::~DatabaseBackup()
+{
+   _stepTimer.stop();
+#ifdef HAVE_SQLITE3_BACKUP
+   if ( _backup )
+      sqlite3_backup_finish(_backup);
+   if ( _dest )
+      sqlite3_close(_dest);
+#endif
+   // An abandoned backup must not be mistaken for a good one.
+   if ( _running )
+      QFile::remove(_partFileName);
+}
+
+bool DatabaseBackup::isAvailable( QSqlDatabase source )
+{
+#ifdef HAVE_SQLITE3_BACKUP
+   if ( ! sourceHandle(source) )
+      return false;
+
+   // Qt may have been built with its own copy of SQLite. Its handles are only
+   // safe to give to the library we linked if the two are the same version.
+   QSqlQuery q(source);
+   if ( ! q.exec("SELECT sqlite_version()") || ! q.next() )
+      return false;
+
+   return q.value(0).toString() == QString(sqlite3_libversion());
+#else
+   Q_UNUSED(source);
+   return false;
+#endif
+}
+
+bool DatabaseBackup::start()
+{
+   if ( _running )
+      return false;
+
+   _success = false;
+   QFile::remove(_partFileName);
+
+#ifdef HAVE_SQLITE3_BACKUP
+   if ( isAvailable(_source) ) {
+      if ( sqlite3_open_v2(_partFileName.toUtf8().constData(), &_dest,
+                           SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, 0) == SQLITE_OK )
+         _backup = sqlite3_backup_init(_dest, "main", sourceHandle(_source), "main");
+
+      if ( ! _backup ) {
+         Brewtarget::logW( QString("%1 : could not start backup to %2 (%3)")
+                              .arg(Q_FUNC_INFO)
+                              .arg(_destFileName)
+                              .arg(_dest ? sqlite3_errmsg(_dest) : "out of memory"));
+         sqlite3_close(_dest);
+         _dest = 0;
+         QFile::remove(_partFileName);
+         return false;
+      }
+
+      _running = true;
+      _stepTimer.start();
+      return true;
+   }
+#endif
+
+   // Without the backup API, copy the whole file. Other connections, like
+   // the worker's, can still write. A read transaction on ours keeps the
+   // file as it is until we are done. Without WAL, their commits wait for
+   // it. With WAL, nothing past our snapshot is checkpointed into the file.
+   _running = true;
+   QSqlQuery pin(_source);
+   bool pinned = pin.exec("BEGIN");
+   if ( pinned && ! pin.exec("SELECT 1 FROM sqlite_master LIMIT 1") )
+      Brewtarget::logW( QString("%1 : could not hold the file for the copy").arg(Q_FUNC_INFO));
+   pin.finish();
+   bool copied = QFile::copy(_source.databaseName(), _partFileName);
+   if ( pinned )
+      pin.exec("COMMIT");
+   emit progress(1, 1);
+   close(copied);
+   return copied;
+}
+
+bool DatabaseBackup::finish()
+{
+#ifdef HAVE_SQLITE3_BACKUP
+   if ( _running && _backup ) {
+      int pagesPerStep = _pagesPerStep;
+      _pagesPerStep = -1;
+      step();
+      _pagesPerStep = pagesPerStep;
+   }
+#endif
+   return ! _running && _success;
+}
+
+bool DatabaseBackup::isRunning() const
+{
+   return _running;
+}
+
+QString DatabaseBackup::destination() const
+{
+   return _destFileName;
+}
+
+void DatabaseBackup::step()
+{
+#ifdef HAVE_SQLITE3_BACKUP
+   if ( ! _backup )
+      return;
+
+   int rc = sqlite3_backup_step(_backup, _pagesPerStep);
+   int pageCount = sqlite3_backup_pagecount(_backup);
+   emit progress( pageCount - sqlite3_backup_remaining(_backup), pageCount );
+
+   // Busy or locked just means try again the next time around.
+   if ( rc == SQLITE_OK || rc == SQLITE_BUSY || rc == SQLITE_LOCKED )
+      return;
+
+   if ( rc != SQLITE_DONE ) {
+      Brewtarget::logW( QString("%1 : backup to %2 failed (%3)")
+                           .arg(Q_FUNC_INFO)
+                           .arg(_destFileName)
+                           .arg(sqlite3_errmsg(_dest)));
+   }
+   close( rc == SQLITE_DONE );
+#endif
+}
+
+void DatabaseBackup::close( bool success )
+{
+   _stepTimer.stop();
+
+#ifdef HAVE_SQLITE3_BACKUP
+   if ( _backup ) {
+      if ( sqlite3_backup_finish(_backup) != SQLITE_OK )
+         success = false;
+      _backup = 0;
+   }
+   if ( _dest ) {
+      sqlite3_close(_dest);
+      _dest = 0;
+   }
+#endif
+
+   if ( success ) {
+      // Remove the file if it already exists so the rename will succeed.
+      QFile::remove(_destFileName);
+      success = QFile::rename(_partFileName, _destFileName);
+   }
+   if ( success )
+      QFile::setPermissions( _destFileName, QFile::ReadOwner | QFile::WriteOwner | QFile::ReadGroup );
+   else
+      QFile::remove(_partFileName);
+
+   _running = false;
+   _success = success;
+   emit finished(success, _destFileName);
+}
@@ -0,0 +1,108 @@
+/*
+ * DatabaseBackup.h is part of Brewtarget, and is Copyright the following
+ * authors 2009-2016
+ *
+ * Brewtarget is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Brewtarget is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _DATABASEBACKUP_H
+#define _DATABASEBACKUP_H
+
+class DatabaseBackup;
+
+#include <QObject>
+#include <QString>
+#include <QSqlDatabase>
+#include <QTimer>
+
+#ifdef HAVE_SQLITE3_BACKUP
+#include <sqlite3.h>
+#endif
+
+/*!
+ * \class DatabaseBackup
+ *
+ * \brief Copies an open SQLite database to a file while the app keeps
+ * using it.
+ *
+ * Built with the SQLite online backup API, the copy is made a few pages at
+ * a time from the event loop. Writes made through the source connection in
+ * between steps are folded into the copy. The worker and reader connections
+ * have their own handles, so a write through one of them makes SQLite start
+ * the copy over at the next step. Either way the finished file is a
+ * consistent snapshot.
+ *
+ * A step only holds a shared lock on the source while it runs. Without WAL,
+ * a writer on another connection may wait for a step to finish. With WAL,
+ * nobody waits.
+ *
+ * Without the API, the database file is copied in one go instead, inside a
+ * read transaction on the source connection that keeps the file as it is.
+ */
+class DatabaseBackup : public QObject
+{
+   Q_OBJECT
+public:
+   /*!
+    * \param source is the open connection to back up. Its handle is given
+    *        straight to SQLite, so steps must run on the thread that owns it.
+    * \param destFileName is where the copy ends up. It is written under a
+    *        temporary name and only renamed once it is complete.
+    * \param pagesPerStep is how many pages to copy each time the event loop
+    *        comes around. Negative means everything in one step.
+    */
+   DatabaseBackup( QSqlDatabase source, QString const& destFileName, int pagesPerStep = 100, QObject* parent = 0 );
+   virtual ~DatabaseBackup();
+
+   //! \returns true if \b source can be copied page by page.
+   static bool isAvailable( QSqlDatabase source );
+
+   /*!
+    * Start the backup. Steps are run from the event loop, so this returns
+    * right away unless the file has to be copied whole.
+    * \returns false if the backup could not be started.
+    */
+   bool start();
+   //! Copy whatever is left without going back to the event loop.
+   bool finish();
+   //! \returns true between start() and finished().
+   bool isRunning() const;
+   QString destination() const;
+
+signals:
+   //! Emitted after each step.
+   void progress( int pagesDone, int pageCount );
+   //! Emitted once, when the backup is complete or has failed.
+   void finished( bool success, QString const& destFileName );
+
+private slots:
+   void step();
+
+private:
+   void close( bool success );
+
+   QSqlDatabase _source;
+   QString _destFileName;
+   QString _partFileName;
+   int _pagesPerStep;
+   bool _running;
+   bool _success;
+   QTimer _stepTimer;
+#ifdef HAVE_SQLITE3_BACKUP
+   sqlite3* _dest;
+   sqlite3_backup* _backup;
+#endif
+};
+
+#endif   /* _DATABASEBACKUP_H */
@@ -0,0 +1,406 @@
+/*
+ * DatabasePurge.cpp is part of Brewtarget, and is Copyright the following
+ * authors 2009-2016
+ *
+ * Brewtarget is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Brewtarget is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "DatabasePurge.h"
+
+#include <QSqlError>
+#include <QSqlQuery>
+#include <QSqlRecord>
+#include <QStringList>
+#include <QVariant>
+
+#include "brewtarget.h"
+
+// Removing a recipe can free its ingredients, and removing those their
+// parents. A few rounds catch all of that.
+static int const maxSweeps = 4;
+
+DatabasePurge::DatabasePurge( QSqlDatabase db, int rowsPerStep, QObject* parent )
+   : QObject(parent),
+     _db(db),
+     _isPgsql(db.driverName() == "QPSQL"),
+     _rowsPerStep(qMax(1, rowsPerStep)),
+     _firstPurgeStep(0),
+     _lastPurgeStep(-1),
+     _position(0),
+     _sweep(0),
+     _purgedThisSweep(false),
+     _vacuumChecked(false),
+     _rowsPurged(0),
+     _bytesBefore(0),
+     _running(false)
+{
+   // Give the event loop a moment between steps, so the user gets a turn.
+   _stepTimer.setInterval(10);
+   connect( &_stepTimer, &QTimer::timeout, this, &DatabasePurge::step );
+}
+
+DatabasePurge::~DatabasePurge()
+{
+   _stepTimer.stop();
+}
+
+bool DatabasePurge::isLinkTable( QString const& table )
+{
+   return table.endsWith("_in_recipe") || table.endsWith("_children") || table.endsWith("_in_inventory");
+}
+
+QString DatabasePurge::ownerColumn( QString const& table )
+{
+   // A recipe owns its ingredient links, and a copy owns the link to the
+   // ingredient it was copied from. Inventory rows have only one side.
+   if ( table.endsWith("_in_recipe") )
+      return "recipe_id";
+   if ( table.endsWith("_children") )
+      return "child_id";
+   return QString();
+}
+
+QString DatabasePurge::refTable( QString const& table, QString const& column ) const
+{
+   foreach( ForeignKey const& fk, _foreignKeys ) {
+      if ( fk.table == table && fk.column == column )
+         return fk.refTable;
+   }
+   return QString();
+}
+
+void DatabasePurge::plan()
+{
+   QSqlQuery q(_db);
+   QStringList tables = _db.tables();
+   tables.sort();
+
+   _foreignKeys.clear();
+   _softDeleted.clear();
+   _steps.clear();
+
+   if ( _isPgsql ) {
+      QString fkQuery = "SELECT kcu.table_name, kcu.column_name, ccu.table_name "
+                        "FROM information_schema.table_constraints tc "
+                        "JOIN information_schema.key_column_usage kcu "
+                        "ON tc.constraint_name = kcu.constraint_name AND tc.table_schema = kcu.table_schema "
+                        "JOIN information_schema.constraint_column_usage ccu "
+                        "ON tc.constraint_name = ccu.constraint_name AND tc.table_schema = ccu.table_schema "
+                        "WHERE tc.constraint_type = 'FOREIGN KEY' AND tc.table_schema = current_schema()";
+      if ( ! q.exec(fkQuery) )
+         throw QString("Could not read the foreign keys : %1").arg(q.lastError().text());
+      while ( q.next() ) {
+         ForeignKey fk = { q.value(0).toString(), q.value(1).toString(), q.value(2).toString() };
+         _foreignKeys.append(fk);
+      }
+   }
+   else {
+      foreach( QString table, tables ) {
+         if ( ! q.exec( QString("PRAGMA foreign_key_list(%1)").arg(table) ) )
+            throw QString("Could not read the foreign keys of %1 : %2").arg(table).arg(q.lastError().text());
+         while ( q.next() ) {
+            ForeignKey fk = { table, q.record().value("from").toString(), q.record().value("table").toString() };
+            _foreignKeys.append(fk);
+         }
+      }
+   }
+   q.finish();
+
+   foreach( QString table, tables ) {
+      if ( isLinkTable(table) ) {
+         Step s = { OrphanLinks, table };
+         _steps.append(s);
+      }
+   }
+
+   _firstPurgeStep = _steps.size();
+   foreach( QString table, tables ) {
+      if ( _db.record(table).contains("deleted") ) {
+         _softDeleted.insert(table);
+         Step s = { PurgeRows, table };
+         _steps.append(s);
+      }
+   }
+   _lastPurgeStep = _steps.size() - 1;
+
+   // SQLite compacts the whole file at once; PostgreSQL goes by table.
+   if ( _isPgsql ) {
+      foreach( QString table, tables ) {
+         if ( isLinkTable(table) || _softDeleted.contains(table) ) {
+            Step s = { Compact, table };
+            _steps.append(s);
+         }
+      }
+   }
+   else {
+      Step compactStep = { Compact, QString() };
+      Step analyzeStep = { Analyze, QString() };
+      _steps.append(compactStep);
+      _steps.append(analyzeStep);
+   }
+}
+
+bool DatabasePurge::start( int resumeAt )
+{
+   if ( _running || ! _db.isOpen() )
+      return false;
+
+   try {
+      plan();
+   }
+   catch (QString e) {
+      Brewtarget::logW( QString("%1 %2").arg(Q_FUNC_INFO).arg(e));
+      return false;
+   }
+
+   // A different schema could mean different steps; start over then.
+   _position = resumeAt >= 0 && resumeAt < _steps.size() ? resumeAt : 0;
+   _sweep = 0;
+   _purgedThisSweep = false;
+   _rowsPurged = 0;
+   _bytesBefore = databaseBytes();
+   _running = true;
+   _stepTimer.start();
+   return true;
+}
+
+void DatabasePurge::stop()
+{
+   _stepTimer.stop();
+   _running = false;
+}
+
+bool DatabasePurge::isRunning() const
+{
+   return _running;
+}
+
+int DatabasePurge::position() const
+{
+   return _position;
+}
+
+void DatabasePurge::step()
+{
+   if ( _position >= _steps.size() ) {
+      close(true);
+      return;
+   }
+
+   Step const s = _steps.at(_position);
+   bool done = true;
+
+   try {
+      switch( s.type ) {
+         case OrphanLinks:
+            removeOrphanLinks(s.table);
+            break;
+         case PurgeRows: {
+            int n = purgeRows(s.table);
+            if ( n > 0 )
+               _purgedThisSweep = true;
+            // A full batch means there may be more in this table.
+            done = n < _rowsPerStep;
+            break;
+         }
+         case Compact:
+            done = compact(s.table);
+            break;
+         case Analyze: {
+            QSqlQuery q(_db);
+            if ( ! q.exec("ANALYZE") )
+               Brewtarget::logW( QString("%1 : ANALYZE failed: %2").arg(Q_FUNC_INFO).arg(q.lastError().text()));
+            break;
+         }
+      }
+   }
+   catch (QString e) {
+      Brewtarget::logW( QString("%1 %2").arg(Q_FUNC_INFO).arg(e));
+      close(false);
+      return;
+   }
+
+   if ( ! done )
+      return;
+
+   ++_position;
+   if ( _position == _lastPurgeStep + 1 && _purgedThisSweep && _sweep < maxSweeps - 1 ) {
+      _position = _firstPurgeStep;
+      _purgedThisSweep = false;
+      ++_sweep;
+   }
+   emit progress( _position, _steps.size() );
+}
+
+void DatabasePurge::removeOrphanLinks( QString const& table )
+{
+   QSqlQuery q(_db);
+
+   foreach( ForeignKey const& fk, _foreignKeys ) {
+      if ( fk.table != table )
+         continue;
+
+      // A zero parent is how the *_children tables say "no parent".
+      QString del = QString("DELETE FROM %1 WHERE %2 IS NOT NULL AND %2 <> 0 "
+                            "AND NOT EXISTS ( SELECT 1 FROM %3 r WHERE r.id = %1.%2 )")
+                       .arg(table).arg(fk.column).arg(fk.refTable);
+      if ( ! q.exec(del) )
+         throw QString("Could not execute %1 : %2").arg(del).arg(q.lastError().text());
+      if ( q.numRowsAffected() > 0 )
+         _rowsPurged += q.numRowsAffected();
+   }
+}
+
+int DatabasePurge::purgeRows( QString const& table )
+{
+   QStringList conditions;
+   conditions << QString("t.deleted = %1").arg(Brewtarget::dbTrue());
+
+   // Rows of our own table can refer to each other, so they go through the
+   // same rules and a later sweep picks up what this one had to leave.
+   foreach( ForeignKey const& fk, _foreignKeys ) {
+      if ( fk.refTable != table )
+         continue;
+
+      if ( ! isLinkTable(fk.table) ) {
+         conditions << QString("NOT EXISTS ( SELECT 1 FROM %1 r WHERE r.%2 = t.id )")
+                          .arg(fk.table).arg(fk.column);
+         continue;
+      }
+
+      // A link only keeps the row if it is not the owner's side and the
+      // owner is still alive.
+      QString owner = ownerColumn(fk.table);
+      if ( owner.isEmpty() || owner == fk.column )
+         continue;
+
+      QString ownerTable = refTable(fk.table, owner);
+      if ( _softDeleted.contains(ownerTable) )
+         conditions << QString("NOT EXISTS ( SELECT 1 FROM %1 l JOIN %2 o ON o.id = l.%3 "
+                               "WHERE l.%4 = t.id AND o.deleted = %5 )")
+                          .arg(fk.table).arg(ownerTable).arg(owner).arg(fk.column).arg(Brewtarget::dbFalse());
+      else
+         conditions << QString("NOT EXISTS ( SELECT 1 FROM %1 l WHERE l.%2 = t.id )")
+                          .arg(fk.table).arg(fk.column);
+   }
+
+   QSqlQuery q(_db);
+   QString select = QString("SELECT t.id FROM %1 t WHERE %2 LIMIT %3")
+                       .arg(table).arg(conditions.join(" AND ")).arg(_rowsPerStep);
+   if ( ! q.exec(select) )
+      throw QString("Could not execute %1 : %2").arg(select).arg(q.lastError().text());
+
+   QList<int> keys;
+   QStringList ids;
+   while ( q.next() ) {
+      keys.append( q.value(0).toInt() );
+      ids.append( q.value(0).toString() );
+   }
+   q.finish();
+
+   if ( keys.isEmpty() )
+      return 0;
+
+   QString idList = ids.join(",");
+   int linkRows = 0;
+
+   _db.transaction();
+   try {
+      // The links first, or the foreign keys will not let the rows go.
+      foreach( ForeignKey const& fk, _foreignKeys ) {
+         if ( fk.refTable != table || ! isLinkTable(fk.table) )
+            continue;
+
+         QString del = QString("DELETE FROM %1 WHERE %2 IN (%3)").arg(fk.table).arg(fk.column).arg(idList);
+         if ( ! q.exec(del) )
+            throw QString("Could not execute %1 : %2").arg(del).arg(q.lastError().text());
+         linkRows += qMax(0, q.numRowsAffected());
+      }
+
+      QString del = QString("DELETE FROM %1 WHERE id IN (%2)").arg(table).arg(idList);
+      if ( ! q.exec(del) )
+         throw QString("Could not execute %1 : %2").arg(del).arg(q.lastError().text());
+   }
+   catch (QString) {
+      _db.rollback();
+      throw;
+   }
+   _db.commit();
+
+   _rowsPurged += keys.size() + linkRows;
+   emit purged(table, keys);
+   return keys.size();
+}
+
+bool DatabasePurge::compact( QString const& table )
+{
+   QSqlQuery q(_db);
+
+   if ( _isPgsql ) {
+      if ( ! q.exec( QString("VACUUM ANALYZE %1").arg(table) ) )
+         Brewtarget::logW( QString("%1 : could not vacuum %2: %3").arg(Q_FUNC_INFO).arg(table).arg(q.lastError().text()));
+      return true;
+   }
+
+   // Incremental vacuum only works once the file is set up for it, and that
+   // takes one full VACUUM. Every later run gets away with freeing pages.
+   if ( ! _vacuumChecked ) {
+      _vacuumChecked = true;
+      if ( q.exec("PRAGMA auto_vacuum") && q.next() && q.value(0).toInt() != 2 ) {
+         q.finish();
+         if ( ! q.exec("PRAGMA auto_vacuum = INCREMENTAL") || ! q.exec("VACUUM") )
+            Brewtarget::logW( QString("%1 : could not vacuum: %2").arg(Q_FUNC_INFO).arg(q.lastError().text()));
+         return true;
+      }
+      q.finish();
+   }
+
+   // The pragma frees a page each time it is stepped.
+   if ( ! q.exec( QString("PRAGMA incremental_vacuum(%1)").arg(_rowsPerStep) ) ) {
+      Brewtarget::logW( QString("%1 : could not vacuum: %2").arg(Q_FUNC_INFO).arg(q.lastError().text()));
+      return true;
+   }
+   while ( q.next() )
+      ;
+   q.finish();
+
+   return ! q.exec("PRAGMA freelist_count") || ! q.next() || q.value(0).toInt() == 0;
+}
+
+qint64 DatabasePurge::databaseBytes()
+{
+   QSqlQuery q(_db);
+
+   if ( _isPgsql ) {
+      if ( q.exec("SELECT pg_database_size(current_database())") && q.next() )
+         return q.value(0).toLongLong();
+      return 0;
+   }
+
+   qint64 pageCount = 0;
+   if ( q.exec("PRAGMA page_count") && q.next() )
+      pageCount = q.value(0).toLongLong();
+   if ( q.exec("PRAGMA page_size") && q.next() )
+      return pageCount * q.value(0).toLongLong();
+   return 0;
+}
+
+void DatabasePurge::close( bool success )
+{
+   _stepTimer.stop();
+   _running = false;
+
+   qint64 bytes = qMax( Q_INT64_C(0), _bytesBefore - databaseBytes() );
+   emit finished(success, _rowsPurged, bytes);
+}
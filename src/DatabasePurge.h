@@ -0,0 +1,148 @@
+/*
+ * DatabasePurge.h is part of Brewtarget, and is Copyright the following
+ * authors 2009-2016
+ *
+ * Brewtarget is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Brewtarget is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _DATABASEPURGE_H
+#define _DATABASEPURGE_H
+
+class DatabasePurge;
+
+#include <QList>
+#include <QObject>
+#include <QSet>
+#include <QSqlDatabase>
+#include <QString>
+#include <QTimer>
+
+/*!
+ * \class DatabasePurge
+ *
+ * \brief Removes soft-deleted rows for good, then compacts the database.
+ *
+ * Deleting an ingredient only sets its deleted column, so the rows stay
+ * behind and every scan still walks over them. This works through the
+ * database in small steps from the event loop:
+ *
+ *  - link rows (*_in_recipe, *_children, *_in_inventory) pointing at rows
+ *    that do not exist are removed;
+ *  - deleted rows nothing live refers to are removed, along with their link
+ *    rows. A row still in a live recipe, the parent of a live copy, or
+ *    listed in a bt_* table stays. This repeats while it finds more, since
+ *    removing a recipe can free its ingredients;
+ *  - the free space is given back, with incremental VACUUM on SQLite and
+ *    VACUUM ANALYZE on PostgreSQL, and the statistics refreshed.
+ *
+ * The steps run on the thread of the connection, which is the GUI thread.
+ * The very first run on an SQLite file is the exception to "small": it
+ * needs one full VACUUM to turn incremental vacuum on, and that blocks
+ * until the whole file is rewritten.
+ *
+ * Every step is its own transaction, so the job can be stopped at any
+ * point and started again later from position().
+ */
+class DatabasePurge : public QObject
+{
+   Q_OBJECT
+public:
+   /*!
+    * \param db is the open connection to clean. Steps run on the thread
+    *        that owns it.
+    * \param rowsPerStep is how many rows to remove each time the event loop
+    *        comes around.
+    */
+   DatabasePurge( QSqlDatabase db, int rowsPerStep = 200, QObject* parent = 0 );
+   virtual ~DatabasePurge();
+
+   /*!
+    * Start, or pick up where an earlier job stopped.
+    * \param resumeAt is the position() the earlier job had.
+    * \returns false if the job could not be started.
+    */
+   bool start( int resumeAt = 0 );
+   //! Stop after the current step. position() says where to go on from.
+   void stop();
+   //! \returns true between start() and finished() or stop().
+   bool isRunning() const;
+   //! \returns the step to start from to finish the job.
+   int position() const;
+
+signals:
+   //! Emitted when the rows \b keys of \b table are gone.
+   void purged( QString const& table, QList<int> const& keys );
+   //! Emitted after each step.
+   void progress( int stepsDone, int stepCount );
+   //! Emitted once, when the job is done or has failed.
+   void finished( bool success, int rows, qint64 bytes );
+
+private slots:
+   void step();
+
+private:
+   enum StepType { OrphanLinks, PurgeRows, Compact, Analyze };
+   typedef struct
+   {
+      StepType type;
+      QString table;
+   } Step;
+   typedef struct
+   {
+      QString table;
+      QString column;
+      QString refTable;
+   } ForeignKey;
+
+   //! Reads the tables and foreign keys, and lays out the steps.
+   void plan();
+   //! \returns true for tables that only link rows together.
+   static bool isLinkTable( QString const& table );
+   //! \returns the column of a link table whose row owns the link, or an empty string.
+   static QString ownerColumn( QString const& table );
+   //! \returns the table \b column of \b table refers to, or an empty string.
+   QString refTable( QString const& table, QString const& column ) const;
+
+   //! Removes the rows of link table \b table that point nowhere.
+   void removeOrphanLinks( QString const& table );
+   //! Removes up to _rowsPerStep dead rows of \b table. \returns how many.
+   int purgeRows( QString const& table );
+   /*! Gives back some free space. \returns true once there is no more.
+    * The first call on an SQLite file without incremental vacuum runs a
+    * full VACUUM, which blocks the calling thread.
+    */
+   bool compact( QString const& table );
+   //! \returns the size of the database in bytes.
+   qint64 databaseBytes();
+   void close( bool success );
+
+   QSqlDatabase _db;
+   bool _isPgsql;
+   int _rowsPerStep;
+   QList<ForeignKey> _foreignKeys;
+   QSet<QString> _softDeleted;
+   QList<Step> _steps;
+   int _firstPurgeStep;
+   int _lastPurgeStep;
+   int _position;
+   int _sweep;
+   bool _purgedThisSweep;
+   bool _vacuumChecked;
+   int _rowsPurged;
+   qint64 _bytesBefore;
+   bool _running;
+   QTimer _stepTimer;
+};
+
+#endif   /* _DATABASEPURGE_H */
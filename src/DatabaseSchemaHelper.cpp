@@ -27,12 +27,13 @@
 #include <QDebug>
 #include <QSqlError>
 
-const int DatabaseSchemaHelper::dbVersion = 7;
+const int DatabaseSchemaHelper::dbVersion = 8;
 
 // Commands and keywords
 QString DatabaseSchemaHelper::CREATETABLE("CREATE TABLE");
 QString DatabaseSchemaHelper::ALTERTABLE("ALTER TABLE");
 QString DatabaseSchemaHelper::DROPTABLE("DROP TABLE");
+QString DatabaseSchemaHelper::CREATEINDEX("CREATE INDEX IF NOT EXISTS");
 QString DatabaseSchemaHelper::ADDCOLUMN("ADD COLUMN");
 QString DatabaseSchemaHelper::UPDATE("UPDATE");
 QString DatabaseSchemaHelper::SET("SET");
@@ -423,6 +424,12 @@ bool DatabaseSchemaHelper::create(QSqlDatabase db, Brewtarget::DBTypes dbType)
       Brewtarget::logE("create_inventoryTables() failed");
    }
 
+   // Indexes on the relationship columns======================================
+   ret &= create_indexes(q);
+   if ( ! ret ) {
+      Brewtarget::logE("create_indexes() failed");
+   }
+
    // Commit transaction
    if( hasTransaction )
       ret &= db.commit();
@@ -463,6 +470,9 @@ bool DatabaseSchemaHelper::migrateNext(int oldVersion, QSqlDatabase db)
       case 6:
          ret &= migrate_to_7(q);
          break;
+      case 7:
+         ret &= migrate_to_8(q);
+         break;
       default:
          Brewtarget::logE(QString("Unknown version %1").arg(oldVersion));
          return false;
@@ -747,6 +757,55 @@ bool DatabaseSchemaHelper::create_childTable( QSqlQuery q, QString const& tableN
    return create_table(q,create,tableName,tableid);
 }
 
+// Every lookup by a relationship column would otherwise scan the whole
+// table. The UNIQUE columns (child_id in the *_children tables and <x>_id in
+// the inventory tables) already get an index from the constraint, so they
+// do not need another one.
+bool DatabaseSchemaHelper::create_indexes(QSqlQuery q)
+{
+   bool ret = true;
+
+   ret &= create_index(q, tableFermInRec,  "recipe_id");
+   ret &= create_index(q, tableFermInRec,  "fermentable_id");
+   ret &= create_index(q, tableHopInRec,   "recipe_id");
+   ret &= create_index(q, tableHopInRec,   "hop_id");
+   ret &= create_index(q, tableMiscInRec,  "recipe_id");
+   ret &= create_index(q, tableMiscInRec,  "misc_id");
+   ret &= create_index(q, tableWaterInRec, "recipe_id");
+   ret &= create_index(q, tableWaterInRec, "water_id");
+   ret &= create_index(q, tableYeastInRec, "recipe_id");
+   ret &= create_index(q, tableYeastInRec, "yeast_id");
+   ret &= create_index(q, tableInsInRec,   "recipe_id");
+   ret &= create_index(q, tableInsInRec,   "instruction_id");
+
+   ret &= create_index(q, tableEquipChildren, "parent_id");
+   ret &= create_index(q, tableFermChildren,  "parent_id");
+   ret &= create_index(q, tableHopChildren,   "parent_id");
+   ret &= create_index(q, tableMiscChildren,  "parent_id");
+   ret &= create_index(q, tableRecChildren,   "parent_id");
+   ret &= create_index(q, tableStyleChildren, "parent_id");
+   ret &= create_index(q, tableWaterChildren, "parent_id");
+   ret &= create_index(q, tableYeastChildren, "parent_id");
+
+   ret &= create_index(q, tableBrewnote, colBNoteRecipeId);
+   ret &= create_index(q, tableMashStep, colMashStepMashId);
+
+   return ret;
+}
+
+bool DatabaseSchemaHelper::create_index( QSqlQuery q, QString const& tableName, QString const& column )
+{
+   QString create =
+      CREATEINDEX + SEP + QString("%1_%2_idx").arg(tableName).arg(column) +
+      SEP + "ON" + SEP + tableName + SEP + OPENPAREN + column + CLOSEPAREN;
+
+   bool ret = q.exec(create);
+   if ( ! ret )
+      Brewtarget::logE(QString("%1 %2: %3").arg(Q_FUNC_INFO).arg(q.lastQuery()).arg(q.lastError().text()));
+
+   return ret;
+}
+
 // This ones a bit ugly, but the meta stuff is
 bool DatabaseSchemaHelper::create_settings(QSqlQuery q)
 {
@@ -1574,3 +1633,12 @@ bool DatabaseSchemaHelper::migrate_to_7(QSqlQuery q) {
 
    return ret;
 }
+
+bool DatabaseSchemaHelper::migrate_to_8(QSqlQuery q) {
+   bool ret = true;
+
+   // Index the relationship and lookup columns
+   ret &= create_indexes(q);
+
+   return ret;
+}
@@ -46,6 +46,7 @@ private:
    static QString CREATETABLE;
    static QString ALTERTABLE;
    static QString DROPTABLE;
+   static QString CREATEINDEX;
    static QString ADDCOLUMN;
    static QString UPDATE;
    static QString SET;
@@ -405,6 +406,7 @@ private:
    static bool create_inRecipeTables(QSqlQuery q);
    static bool create_inventoryTables(QSqlQuery q);
    static bool create_childrenTables(QSqlQuery q);
+   static bool create_indexes(QSqlQuery q);
 
    //! \brief This creates a table for a bt_* table
    static bool create_btTable(QSqlQuery q, QString tableName, QString foreignTableName, Brewtarget::DBTable tableid);
@@ -414,6 +416,8 @@ private:
    static bool create_inventoryTable(QSqlQuery q, QString tableName, QString foreignTableName, Brewtarget::DBTable tableid);
    //! \brief This creates a beerXML child table
    static bool create_childTable( QSqlQuery q, QString const& tableName, QString const& foreignTable, Brewtarget::DBTable tableid);
+   //! \brief This creates an index on \c column of \c tableName
+   static bool create_index( QSqlQuery q, QString const& tableName, QString const& column );
 
    //! \brief Creating triggers is very DB specific. These isolate the specifics
    static bool create_increment_trigger(QSqlQuery q, Brewtarget::DBTypes dbType=Brewtarget::NODB);
@@ -430,4 +434,5 @@ private:
    static bool migrate_to_5(QSqlQuery q);
    static bool migrate_to_6(QSqlQuery q);
    static bool migrate_to_7(QSqlQuery q);
+   static bool migrate_to_8(QSqlQuery q);
 };
@@ -74,6 +74,7 @@
 #include "MainWindow.h"
 #include "AboutDialog.h"
 #include "database.h"
+#include "TransactionScope.h"
 #include "YeastDialog.h"
 #include "config.h"
 #include "unit.h"
@@ -186,6 +187,8 @@ MainWindow::MainWindow(QWidget* parent)
    // No connections from the database yet? Oh FSM, that probably means I'm
    // doing it wrong again.
    connect( &(Database::instance()), SIGNAL( deletedSignal(BrewNote*)), this, SLOT( closeBrewNote(BrewNote*)));
+   // One redraw for a whole batch of changes.
+   connect( &(Database::instance()), &Database::changedBatch, this, [this]() { showChanges(); } );
 }
 
 // Setup the keyboard shortcuts
@@ -516,7 +519,26 @@ void MainWindow::setupTriggers()
    else {
       connect( actionBackup_Database, &QAction::triggered, this, &MainWindow::backup );
       connect( actionRestore_Database, &QAction::triggered, this, &MainWindow::restoreFromBackup );
+
+      // Backups run in the background, so keep the user posted.
+      connect( &(Database::instance()), &Database::backupProgress, this, [this](int pagesDone, int pageCount) {
+         if ( pageCount > 0 )
+            updateStatus( tr("Backing up the database: %1%").arg( 100 * pagesDone / pageCount ) );
+      });
+      connect( &(Database::instance()), &Database::backupFinished, this, [this](bool success, QString fileName) {
+         if ( success )
+            updateStatus( tr("Database backed up to %1").arg(fileName) );
+         else
+            QMessageBox::warning( this, tr("Oops!"), tr("Could not copy the files for some reason."));
+      });
    }
+   connect( &(Database::instance()), &Database::writesFailed, this, [this](QString) {
+      updateStatus( tr("Some of your changes could not be saved yet. They will be tried again.") );
+   });
+   connect( &(Database::instance()), &Database::purgeFinished, this, [this](bool success, int rows, qint64 bytes) {
+      if ( success && rows > 0 )
+         updateStatus( tr("Removed %1 deleted rows, freed %2 kB").arg(rows).arg(bytes / 1024) );
+   });
    // Printing signals/slots.
    // Refactoring is good.  It's like a rye saison fermenting away
    connect(actionRecipePrint, &QAction::triggered, [this]() {
@@ -835,6 +857,10 @@ void MainWindow::setRecipe(Recipe* recipe)
    // Make sure this MainWindow is paying attention...
    if( recipeObs )
       disconnect( recipeObs, 0, this, 0 );
+   // The brew note tabs belong to the current recipe, so its notes have to
+   // stay loaded.
+   Database::instance().holdBrewNotes(recipe);
+   Database::instance().releaseBrewNotes(recipeObs);
    recipeObs = recipe;
 
    recStyle = recipe->style();
@@ -914,6 +940,10 @@ void MainWindow::changed(QMetaProperty prop, QVariant value)
 
    }
 
+   // A batch redraws everything once it is done, from changedBatch().
+   if ( Database::instance().deliveringBatch() )
+      return;
+
    showChanges(&prop);
 }
 
@@ -1713,23 +1743,31 @@ void MainWindow::setTreeSelection(QModelIndex item)
 void MainWindow::reduceInventory(){
 
    QModelIndexList indexes = treeView_recipe->selectionModel()->selectedRows();
-      QModelIndex bIndex;
+   QList<Recipe*> recipes;
 
-      foreach(QModelIndex selected, indexes)
-      {
-         Recipe*   rec   = treeView_recipe->recipe(selected);
+   foreach(QModelIndex selected, indexes)
+   {
+      Recipe*   rec   = treeView_recipe->recipe(selected);
+      if( rec == 0 ){
+         //try the parent recipe
+         rec = treeView_recipe->recipe(treeView_recipe->parent(selected));
          if( rec == 0 ){
-            //try the parent recipe
-            rec = treeView_recipe->recipe(treeView_recipe->parent(selected));
-            if( rec == 0 ){
-               continue;
-            }
+            continue;
          }
+      }
 
-         // Make sure everything is properly set and selected
-         if( rec != recipeObs )
-            setRecipe(rec);
+      // Make sure everything is properly set and selected
+      if( rec != recipeObs )
+         setRecipe(rec);
+
+      recipes.append(rec);
+   }
 
+   // Every recipe comes off the inventory together, or none of them do.
+   TransactionScope scope;
+
+   foreach(Recipe* rec, recipes)
+   {
       int i = 0;
       //reduce fermentables
       QList<Fermentable*> flist = rec->fermentables();
@@ -1774,6 +1812,7 @@ void MainWindow::reduceInventory(){
          }
       }
    }
+   scope.commit();
 
 }
 
@@ -1845,8 +1884,11 @@ void MainWindow::brewAgainHelper()
 void MainWindow::backup()
 {
    QString dir = QFileDialog::getExistingDirectory(this, tr("Backup Database"));
+   if ( dir.isEmpty() )
+      return;
 
-   bool success = Database::backupToDir(dir);
+   // How the backup went is reported by Database::backupFinished().
+   bool success = Database::instance().startBackup(dir);
 
    if( ! success )
       QMessageBox::warning( this, tr("Oops!"), tr("Could not copy the files for some reason."));
@@ -1866,7 +1908,7 @@ void MainWindow::restoreFromBackup()
       return;
    }
 
-   QString restoreDbFile = QFileDialog::getOpenFileName(this, tr("Choose File"), "", tr("SQLite (*.sqlite)"));
+   QString restoreDbFile = QFileDialog::getOpenFileName(this, tr("Choose File"), "", tr("SQLite (*.sqlite);;Incremental backups (*.manifest)"));
    bool success = Database::restoreFromFile(restoreDbFile);
 
    if( ! success )
@@ -1882,13 +1924,16 @@ void MainWindow::importFiles()
    if ( ! fileOpener->exec() )
       return;
 
+   // The files are read on the database worker, so the window stays live
+   // while a big one is parsed.
    foreach( QString filename, fileOpener->selectedFiles() )
    {
-      if ( ! Database::instance().importFromXML(filename) )
-         importMsg();
+      whenFinished( Database::instance().importFromXMLAsync(filename), this, [this](bool success) {
+         if ( ! success )
+            importMsg();
+         showChanges();
+      });
    }
-
-   showChanges();
 }
 
 bool MainWindow::verifyImport(QString tag, QString name)
@@ -2384,8 +2429,37 @@ void MainWindow::updateDatabase()
                                            Brewtarget::getUserDataDir().canonicalPath(),
                                            tr("Brewtarget Database (*.sqlite)") );
 
-   // Merge.
-   Database::instance().updateDatabase( otherDb );
+   if ( otherDb.isEmpty() )
+      return;
+
+   try {
+      // Show what the merge would do before doing it.
+      QStringList summary;
+      foreach( MergeReport report, Database::instance().updateDatabase( otherDb, true ) ) {
+         if ( report.added.isEmpty() && report.changed.isEmpty() )
+            continue;
+         summary.append( tr("%1: %2 new, %3 changed").arg(report.tableName).arg(report.added.size()).arg(report.changed.size()) );
+      }
+
+      if ( summary.isEmpty() ) {
+         QMessageBox::information( this, tr("Database Update"), tr("Your ingredients are already up to date.") );
+         return;
+      }
+
+      but = QMessageBox::question( this,
+                             tr("Database Update"),
+                             tr("The update will make these changes:\n\n%1\n\nContinue?").arg(summary.join("\n")),
+                             QMessageBox::Yes | QMessageBox::No,
+                             QMessageBox::Yes );
+      if( but == QMessageBox::No )
+         return;
+
+      // Merge.
+      Database::instance().updateDatabase( otherDb );
+   }
+   catch (QString e) {
+      QMessageBox::warning( this, tr("Oops!"), tr("The update failed: %1").arg(e) );
+   }
 }
 
 void MainWindow::finishCheckingVersion()
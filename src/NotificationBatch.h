@@ -0,0 +1,62 @@
+/*
+ * NotificationBatch.h is part of Brewtarget, and is Copyright the following
+ * authors 2009-2016
+ *
+ * Brewtarget is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Brewtarget is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _NOTIFICATIONBATCH_H
+#define _NOTIFICATIONBATCH_H
+
+#include "database.h"
+
+/*!
+ * \class NotificationBatch
+ *
+ * \brief Holds back changed() notifications for as long as it lives.
+ *
+ * Make one on the stack around a run of edits. When the outermost batch
+ * goes, each property that changed is announced once, recipes recalculate
+ * once, and Database::changedBatch() tells the views to redraw once.
+ */
+class NotificationBatch
+{
+public:
+   NotificationBatch()
+      : _ended(false)
+   {
+      Database::instance().beginNotificationBatch();
+   }
+
+   ~NotificationBatch()
+   {
+      end();
+   }
+
+   //! Ends the batch before it goes out of scope, e.g. ahead of a commit.
+   void end()
+   {
+      if ( _ended )
+         return;
+      _ended = true;
+      Database::instance().endNotificationBatch();
+   }
+
+private:
+   Q_DISABLE_COPY(NotificationBatch)
+
+   bool _ended;
+};
+
+#endif   /* _NOTIFICATIONBATCH_H */
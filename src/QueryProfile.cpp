@@ -0,0 +1,107 @@
+/*
+ * QueryProfile.cpp is part of Brewtarget, and is Copyright the following
+ * authors 2009-2016
+ *
+ * Brewtarget is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Brewtarget is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "QueryProfile.h"
+
+#include <QFile>
+#include <QJsonArray>
+#include <QJsonObject>
+#include <QList>
+#include <QMutexLocker>
+#include <QRegExp>
+#include <algorithm>
+
+QueryProfile::QueryProfile()
+{
+}
+
+QString QueryProfile::normalized( QString const& sql )
+{
+   // Quoted strings first, so numbers inside them go with them. The \b
+   // keeps digits that are part of a name, like step_2, where they are.
+   // QRegExp is not safe to share between threads, hence no statics.
+   QRegExp strings("'(?:[^']|'')*'");
+   QRegExp numbers("-?\\b\\d+(?:\\.\\d+)?\\b");
+
+   QString ret(sql);
+   ret.replace(strings, "?");
+   ret.replace(numbers, "?");
+   return ret.simplified();
+}
+
+void QueryProfile::record( QString const& sqlTemplate, qint64 elapsed_us, int rows )
+{
+   QMutexLocker locker(&_mutex);
+
+   QHash<QString,Entry>::iterator i = _entries.find(sqlTemplate);
+   if ( i == _entries.end() ) {
+      Entry entry = { 0, 0, 0, 0 };
+      i = _entries.insert(sqlTemplate, entry);
+   }
+
+   ++i->calls;
+   i->total_us += elapsed_us;
+   i->max_us = qMax(i->max_us, elapsed_us);
+   if ( rows > 0 )
+      i->rows += rows;
+}
+
+void QueryProfile::addRows( QString const& sqlTemplate, int rows )
+{
+   QMutexLocker locker(&_mutex);
+
+   QHash<QString,Entry>::iterator i = _entries.find(sqlTemplate);
+   if ( i != _entries.end() && rows > 0 )
+      i->rows += rows;
+}
+
+QJsonDocument QueryProfile::toJson() const
+{
+   QMutexLocker locker(&_mutex);
+
+   QList<QString> statements = _entries.keys();
+   std::sort( statements.begin(), statements.end(), [this](QString const& a, QString const& b) {
+      return _entries.value(a).total_us > _entries.value(b).total_us;
+   });
+
+   QJsonArray array;
+   foreach( QString const& sql, statements ) {
+      Entry const& entry = _entries[sql];
+      QJsonObject obj;
+      obj.insert("sql", sql);
+      obj.insert("calls", static_cast<double>(entry.calls));
+      obj.insert("total_ms", entry.total_us / 1000.0);
+      obj.insert("max_ms", entry.max_us / 1000.0);
+      obj.insert("mean_ms", entry.total_us / 1000.0 / qMax(Q_UINT64_C(1), entry.calls));
+      obj.insert("rows", static_cast<double>(entry.rows));
+      array.append(obj);
+   }
+
+   QJsonObject root;
+   root.insert("statements", array);
+   return QJsonDocument(root);
+}
+
+bool QueryProfile::writeJson( QString const& fileName ) const
+{
+   QFile out(fileName);
+   if ( ! out.open(QIODevice::WriteOnly | QIODevice::Truncate) )
+      return false;
+
+   return out.write( toJson().toJson() ) >= 0;
+}
@@ -0,0 +1,73 @@
+/*
+ * QueryProfile.h is part of Brewtarget, and is Copyright the following
+ * authors 2009-2016
+ *
+ * Brewtarget is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Brewtarget is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _QUERYPROFILE_H
+#define _QUERYPROFILE_H
+
+class QueryProfile;
+
+#include <QHash>
+#include <QJsonDocument>
+#include <QMutex>
+#include <QString>
+
+/*!
+ * \class QueryProfile
+ *
+ * \brief Adds up how often each SQL statement runs, and how long it takes.
+ *
+ * Statements are kept by template: the text with any literal numbers and
+ * strings turned into ?, so "id=12" and "id=13" count as one statement.
+ * Safe to use from any thread.
+ */
+class QueryProfile
+{
+public:
+   QueryProfile();
+
+   //! \returns \b sql with its literal values replaced by ?.
+   static QString normalized( QString const& sql );
+
+   /*!
+    * Counts one run of \b sqlTemplate that took \b elapsed_us.
+    * \param rows is the rows it returned or changed, or -1 if the driver
+    *        cannot tell; see addRows().
+    */
+   void record( QString const& sqlTemplate, qint64 elapsed_us, int rows = -1 );
+   //! Counts \b rows returned by \b sqlTemplate, for drivers that only know once they are read.
+   void addRows( QString const& sqlTemplate, int rows );
+
+   //! \returns every statement, most expensive in total first.
+   QJsonDocument toJson() const;
+   //! Writes toJson() to \b fileName.
+   bool writeJson( QString const& fileName ) const;
+
+private:
+   typedef struct
+   {
+      quint64 calls;
+      qint64 total_us;
+      qint64 max_us;
+      qint64 rows;
+   } Entry;
+
+   QHash<QString,Entry> _entries;
+   mutable QMutex _mutex;
+};
+
+#endif   /* _QUERYPROFILE_H */
@@ -0,0 +1,61 @@
+/*
+ * ReadSnapshot.cpp is part of Brewtarget, and is Copyright the following
+ * authors 2009-2016
+ *
+ * Brewtarget is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Brewtarget is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "ReadSnapshot.h"
+
+#include <QThread>
+
+#include "brewtarget.h"
+#include "database.h"
+
+ReadSnapshot::ReadSnapshot()
+   : _pinned(false)
+{
+   Database& db = Database::instance();
+
+   // The GUI thread holds back writes of its own, and would not see them
+   // through a separate connection.
+   if ( db.walMode() && QThread::currentThread() != db.thread() ) {
+      _db = db.acquireReader();
+      _pinned = true;
+   }
+   else {
+      // Reading through its own connection, the GUI thread has to get what
+      // it holds back into the tables first.
+      if ( QThread::currentThread() == db.thread() ) {
+         try {
+            db.flush();
+         }
+         catch (QString e) {
+            Brewtarget::logW( QString("%1 : %2").arg(Q_FUNC_INFO).arg(e));
+         }
+      }
+      _db = Database::sqlDatabase();
+   }
+}
+
+ReadSnapshot::~ReadSnapshot()
+{
+   if ( _pinned )
+      Database::instance().releaseReader(_db);
+}
+
+QSqlDatabase ReadSnapshot::database() const
+{
+   return _db;
+}
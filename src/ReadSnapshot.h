@@ -0,0 +1,56 @@
+/*
+ * ReadSnapshot.h is part of Brewtarget, and is Copyright the following
+ * authors 2009-2016
+ *
+ * Brewtarget is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Brewtarget is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _READSNAPSHOT_H
+#define _READSNAPSHOT_H
+
+class ReadSnapshot;
+
+#include <QSqlDatabase>
+
+/*!
+ * \class ReadSnapshot
+ *
+ * \brief A consistent view of the database for background reads.
+ *
+ * In WAL mode, a thread other than the GUI thread gets one of a few
+ * read-only connections, held on a single snapshot until the ReadSnapshot
+ * goes away. Writes made in the meantime neither block it nor show up in
+ * it. Otherwise, and on the GUI thread, it is just sqlDatabase(), with what
+ * the GUI thread holds back written first.
+ *
+ * Keep it short lived: a snapshot holds back checkpoints, and a thread
+ * waits for a free connection while all of them are taken.
+ */
+class ReadSnapshot
+{
+public:
+   ReadSnapshot();
+   ~ReadSnapshot();
+
+   //! \returns the connection to read from. Only use it on this thread.
+   QSqlDatabase database() const;
+
+private:
+   Q_DISABLE_COPY(ReadSnapshot)
+
+   QSqlDatabase _db;
+   bool _pinned;
+};
+
+#endif   /* _READSNAPSHOT_H */
@@ -0,0 +1,356 @@
+/*
+ * RecipeCalculator.cpp is part of Brewtarget, and is Copyright the following
+ * authors 2009-2016
+ *
+ * Brewtarget is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Brewtarget is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "RecipeCalculator.h"
+
+#include "Algorithms.h"
+#include "ColorMethods.h"
+#include "IbuMethods.h"
+#include "PhysicalConstants.h"
+
+void RecipeCalculator::calculate( RecipeSnapshot const& s, RecipeStats& stats, double* hopIbus )
+{
+   stats.grainsInMash_kg = grainsInMash_kg(s);
+   stats.grains_kg = grains_kg(s);
+   volumes(s, stats.grainsInMash_kg, stats);
+   stats.color_srm = color_srm(s, stats.finalVolumeNoLosses_l);
+   ogFg(s, stats.wortFromMash_l, stats.finalVolumeNoLosses_l, stats);
+   stats.ABV_pct = ABV_pct(stats.og_fermentable, stats.fg_fermentable);
+   stats.boilGrav = boilGrav(s);
+
+   stats.IBU = extractIbu(s);
+   for( int i = 0; i < s.hops.size(); ++i )
+   {
+      double ibus = hopIbu(s, s.hops.at(i), stats.og, stats.finalVolumeNoLosses_l);
+      if( hopIbus )
+         hopIbus[i] = ibus;
+      stats.IBU += ibus;
+   }
+
+   stats.calories = calories(stats.og, stats.fg);
+}
+
+double RecipeCalculator::grainsInMash_kg( RecipeSnapshot const& s )
+{
+   double ret = 0.0;
+   for( int i = 0; i < s.fermentables.size(); ++i )
+   {
+      FermentableParams const& ferm = s.fermentables.at(i);
+      if( ferm.type == Fermentable::Grain && ferm.isMashed )
+         ret += ferm.amount_kg;
+   }
+   return ret;
+}
+
+double RecipeCalculator::grains_kg( RecipeSnapshot const& s )
+{
+   double ret = 0.0;
+   for( int i = 0; i < s.fermentables.size(); ++i )
+      ret += s.fermentables.at(i).amount_kg;
+   return ret;
+}
+
+double RecipeCalculator::wortEndOfBoil_l( RecipeSnapshot const& s, double kettleWort_l )
+{
+   return kettleWort_l - (s.equipmentBoilTime_min/60.0)*s.evapRate_lHr;
+}
+
+void RecipeCalculator::volumes( RecipeSnapshot const& s, double grainsInMash_kg, RecipeStats& stats )
+{
+   double wortFromMash_l = 0.0;
+   double boil_l;
+
+   // wortFromMash_l ==========================
+   if( s.hasMash )
+   {
+      double absorption_lKg = s.hasEquipment ? s.grainAbsorption_LKg : PhysicalConstants::grainAbsorption_Lkg;
+      wortFromMash_l = s.totalMashWater_l - absorption_lKg * grainsInMash_kg;
+   }
+
+   // boilVolume_l ==============================
+   if( s.hasEquipment )
+      boil_l = wortFromMash_l - s.lauterDeadspace_l + s.topUpKettle_l;
+   else
+      boil_l = wortFromMash_l;
+
+   // Need to account for extract/sugar volume also.
+   for( int i = 0; i < s.fermentables.size(); ++i )
+   {
+      FermentableParams const& ferm = s.fermentables.at(i);
+      if( ferm.type == Fermentable::Extract )
+         boil_l += ferm.amount_kg / PhysicalConstants::liquidExtractDensity_kgL;
+      else if( ferm.type == Fermentable::Sugar )
+         boil_l += ferm.amount_kg / PhysicalConstants::sucroseDensity_kgL;
+      else if( ferm.type == Fermentable::Dry_Extract )
+         boil_l += ferm.amount_kg / PhysicalConstants::dryExtractDensity_kgL;
+   }
+
+   if( boil_l <= 0.0 )
+      boil_l = s.boilSize_l; // Give up.
+
+   stats.wortFromMash_l = wortFromMash_l;
+   stats.boilVolume_l = boil_l;
+
+   // finalVolume_l ==============================
+
+   // NOTE: the following figure is not based on the other volume estimates
+   // since we want to show og,fg,ibus,etc. as if the collected wort is correct.
+   stats.finalVolumeNoLosses_l = s.batchSize_l + (s.hasEquipment ? s.trubChillerLoss_l : 0.0);
+
+   if( s.hasEquipment )
+   {
+      stats.finalVolume_l = wortEndOfBoil_l(s, boil_l) + s.topUpWater_l - s.trubChillerLoss_l;
+      stats.postBoilVolume_l = wortEndOfBoil_l(s, boil_l);
+   }
+   else
+   {
+      // Can't do much without an equipment.
+      stats.finalVolume_l = 0.0;
+      stats.postBoilVolume_l = s.batchSize_l; // Give up.
+   }
+}
+
+double RecipeCalculator::color_srm( RecipeSnapshot const& s, double finalVolumeNoLosses_l )
+{
+   double mcu = 0.0;
+
+   for( int i = 0; i < s.fermentables.size(); ++i )
+   {
+      FermentableParams const& ferm = s.fermentables.at(i);
+      // Conversion factor for lb/gal to kg/l = 8.34538.
+      mcu += ferm.color_srm*8.34538 * ferm.amount_kg/finalVolumeNoLosses_l;
+   }
+
+   return ColorMethods::mcuToSrm(mcu);
+}
+
+RecipeCalculator::Sugars RecipeCalculator::totalPoints( RecipeSnapshot const& s )
+{
+   Sugars ret;
+   ret.sugar_kg = 0.0;
+   ret.nonFermentableSugars_kg = 0.0;
+   ret.sugar_kg_ignoreEfficiency = 0.0;
+   ret.lateAddition_kg = 0.0;
+   ret.lateAddition_kg_ignoreEff = 0.0;
+
+   for( int i = 0; i < s.fermentables.size(); ++i )
+   {
+      FermentableParams const& ferm = s.fermentables.at(i);
+
+      // If we have some sort of non-grain, we have to ignore efficiency.
+      if( ferm.type == Fermentable::Sugar || ferm.type == Fermentable::Extract || ferm.type == Fermentable::Dry_Extract )
+      {
+         ret.sugar_kg_ignoreEfficiency += ferm.equivSucrose_kg;
+
+         if( ferm.addAfterBoil )
+            ret.lateAddition_kg_ignoreEff += ferm.equivSucrose_kg;
+
+         if( ! ferm.fermentable )
+            ret.nonFermentableSugars_kg += ferm.equivSucrose_kg;
+      }
+      else
+      {
+         ret.sugar_kg += ferm.equivSucrose_kg;
+
+         if( ferm.addAfterBoil )
+            ret.lateAddition_kg += ferm.equivSucrose_kg;
+      }
+   }
+
+   return ret;
+}
+
+void RecipeCalculator::ogFg( RecipeSnapshot const& s, double wortFromMash_l, double finalVolumeNoLosses_l, RecipeStats& stats )
+{
+   Sugars sugars = totalPoints(s);
+   double sugar_kg = sugars.sugar_kg;
+   double sugar_kg_ignoreEfficiency = sugars.sugar_kg_ignoreEfficiency;
+   double nonFermentableSugars_kg = sugars.nonFermentableSugars_kg;
+   double attenuation_pct = 0.0;
+   double plato, og, fg, pnts, fermPnts, nonFermPnts;
+
+   // We might lose some sugar in the form of Trub/Chiller loss and lauter deadspace.
+   if( s.hasEquipment )
+   {
+      double kettleWort_l = (wortFromMash_l - s.lauterDeadspace_l) + s.topUpKettle_l;
+      double postBoilWort_l = wortEndOfBoil_l(s, kettleWort_l);
+      double ratio = (postBoilWort_l - s.trubChillerLoss_l) / postBoilWort_l;
+      if( ratio > 1.0 ) // Usually happens when we don't have a mash yet.
+         ratio = 1.0;
+      else if( ratio < 0.0 )
+         ratio = 0.0;
+      else if( Algorithms::isNan(ratio) )
+         ratio = 1.0;
+      // Only the sugars the efficiency does not already account for.
+      sugar_kg_ignoreEfficiency *= ratio;
+      if( nonFermentableSugars_kg != 0.0 )
+         nonFermentableSugars_kg *= ratio;
+   }
+
+   // Total sugars after accounting for efficiency and mash losses. Implicitly includes non-fermentable sugars
+   sugar_kg = sugar_kg * s.efficiency_pct/100.0 + sugar_kg_ignoreEfficiency;
+   plato = Algorithms::getPlato( sugar_kg, finalVolumeNoLosses_l );
+
+   og = Algorithms::PlatoToSG_20C20C( plato );  // og from all sugars
+   pnts = (og-1)*1000.0;  // points from all sugars
+   if( nonFermentableSugars_kg != 0.0 )
+   {
+      double ferm_kg = sugar_kg - nonFermentableSugars_kg;  // Mass of only fermentable sugars
+      plato = Algorithms::getPlato( ferm_kg, finalVolumeNoLosses_l );
+      stats.og_fermentable = Algorithms::PlatoToSG_20C20C( plato );  // og from only fermentable sugars
+      plato = Algorithms::getPlato( nonFermentableSugars_kg, finalVolumeNoLosses_l );
+      nonFermPnts = (Algorithms::PlatoToSG_20C20C( plato )-1)*1000.0;  // og points from non-fermentable sugars
+   }
+   else
+   {
+      stats.og_fermentable = og;
+      nonFermPnts = 0;
+   }
+
+   // Get the yeast with the greatest attenuation.
+   for( int i = 0; i < s.yeastAttenuations_pct.size(); ++i )
+   {
+      if( s.yeastAttenuations_pct.at(i) > attenuation_pct )
+         attenuation_pct = s.yeastAttenuations_pct.at(i);
+   }
+   if( s.yeastAttenuations_pct.size() > 0 && attenuation_pct <= 0.0 ) // This means we have yeast, but they neglected to provide attenuation percentages.
+      attenuation_pct = 75.0; // 75% is an average attenuation.
+
+   if( nonFermentableSugars_kg != 0.0 )
+   {
+      fermPnts = (pnts-nonFermPnts) * (1.0 - attenuation_pct/100.0);  // fg points from fermentable sugars
+      pnts = fermPnts + nonFermPnts;  // FG points from both fermentable and non-fermentable sugars
+      fg = 1 + pnts/1000.0;
+      stats.fg_fermentable = 1 + fermPnts/1000.0;  // FG from fermentables only
+   }
+   else
+   {
+      pnts *= (1.0 - attenuation_pct/100.0);
+      fg = 1 + pnts/1000.0;
+      stats.fg_fermentable = fg;
+   }
+
+   stats.og = og;
+   stats.fg = fg;
+}
+
+double RecipeCalculator::ABV_pct( double og_fermentable, double fg_fermentable )
+{
+   // The complex formula, and variations comes from Ritchie Products Ltd, (Zymurgy, Summer 1995, vol. 18, no. 2)
+   // Michael L. Hall’s article Brew by the Numbers: Add Up What’s in Your Beer, and Designing Great Beers by Daniels.
+   return (76.08 * (og_fermentable - fg_fermentable) / (1.775 - og_fermentable)) * (fg_fermentable / 0.794);
+}
+
+double RecipeCalculator::boilGrav( RecipeSnapshot const& s )
+{
+   Sugars sugars = totalPoints(s);
+
+   // Since the efficiency refers to how much sugar we get into the fermenter,
+   // we need to adjust for that here.
+   double sugar_kg = s.efficiency_pct/100.0 * (sugars.sugar_kg - sugars.lateAddition_kg)
+                     + sugars.sugar_kg_ignoreEfficiency - sugars.lateAddition_kg_ignoreEff;
+
+   return Algorithms::PlatoToSG_20C20C( Algorithms::getPlato(sugar_kg, s.boilSize_l) );
+}
+
+double RecipeCalculator::hopIbu( RecipeSnapshot const& s, HopParams const& hop, double og, double finalVolumeNoLosses_l )
+{
+   double ibus = 0.0;
+   double AArating = hop.alpha_pct/100.0;
+   double grams = hop.amount_kg*1000.0;
+   // Assume 100% utilization and a 60 min boil until further notice
+   double hopUtilization = 1.0;
+   int boilTime = 60;
+
+   // NOTE: we used to carefully calculate the average boil gravity and use it in the
+   // IBU calculations. However, due to John Palmer
+   // (http://homebrew.stackexchange.com/questions/7343/does-wort-gravity-affect-hop-utilization),
+   // it seems more appropriate to just use the OG directly, since it is the total
+   // amount of break material that truly affects the IBUs.
+   if( s.hasEquipment )
+   {
+      hopUtilization = s.hopUtilization_pct / 100.0;
+      boilTime = static_cast<int>(s.equipmentBoilTime_min);
+   }
+
+   if( hop.use == Hop::Boil )
+      ibus = IbuMethods::getIbus( AArating, grams, finalVolumeNoLosses_l, og, hop.time_min );
+   else if( hop.use == Hop::First_Wort )
+      ibus = s.firstWortHopAdjustment * IbuMethods::getIbus( AArating, grams, finalVolumeNoLosses_l, og, boilTime );
+   else if( hop.use == Hop::Mash && s.mashHopAdjustment > 0.0 )
+      ibus = s.mashHopAdjustment * IbuMethods::getIbus( AArating, grams, finalVolumeNoLosses_l, og, boilTime );
+
+   // Adjust for hop form. Tinseth's table was created from whole cone data,
+   // and it seems other formulae are optimized that way as well. So, the
+   // utilization is considered unadjusted for whole cones, and adjusted
+   // up for plugs and pellets.
+   //
+   // - http://www.realbeer.com/hops/FAQ.html
+   // - https://groups.google.com/forum/#!topic/brewtarget-help/mv2qvWBC4sU
+   switch( hop.form ) {
+   case Hop::Plug:
+      hopUtilization *= 1.02;
+      break;
+   case Hop::Pellet:
+      hopUtilization *= 1.10;
+      break;
+   default:
+      break;
+   }
+
+   // Adjust for hop utilization.
+   return ibus * hopUtilization;
+}
+
+double RecipeCalculator::extractIbu( RecipeSnapshot const& s )
+{
+   double ibus = 0.0;
+
+   for( int i = 0; i < s.fermentables.size(); ++i )
+   {
+      FermentableParams const& ferm = s.fermentables.at(i);
+      // Conversion factor for lb/gal to kg/l = 8.34538.
+      ibus += ferm.ibuGalPerLb * (ferm.amount_kg / s.batchSize_l) / 8.34538;
+   }
+   return ibus;
+}
+
+// the formula in here are taken from http://hbd.org/ensmingr/
+double RecipeCalculator::calories( double og, double fg )
+{
+   // Need to translate OG and FG into plato
+   double startPlato  = -463.37 + ( 668.72 * og ) - (205.35 * og * og);
+   double finishPlato = -463.37 + ( 668.72 * fg ) - (205.35 * fg * fg);
+
+   // RE (real extract)
+   double RE = (0.1808 * startPlato) + (0.8192 * finishPlato);
+
+   // Alcohol by weight?
+   double abw = (startPlato-RE)/(2.0665 - (0.010665 * startPlato));
+
+   // The final results of this formular are calories per 100 ml.
+   // The 3.55 puts it in terms of 12 oz. I really should have stored it
+   // without that adjust.
+   double ret = ((6.9*abw) + 4.0 * (RE-0.1)) * fg * 3.55;
+
+   //! If there are no fermentables in the recipe, if there is no mash, etc.,
+   //  then the calories/12 oz ends up negative. Since negative doesn't make
+   //  sense, set it to 0
+   return ret < 0 ? 0 : ret;
+}
@@ -0,0 +1,103 @@
+/*
+ * RecipeCalculator.h is part of Brewtarget, and is Copyright the following
+ * authors 2009-2016
+ *
+ * Brewtarget is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Brewtarget is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _RECIPECALCULATOR_H
+#define _RECIPECALCULATOR_H
+
+class RecipeCalculator;
+
+#include "RecipeSnapshot.h"
+
+//! \brief Every calculated property of a recipe.
+struct RecipeStats
+{
+   double grainsInMash_kg;
+   double grains_kg;
+   double wortFromMash_l;
+   double boilVolume_l;
+   double postBoilVolume_l;
+   double finalVolume_l;
+   //! Final volume before any losses out of the kettle, used for sg/ibu/etc.
+   double finalVolumeNoLosses_l;
+   double color_srm;
+   double og;
+   double fg;
+   double og_fermentable;
+   double fg_fermentable;
+   double ABV_pct;
+   double boilGrav;
+   double IBU;
+   double calories;
+};
+
+/*!
+ * \class RecipeCalculator
+ *
+ * \brief Works out the calculated properties of a recipe from a RecipeSnapshot.
+ *
+ * Nothing here touches the database, emits a signal or allocates memory,
+ * and nothing is kept between calls, so it is safe from any thread. Recipe
+ * runs each step on its own as the inputs it reads change. calculate() runs
+ * them all.
+ */
+class RecipeCalculator
+{
+public:
+   //! \brief Sugars of a recipe, in kg of sucrose equivalent.
+   struct Sugars
+   {
+      //! Sugars that \b are affected by the mash efficiency.
+      double sugar_kg;
+      //! Sugars yeast will not eat. Also counted in sugar_kg_ignoreEfficiency.
+      double nonFermentableSugars_kg;
+      //! Sugars that \b are \b not affected by the mash efficiency.
+      double sugar_kg_ignoreEfficiency;
+      double lateAddition_kg;
+      double lateAddition_kg_ignoreEff;
+   };
+
+   /*!
+    * Works out everything.
+    * \param hopIbus if not null, gets the IBUs of each hop in \b s, in
+    *        order. It must have room for all of them.
+    */
+   static void calculate( RecipeSnapshot const& s, RecipeStats& stats, double* hopIbus = 0 );
+
+   static double grainsInMash_kg( RecipeSnapshot const& s );
+   static double grains_kg( RecipeSnapshot const& s );
+   //! Fills in the volumes of \b stats.
+   static void volumes( RecipeSnapshot const& s, double grainsInMash_kg, RecipeStats& stats );
+   static double color_srm( RecipeSnapshot const& s, double finalVolumeNoLosses_l );
+   static Sugars totalPoints( RecipeSnapshot const& s );
+   //! Fills in og, fg and their fermentable-only parts in \b stats.
+   static void ogFg( RecipeSnapshot const& s, double wortFromMash_l, double finalVolumeNoLosses_l, RecipeStats& stats );
+   static double ABV_pct( double og_fermentable, double fg_fermentable );
+   static double boilGrav( RecipeSnapshot const& s );
+   //! \returns the IBUs from \b hop alone.
+   static double hopIbu( RecipeSnapshot const& s, HopParams const& hop, double og, double finalVolumeNoLosses_l );
+   //! \returns the IBUs from hopped extracts.
+   static double extractIbu( RecipeSnapshot const& s );
+   //! \returns the calories in 12 oz.
+   static double calories( double og, double fg );
+
+private:
+   static double wortEndOfBoil_l( RecipeSnapshot const& s, double kettleWort_l );
+};
+
+#endif   /* _RECIPECALCULATOR_H */
@@ -0,0 +1,137 @@
+/*
+ * RecipeSnapshot.cpp is part of Brewtarget, and is Copyright the following
+ * authors 2009-2016
+ *
+ * Brewtarget is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Brewtarget is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "RecipeSnapshot.h"
+
+#include "brewtarget.h"
+#include "equipment.h"
+#include "mash.h"
+#include "recipe.h"
+#include "yeast.h"
+
+RecipeSnapshot::RecipeSnapshot()
+   : hasEquipment(false),
+     grainAbsorption_LKg(0),
+     lauterDeadspace_l(0),
+     topUpKettle_l(0),
+     topUpWater_l(0),
+     trubChillerLoss_l(0),
+     evapRate_lHr(0),
+     equipmentBoilTime_min(60),
+     hopUtilization_pct(100),
+     hasMash(false),
+     totalMashWater_l(0),
+     batchSize_l(0),
+     boilSize_l(0),
+     efficiency_pct(0),
+     firstWortHopAdjustment(1.1),
+     mashHopAdjustment(0)
+{
+}
+
+void RecipeSnapshot::fill( Recipe* rec )
+{
+   setFermentables( rec->fermentables() );
+   setHops( rec->hops() );
+   setYeasts( rec->yeasts() );
+   setEquipment( rec->equipment() );
+   setMash( rec->mash() );
+   setTargets( rec );
+   readOptions();
+}
+
+void RecipeSnapshot::setFermentables( QList<Fermentable*> const& ferms )
+{
+   fermentables.resize( ferms.size() );
+   for( int i = 0; i < ferms.size(); ++i )
+   {
+      Fermentable* ferm = ferms.at(i);
+      FermentableParams& p = fermentables[i];
+
+      p.type = ferm->type();
+      p.amount_kg = ferm->amount_kg();
+      p.color_srm = ferm->color_srm();
+      p.equivSucrose_kg = ferm->equivSucrose_kg();
+      p.ibuGalPerLb = ferm->ibuGalPerLb();
+      p.isMashed = ferm->isMashed();
+      p.addAfterBoil = ferm->addAfterBoil();
+      p.fermentable = Recipe::isFermentableSugar(ferm);
+   }
+}
+
+void RecipeSnapshot::setHops( QList<Hop*> const& hopList )
+{
+   hops.resize( hopList.size() );
+   for( int i = 0; i < hopList.size(); ++i )
+      hops[i] = hopParams( hopList.at(i) );
+}
+
+HopParams RecipeSnapshot::hopParams( Hop const* hop )
+{
+   HopParams p;
+   p.key = hop->key();
+   p.use = hop->use();
+   p.form = hop->form();
+   p.alpha_pct = hop->alpha_pct();
+   p.amount_kg = hop->amount_kg();
+   p.time_min = hop->time_min();
+   return p;
+}
+
+void RecipeSnapshot::setYeasts( QList<Yeast*> const& yeasts )
+{
+   yeastAttenuations_pct.resize( yeasts.size() );
+   for( int i = 0; i < yeasts.size(); ++i )
+      yeastAttenuations_pct[i] = yeasts.at(i)->attenuation_pct();
+}
+
+void RecipeSnapshot::setEquipment( Equipment* equip )
+{
+   hasEquipment = equip != 0;
+   if( equip == 0 )
+      return;
+
+   grainAbsorption_LKg = equip->grainAbsorption_LKg();
+   lauterDeadspace_l = equip->lauterDeadspace_l();
+   topUpKettle_l = equip->topUpKettle_l();
+   topUpWater_l = equip->topUpWater_l();
+   trubChillerLoss_l = equip->trubChillerLoss_l();
+   evapRate_lHr = equip->evapRate_lHr();
+   equipmentBoilTime_min = equip->boilTime_min();
+   hopUtilization_pct = equip->hopUtilization_pct();
+}
+
+void RecipeSnapshot::setMash( Mash* mash )
+{
+   hasMash = mash != 0;
+   totalMashWater_l = mash ? mash->totalMashWater_l() : 0.0;
+}
+
+void RecipeSnapshot::setTargets( Recipe* rec )
+{
+   batchSize_l = rec->batchSize_l();
+   boilSize_l = rec->boilSize_l();
+   efficiency_pct = rec->efficiency_pct();
+}
+
+void RecipeSnapshot::readOptions()
+{
+   firstWortHopAdjustment = Brewtarget::toDouble(Brewtarget::option("firstWortHopAdjustment", 1.1).toString(), "RecipeSnapshot::readOptions()");
+   mashHopAdjustment = Brewtarget::toDouble(Brewtarget::option("mashHopAdjustment", 0).toString(), "RecipeSnapshot::readOptions()");
+}
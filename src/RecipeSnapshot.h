@@ -0,0 +1,114 @@
+/*
+ * RecipeSnapshot.h is part of Brewtarget, and is Copyright the following
+ * authors 2009-2016
+ *
+ * Brewtarget is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Brewtarget is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _RECIPESNAPSHOT_H
+#define _RECIPESNAPSHOT_H
+
+struct RecipeSnapshot;
+
+#include <QList>
+#include <QVector>
+#include "fermentable.h"
+#include "hop.h"
+
+class Equipment;
+class Mash;
+class Recipe;
+class Yeast;
+
+//! \brief What the calculations need to know about one fermentable.
+struct FermentableParams
+{
+   Fermentable::Type type;
+   double amount_kg;
+   double color_srm;
+   double equivSucrose_kg;
+   double ibuGalPerLb;
+   bool isMashed;
+   bool addAfterBoil;
+   //! False for sugars yeast leaves alone, like lactose.
+   bool fermentable;
+};
+
+//! \brief What the calculations need to know about one hop.
+struct HopParams
+{
+   int key;
+   Hop::Use use;
+   Hop::Form form;
+   double alpha_pct;
+   double amount_kg;
+   double time_min;
+};
+
+/*!
+ * \struct RecipeSnapshot
+ *
+ * \brief Everything the recipe calculations read, copied out of the database.
+ *
+ * The fill methods talk to the database, so they belong to the GUI thread.
+ * Once filled, a snapshot is plain data: RecipeCalculator can work on it
+ * from any thread, and any number of threads at once.
+ */
+struct RecipeSnapshot
+{
+   RecipeSnapshot();
+
+   QVector<FermentableParams> fermentables;
+   QVector<HopParams> hops;
+   QVector<double> yeastAttenuations_pct;
+
+   bool hasEquipment;
+   double grainAbsorption_LKg;
+   double lauterDeadspace_l;
+   double topUpKettle_l;
+   double topUpWater_l;
+   double trubChillerLoss_l;
+   double evapRate_lHr;
+   double equipmentBoilTime_min;
+   double hopUtilization_pct;
+
+   bool hasMash;
+   double totalMashWater_l;
+
+   double batchSize_l;
+   double boilSize_l;
+   double efficiency_pct;
+
+   // From the options.
+   double firstWortHopAdjustment;
+   double mashHopAdjustment;
+
+   //! Copies everything from \b rec.
+   void fill( Recipe* rec );
+   void setFermentables( QList<Fermentable*> const& ferms );
+   void setHops( QList<Hop*> const& hops );
+   void setYeasts( QList<Yeast*> const& yeasts );
+   //! \b equip may be null.
+   void setEquipment( Equipment* equip );
+   //! \b mash may be null.
+   void setMash( Mash* mash );
+   //! Batch size, boil size and efficiency.
+   void setTargets( Recipe* rec );
+   void readOptions();
+
+   static HopParams hopParams( Hop const* hop );
+};
+
+#endif   /* _RECIPESNAPSHOT_H */
@@ -0,0 +1,337 @@
+/*
+ * RecipeStatsTable.cpp is part of Brewtarget, and is Copyright the following
+ * authors 2009-2016
+ *
+ * Brewtarget is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Brewtarget is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "RecipeStatsTable.h"
+
+#include <QElapsedTimer>
+#include <QFuture>
+#include <QSqlError>
+#include <QSqlQuery>
+#include <QThreadPool>
+#include <QtAlgorithms>
+
+#include "AsyncJob.h"
+#include "brewtarget.h"
+#include "mashstep.h"
+#include "recipe.h"
+#include "RecipeCalculator.h"
+
+// Fewer rows than this in a run and handing it to a thread costs more than
+// calculating it.
+static int const minRunRows = 64;
+
+RecipeStatsTable::RecipeStatsTable()
+   : _snapshot_ms(0),
+     _calculate_ms(0)
+{
+}
+
+void RecipeStatsTable::calculate( QSqlDatabase db, RecipeSnapshot const* options, QThreadPool* pool )
+{
+   QElapsedTimer timer;
+
+   if( pool == 0 )
+      pool = QThreadPool::globalInstance();
+
+   timer.start();
+
+   RecipeSnapshot ownOptions;
+   if( options == 0 )
+   {
+      ownOptions.readOptions();
+      options = &ownOptions;
+   }
+
+   QVector<RecipeSnapshot> snapshots;
+   readSnapshots( db, *options, snapshots );
+   int rows = snapshots.size();
+   _snapshot_ms = timer.restart();
+
+   // Detach the columns here, so the workers only ever see raw memory.
+   double* columns[NumColumns];
+   for( int c = 0; c < NumColumns; ++c )
+   {
+      _columns[c].resize(rows);
+      columns[c] = _columns[c].data();
+   }
+
+   // A few runs per thread, so a slow run does not leave the others idle.
+   int runs = qMax(1, pool->maxThreadCount() * 4);
+   int runRows = qMax(minRunRows, (rows + runs - 1) / runs);
+   RecipeSnapshot const* snapData = snapshots.constData();
+   double* const* colData = columns;
+
+   QList< QFuture<int> > futures;
+   for( int begin = 0; begin < rows; begin += runRows )
+   {
+      int end = qMin(rows, begin + runRows);
+      AsyncJob<int>* job = new AsyncJob<int>( [snapData, begin, end, colData]() {
+         calculateRows(snapData, begin, end, colData);
+         return end - begin;
+      });
+      futures.append( job->future() );
+      pool->start(job);
+   }
+
+   int done = 0;
+   foreach( QFuture<int> future, futures )
+   {
+      future.waitForFinished();
+      done += future.result();
+   }
+   _calculate_ms = timer.elapsed();
+
+   Brewtarget::log.info( QString("%1 : %2 of %3 recipes in %4 ms (%5 ms reading, %6 runs), %7 recipes/s")
+                         .arg(Q_FUNC_INFO)
+                         .arg(done)
+                         .arg(rows)
+                         .arg(_snapshot_ms + _calculate_ms)
+                         .arg(_snapshot_ms)
+                         .arg(futures.size())
+                         .arg(recipesPerSec(), 0, 'f', 0));
+}
+
+void RecipeStatsTable::update( int key, RecipeSnapshot const& snapshot )
+{
+   int row = _rows.value(key, -1);
+   if( row < 0 )
+   {
+      row = qLowerBound(_keys.begin(), _keys.end(), key) - _keys.begin();
+      _keys.insert(row, key);
+      for( int c = 0; c < NumColumns; ++c )
+         _columns[c].insert(row, 0.0);
+      for( int i = row; i < _keys.size(); ++i )
+         _rows.insert(_keys.at(i), i);
+   }
+
+   double* columns[NumColumns];
+   for( int c = 0; c < NumColumns; ++c )
+      columns[c] = _columns[c].data();
+
+   RecipeStats stats;
+   RecipeCalculator::calculate( snapshot, stats );
+   store( stats, row, columns );
+}
+
+// Runs \b q, which has been prepared and bound.
+static void execSnapshotQuery( QSqlQuery& q )
+{
+   if ( ! q.exec() )
+      throw QString("%1 %2").arg(q.lastQuery()).arg(q.lastError().text());
+}
+
+void RecipeStatsTable::readSnapshots( QSqlDatabase db, RecipeSnapshot const& options, QVector<RecipeSnapshot>& snapshots )
+{
+   QSqlQuery q(db);
+   q.setForwardOnly(true);
+
+   _keys.clear();
+   _rows.clear();
+
+   // The recipes, with their equipment if they have one.
+   q.prepare( QString("SELECT r.id, r.batch_size, r.boil_size, r.efficiency, "
+                      "e.id, e.absorption, e.lauter_deadspace, e.top_up_kettle, e.top_up_water, "
+                      "e.trub_chiller_loss, e.real_evap_rate, e.boil_time, e.hop_utilization "
+                      "FROM recipe r LEFT JOIN equipment e ON e.id = r.equipment_id "
+                      "WHERE r.deleted = %1 ORDER BY r.id").arg(Brewtarget::dbFalse()) );
+   execSnapshotQuery(q);
+   while ( q.next() )
+   {
+      RecipeSnapshot snap;
+      snap.batchSize_l = q.value(1).toDouble();
+      snap.boilSize_l = q.value(2).toDouble();
+      snap.efficiency_pct = q.value(3).toDouble();
+
+      snap.hasEquipment = ! q.value(4).isNull();
+      if ( snap.hasEquipment )
+      {
+         snap.grainAbsorption_LKg = q.value(5).toDouble();
+         snap.lauterDeadspace_l = q.value(6).toDouble();
+         snap.topUpKettle_l = q.value(7).toDouble();
+         snap.topUpWater_l = q.value(8).toDouble();
+         snap.trubChillerLoss_l = q.value(9).toDouble();
+         snap.evapRate_lHr = q.value(10).toDouble();
+         snap.equipmentBoilTime_min = q.value(11).toDouble();
+         snap.hopUtilization_pct = q.value(12).toDouble();
+      }
+
+      snap.firstWortHopAdjustment = options.firstWortHopAdjustment;
+      snap.mashHopAdjustment = options.mashHopAdjustment;
+
+      _rows.insert( q.value(0).toInt(), snapshots.size() );
+      _keys.append( q.value(0).toInt() );
+      snapshots.append(snap);
+   }
+   q.finish();
+
+   // The water added by the steps MashStep::isInfusion() counts.
+   q.prepare( QString("SELECT r.id, SUM(CASE WHEN s.mstype IN (?, ?, ?) THEN s.infuse_amount ELSE 0 END) "
+                      "FROM recipe r JOIN mash m ON m.id = r.mash_id "
+                      "LEFT JOIN mashstep s ON s.mash_id = m.id AND s.deleted = %1 "
+                      "WHERE r.deleted = %1 GROUP BY r.id").arg(Brewtarget::dbFalse()) );
+   q.addBindValue( MashStep::types.at(MashStep::Infusion) );
+   q.addBindValue( MashStep::types.at(MashStep::flySparge) );
+   q.addBindValue( MashStep::types.at(MashStep::batchSparge) );
+   execSnapshotQuery(q);
+   while ( q.next() )
+   {
+      int row = _rows.value( q.value(0).toInt(), -1 );
+      if ( row < 0 )
+         continue;
+
+      snapshots[row].hasMash = true;
+      snapshots[row].totalMashWater_l = q.value(1).toDouble();
+   }
+   q.finish();
+
+   // The ingredients come in the order the recipes added them, like the
+   // recipe index has them.
+   q.prepare( QString("SELECT l.recipe_id, f.ftype, f.name, f.amount, f.yield, f.moisture, "
+                      "f.color, f.ibu_gal_per_lb, f.is_mashed, f.add_after_boil "
+                      "FROM fermentable_in_recipe l "
+                      "JOIN recipe r ON r.id = l.recipe_id "
+                      "JOIN fermentable f ON f.id = l.fermentable_id "
+                      "WHERE r.deleted = %1 ORDER BY l.recipe_id, l.id").arg(Brewtarget::dbFalse()) );
+   execSnapshotQuery(q);
+   while ( q.next() )
+   {
+      int row = _rows.value( q.value(0).toInt(), -1 );
+      if ( row < 0 )
+         continue;
+
+      FermentableParams p;
+      p.type = static_cast<Fermentable::Type>( Fermentable::types.indexOf(q.value(1).toString()) );
+      p.amount_kg = q.value(3).toDouble();
+      p.color_srm = q.value(6).toDouble();
+      p.isMashed = q.value(8).toBool();
+      p.equivSucrose_kg = Fermentable::equivSucrose_kg( p.type, p.amount_kg, q.value(4).toDouble(), q.value(5).toDouble(), p.isMashed );
+      p.ibuGalPerLb = q.value(7).toDouble();
+      p.addAfterBoil = q.value(9).toBool();
+      p.fermentable = Recipe::isFermentableSugar( p.type, q.value(2).toString() );
+      snapshots[row].fermentables.append(p);
+   }
+   q.finish();
+
+   q.prepare( QString("SELECT l.recipe_id, h.id, h.use, h.form, h.alpha, h.amount, h.time "
+                      "FROM hop_in_recipe l "
+                      "JOIN recipe r ON r.id = l.recipe_id "
+                      "JOIN hop h ON h.id = l.hop_id "
+                      "WHERE r.deleted = %1 ORDER BY l.recipe_id, l.id").arg(Brewtarget::dbFalse()) );
+   execSnapshotQuery(q);
+   while ( q.next() )
+   {
+      int row = _rows.value( q.value(0).toInt(), -1 );
+      if ( row < 0 )
+         continue;
+
+      HopParams p;
+      p.key = q.value(1).toInt();
+      p.use = static_cast<Hop::Use>( Hop::uses.indexOf(q.value(2).toString()) );
+      p.form = static_cast<Hop::Form>( Hop::forms.indexOf(q.value(3).toString()) );
+      p.alpha_pct = q.value(4).toDouble();
+      p.amount_kg = q.value(5).toDouble();
+      p.time_min = q.value(6).toDouble();
+      snapshots[row].hops.append(p);
+   }
+   q.finish();
+
+   q.prepare( QString("SELECT l.recipe_id, y.attenuation "
+                      "FROM yeast_in_recipe l "
+                      "JOIN recipe r ON r.id = l.recipe_id "
+                      "JOIN yeast y ON y.id = l.yeast_id "
+                      "WHERE r.deleted = %1 ORDER BY l.recipe_id, l.id").arg(Brewtarget::dbFalse()) );
+   execSnapshotQuery(q);
+   while ( q.next() )
+   {
+      int row = _rows.value( q.value(0).toInt(), -1 );
+      if ( row < 0 )
+         continue;
+
+      snapshots[row].yeastAttenuations_pct.append( q.value(1).toDouble() );
+   }
+   q.finish();
+}
+
+void RecipeStatsTable::calculateRows( RecipeSnapshot const* snapshots, int begin, int end, double* const* columns )
+{
+   RecipeStats stats;
+   for( int row = begin; row < end; ++row )
+   {
+      RecipeCalculator::calculate( snapshots[row], stats );
+      store( stats, row, columns );
+   }
+}
+
+void RecipeStatsTable::store( RecipeStats const& stats, int row, double* const* columns )
+{
+   columns[GrainsInMashColumn][row]   = stats.grainsInMash_kg;
+   columns[GrainsColumn][row]         = stats.grains_kg;
+   columns[WortFromMashColumn][row]   = stats.wortFromMash_l;
+   columns[BoilVolumeColumn][row]     = stats.boilVolume_l;
+   columns[PostBoilVolumeColumn][row] = stats.postBoilVolume_l;
+   columns[FinalVolumeColumn][row]    = stats.finalVolume_l;
+   columns[ColorColumn][row]          = stats.color_srm;
+   columns[OgColumn][row]             = stats.og;
+   columns[FgColumn][row]             = stats.fg;
+   columns[ABVColumn][row]            = stats.ABV_pct;
+   columns[BoilGravColumn][row]       = stats.boilGrav;
+   columns[IBUColumn][row]            = stats.IBU;
+   columns[CaloriesColumn][row]       = stats.calories;
+}
+
+int RecipeStatsTable::rowCount() const
+{
+   return _keys.size();
+}
+
+int RecipeStatsTable::key( int row ) const
+{
+   return _keys.at(row);
+}
+
+int RecipeStatsTable::row( int key ) const
+{
+   return _rows.value(key, -1);
+}
+
+double RecipeStatsTable::value( int row, Column column ) const
+{
+   return _columns[column].at(row);
+}
+
+QVector<double> const& RecipeStatsTable::column( Column column ) const
+{
+   return _columns[column];
+}
+
+qint64 RecipeStatsTable::snapshot_ms() const
+{
+   return _snapshot_ms;
+}
+
+qint64 RecipeStatsTable::calculate_ms() const
+{
+   return _calculate_ms;
+}
+
+double RecipeStatsTable::recipesPerSec() const
+{
+   qint64 elapsed_ms = _snapshot_ms + _calculate_ms;
+   return rowCount() * 1000.0 / qMax(Q_INT64_C(1), elapsed_ms);
+}
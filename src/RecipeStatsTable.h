@@ -0,0 +1,122 @@
+/*
+ * RecipeStatsTable.h is part of Brewtarget, and is Copyright the following
+ * authors 2009-2016
+ *
+ * Brewtarget is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Brewtarget is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _RECIPESTATSTABLE_H
+#define _RECIPESTATSTABLE_H
+
+class RecipeStatsTable;
+
+#include <QHash>
+#include <QSqlDatabase>
+#include <QVector>
+
+#include "RecipeSnapshot.h"
+
+class QThreadPool;
+struct RecipeStats;
+
+/*!
+ * \class RecipeStatsTable
+ *
+ * \brief The calculated properties of many recipes at once, one column per
+ * property.
+ *
+ * calculate() reads a snapshot of every recipe straight from the database,
+ * a table at a time, then splits the snapshots into runs that
+ * RecipeCalculator works through on a thread pool. No Recipe is needed.
+ * Each run writes its own rows straight into the columns, so the workers
+ * share nothing and need no locks. A column is a plain vector of doubles,
+ * ready for sorting, filtering or reporting across the whole library.
+ *
+ * Database::recipeStatsAsync() fills one on the database worker, and
+ * update() keeps a single row current as its recipe is edited.
+ */
+class RecipeStatsTable
+{
+public:
+   enum Column
+   {
+      GrainsInMashColumn,
+      GrainsColumn,
+      WortFromMashColumn,
+      BoilVolumeColumn,
+      PostBoilVolumeColumn,
+      FinalVolumeColumn,
+      ColorColumn,
+      OgColumn,
+      FgColumn,
+      ABVColumn,
+      BoilGravColumn,
+      IBUColumn,
+      CaloriesColumn,
+      NumColumns
+   };
+
+   RecipeStatsTable();
+
+   /*!
+    * Replaces the table with the stats of every recipe in \b db, one row
+    * each, in key order. Blocks until every row is done.
+    * \param db is only used on the calling thread.
+    * \param options the options to calculate with. Null means read them
+    *        here, which is for the GUI thread.
+    * \param pool runs the calculations. Null means the global pool.
+    * \throws QString if the snapshots cannot be read.
+    */
+   void calculate( QSqlDatabase db, RecipeSnapshot const* options = 0, QThreadPool* pool = 0 );
+   /*!
+    * Calculates the row of the recipe with \b key again from \b snapshot,
+    * on the calling thread. A recipe the table does not have yet gets a
+    * row in key order.
+    */
+   void update( int key, RecipeSnapshot const& snapshot );
+
+   int rowCount() const;
+   //! \returns the key of the recipe in \b row.
+   int key( int row ) const;
+   //! \returns the row of the recipe with \b key, or -1.
+   int row( int key ) const;
+   double value( int row, Column column ) const;
+   QVector<double> const& column( Column column ) const;
+
+   //! Time the last calculate() spent reading the snapshots.
+   qint64 snapshot_ms() const;
+   //! Time the last calculate() spent calculating, once the snapshots were taken.
+   qint64 calculate_ms() const;
+   //! \returns how many recipes the last calculate() did per second, snapshots included.
+   double recipesPerSec() const;
+
+private:
+   /*! Reads the recipes of \b db into \b snapshots, and their keys into
+    * _keys and _rows. Each table is one query, with the recipes it belongs
+    * to in its first column.
+    */
+   void readSnapshots( QSqlDatabase db, RecipeSnapshot const& options, QVector<RecipeSnapshot>& snapshots );
+   //! Calculates rows \b begin to \b end - 1 into \b columns.
+   static void calculateRows( RecipeSnapshot const* snapshots, int begin, int end, double* const* columns );
+   static void store( RecipeStats const& stats, int row, double* const* columns );
+
+   QVector<int> _keys;
+   QHash<int,int> _rows;
+   QVector<double> _columns[NumColumns];
+   qint64 _snapshot_ms;
+   qint64 _calculate_ms;
+};
+
+#endif   /* _RECIPESTATSTABLE_H */
@@ -30,6 +30,8 @@
 #include "yeast.h"
 #include "water.h"
 #include "database.h"
+#include "NotificationBatch.h"
+#include "TransactionScope.h"
 #include "equipment.h"
 #include "EquipmentListModel.h"
 #include "BeerXMLSortProxyModel.h"
@@ -76,6 +78,12 @@ void ScaleRecipeTool::scale(Equipment* equip, double newEff)
    double oldEfficiency = recObs->efficiency_pct();
    double effRatio = oldEfficiency / newEff;
    
+   // The whole scaling is one transaction. The batch ends before the
+   // commit, so what the recipe recalculates then goes in with it.
+   TransactionScope scope;
+   // Views redraw once, when the whole recipe is done.
+   NotificationBatch batch;
+
    Database::instance().addToRecipe(recObs, equip);
    recObs->setBatchSize_l(newBatchSize_l);
    recObs->setBoilSize_l(equip->boilSize_l());
@@ -136,7 +144,11 @@ void ScaleRecipeTool::scale(Equipment* equip, double newEff)
    
    Mash* mash = recObs->mash();
    if( mash == 0 )
+   {
+      batch.end();
+      scope.commit();
       return;
+   }
    
    QList<MashStep*> mashSteps = mash->mashSteps();
    size = mashSteps.size();
@@ -153,6 +165,9 @@ void ScaleRecipeTool::scale(Equipment* equip, double newEff)
       step->setInfuseAmount_l(0);
    }
    
+   batch.end();
+   scope.commit();
+
    // I don't think I should scale the yeasts.
    
    // Let the user know what happened.
@@ -0,0 +1,223 @@
+/*
+ * TableCopier.cpp is part of Brewtarget, and is Copyright the following
+ * authors 2009-2016
+ *
+ * Brewtarget is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Brewtarget is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "TableCopier.h"
+
+#include <QElapsedTimer>
+#include <QHash>
+#include <QMutexLocker>
+#include <QSqlError>
+#include <QSqlQuery>
+#include <QStringList>
+
+TableCopier::TableCopier( QSqlDatabase const& target, QString const& table, QString const& rowSql,
+                          int columns, bool multiRow, int idColumn, int queueDepth )
+   : QThread(),
+     _driverName(target.driverName()),
+     _hostName(target.hostName()),
+     _databaseName(target.databaseName()),
+     _userName(target.userName()),
+     _password(target.password()),
+     _port(target.port()),
+     _connectOptions(target.connectOptions()),
+     _table(table),
+     _rowSql(rowSql),
+     _columns(columns),
+     _multiRow(multiRow),
+     _idColumn(idColumn),
+     _queueDepth(queueDepth),
+     _closed(false),
+     _failed(false),
+     _rowsWritten(0),
+     _maxId(-1),
+     _elapsed_ms(0)
+{
+   // Stay under the bound parameter limit: 999 on older SQLite, 32767 on
+   // PostgreSQL. Past a few hundred rows, bigger statements buy nothing.
+   int maxParams = _driverName == "QPSQL" ? 32767 : 999;
+   if ( _multiRow )
+      _batchRows = qBound(1, maxParams / qMax(1, _columns), 500);
+   else
+      _batchRows = 100;
+}
+
+TableCopier::~TableCopier()
+{
+   close();
+   wait();
+}
+
+int TableCopier::batchRows() const
+{
+   return _batchRows;
+}
+
+bool TableCopier::push( QList<QVariantList> const& rows )
+{
+   QMutexLocker locker(&_queueMutex);
+
+   while ( _queue.size() >= _queueDepth && ! _failed )
+      _notFull.wait(&_queueMutex);
+
+   if ( _failed )
+      return false;
+
+   _queue.enqueue(rows);
+   _notEmpty.wakeOne();
+   return true;
+}
+
+void TableCopier::close()
+{
+   QMutexLocker locker(&_queueMutex);
+   _closed = true;
+   _notEmpty.wakeAll();
+}
+
+QList<QVariantList> TableCopier::take()
+{
+   QMutexLocker locker(&_queueMutex);
+
+   while ( _queue.isEmpty() && ! _closed )
+      _notEmpty.wait(&_queueMutex);
+
+   if ( _queue.isEmpty() )
+      return QList<QVariantList>();
+
+   QList<QVariantList> rows = _queue.dequeue();
+   _notFull.wakeOne();
+   return rows;
+}
+
+QString TableCopier::error() const
+{
+   return _error;
+}
+
+int TableCopier::rowsWritten() const
+{
+   return _rowsWritten;
+}
+
+qint64 TableCopier::elapsed_ms() const
+{
+   return _elapsed_ms;
+}
+
+QString TableCopier::table() const
+{
+   return _table;
+}
+
+void TableCopier::run()
+{
+   QString conName = QString("copier_0x%1").arg(reinterpret_cast<quintptr>(this), 0, 16);
+   QElapsedTimer timer;
+
+   {
+      QSqlDatabase db = QSqlDatabase::addDatabase(_driverName, conName);
+      db.setHostName(_hostName);
+      db.setDatabaseName(_databaseName);
+      db.setUserName(_userName);
+      db.setPassword(_password);
+      db.setPort(_port);
+      db.setConnectOptions(_connectOptions);
+
+      // Prepared once per statement size: a full batch and the last one.
+      QHash<int,QSqlQuery> statements;
+
+      try {
+         if ( ! db.open() )
+            throw QString("Could not open %1 : %2").arg(_databaseName).arg(db.lastError().text());
+
+         if ( ! db.transaction() )
+            throw QString("Could not start a transaction : %1").arg(db.lastError().text());
+
+         for(;;) {
+            QList<QVariantList> rows = take();
+            if ( rows.isEmpty() )
+               break;
+
+            if ( ! timer.isValid() )
+               timer.start();
+
+            int perStatement = _multiRow ? rows.size() : 1;
+            for( int start = 0; start < rows.size(); start += perStatement ) {
+               int n = qMin(perStatement, rows.size() - start);
+
+               if ( ! statements.contains(n) ) {
+                  QStringList qmarks;
+                  for( int i = 0; i < _columns; ++i )
+                     qmarks.append("?");
+
+                  QString sql = _rowSql + QString(",(%1)").arg(qmarks.join(",")).repeated(n-1);
+                  QSqlQuery q(db);
+                  if ( ! q.prepare(sql) )
+                     throw QString("Could not prepare %1 : %2").arg(sql).arg(q.lastError().text());
+                  statements.insert(n, q);
+               }
+
+               QSqlQuery& q = statements[n];
+               int pos = 0;
+               for( int r = start; r < start + n; ++r ) {
+                  QVariantList const& row = rows.at(r);
+                  for( int i = 0; i < row.size(); ++i )
+                     q.bindValue(pos++, row.at(i), QSql::In);
+
+                  if ( _idColumn >= 0 && row.at(_idColumn).toInt() > _maxId )
+                     _maxId = row.at(_idColumn).toInt();
+               }
+
+               if ( ! q.exec() )
+                  throw QString("Could not insert new row %1 : %2").arg(q.lastQuery()).arg(q.lastError().text());
+               _rowsWritten += n;
+            }
+         }
+
+         // We need to manually reset the sequences
+         if ( _driverName == "QPSQL" && _maxId > 0 ) {
+            QString seq = QString("SELECT setval('%1_id_seq',%2)").arg(_table).arg(_maxId);
+            QSqlQuery updateSeq(db);
+
+            if ( ! updateSeq.exec(seq) )
+               throw QString("Could not reset the sequences: %1 %2")
+                  .arg(seq).arg(updateSeq.lastError().text());
+         }
+
+         statements.clear();
+         if ( ! db.commit() )
+            throw QString("Could not commit %1 : %2").arg(_table).arg(db.lastError().text());
+      }
+      catch (QString e) {
+         statements.clear();
+         db.rollback();
+         _error = e;
+
+         // Let the reader go, it has nobody to hand rows to.
+         QMutexLocker locker(&_queueMutex);
+         _failed = true;
+         _queue.clear();
+         _notFull.wakeAll();
+      }
+
+      _elapsed_ms = timer.isValid() ? timer.elapsed() : 0;
+      db.close();
+   } // db goes out of scope before removeDatabase()
+
+   QSqlDatabase::removeDatabase(conName);
+}
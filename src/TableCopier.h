@@ -0,0 +1,119 @@
+/*
+ * TableCopier.h is part of Brewtarget, and is Copyright the following
+ * authors 2009-2016
+ *
+ * Brewtarget is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Brewtarget is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _TABLECOPIER_H
+#define _TABLECOPIER_H
+
+class TableCopier;
+
+#include <QList>
+#include <QMutex>
+#include <QQueue>
+#include <QSqlDatabase>
+#include <QString>
+#include <QThread>
+#include <QVariant>
+#include <QWaitCondition>
+
+/*!
+ * \class TableCopier
+ *
+ * \brief Writes the rows of one table into another database on its own
+ * thread.
+ *
+ * Whoever reads the rows hands them over in batches through push(). The
+ * batches wait in a bounded queue, so reading the old database overlaps
+ * with writing the new one without holding the whole table in memory. Each
+ * batch is written with one multi-row INSERT, and the whole table in one
+ * transaction.
+ */
+class TableCopier : public QThread
+{
+public:
+   /*!
+    * \param target is the database to write to. Connections cannot cross
+    *        threads, so only its settings are used, to open our own.
+    * \param table is the table to write.
+    * \param rowSql writes a single row with positional place holders.
+    * \param columns is the number of place holders in \b rowSql.
+    * \param multiRow true if \b rowSql is an INSERT that can take several
+    *        rows in its VALUES.
+    * \param idColumn is the position of the id column, or -1. On PostgreSQL,
+    *        the id sequence is moved past the largest id written.
+    */
+   TableCopier( QSqlDatabase const& target, QString const& table, QString const& rowSql,
+                int columns, bool multiRow, int idColumn, int queueDepth = 8 );
+   virtual ~TableCopier();
+
+   //! \returns how many rows each push() should carry.
+   int batchRows() const;
+
+   /*!
+    * Queue \b rows for writing. Blocks while the queue is full.
+    * \returns false if the writer has failed and wants no more rows.
+    */
+   bool push( QList<QVariantList> const& rows );
+   //! Tell the writer no more rows are coming.
+   void close();
+
+   //! \returns what went wrong, or an empty string. Only valid after wait().
+   QString error() const;
+   //! \returns the rows written. Only valid after wait().
+   int rowsWritten() const;
+   //! \returns the time from the first row to the commit. Only valid after wait().
+   qint64 elapsed_ms() const;
+   QString table() const;
+
+protected:
+   //! Reimplemented from QThread.
+   void run();
+
+private:
+   //! \returns the next batch, or an empty list once closed and drained.
+   QList<QVariantList> take();
+
+   QString _driverName;
+   QString _hostName;
+   QString _databaseName;
+   QString _userName;
+   QString _password;
+   int _port;
+   QString _connectOptions;
+
+   QString _table;
+   QString _rowSql;
+   int _columns;
+   bool _multiRow;
+   int _idColumn;
+   int _batchRows;
+   int _queueDepth;
+
+   QMutex _queueMutex;
+   QWaitCondition _notEmpty;
+   QWaitCondition _notFull;
+   QQueue< QList<QVariantList> > _queue;
+   bool _closed;
+   bool _failed;
+
+   QString _error;
+   int _rowsWritten;
+   int _maxId;
+   qint64 _elapsed_ms;
+};
+
+#endif   /* _TABLECOPIER_H */
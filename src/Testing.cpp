@@ -26,6 +26,21 @@
 #include "fermentable.h"
 #include "mash.h"
 #include "mashstep.h"
+#include "brewnote.h"
+#include "AsyncJob.h"
+#include "BackupStore.h"
+#include "ConnectionPool.h"
+#include "DatabasePurge.h"
+#include "NotificationBatch.h"
+#include "QueryProfile.h"
+#include "RecipeCalculator.h"
+#include "RecipeSnapshot.h"
+#include "RecipeStatsTable.h"
+#include "TransactionScope.h"
+#include <QJsonArray>
+#include <QJsonObject>
+#include <QSignalSpy>
+#include <QThreadPool>
 
 QTEST_MAIN(Testing)
 
@@ -236,6 +251,547 @@ void Testing::postBoilLossOgTest()
    QVERIFY2( fuzzyComp(recLoss->og(), recNoLoss->og(), 0.002), "OG of recipe with post-boil loss is different from no-loss recipe" );
 }
 
+void Testing::rowCacheTest()
+{
+   Database& db = Database::instance();
+   Hop* hop = db.newHop();
+
+   hop->setAlpha_pct(5.5);
+   hop->alpha_pct();
+
+   // Once the row is loaded, further reads of any column are hits.
+   quint64 hits = db.rowCacheHits();
+   quint64 misses = db.rowCacheMisses();
+   QVERIFY2( fuzzyComp(hop->alpha_pct(), 5.5, 0.001), "Wrong cached alpha" );
+   hop->time_min();
+   QVERIFY2( db.rowCacheHits() == hits + 2, "Cached read was not a hit" );
+   QVERIFY2( db.rowCacheMisses() == misses, "Cached read went to the database" );
+
+   // Writes go through to the cached row.
+   hop->setAlpha_pct(7.25);
+   QVERIFY2( fuzzyComp(hop->alpha_pct(), 7.25, 0.001), "Cache missed a write" );
+
+   // Invalidation forces a reload that agrees with the database.
+   db.invalidateRowCache(Brewtarget::HOPTABLE, hop->key());
+   QVERIFY2( fuzzyComp(hop->alpha_pct(), 7.25, 0.001), "Wrong alpha after reload" );
+   QVERIFY2( db.rowCacheMisses() == misses + 1, "Invalidated read did not reload" );
+}
+
+void Testing::indexedQueryPlanTest()
+{
+   if ( Brewtarget::dbType() != Brewtarget::SQLITE )
+      QSKIP("EXPLAIN QUERY PLAN is SQLite only");
+
+   QStringList queries;
+   QStringList ingredients;
+   ingredients << "fermentable" << "hop" << "misc" << "water" << "yeast" << "instruction";
+   foreach( QString ing, ingredients )
+   {
+      queries << QString("SELECT %1_id FROM %1_in_recipe WHERE recipe_id = 1").arg(ing)
+              << QString("SELECT recipe_id FROM %1_in_recipe WHERE %1_id = 1 AND recipe_id = 1").arg(ing);
+   }
+
+   QStringList children;
+   children << "equipment" << "fermentable" << "hop" << "misc" << "recipe" << "style" << "water" << "yeast";
+   foreach( QString child, children )
+   {
+      queries << QString("SELECT parent_id FROM %1_children WHERE child_id = 1").arg(child)
+              << QString("SELECT child_id FROM %1_children WHERE parent_id = 1").arg(child);
+   }
+
+   QStringList inventories;
+   inventories << "fermentable" << "hop" << "misc" << "yeast";
+   foreach( QString inv, inventories )
+      queries << QString("SELECT id FROM %1_in_inventory WHERE %1_id = 1").arg(inv);
+
+   queries << "SELECT id FROM brewnote WHERE recipe_id = 1 AND deleted = 0"
+           << "SELECT id FROM mashstep WHERE mash_id = 1 AND deleted = 0 order by step_number";
+
+   QSqlQuery q(Database::sqlDatabase());
+   foreach( QString query, queries )
+   {
+      QVERIFY2( q.exec("EXPLAIN QUERY PLAN " + query), qPrintable(q.lastError().text()) );
+      while( q.next() )
+      {
+         QString detail = q.record().value("detail").toString();
+         QVERIFY2( ! detail.startsWith("SCAN"), qPrintable(QString("%1 : %2").arg(query).arg(detail)) );
+      }
+   }
+}
+
+void Testing::backupStoreTest()
+{
+   QDir dir( QDir::temp().filePath("bt_backupStoreTest") );
+   dir.removeRecursively();
+   QVERIFY( dir.mkpath(".") );
+
+   // Eight distinct 4 kB pages, no SQLite header, so the store uses 4096.
+   QByteArray data;
+   for( int i = 0; i < 8; ++i )
+      data.append( QByteArray(4096, static_cast<char>('a' + i)) );
+
+   QFile db( dir.filePath("db") );
+   QVERIFY( db.open(QIODevice::WriteOnly) );
+   db.write(data);
+   db.close();
+
+   BackupStore store( dir.path() );
+   QVERIFY( store.add(db.fileName(), "one.manifest") );
+   QVERIFY( store.chunksWritten() == 8 );
+
+   // Change one page. Only it should be written.
+   data[5 * 4096] = 'z';
+   QVERIFY( db.open(QIODevice::WriteOnly) );
+   db.write(data);
+   db.close();
+   QVERIFY( store.add(db.fileName(), "two.manifest") );
+   QVERIFY( store.chunksWritten() == 1 );
+   QVERIFY( store.chunksReused() == 7 );
+   QVERIFY( store.storedBytes() < store.logicalBytes() );
+
+   // Either point in time comes back byte for byte.
+   QVERIFY( BackupStore::restore(dir.filePath("two.manifest"), dir.filePath("restored")) );
+   QFile restored( dir.filePath("restored") );
+   QVERIFY( restored.open(QIODevice::ReadOnly) );
+   QVERIFY( restored.readAll() == data );
+   restored.close();
+
+   // Dropping the newer backup frees only its own page.
+   QVERIFY( store.remove("two.manifest") );
+   QVERIFY( BackupStore::restore(dir.filePath("one.manifest"), dir.filePath("restored")) );
+   QVERIFY( restored.open(QIODevice::ReadOnly) );
+   data[5 * 4096] = 'f';
+   QVERIFY( restored.readAll() == data );
+   restored.close();
+
+   dir.removeRecursively();
+}
+
+void Testing::asyncGetterTest()
+{
+   Database& db = Database::instance();
+   Hop* hop = db.newHop();
+   hop->setName("asyncGetterTest");
+
+   QFuture< QList<Hop*> > future = db.hopsAsync();
+   future.waitForFinished();
+
+   QList<Hop*> hops = db.hops();
+   QVERIFY2( future.result().size() == hops.size(), "Worker saw a different number of hops" );
+   QVERIFY2( future.result().contains(hop), "Worker missed a held back write" );
+
+   // The worker writes, but the hop hears about it on our thread.
+   QThread* heardOn = 0;
+   QMetaObject::Connection c = connect( hop, &BeerXMLElement::changed, [&](QMetaProperty, QVariant) {
+      heardOn = QThread::currentThread();
+   });
+   QFuture<bool> written = db.updateEntryAsync( Brewtarget::HOPTABLE, hop->key(), "amount", 0.025, hop->metaProperty("amount_kg"), hop );
+   QTRY_VERIFY( written.isFinished() );
+   disconnect(c);
+
+   QVERIFY( written.result() );
+   QVERIFY2( heardOn == QThread::currentThread(), "changed() was emitted on the worker" );
+}
+
+void Testing::notificationBatchTest()
+{
+   Database& db = Database::instance();
+   Hop* hop = db.newHop();
+   int changes = 0;
+   int batches = 0;
+   double lastAmount = 0.0;
+
+   QMetaObject::Connection c1 = connect( hop, &BeerXMLElement::changed, [&](QMetaProperty, QVariant value) {
+      ++changes;
+      lastAmount = value.toDouble();
+   });
+   QMetaObject::Connection c2 = connect( &db, &Database::changedBatch, [&](QList<BatchedChange>) { ++batches; } );
+
+   {
+      NotificationBatch outer;
+      {
+         NotificationBatch inner;
+         hop->setAmount_kg(0.010);
+         hop->setAmount_kg(0.020);
+      }
+      hop->setAmount_kg(0.030);
+      QVERIFY2( changes == 0, "A notification got out of the batch" );
+   }
+
+   disconnect(c1);
+   disconnect(c2);
+   QVERIFY2( changes == 1, "Each property should be announced once" );
+   QVERIFY2( batches == 1, "The batch should end with one changedBatch()" );
+   QVERIFY( fuzzyComp(lastAmount, 0.030, 1e-6) );
+}
+
+void Testing::queryProfileTest()
+{
+   QString sql = QueryProfile::normalized("UPDATE mashstep SET name='Step 2', step_2=-1.5 WHERE id=12");
+   QVERIFY2( sql == "UPDATE mashstep SET name=?, step_2=? WHERE id=?", qPrintable(sql) );
+
+   QueryProfile profile;
+   profile.record("SELECT * FROM hop WHERE id=?", 1500);
+   profile.record("SELECT * FROM hop WHERE id=?", 500);
+   profile.addRows("SELECT * FROM hop WHERE id=?", 2);
+   profile.record("UPDATE hop SET name=? WHERE id=?", 4000, 1);
+
+   QJsonArray statements = profile.toJson().object().value("statements").toArray();
+   QVERIFY( statements.size() == 2 );
+   // Most expensive first.
+   QVERIFY( statements.at(0).toObject().value("sql").toString().startsWith("UPDATE") );
+
+   QJsonObject select = statements.at(1).toObject();
+   QVERIFY( select.value("calls").toInt() == 2 );
+   QVERIFY( select.value("rows").toInt() == 2 );
+   QVERIFY( fuzzyComp(select.value("total_ms").toDouble(), 2.0, 1e-6) );
+   QVERIFY( fuzzyComp(select.value("max_ms").toDouble(), 1.5, 1e-6) );
+}
+
+void Testing::purgeTest()
+{
+   Database& db = Database::instance();
+   Hop* hop = db.newHop();
+   int key = hop->key();
+   db.remove(hop);
+   db.flush();
+
+   DatabasePurge purge( Database::sqlDatabase(), 50 );
+   QSignalSpy finished( &purge, SIGNAL(finished(bool,int,qint64)) );
+   QVERIFY( purge.start() );
+   QVERIFY( finished.wait(60000) );
+   QVERIFY2( finished.at(0).at(0).toBool(), "The purge failed" );
+   QVERIFY( finished.at(0).at(1).toInt() > 0 );
+
+   // Nothing refers to the hop, so its row should be gone.
+   QSqlQuery q(Database::sqlDatabase());
+   QVERIFY( q.exec( QString("SELECT id FROM hop WHERE id = %1").arg(key) ) );
+   QVERIFY2( ! q.next(), "The deleted hop is still there" );
+}
+
+void Testing::brewNotePagingTest()
+{
+   Database& db = Database::instance();
+   Recipe* rec = db.newRecipe();
+   BrewNote* first = db.newBrewNote(rec);
+   int firstKey = first->key();
+   db.newBrewNote(rec);
+   QVERIFY( db.brewNoteCount(rec) == 2 );
+
+   // Over budget, a held recipe keeps its notes.
+   qint64 budget = db._brewNoteBudget;
+   db._brewNoteBudget = 0;
+   db.holdBrewNotes(rec);
+   db.evictBrewNotes();
+   QVERIFY( db.allBrewNotes.contains(firstKey) );
+
+   // Let go, they are unloaded but still counted.
+   db.releaseBrewNotes(rec);
+   db.evictBrewNotes();
+   QVERIFY2( ! db.allBrewNotes.contains(firstKey), "The notes were not unloaded" );
+   QVERIFY( db.brewNoteCount(rec) == 2 );
+
+   // And come back on demand.
+   QList<BrewNote*> notes = rec->brewNotes();
+   db._brewNoteBudget = budget;
+   QVERIFY( notes.size() == 2 );
+   QVERIFY( notes.at(0)->key() == firstKey );
+}
+
+void Testing::connectionPoolTest()
+{
+   QString dbName = QDir::temp().filePath("bt_connectionPoolTest.sqlite");
+   ConnectionPool pool;
+   pool.configure("QSQLITE", dbName);
+
+   // A worker opens a connection and exits. Its connection goes with it.
+   QString conName;
+   QThread worker;
+   connect( &worker, &QThread::started, [&]() {
+      conName = pool.connection().connectionName();
+      worker.quit();
+   });
+   worker.start();
+   QVERIFY( worker.wait(10000) );
+
+   ConnectionPool::Metrics metrics = pool.metrics();
+   QVERIFY( ! conName.isEmpty() );
+   QVERIFY2( ! QSqlDatabase::contains(conName), "The worker's connection outlived it" );
+   QVERIFY( metrics.opens == 1 );
+   QVERIFY( metrics.threadExits == 1 );
+   QVERIFY( metrics.open == 0 );
+
+   // Asking for the name does not open a connection.
+   QVERIFY( pool.connectionName().isEmpty() );
+   QVERIFY( pool.metrics().opens == 1 );
+
+   // The same thread gets the same connection back.
+   QVERIFY( pool.connection().connectionName() == pool.connection().connectionName() );
+   QVERIFY( pool.metrics().reuses == 1 );
+   pool.release();
+
+   // With one slot, a second lease waits until the first is given back.
+   pool.setMaxLeases(1);
+   QVERIFY( pool.lease() );
+   QVERIFY( ! pool.lease(10) );
+   bool leased = false;
+   QThread waiter;
+   connect( &waiter, &QThread::started, [&]() {
+      ConnectionLease lease(pool);
+      leased = true;
+      waiter.quit();
+   });
+   waiter.start();
+   QTest::qWait(50);
+   QVERIFY( ! leased );
+   pool.endLease();
+   QVERIFY( waiter.wait(10000) );
+   QVERIFY( leased );
+   metrics = pool.metrics();
+   QVERIFY( metrics.leases == 2 );
+   QVERIFY( metrics.leaseWaits == 2 );
+   QVERIFY( metrics.leaseWait_ms > 0 );
+   QFile::remove(dbName);
+}
+
+void Testing::transactionScopeTest()
+{
+   Database& db = Database::instance();
+   Recipe* rec = db.newRecipe();
+   QSqlDatabase sql = Database::sqlDatabase();
+
+   // An abandoned inner scope only undoes its own work.
+   {
+      TransactionScope outer;
+      rec->setName("outer");
+      try {
+         TransactionScope inner;
+         QVERIFY( TransactionScope::active(sql) );
+         rec->setName("inner");
+         throw QString("abandon the inner scope");
+      }
+      catch (QString) {}
+      outer.commit();
+   }
+   QVERIFY( ! TransactionScope::active(sql) );
+
+   QSqlQuery q(sql);
+   QVERIFY( q.exec( QString("SELECT name FROM recipe WHERE id=%1").arg(rec->key()) ) && q.next() );
+   QVERIFY2( q.value(0).toString() == "outer", "The outer write did not survive" );
+   q.finish();
+
+   // One that goes away without commit() leaves nothing behind.
+   {
+      TransactionScope scope;
+      rec->setName("rolled back");
+   }
+   QVERIFY( rec->name() == "outer" );
+
+   // Work an inner scope released is still undone in memory when the outer
+   // one rolls back.
+   {
+      TransactionScope scope;
+      db.addToRecipe(rec, cascade_4pct);
+      QVERIFY( rec->hops().size() == 1 );
+   }
+   QVERIFY2( rec->hops().isEmpty(), "The recipe index kept a rolled back hop" );
+}
+
+void Testing::recipeCopyTest()
+{
+   Database& db = Database::instance();
+   Recipe* rec = db.newRecipe();
+   rec->setName("Copy Source");
+   db.addToRecipe(rec, cascade_4pct);
+   db.addToRecipe(rec, twoRow);
+   db.newMashStep(rec->mash());
+   db.newInstruction(rec);
+
+   QSignalSpy spy(&db, SIGNAL(newRecipeSignal(Recipe*)));
+   Recipe* copy = db.newRecipe(rec);
+   QVERIFY( spy.count() == 1 );
+   QVERIFY( copy != rec );
+   QVERIFY( copy->name() == "Copy Source" );
+
+   // Copies of the ingredients, sharing the inventory of the originals.
+   QVERIFY( copy->hops().size() == 1 );
+   QVERIFY( copy->fermentables().size() == 1 );
+   QVERIFY( copy->hops().first() != rec->hops().first() );
+   QVERIFY( db.getParentID(Brewtarget::HOPTABLE, copy->hops().first()->key()) == cascade_4pct->key() );
+
+   QVERIFY( copy->mash() != 0 );
+   QVERIFY( copy->mash() != rec->mash() );
+   QVERIFY( copy->mash()->mashSteps().size() == 1 );
+   QVERIFY( copy->instructions().size() == 1 );
+   QVERIFY( copy->instructions().first() != rec->instructions().first() );
+}
+
+void Testing::ingredientLibraryTest()
+{
+   Database& db = Database::instance();
+   QString libName = QDir::temp().filePath("bt_ingredientLibraryTest.sqlite");
+   QFile::remove(libName);
+
+   // A library with one hop we do not have.
+   QSqlDatabase sql = Database::sqlDatabase();
+   QSqlQuery q(sql);
+   QVERIFY( q.exec( QString("ATTACH DATABASE '%1' AS lib").arg(libName) ) );
+   QVERIFY( q.exec( QString("CREATE TABLE lib.hop AS SELECT * FROM hop WHERE id=%1").arg(cascade_4pct->key()) ) );
+   QVERIFY( q.exec( QString("UPDATE lib.hop SET name='Library Hop', display=%1, deleted=%2")
+                       .arg(Brewtarget::dbTrue()).arg(Brewtarget::dbFalse()) ) );
+   QVERIFY( q.exec("DETACH DATABASE lib") );
+   q.finish();
+
+   db.attachLibrary(libName);
+   QVERIFY( db.libraryAttached() );
+
+   Hop* libHop = 0;
+   foreach( Hop* hop, db.hops() ) {
+      if ( hop->name() == "Library Hop" )
+         libHop = hop;
+   }
+   QVERIFY2( libHop != 0, "The library hop is not served" );
+   QVERIFY( libHop->key() < 0 );
+   QVERIFY( libHop->alpha_pct() == 4.0 );
+
+   // The first write gives it a row of ours. The library keeps its own.
+   libHop->setAlpha_pct(5.0);
+   db.flush();
+   QVERIFY( libHop->key() > 0 );
+   QVERIFY( q.exec( QString("SELECT alpha FROM hop WHERE id=%1").arg(libHop->key()) ) && q.next() );
+   QVERIFY( q.value(0).toDouble() == 5.0 );
+   QVERIFY( q.exec("SELECT alpha FROM library.hop") && q.next() );
+   QVERIFY( q.value(0).toDouble() == 4.0 );
+   q.finish();
+
+   // Nobody writes to the library.
+   QVERIFY( ! q.exec("UPDATE library.hop SET alpha=6") );
+}
+
+void Testing::incrementalRecalcTest()
+{
+   Database& db = Database::instance();
+   Recipe* rec = db.newRecipe();
+   rec->setBatchSize_l(20.0);
+   rec->setBoilSize_l(24.0);
+   db.addToRecipe(rec, equipFiveGalNoLoss);
+   db.addToRecipe(rec, twoRow);
+   db.addToRecipe(rec, cascade_4pct);
+   db.addToRecipe(rec, cascade_4pct);
+   QVERIFY( rec->hops().size() == 2 );
+   double before = rec->IBU();
+
+   // One hop's time: its own IBUs and the total, nothing else.
+   Hop* hop = rec->hops().first();
+   hop->setTime_min( hop->time_min() / 2.0 );
+   QVERIFY2( rec->lastRecalcNodes() == 2, "A hop change re-evaluated more than its IBUs" );
+   QVERIFY( rec->IBU() < before );
+   QVERIFY( fuzzyComp(rec->IBU(), rec->IBUs().at(0) + rec->IBUs().at(1), 0.001) );
+
+   // The fermentables feed every calculation, and through the og every hop.
+   Fermentable* ferm = rec->fermentables().first();
+   ferm->setAmount_kg( ferm->amount_kg() + 1.0 );
+   QVERIFY( rec->lastRecalcNodes() == 12 );
+}
+
+void Testing::recipeCalculatorTest()
+{
+   Database& db = Database::instance();
+   Recipe* rec = db.newRecipe();
+   rec->setBatchSize_l(20.0);
+   rec->setBoilSize_l(24.0);
+   rec->setEfficiency_pct(70.0);
+   db.addToRecipe(rec, equipFiveGalNoLoss);
+   db.addToRecipe(rec, twoRow);
+   db.addToRecipe(rec, cascade_4pct);
+   db.addToRecipe(rec, cascade_4pct);
+   rec->hops().first()->setTime_min(15.0);
+
+   // The snapshot is plain data, so the worker can have its own copy.
+   RecipeSnapshot snap = rec->snapshot();
+   QVERIFY( snap.fermentables.size() == 1 );
+   QVERIFY( snap.hops.size() == 2 );
+
+   AsyncJob<QVector<double> >* job = new AsyncJob<QVector<double> >( [snap]() {
+      RecipeStats stats;
+      double hopIbus[2];
+      RecipeCalculator::calculate(snap, stats, hopIbus);
+      return QVector<double>() << stats.og << stats.fg << stats.ABV_pct << stats.color_srm
+                               << stats.boilGrav << stats.IBU << stats.calories
+                               << stats.boilVolume_l << hopIbus[0] << hopIbus[1];
+   });
+   QFuture< QVector<double> > future = job->future();
+   QThreadPool::globalInstance()->start(job);
+   future.waitForFinished();
+
+   QVector<double> stats = future.result();
+   QVERIFY( stats.size() == 10 );
+   QVERIFY( fuzzyComp(stats.at(0), rec->og(), 0.0001) );
+   QVERIFY( fuzzyComp(stats.at(1), rec->fg(), 0.0001) );
+   QVERIFY( fuzzyComp(stats.at(2), rec->ABV_pct(), 0.001) );
+   QVERIFY( fuzzyComp(stats.at(3), rec->color_srm(), 0.001) );
+   QVERIFY( fuzzyComp(stats.at(4), rec->boilGrav(), 0.0001) );
+   QVERIFY( fuzzyComp(stats.at(5), rec->IBU(), 0.001) );
+   QVERIFY( fuzzyComp(stats.at(6), rec->calories12oz(), 0.001) );
+   QVERIFY( fuzzyComp(stats.at(7), rec->boilVolume_l(), 0.001) );
+   QVERIFY( fuzzyComp(stats.at(8), rec->IBUs().at(0), 0.001) );
+   QVERIFY( fuzzyComp(stats.at(9), rec->IBUs().at(1), 0.001) );
+   QVERIFY( stats.at(8) < stats.at(9) );
+}
+
+void Testing::recipeStatsTableTest()
+{
+   Database& db = Database::instance();
+   QList<Recipe*> recs;
+
+   // Enough recipes to be split over several runs, each a little different.
+   for( int i = 0; i < 150; ++i )
+   {
+      Recipe* rec = db.newRecipe();
+      rec->setBatchSize_l(10.0 + i % 20);
+      rec->setBoilSize_l(15.0 + i % 20);
+      rec->setEfficiency_pct(70.0);
+      if( i % 2 )
+         db.addToRecipe(rec, equipFiveGalNoLoss);
+      db.addToRecipe(rec, twoRow);
+      if( i % 3 )
+         db.addToRecipe(rec, cascade_4pct);
+      recs.append(rec);
+   }
+
+   // The table has every recipe in the database, not just these.
+   QFuture<RecipeStatsTable> future = db.recipeStatsAsync();
+   future.waitForFinished();
+   RecipeStatsTable table = future.result();
+   QVERIFY( table.rowCount() >= recs.size() );
+   QVERIFY( table.recipesPerSec() > 0.0 );
+
+   foreach( Recipe* rec, recs )
+   {
+      int row = table.row(rec->key());
+      QVERIFY( row >= 0 );
+      QVERIFY( table.key(row) == rec->key() );
+      QVERIFY( fuzzyComp(table.value(row, RecipeStatsTable::OgColumn), rec->og(), 0.0001) );
+      QVERIFY( fuzzyComp(table.value(row, RecipeStatsTable::FgColumn), rec->fg(), 0.0001) );
+      QVERIFY( fuzzyComp(table.value(row, RecipeStatsTable::ABVColumn), rec->ABV_pct(), 0.001) );
+      QVERIFY( fuzzyComp(table.value(row, RecipeStatsTable::IBUColumn), rec->IBU(), 0.001) );
+      QVERIFY( fuzzyComp(table.value(row, RecipeStatsTable::ColorColumn), rec->color_srm(), 0.001) );
+   }
+
+   for( int row = 1; row < table.rowCount(); ++row )
+      QVERIFY( table.key(row - 1) < table.key(row) );
+   QVERIFY( table.column(RecipeStatsTable::IBUColumn).size() == table.rowCount() );
+   QVERIFY( table.row(-12345) == -1 );
+
+   // An edit only redoes its own row.
+   Recipe* edited = recs.first();
+   edited->setBatchSize_l(40.0);
+   int rows = table.rowCount();
+   table.update( edited->key(), edited->snapshot() );
+   QVERIFY( table.rowCount() == rows );
+   QVERIFY( fuzzyComp(table.value(table.row(edited->key()), RecipeStatsTable::OgColumn), edited->og(), 0.0001) );
+}
+
 void Testing::cleanupTestCase()
 {
    Brewtarget::cleanup();
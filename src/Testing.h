@@ -103,6 +103,51 @@ private slots:
 
    //! \brief Verify post-boil losses do not affect OG
    void postBoilLossOgTest();
+
+   //! \brief Verify the row cache serves reads and follows writes
+   void rowCacheTest();
+
+   //! \brief Verify no lookup by a relationship column scans its whole table
+   void indexedQueryPlanTest();
+
+   //! \brief Verify the backup store only keeps changed pages and restores exactly
+   void backupStoreTest();
+
+   //! \brief Verify the worker thread reads the same elements as the GUI thread
+   void asyncGetterTest();
+
+   //! \brief Verify a batch announces each changed property once, when it closes
+   void notificationBatchTest();
+
+   //! \brief Verify statements are profiled by template
+   void queryProfileTest();
+
+   //! \brief Verify the purge removes deleted rows nothing refers to
+   void purgeTest();
+
+   //! \brief Verify brew notes are unloaded over budget and loaded on demand
+   void brewNotePagingTest();
+
+   //! \brief Verify pooled connections are bounded and closed on thread exit
+   void connectionPoolTest();
+
+   //! \brief Verify nested scopes roll back to their savepoint and keep the outer work
+   void transactionScopeTest();
+
+   //! \brief Verify a copied recipe gets copies of its ingredients, mash and instructions
+   void recipeCopyTest();
+
+   //! \brief Verify library rows are served read-only and copied over on their first write
+   void ingredientLibraryTest();
+
+   //! \brief Verify an edit only re-evaluates the calculations that depend on it
+   void incrementalRecalcTest();
+
+   //! \brief Verify stats worked out from a snapshot on another thread match the recipe's
+   void recipeCalculatorTest();
+
+   //! \brief Verify the batch stats of many recipes match each recipe's own
+   void recipeStatsTableTest();
 };
 
 #endif /*TESTING_H*/
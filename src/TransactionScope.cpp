@@ -0,0 +1,211 @@
+/*
+ * TransactionScope.cpp is part of Brewtarget, and is Copyright the following
+ * authors 2009-2016
+ *
+ * Brewtarget is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Brewtarget is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "TransactionScope.h"
+
+#include <QSqlError>
+#include <QSqlQuery>
+#include <QThread>
+
+#include "brewtarget.h"
+#include "database.h"
+
+QThreadStorage<TransactionScope::Innermost> TransactionScope::_innermost;
+
+TransactionScope::TransactionScope()
+   : _db(Database::sqlDatabase()),
+     _enclosing(0),
+     _depth(0),
+     _done(false)
+{
+   // What was held back before the scope began is not part of it.
+   flushPending( ! active(_db) );
+
+   _enclosing = innermost();
+   _depth = _enclosing ? _enclosing->_depth + 1 : 0;
+   _innermost.localData().scope = this;
+
+   try {
+      if ( _depth > 0 )
+         exec( QString("SAVEPOINT bt_sp_%1").arg(_depth) );
+      // In WAL mode, take the write lock up front. A reader upgrading to a
+      // writer half way through would fail instead of waiting.
+      else if ( Database::dbInstance && Database::dbInstance->_walMode )
+         exec("BEGIN IMMEDIATE");
+      else if ( ! _db.transaction() )
+         throw QString("Could not start a transaction: %1").arg(_db.lastError().text());
+   }
+   catch (QString) {
+      _done = true;
+      leave();
+      throw;
+   }
+}
+
+TransactionScope::~TransactionScope()
+{
+   if ( _done )
+      return;
+
+   // Destructors must not throw, and we are likely here because something
+   // else already did.
+   try {
+      rollback();
+   }
+   catch (QString e) {
+      Brewtarget::logE( QString("%1 %2").arg(Q_FUNC_INFO).arg(e));
+   }
+}
+
+bool TransactionScope::active( QSqlDatabase const& db )
+{
+   TransactionScope* scope = innermost();
+   return scope && scope->_db.connectionName() == db.connectionName();
+}
+
+TransactionScope* TransactionScope::innermost()
+{
+   // A connection only ever serves the thread that opened it, so the
+   // thread's own scope is the one, and finding it takes no lock.
+   return _innermost.hasLocalData() ? _innermost.localData().scope : 0;
+}
+
+bool TransactionScope::onRollback( std::function<void()> undo )
+{
+   TransactionScope* scope = innermost();
+   if ( ! scope )
+      return false;
+
+   scope->_undo.append(undo);
+   return true;
+}
+
+void TransactionScope::touch( Brewtarget::DBTable table, int key )
+{
+   TransactionScope* scope = innermost();
+   if ( scope )
+      scope->_touched[table].insert(key);
+}
+
+void TransactionScope::exec( QString const& sql )
+{
+   QSqlQuery q(_db);
+   if ( ! q.exec(sql) )
+      throw QString("%1 : %2").arg(sql).arg(q.lastError().text());
+}
+
+void TransactionScope::flushPending( bool outermost )
+{
+   // Only the database's own thread holds writes back.
+   Database* db = Database::dbInstance;
+   if ( ! db || db->thread() != QThread::currentThread() )
+      return;
+
+   if ( ! outermost ) {
+      db->flushPendingWrites(false);
+      return;
+   }
+
+   // Before the outermost scope, the writes go in their own transaction.
+   // Rows that fail stay with the database for a later try; the work this
+   // scope is about to do has nothing to do with them.
+   try {
+      db->flush();
+   }
+   catch (QString e) {
+      Brewtarget::logW( QString("%1 : %2").arg(Q_FUNC_INFO).arg(e));
+   }
+}
+
+void TransactionScope::leave()
+{
+   _innermost.localData().scope = _enclosing;
+}
+
+void TransactionScope::commit()
+{
+   if ( _done )
+      return;
+
+   try {
+      flushPending();
+      if ( _depth > 0 )
+         exec( QString("RELEASE SAVEPOINT bt_sp_%1").arg(_depth) );
+      else if ( ! _db.commit() )
+         throw QString("Could not commit: %1").arg(_db.lastError().text());
+   }
+   catch (QString e) {
+      Brewtarget::logE( QString("%1 %2").arg(Q_FUNC_INFO).arg(e));
+      rollback();
+      throw;
+   }
+
+   // The enclosing scope can still roll back what this one did.
+   if ( _enclosing ) {
+      _enclosing->_undo.append(_undo);
+      QHash< Brewtarget::DBTable, QSet<int> >::const_iterator t;
+      for( t = _touched.constBegin(); t != _touched.constEnd(); ++t )
+         _enclosing->_touched[t.key()].unite(t.value());
+   }
+
+   _done = true;
+   leave();
+}
+
+void TransactionScope::rollback()
+{
+   if ( _done )
+      return;
+   _done = true;
+
+   QString error;
+
+   // Writes still held back were made inside this scope, and go down with
+   // it without ever reaching the database.
+   if ( Database::dbInstance && Database::dbInstance->thread() == QThread::currentThread() )
+      Database::dbInstance->discardPendingWrites();
+
+   if ( _depth > 0 ) {
+      QSqlQuery q(_db);
+      if ( ! q.exec( QString("ROLLBACK TO SAVEPOINT bt_sp_%1").arg(_depth) ) ||
+           ! q.exec( QString("RELEASE SAVEPOINT bt_sp_%1").arg(_depth) ) )
+         error = q.lastError().text();
+   }
+   else if ( ! _db.rollback() )
+      error = _db.lastError().text();
+
+   leave();
+
+   // Put back what the database changed in memory, newest first, then drop
+   // the cached rows that may hold values that never made it to disk.
+   for( int i = _undo.size() - 1; i >= 0; --i )
+      _undo.at(i)();
+   _undo.clear();
+
+   if ( Database::dbInstance ) {
+      QHash< Brewtarget::DBTable, QSet<int> >::const_iterator t;
+      for( t = _touched.constBegin(); t != _touched.constEnd(); ++t ) {
+         foreach( int key, t.value() )
+            Database::dbInstance->invalidateRowCache(t.key(), key);
+      }
+   }
+   _touched.clear();
+
+   if ( ! error.isEmpty() )
+      Brewtarget::logW( QString("%1 : %2").arg(Q_FUNC_INFO).arg(error));
+}
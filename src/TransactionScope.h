@@ -0,0 +1,114 @@
+/*
+ * TransactionScope.h is part of Brewtarget, and is Copyright the following
+ * authors 2009-2016
+ *
+ * Brewtarget is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Brewtarget is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _TRANSACTIONSCOPE_H
+#define _TRANSACTIONSCOPE_H
+
+class TransactionScope;
+
+#include <functional>
+#include <QHash>
+#include <QList>
+#include <QSet>
+#include <QSqlDatabase>
+#include <QString>
+#include <QThreadStorage>
+#include "brewtarget.h"
+
+/*!
+ * \class TransactionScope
+ *
+ * \brief Makes everything written to the database during its life one unit
+ * of work.
+ *
+ * The outermost scope on a connection opens a real transaction. Scopes
+ * opened inside it become savepoints, so a function that wants its own
+ * transaction can be called from one that already has one. Nothing is
+ * written until commit() is called; a scope that goes away without it,
+ * because something threw, rolls back to where it started.
+ *
+ * What the database keeps in memory about the rows has to go back with
+ * them. Cached rows read or written inside a scope are dropped when it
+ * rolls back, and the database registers an undo for each change it makes
+ * to its indexes and object hashes. A savepoint that is released hands
+ * both to the scope around it, which may still roll back.
+ *
+ * Use it on the stack, on the thread that does the writes.
+ */
+class TransactionScope
+{
+public:
+   //! Begins the transaction, or a savepoint when one is already open. Throws a QString if it cannot.
+   TransactionScope();
+   //! Rolls back, unless commit() was called.
+   ~TransactionScope();
+
+   /*!
+    * Flush what the database is holding back and make the work permanent,
+    * or hand it to the enclosing scope. Throws a QString, after rolling
+    * back, if it cannot.
+    */
+   void commit();
+   //! Undo everything written since the scope began.
+   void rollback();
+
+   //! \returns true if a scope is open on \b db.
+   static bool active( QSqlDatabase const& db );
+
+   /*! \b undo runs if the calling thread's innermost scope, or any scope
+    * around it, rolls back. \returns false, and drops \b undo, when the
+    * thread has no scope open.
+    */
+   static bool onRollback( std::function<void()> undo );
+   //! The cached row \b key of \b table is dropped if the calling thread's scope rolls back.
+   static void touch( Brewtarget::DBTable table, int key );
+
+private:
+   Q_DISABLE_COPY(TransactionScope)
+
+   //! Runs \b sql on our connection, throwing a QString if it fails.
+   void exec( QString const& sql );
+   /*! Writes what the database is holding back. Inside the scope, so it is
+    * part of it; before the \b outermost one begins, so it is not.
+    */
+   void flushPending( bool outermost = false );
+   //! Closes the scope on this connection.
+   void leave();
+   //! \returns the calling thread's innermost scope, or 0 if it has none.
+   static TransactionScope* innermost();
+
+   QSqlDatabase _db;
+   TransactionScope* _enclosing;
+   int _depth;
+   bool _done;
+
+   // What a rollback has to put back in memory, oldest first.
+   QList< std::function<void()> > _undo;
+   QHash< Brewtarget::DBTable, QSet<int> > _touched;
+
+   // The calling thread's innermost open scope. QThreadStorage deletes
+   // pointers it holds, so it holds this instead.
+   struct Innermost
+   {
+      Innermost() : scope(0) {}
+      TransactionScope* scope;
+   };
+   static QThreadStorage<Innermost> _innermost;
+};
+
+#endif   /* _TRANSACTIONSCOPE_H */
@@ -66,8 +66,6 @@ const QString kProjectedEfficiency("projected_eff");
 const QString kProjectedABV("projected_abv");
 const QString kProjectedAttenuation("projected_atten");
 const QString kBoilOff("boil_off");
-const QString kSugarKg("sugar_kg");
-const QString kSugarKg_IgnoreEff("sugar_kg_ignoreEfficiency");
 
 
 /************** Props **************/
@@ -174,7 +172,7 @@ void BrewNote::populateNote(Recipe* parent)
    MashStep* mStep;
    QList<Yeast*> yeasts = parent->yeasts();
    Yeast* yeast;
-   QHash<QString,double> sugars;
+   RecipeCalculator::Sugars sugars;
    double atten_pct = -1.0;
 
    // Since we have the recipe, lets set some defaults The order in which
@@ -194,10 +192,8 @@ void BrewNote::populateNote(Recipe* parent)
       setBoilOff_l( equip->evapRate_lHr() * ( parent->boilTime_min()/60));
 
    sugars = parent->calcTotalPoints();
-   setProjPoints(sugars.value(kSugarKg) + sugars.value(kSugarKg_IgnoreEff));
-
-   sugars = parent->calcTotalPoints();
-   setProjFermPoints(sugars.value(kSugarKg) + sugars.value(kSugarKg_IgnoreEff));
+   setProjPoints(sugars.sugar_kg + sugars.sugar_kg_ignoreEfficiency);
+   setProjFermPoints(sugars.sugar_kg + sugars.sugar_kg_ignoreEfficiency);
 
    // Out of the gate, we expect projected to be the measured.
    setSg( parent->boilGrav() );
@@ -259,13 +255,11 @@ void BrewNote::populateNote(Recipe* parent)
 void BrewNote::recalculateEff(Recipe* parent)
 {
 
-   QHash<QString,double> sugars;
-
-   sugars = parent->calcTotalPoints();
-   setProjPoints(sugars.value(kSugarKg) + sugars.value(kSugarKg_IgnoreEff));
+   RecipeCalculator::Sugars sugars;
 
    sugars = parent->calcTotalPoints();
-   setProjFermPoints(sugars.value(kSugarKg) + sugars.value(kSugarKg_IgnoreEff));
+   setProjPoints(sugars.sugar_kg + sugars.sugar_kg_ignoreEfficiency);
+   setProjFermPoints(sugars.sugar_kg + sugars.sugar_kg_ignoreEfficiency);
 
    calculateEffIntoBK_pct();
    calculateBrewHouseEff_pct();
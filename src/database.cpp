@@ -44,6 +44,7 @@
 #include <QSqlIndex>
 #include <QSqlError>
 #include <QSqlField>
+#include <QSqlDriver>
 #include <QThread>
 #include <QDebug>
 #include <QMutex>
@@ -52,6 +53,12 @@
 #include <QInputDialog>
 #include <QCryptographicHash>
 #include <QPair>
+#include <QSet>
+#include <QElapsedTimer>
+#include <QTimer>
+#include <QDateTime>
+#include <QUrl>
+#include <QVector>
 
 #include "Algorithms.h"
 #include "brewnote.h"
@@ -71,6 +78,11 @@
 #include "brewtarget.h"
 #include "QueuedMethod.h"
 #include "DatabaseSchemaHelper.h"
+#include "DatabaseBackup.h"
+#include "DatabasePurge.h"
+#include "BackupStore.h"
+#include "TableCopier.h"
+#include "RecipeStatsTable.h"
 
 // Static members.
 Database* Database::dbInstance = 0;
@@ -90,9 +102,12 @@ QHash<Brewtarget::DBTable,QString> Database::tableNames;
 QHash<QString,Brewtarget::DBTable> Database::classNameToTable;
 QHash<Brewtarget::DBTable,Brewtarget::DBTable> Database::tableToChildTable = Database::tableToChildTableHash();
 QHash<Brewtarget::DBTable,Brewtarget::DBTable> Database::tableToInventoryTable = Database::tableToInventoryTableHash();
+QHash<Brewtarget::DBTable,Brewtarget::DBTable> Database::indexedInRecipeTables = Database::indexedInRecipeTablesHash();
 
-QHash< QThread*, QString > Database::_threadToConnection;
+ConnectionPool Database::_connectionPool;
 QMutex Database::_threadToConnectionMutex;
+QHash< QThread*, QString > Database::_threadToReader;
+QString Database::_profileFileName;
 
 Database::Database()
 {
@@ -100,6 +115,61 @@ Database::Database()
    // Lock this here until we actually construct the first database connection.
    _threadToConnectionMutex.lock();
    converted = false;
+   _rowCacheHits = 0;
+   _rowCacheMisses = 0;
+   _rowCacheMissTime_ms = 0;
+   _statementPrepares = 0;
+   _statementExecs = 0;
+
+   // How long the app has to sit still before held back writes go out.
+   _writeFailureReported = false;
+   _flushTimer.setSingleShot(true);
+   _flushTimer.setInterval(500);
+   connect( &_flushTimer, &QTimer::timeout, this, &Database::flushOnIdle );
+
+   _runningBackup = 0;
+   connect( &_backupTimer, &QTimer::timeout, this, &Database::scheduledBackup );
+   _runningPurge = 0;
+
+   _executor.setMaxThreadCount(1);
+   _executor.setExpiryTimeout(-1);
+
+   _walMode = false;
+   _readerSlots.release( qMax(1, Brewtarget::option("readerConnections", 2).toInt()) );
+   _execsAtLastCheckpoint = 0;
+   _readerWait_ms = 0;
+   _writerWait_ms = 0;
+   _snapshots = 0;
+   _checkpoints = 0;
+   connect( &_checkpointTimer, &QTimer::timeout, this, &Database::checkpointOnIdle );
+
+   _batchDepth = 0;
+   _deliveringBatch = false;
+
+   _slowQuery_ms = Brewtarget::option("slowQueryThreshold_ms", 100).toInt();
+
+   _connectionPool.setMaxLeases( Brewtarget::option("poolSize", 4).toInt() );
+   _connectionPool.setHealthCheckInterval( Brewtarget::option("poolHealthCheck_s", 30).toInt() * 1000 );
+   // Statements have to go before the connection they were prepared on.
+   _connectionPool.setCloseHook( [](QString const& conName) {
+      if ( dbInstance ) {
+         QMutexLocker locker(&dbInstance->_statementCacheMutex);
+         dbInstance->_statementCache.remove(conName);
+      }
+   });
+
+   _brewNoteBytes = 0;
+   _brewNoteBudget = qint64(Brewtarget::option("brewNoteBudget_kB", 8192).toInt()) * 1024;
+   _brewNotePageLoads = 0;
+   _brewNotePageEvictions = 0;
+
+   _libraryAttached = false;
+   _libraryRows = 0;
+   _libraryCopies = 0;
+   // Unload from the event loop, never under someone's feet.
+   _brewNoteEvictTimer.setSingleShot(true);
+   _brewNoteEvictTimer.setInterval(0);
+   connect( &_brewNoteEvictTimer, &QTimer::timeout, this, &Database::evictBrewNotes );
 }
 
 Database::~Database()
@@ -144,19 +214,27 @@ bool Database::loadSQLite()
       if( newdb.exists() )
       {
          dbFile.remove();
+         // A log left behind would be replayed into the restored file.
+         QFile::remove( QString("%1-wal").arg(dbFileName) );
+         QFile::remove( QString("%1-shm").arg(dbFileName) );
          newdb.copy(dbFileName);
          QFile::setPermissions( dbFileName, QFile::ReadOwner | QFile::WriteOwner | QFile::ReadGroup );
          newdb.remove();
       }
    }
 
+   // With the library attached, the shipped ingredients stay where they are.
+   bool library = Brewtarget::option("ingredientLibrary", false).toBool()
+                  && dataDbFile.exists()
+                  && dataDbFileName != dbFileName;
+
    // If there's no dbFile, try to copy from dataDbFile.
    if( !dbFile.exists() )
    {
       Brewtarget::userDatabaseDidNotExist = true;
 
       // Have to wait until db is open before creating from scratch.
-      if( dataDbFile.exists() )
+      if( dataDbFile.exists() && ! library )
       {
          dataDbFile.copy(dbFileName);
          QFile::setPermissions( dbFileName, QFile::ReadOwner | QFile::WriteOwner | QFile::ReadGroup );
@@ -169,6 +247,9 @@ bool Database::loadSQLite()
    // Open SQLite db.
    sqldb = QSqlDatabase::addDatabase("QSQLITE");
    sqldb.setDatabaseName(dbFileName);
+   // Lets ATTACH take the file: URI that opens the library read-only. A
+   // plain path is still just a path.
+   sqldb.setConnectOptions("QSQLITE_OPEN_URI");
    dbIsOpen = sqldb.open();
    dbConName = sqldb.connectionName();
 
@@ -192,17 +273,28 @@ bool Database::loadSQLite()
             throw QString("could not disable synchronous writes");
          if ( ! pragma.exec( "PRAGMA foreign_keys = on"))
             throw QString("could not enable foreign keys");
-         if ( ! pragma.exec( "PRAGMA locking_mode = EXCLUSIVE"))
-            throw QString("could not enable exclusive locks");
+         // No exclusive locks: the worker thread behind the *Async() calls
+         // reads through a connection of its own.
          if ( ! pragma.exec("PRAGMA temp_store = MEMORY") )
             throw QString("could not enable temporary memory");
 
+         // The journal mode sticks to the file, so turning WAL off has to
+         // be said out loud too.
+         QString journal = Brewtarget::option("walMode", false).toBool() ? "wal" : "delete";
+         if ( ! pragma.exec( QString("PRAGMA journal_mode = %1").arg(journal) ) || ! pragma.next() )
+            throw QString("could not set the journal mode");
+         _walMode = pragma.value(0).toString().toLower() == "wal";
+         if ( journal == "wal" && ! _walMode )
+            Brewtarget::logW( QString("%1: could not switch to WAL, journal mode is %2").arg(Q_FUNC_INFO).arg(pragma.value(0).toString()));
+         pragma.finish();
+
          // older sqlite databases may not have a settings table. I think I will
          // just check to see if anything is in there.
          createFromScratch = sqldb.tables().size() == 0;
 
          // Associate this db with the current thread.
-         _threadToConnection.insert(QThread::currentThread(), sqldb.connectionName());
+         _connectionPool.configure("QSQLITE", dbFileName, QString(), QString(), QString(), -1, sqldb.connectOptions());
+         _connectionPool.adopt(sqldb);
       }
       catch(QString e) {
          Brewtarget::logE( QString("%1: %2 (%3)").arg(Q_FUNC_INFO).arg(e).arg(pragma.lastError().text()));
@@ -263,7 +355,8 @@ bool Database::loadPgSQL()
       // by the time we had pgsql support, there is a settings table
       createFromScratch = ! sqldb.tables().contains("settings");
       // Associate this db with the current thread.
-      _threadToConnection.insert(QThread::currentThread(), sqldb.connectionName());
+      _connectionPool.configure("QPSQL", dbName, dbHostname, dbUsername, dbPassword, dbPortnum);
+      _connectionPool.adopt(sqldb);
    }
 
    return dbIsOpen;
@@ -331,6 +424,7 @@ bool Database::load()
    // See if there are new ingredients that we need to merge from the data-space db.
    if( dataDbFile.fileName() != dbFile.fileName()
       && ! Brewtarget::userDatabaseDidNotExist // Don't do this if we JUST copied the dataspace database.
+      && ! Brewtarget::option("ingredientLibrary", false).toBool() // Nor if we read it in place.
       && QFileInfo(dataDbFile).lastModified() > Brewtarget::lastDbMergeRequest )
    {
 
@@ -352,62 +446,73 @@ bool Database::load()
       Brewtarget::lastDbMergeRequest = QDateTime::currentDateTime();
    }
 
-   // Create and store all pointers.
-   populateElements( allBrewNotes, Brewtarget::BREWNOTETABLE );
-   populateElements( allEquipments, Brewtarget::EQUIPTABLE );
-   populateElements( allFermentables, Brewtarget::FERMTABLE );
-   populateElements( allHops, Brewtarget::HOPTABLE );
-   populateElements( allInstructions, Brewtarget::INSTRUCTIONTABLE );
-   populateElements( allMashs, Brewtarget::MASHTABLE );
-   populateElements( allMashSteps, Brewtarget::MASHSTEPTABLE );
-   populateElements( allMiscs, Brewtarget::MISCTABLE );
-   populateElements( allStyles, Brewtarget::STYLETABLE );
-   populateElements( allWaters, Brewtarget::WATERTABLE );
-   populateElements( allYeasts, Brewtarget::YEASTTABLE );
-
-   populateElements( allRecipes, Brewtarget::RECTABLE );
-
-   // Connect fermentable,hop changed signals to their parent recipe.
-   QHash<int,Recipe*>::iterator i;
-   QList<Fermentable*>::iterator j;
-   QList<Hop*>::iterator k;
-   QList<Yeast*>::iterator l;
-   QList<Mash*>::iterator m;
-   QList<MashStep*>::iterator n;
-
-
-   for( i = allRecipes.begin(); i != allRecipes.end(); i++ )
-   {
-      Equipment* e = equipment(*i);
-      if( e )
-      {
-         connect( e, &BeerXMLElement::changed, *i, &Recipe::acceptEquipChange );
-         connect( e, &Equipment::changedBoilSize_l, *i, &Recipe::setBoilSize_l);
-         connect( e, &Equipment::changedBoilTime_min, *i, &Recipe::setBoilTime_min);
+   // Create and store all pointers. The bulk loader reads every column in
+   // the same pass, so the first tree render does not pay one query per row.
+   bool bulk = Brewtarget::option("bulkLoad", true).toBool();
+   int rows = 0;
+   QElapsedTimer loadTimer;
+   loadTimer.start();
+
+   // Brew notes come in per recipe, when somebody looks at them.
+   populateBrewNoteCounts();
+   rows += populateElements( allEquipments, Brewtarget::EQUIPTABLE, bulk );
+   rows += populateElements( allFermentables, Brewtarget::FERMTABLE, bulk );
+   rows += populateElements( allHops, Brewtarget::HOPTABLE, bulk );
+   rows += populateElements( allInstructions, Brewtarget::INSTRUCTIONTABLE, bulk );
+   rows += populateElements( allMashs, Brewtarget::MASHTABLE, bulk );
+   rows += populateElements( allMashSteps, Brewtarget::MASHSTEPTABLE, bulk );
+   rows += populateElements( allMiscs, Brewtarget::MISCTABLE, bulk );
+   rows += populateElements( allStyles, Brewtarget::STYLETABLE, bulk );
+   rows += populateElements( allWaters, Brewtarget::WATERTABLE, bulk );
+   rows += populateElements( allYeasts, Brewtarget::YEASTTABLE, bulk );
+
+   if ( Brewtarget::dbType() == Brewtarget::SQLITE
+        && Brewtarget::option("ingredientLibrary", false).toBool()
+        && dataDbFile.exists() && dataDbFileName != dbFileName ) {
+      try {
+         attachLibrary(dataDbFileName);
       }
+      catch (QString e) {
+         Brewtarget::logW( QString("%1 : no ingredient library: %2").arg(Q_FUNC_INFO).arg(e));
+      }
+   }
 
-      QList<Fermentable*> tmpF = fermentables(*i);
-      for( j = tmpF.begin(); j != tmpF.end(); ++j )
-         connect( *j, SIGNAL(changed(QMetaProperty,QVariant)), *i, SLOT(acceptFermChange(QMetaProperty,QVariant)) );
-
-      QList<Hop*> tmpH = hops(*i);
-      for( k = tmpH.begin(); k != tmpH.end(); ++k )
-         connect( *k, SIGNAL(changed(QMetaProperty,QVariant)), *i, SLOT(acceptHopChange(QMetaProperty,QVariant)) );
-
-      QList<Yeast*> tmpY = yeasts(*i);
-      for( l = tmpY.begin(); l != tmpY.end(); ++l )
-         connect( *l, SIGNAL(changed(QMetaProperty,QVariant)), *i, SLOT(acceptYeastChange(QMetaProperty,QVariant)) );
+   rows += populateElements( allRecipes, Brewtarget::RECTABLE, bulk );
+   populateRecipeIndex();
+   populateInventoryIndex();
 
-      connect( mash(*i), SIGNAL(changed(QMetaProperty,QVariant)), *i, SLOT(acceptMashChange(QMetaProperty,QVariant)) );
-   }
+   // The lazy path pays for its rows later, one query per row. Those misses
+   // and their cost are reported by unload(), so the two can be compared.
+   Brewtarget::log.info( QString("%1 : %2 loader read %3 rows in %4 ms")
+                           .arg(Q_FUNC_INFO)
+                           .arg( bulk ? "bulk" : "lazy" )
+                           .arg(rows)
+                           .arg(loadTimer.elapsed()));
 
-   QList<Mash*> tmpM = mashs();
-   for( m = tmpM.begin(); m != tmpM.end(); ++m )
-   {
-      QList<MashStep*> tmpMS = mashSteps(*m);
-      for( n=tmpMS.begin(); n != tmpMS.end(); ++n)
-         connect( *n, SIGNAL(changed(QMetaProperty,QVariant)), *m, SLOT(acceptMashStepChange(QMetaProperty,QVariant)) );
-   }
+   // Connect fermentable,hop changed signals to their parent recipe.
+   foreach( Recipe* rec, allRecipes )
+      connectRecipe(rec);
+
+   foreach( Mash* m, mashs() )
+      connectMash(m);
+
+   // Online backups while we are open. 0 turns them off.
+   int interval = Brewtarget::option("interval", 0, "backups").toInt();
+   if ( Brewtarget::dbType() == Brewtarget::SQLITE && interval > 0 )
+      _backupTimer.start( interval * 60 * 1000 );
+
+   // Purge every "intervalDays" days, or finish one that was cut short. Wait
+   // a minute, so it does not get in the way of starting up. 0 turns it off.
+   int purgeDays = Brewtarget::option("intervalDays", 30, "purge").toInt();
+   int purgeAt = Brewtarget::option("position", -1, "purge").toInt();
+   QDateTime lastPurge = Brewtarget::option("lastRun", QDateTime(), "purge").toDateTime();
+   if ( purgeDays > 0 &&
+        ( purgeAt >= 0 || ! lastPurge.isValid() || lastPurge.daysTo(QDateTime::currentDateTime()) >= purgeDays ) )
+      QTimer::singleShot( 60 * 1000, this, SLOT(scheduledPurge()) );
+
+   // With a write-ahead log, look for a quiet moment to checkpoint it.
+   if ( _walMode )
+      _checkpointTimer.start( qMax(1, Brewtarget::option("checkpointInterval", 30).toInt()) * 1000 );
 
    loadWasSuccessful = true;
    return loadWasSuccessful;
@@ -434,6 +539,34 @@ bool Database::createBlank(QString const& filename)
    return true;
 }
 
+void Database::connectRecipe( Recipe* rec )
+{
+   Equipment* e = equipment(rec);
+   if( e )
+   {
+      connect( e, &BeerXMLElement::changed, rec, &Recipe::acceptEquipChange );
+      connect( e, &Equipment::changedBoilSize_l, rec, &Recipe::setBoilSize_l);
+      connect( e, &Equipment::changedBoilTime_min, rec, &Recipe::setBoilTime_min);
+   }
+
+   foreach( Fermentable* ferm, fermentables(rec) )
+      connect( ferm, SIGNAL(changed(QMetaProperty,QVariant)), rec, SLOT(acceptFermChange(QMetaProperty,QVariant)) );
+
+   foreach( Hop* hop, hops(rec) )
+      connect( hop, SIGNAL(changed(QMetaProperty,QVariant)), rec, SLOT(acceptHopChange(QMetaProperty,QVariant)) );
+
+   foreach( Yeast* yeast, yeasts(rec) )
+      connect( yeast, SIGNAL(changed(QMetaProperty,QVariant)), rec, SLOT(acceptYeastChange(QMetaProperty,QVariant)) );
+
+   connect( mash(rec), SIGNAL(changed(QMetaProperty,QVariant)), rec, SLOT(acceptMashChange(QMetaProperty,QVariant)) );
+}
+
+void Database::connectMash( Mash* m )
+{
+   foreach( MashStep* step, mashSteps(m) )
+      connect( step, SIGNAL(changed(QMetaProperty,QVariant)), m, SLOT(acceptMashStepChange(QMetaProperty,QVariant)) );
+}
+
 bool Database::loadSuccessful()
 {
    return loadWasSuccessful;
@@ -487,62 +620,259 @@ QSqlDatabase Database::sqlDatabase()
    // Need a unique database connection for each thread.
    //http://www.linuxjournal.com/article/9602
 
-   QThread* t = QThread::currentThread();
-   QSqlDatabase sqldb;
+   // Wait for load() to open the first connection.
+   QMutexLocker locker(&_threadToConnectionMutex);
+   try {
+      return _connectionPool.connection();
+   }
+   catch (QString e) {
+      Brewtarget::logE( QString("%1 %2").arg(Q_FUNC_INFO).arg(e));
+      throw;
+   }
+}
+
+void Database::releaseConnection()
+{
+   QStringList conNames;
+
+   _connectionPool.release();
 
    _threadToConnectionMutex.lock();
-   // If this thread already has a connection, return it.
-   if( _threadToConnection.contains(t) )
-   {
-      QSqlDatabase ret = QSqlDatabase::database(_threadToConnection[t]);
-      _threadToConnectionMutex.unlock();
-      return ret;
+   if ( _threadToReader.contains( QThread::currentThread() ) )
+      conNames.append( _threadToReader.take( QThread::currentThread() ) );
+   _threadToConnectionMutex.unlock();
+
+   foreach( QString conName, conNames ) {
+      // Statements have to go before the connection they were prepared on.
+      if ( dbInstance ) {
+         QMutexLocker locker(&dbInstance->_statementCacheMutex);
+         dbInstance->_statementCache.remove(conName);
+      }
+
+      QSqlDatabase::database( conName, false ).close();
+      QSqlDatabase::removeDatabase( conName );
    }
-   // Create a unique connection name, just containing the addy of the thread.
-   QString conName = QString("0x%1").arg(reinterpret_cast<uintptr_t>(t), 0, 16);
+}
+
+QSqlDatabase Database::acquireReader()
+{
+   QElapsedTimer waited;
+   waited.start();
+
+   _readerSlots.acquire();
+
+   QThread* t = QThread::currentThread();
+   QSqlDatabase reader;
 
-   // Create the new connection.
+   _threadToConnectionMutex.lock();
    try {
-      if ( Brewtarget::dbType() == Brewtarget::PGSQL ) {
-         sqldb = QSqlDatabase::addDatabase("QPSQL",conName);
-
-         sqldb.setHostName( dbHostname );
-         sqldb.setDatabaseName( dbName );
-         sqldb.setUserName( dbUsername );
-         sqldb.setPort( dbPortnum );
-         sqldb.setPassword( dbPassword );
-
-         if( ! sqldb.open() )
-            throw QString("Could not open %1 for reading.\n%2")
-            .arg(dbHostname).arg(sqldb.lastError().text());
-      }
+      if ( _threadToReader.contains(t) )
+         reader = QSqlDatabase::database( _threadToReader[t] );
       else {
-         sqldb = QSqlDatabase::addDatabase("QSQLITE",conName);
-         sqldb.setDatabaseName(dbFileName);
-         if( ! sqldb.open() )
-            throw QString("Could not open %1 for reading.\n%2")
-            .arg(dbFileName).arg(sqldb.lastError().text());
+         QString conName = QString("reader_0x%1").arg(reinterpret_cast<uintptr_t>(t), 0, 16);
+         reader = QSqlDatabase::addDatabase("QSQLITE", conName);
+         reader.setDatabaseName(dbFileName);
+         reader.setConnectOptions("QSQLITE_OPEN_READONLY");
+         if ( ! reader.open() )
+            throw QString("Could not open %1 for reading.\n%2").arg(dbFileName).arg(reader.lastError().text());
+         _threadToReader.insert(t, conName);
       }
    }
    catch (QString e) {
       Brewtarget::logE( QString("%1 %2").arg(Q_FUNC_INFO).arg(e));
       _threadToConnectionMutex.unlock();
+      _readerSlots.release();
       throw;
    }
-
-   // Put new connection in the hash.
-   _threadToConnection.insert(t,conName);
    _threadToConnectionMutex.unlock();
-   return sqldb;
+
+   // A read transaction only takes its snapshot at the first read.
+   QSqlQuery pin(reader);
+   if ( ! pin.exec("BEGIN") || ! pin.exec("SELECT 1 FROM sqlite_master LIMIT 1") ) {
+      QString e = QString("Could not start a snapshot: %1").arg(pin.lastError().text());
+      Brewtarget::logE( QString("%1 %2").arg(Q_FUNC_INFO).arg(e));
+      reader.rollback();
+      _readerSlots.release();
+      throw e;
+   }
+   pin.finish();
+
+   QMutexLocker locker(&_waitMutex);
+   _readerWait_ms += waited.elapsed();
+   ++_snapshots;
+   return reader;
+}
+
+void Database::releaseReader( QSqlDatabase reader )
+{
+   // Nothing was written, so there is nothing to lose either way.
+   if ( ! reader.commit() )
+      reader.rollback();
+   _readerSlots.release();
+}
+
+bool Database::checkpoint( QString const& mode )
+{
+   QSqlQuery q( sqlDatabase() );
+
+   // Gives back busy, the frames in the log and the frames moved out of it.
+   if ( ! execProfiled(q, QString("PRAGMA wal_checkpoint(%1)").arg(mode) ) || ! q.next() ) {
+      Brewtarget::logW( QString("%1 : %2").arg(Q_FUNC_INFO).arg(q.lastError().text()));
+      return false;
+   }
+
+   int busy = q.value(0).toInt();
+   int logFrames = q.value(1).toInt();
+   int moved = q.value(2).toInt();
+   q.finish();
+
+   if ( logFrames > 0 ) {
+      ++_checkpoints;
+      Brewtarget::log.info( QString("%1 : %2 checkpoint moved %3 of %4 frames")
+                              .arg(Q_FUNC_INFO).arg(mode).arg(moved).arg(logFrames));
+   }
+   return busy == 0 && moved == logFrames;
+}
+
+void Database::checkpointOnIdle()
+{
+   // Anything written since the last tick means we are not idle yet.
+   quint64 execs = statementExecs();
+   if ( execs != _execsAtLastCheckpoint || ! _pendingWrites.isEmpty() ) {
+      _execsAtLastCheckpoint = execs;
+      return;
+   }
+
+   // PASSIVE never waits on readers or writers. Whatever it cannot move now
+   // goes next time.
+   checkpoint("PASSIVE");
+}
+
+bool Database::walMode() const
+{
+   return _walMode;
+}
+
+qint64 Database::readerWait_ms() const
+{
+   QMutexLocker locker(&_waitMutex);
+   return _readerWait_ms;
+}
+
+qint64 Database::writerWait_ms() const
+{
+   QMutexLocker locker(&_waitMutex);
+   return _writerWait_ms;
 }
 
 void Database::unload()
 {
 
 
-   // selectSome saves context. If we close the database before we tear that
-   // context down, core gets dumped
-   selectSome.clear();
+   try {
+      flush();
+   }
+   catch (QString e) {
+      Brewtarget::logE( QString("%1 %2").arg(Q_FUNC_INFO).arg(e));
+   }
+   _flushTimer.stop();
+
+   // Let the worker finish what it has, then close its connection.
+   AsyncJob<bool>* release = new AsyncJob<bool>( []() { releaseConnection(); return true; } );
+   _executor.start(release);
+   _executor.waitForDone();
+
+   _checkpointTimer.stop();
+   if ( _walMode ) {
+      Brewtarget::log.info( QString("%1 : %2 snapshots, readers waited %3 ms, writers waited %4 ms, %5 checkpoints")
+                              .arg(Q_FUNC_INFO)
+                              .arg(_snapshots)
+                              .arg(readerWait_ms())
+                              .arg(writerWait_ms())
+                              .arg(_checkpoints));
+
+      // Readers left on threads that are gone by now.
+      _threadToConnectionMutex.lock();
+      QStringList readers = _threadToReader.values();
+      _threadToReader.clear();
+      _threadToConnectionMutex.unlock();
+      foreach( QString conName, readers ) {
+         {
+            QMutexLocker locker(&_statementCacheMutex);
+            _statementCache.remove(conName);
+         }
+         QSqlDatabase::database( conName, false ).close();
+         QSqlDatabase::removeDatabase( conName );
+      }
+   }
+
+   // A backup still running needs the connection we are about to close.
+   _backupTimer.stop();
+   if ( _runningBackup )
+      _runningBackup->finish();
+
+   // Remember how far the purge got, so the next start can go on from there.
+   if ( _runningPurge ) {
+      _runningPurge->stop();
+      Brewtarget::setOption("position", _runningPurge->position(), "purge");
+      delete _runningPurge;
+      _runningPurge = 0;
+   }
+
+   // The statement cache saves context. If we close the database before we
+   // tear that context down, core gets dumped
+   Brewtarget::log.info( QString("%1 : brew note pages loaded %2, unloaded %3, %4 kB in memory")
+                           .arg(Q_FUNC_INFO)
+                           .arg(_brewNotePageLoads)
+                           .arg(_brewNotePageEvictions)
+                           .arg(_brewNoteBytes / 1024));
+   _brewNoteEvictTimer.stop();
+
+   Brewtarget::log.info( QString("%1 : statements prepared %2, executed %3")
+                           .arg(Q_FUNC_INFO)
+                           .arg(_statementPrepares)
+                           .arg(_statementExecs));
+   {
+      QMutexLocker locker(&_statementCacheMutex);
+      _statementCache.clear();
+   }
+
+   if ( ! _profileFileName.isEmpty() ) {
+      if ( _queryProfile.writeJson(_profileFileName) )
+         Brewtarget::log.info( QString("%1 : query profile written to %2").arg(Q_FUNC_INFO).arg(_profileFileName));
+      else
+         Brewtarget::logW( QString("%1 : could not write the query profile to %2").arg(Q_FUNC_INFO).arg(_profileFileName));
+   }
+
+   Brewtarget::log.info( QString("%1 : row cache hits %2, misses %3 (%4 ms loading rows on a miss)")
+                           .arg(Q_FUNC_INFO)
+                           .arg(_rowCacheHits)
+                           .arg(_rowCacheMisses)
+                           .arg(_rowCacheMissTime_ms));
+   invalidateRowCache();
+
+   if ( _libraryAttached )
+      Brewtarget::log.info( QString("%1 : served %2 library rows, copied %3 of them")
+                              .arg(Q_FUNC_INFO)
+                              .arg(_libraryRows)
+                              .arg(_libraryCopies));
+
+   ConnectionPool::Metrics pool = _connectionPool.metrics();
+   Brewtarget::log.info( QString("%1 : connections opened %2 (peak %3 open), reused %4, %5 closed on thread exit, "
+                                 "%6 health checks, %7 reconnects, %8 leases (%9 waited %10 ms)")
+                           .arg(Q_FUNC_INFO)
+                           .arg(pool.opens)
+                           .arg(pool.peakOpen)
+                           .arg(pool.reuses)
+                           .arg(pool.threadExits)
+                           .arg(pool.healthChecks)
+                           .arg(pool.reconnects)
+                           .arg(pool.leases)
+                           .arg(pool.leaseWaits)
+                           .arg(pool.leaseWait_ms));
+
+   // Our own connection is the one load() opened.
+   _connectionPool.release();
    QSqlDatabase::database( dbConName, false ).close();
    QSqlDatabase::removeDatabase( dbConName );
 
@@ -574,16 +904,30 @@ void Database::automaticBackup()
    }
 
    QString backupDir = Brewtarget::option("directory", Brewtarget::getConfigDir().canonicalPath(),"backups").toString();
-   QString listOfFiles = Brewtarget::option("files",QVariant(),"backups").toString();
-   QStringList fileNames = listOfFiles.split(",", QString::SkipEmptyParts);
+   bool incremental = Brewtarget::option("incremental",false,"backups").toBool();
+   QString newName = uniqueBackupName(backupDir, incremental ? BackupStore::manifestSuffix : QString());
+
+   // backup the file first. The database is closed by now, so the file
+   // will hold still while the store reads it.
+   if ( incremental )
+      storeBackup(backupDir, dbFileName, newName);
+   else
+      backupToDir(backupDir,newName);
+   recordBackup(backupDir, newName, maxBackups);
 
+   // finally, reset the counter
+   Brewtarget::setOption( "count", 0, "backups");
+}
+
+QString Database::uniqueBackupName( QString const& backupDir, QString const& suffix )
+{
    QString halfName = QString("%1.%2").arg("bt_database").arg(QDate::currentDate().toString("yyyyMMdd"));
    QString newName = halfName;
    // Unique filenames are a pain in the ass. In the case you open brewtarget
    // twice in a day, this loop makes sure we don't over write (or delete) the
    // wrong thing
    int foobar = 0;
-   while ( foobar < 10000 && QFile::exists( backupDir + "/" + newName ) ) {
+   while ( foobar < 10000 && QFile::exists( backupDir + "/" + newName + suffix ) ) {
       foobar++;
       newName = QString("%1_%2").arg(halfName).arg(foobar,4,10,QChar('0'));
       if ( foobar > 9999 ) {
@@ -591,9 +935,32 @@ void Database::automaticBackup()
          newName = halfName;
       }
    }
-   // backup the file first
-   backupToDir(backupDir,newName);
+   return newName + suffix;
+}
+
+bool Database::storeBackup( QString const& backupDir, QString const& fileName, QString const& manifestName )
+{
+   BackupStore store(backupDir);
+   if ( ! store.add(fileName, manifestName) ) {
+      Brewtarget::logW( QString("%1 : could not store %2 in %3").arg(Q_FUNC_INFO).arg(fileName).arg(backupDir));
+      return false;
+   }
+
+   qint64 logical = store.logicalBytes();
+   qint64 stored = store.storedBytes();
+   Brewtarget::log.info( QString("%1 : %2 wrote %3 new pages, reused %4. The store holds %5 bytes of backups in %6 bytes (%7% saved)")
+                           .arg(Q_FUNC_INFO)
+                           .arg(manifestName)
+                           .arg(store.chunksWritten())
+                           .arg(store.chunksReused())
+                           .arg(logical)
+                           .arg(stored)
+                           .arg( logical > 0 ? 100 * (logical - stored) / logical : 0 ));
+   return true;
+}
 
+void Database::recordBackup( QString const& backupDir, QString const& newName, int maxBackups )
+{
    // If we have maxBackups == -1, it means never clean. It also means we
    // don't track the filenames.
    if ( maxBackups == -1 )  {
@@ -601,6 +968,9 @@ void Database::automaticBackup()
       return;
    }
 
+   QString listOfFiles = Brewtarget::option("files",QVariant(),"backups").toString();
+   QStringList fileNames = listOfFiles.split(",", QString::SkipEmptyParts);
+
    fileNames.append(newName);
 
    // If we have too many backups. This is in a while loop because we need to
@@ -608,7 +978,17 @@ void Database::automaticBackup()
    // The while loop will clean that up properly.
    while ( fileNames.size() > maxBackups ) {
       // takeFirst() removes the file from the list, which is important
-      QString victim = backupDir + "/" + fileNames.takeFirst();
+      QString victimName = fileNames.takeFirst();
+      QString victim = backupDir + "/" + victimName;
+
+      // Pages in the store may still belong to newer backups. Let the store
+      // sort out which ones can go.
+      if ( BackupStore::isManifest(victimName) ) {
+         if ( ! BackupStore(backupDir).remove(victimName) )
+            Brewtarget::logW( QString("%1 : could not remove %2.").arg(Q_FUNC_INFO).arg(victim));
+         continue;
+      }
+
       QFile *file = new QFile(victim);
       QFileInfo *fileThing = new QFileInfo(victim);
 
@@ -622,14 +1002,207 @@ void Database::automaticBackup()
       }
    }
 
-   // re-encode the list
+   // re-encode the list and save it
    listOfFiles = fileNames.join(",");
-
-   // finally, reset the counter and save the new list of files
-   Brewtarget::setOption( "count", 0, "backups");
    Brewtarget::setOption( "files", listOfFiles, "backups");
 }
 
+void Database::scheduledBackup()
+{
+   int maxBackups = Brewtarget::option("maximum",10,"backups").toInt();
+   if ( maxBackups == 0 || _runningBackup )
+      return;
+
+   QString backupDir = Brewtarget::option("directory", Brewtarget::getConfigDir().canonicalPath(),"backups").toString();
+   bool incremental = Brewtarget::option("incremental",false,"backups").toBool();
+   QString newName = uniqueBackupName(backupDir, incremental ? BackupStore::manifestSuffix : QString());
+   // An incremental backup is first copied whole, so the store reads a file
+   // that holds still.
+   QString copyName = incremental ? QString("%1.tmp").arg(newName) : newName;
+
+   // Only keep track of the file once it is actually there.
+   QMetaObject::Connection* done = new QMetaObject::Connection;
+   *done = connect( this, &Database::backupFinished, this,
+                    [backupDir, newName, copyName, incremental, maxBackups, done](bool success, QString fileName) {
+      QObject::disconnect(*done);
+      delete done;
+      if ( success && incremental ) {
+         success = storeBackup(backupDir, fileName, newName);
+         QFile::remove(fileName);
+      }
+      if ( success )
+         recordBackup(backupDir, newName, maxBackups);
+   });
+
+   if ( ! startBackup(backupDir, copyName) ) {
+      disconnect(*done);
+      delete done;
+   }
+}
+
+bool Database::startBackup(QString dir, QString filename)
+{
+   if ( _runningBackup || Brewtarget::dbType() != Brewtarget::SQLITE )
+      return false;
+
+   // The backup copies what is in the file, so nothing can be held back.
+   flush();
+
+   QString newDbFileName = dir + "/" + (filename.isEmpty() ? QString("database.sqlite") : filename);
+   // Without the backup API the file is copied as is, and the log with it
+   // would be left behind.
+   if ( _walMode && ! DatabaseBackup::isAvailable( sqlDatabase() ) )
+      checkpoint("FULL");
+   int pagesPerStep = Brewtarget::option("pagesPerStep", 100, "backups").toInt();
+
+   _runningBackup = new DatabaseBackup( sqlDatabase(), newDbFileName, pagesPerStep, this );
+   connect( _runningBackup, &DatabaseBackup::progress, this, &Database::backupProgress );
+   connect( _runningBackup, &DatabaseBackup::finished, this, [this](bool success, QString const& fileName) {
+      _runningBackup->deleteLater();
+      _runningBackup = 0;
+      Brewtarget::log.info( QString("%1 : backup to %2 %3")
+                              .arg(Q_FUNC_INFO)
+                              .arg(fileName)
+                              .arg(success ? "finished" : "failed"));
+      emit backupFinished(success, fileName);
+   });
+
+   DatabaseBackup* backup = _runningBackup;
+   if ( ! backup->start() && _runningBackup == backup ) {
+      // It never got going, so finished() will not come either.
+      backup->deleteLater();
+      _runningBackup = 0;
+      return false;
+   }
+   return true;
+}
+
+void Database::scheduledPurge()
+{
+   if ( loadWasSuccessful && ! _runningPurge )
+      startPurge();
+}
+
+bool Database::startPurge()
+{
+   if ( _runningPurge )
+      return false;
+
+   // The purge decides from what is in the tables, so nothing can be held back.
+   flush();
+
+   int rowsPerStep = Brewtarget::option("rowsPerStep", 200, "purge").toInt();
+   int resumeAt = qMax(0, Brewtarget::option("position", -1, "purge").toInt());
+
+   _runningPurge = new DatabasePurge( sqlDatabase(), rowsPerStep, this );
+   connect( _runningPurge, &DatabasePurge::progress, this, &Database::purgeProgress );
+   // Each step decides from the tables too, so what was held back since the
+   // last one goes out before the next.
+   connect( _runningPurge, &DatabasePurge::progress, this, [this]() {
+      try {
+         flush();
+      }
+      catch (QString e) {
+         Brewtarget::logW( QString("%1 : %2").arg(Q_FUNC_INFO).arg(e));
+      }
+   });
+   connect( _runningPurge, &DatabasePurge::purged, this, [this](QString const& table, QList<int> const& keys) {
+      Brewtarget::DBTable dbTable = tableNames.key(table, Brewtarget::NOTABLE);
+      if ( dbTable != Brewtarget::NOTABLE )
+         forgetPurged(dbTable, keys);
+   });
+   connect( _runningPurge, &DatabasePurge::finished, this, [this](bool success, int rows, qint64 bytes) {
+      _runningPurge->deleteLater();
+      _runningPurge = 0;
+      if ( success ) {
+         Brewtarget::setOption("position", -1, "purge");
+         Brewtarget::setOption("lastRun", QDateTime::currentDateTime(), "purge");
+      }
+      // Parents and inventory rows may have gone with the rows.
+      if ( rows > 0 )
+         populateInventoryIndex();
+      Brewtarget::log.info( QString("%1 : purge %2, %3 rows removed, %4 bytes given back")
+                              .arg(Q_FUNC_INFO)
+                              .arg(success ? "finished" : "failed")
+                              .arg(rows)
+                              .arg(bytes));
+      emit purgeFinished(success, rows, bytes);
+   });
+
+   DatabasePurge* purge = _runningPurge;
+   if ( ! purge->start(resumeAt) && _runningPurge == purge ) {
+      // It never got going, so finished() will not come either.
+      purge->deleteLater();
+      _runningPurge = 0;
+      return false;
+   }
+   return true;
+}
+
+void Database::forgetPurged( Brewtarget::DBTable table, QList<int> const& keys )
+{
+   foreach( int key, keys ) {
+      invalidateRowCache(table, key);
+      if ( _pendingWrites.contains(table) )
+         _pendingWrites[table].remove(key);
+   }
+
+   {
+      QMutexLocker locker(&_recipeIndexMutex);
+      if ( table == Brewtarget::RECTABLE ) {
+         foreach( Brewtarget::DBTable ingTable, indexedInRecipeTables.keys() ) {
+            foreach( int key, keys )
+               _recipeIndex[ingTable].remove(key);
+         }
+      }
+      else if ( _recipeIndex.contains(table) ) {
+         QHash< int, QList<int> >& links = _recipeIndex[table];
+         QMutableHashIterator< int, QList<int> > i(links);
+         while ( i.hasNext() ) {
+            i.next();
+            foreach( int key, keys )
+               i.value().removeAll(key);
+            if ( i.value().isEmpty() )
+               i.remove();
+         }
+      }
+   }
+
+   {
+      QMutexLocker locker(&_inventoryIndexMutex);
+      foreach( int key, keys ) {
+         if ( _parentOf.contains(table) )
+            _parentOf[table].remove(key);
+         if ( _inventoryOf.contains(table) )
+            _inventoryOf[table].remove(key);
+      }
+   }
+
+   switch ( table )
+   {
+      case Brewtarget::BREWNOTETABLE:
+         foreach( int key, keys ) {
+            int recipeKey = _brewNoteRecipe.take(key);
+            if ( _brewNotePages.contains(recipeKey) )
+               _brewNotePages[recipeKey].removeOne(key);
+         }
+         forgetPurged( allBrewNotes, keys );
+         break;
+      case Brewtarget::EQUIPTABLE: forgetPurged( allEquipments, keys ); break;
+      case Brewtarget::FERMTABLE: forgetPurged( allFermentables, keys ); break;
+      case Brewtarget::HOPTABLE: forgetPurged( allHops, keys ); break;
+      case Brewtarget::INSTRUCTIONTABLE: forgetPurged( allInstructions, keys ); break;
+      case Brewtarget::MASHTABLE: forgetPurged( allMashs, keys ); break;
+      case Brewtarget::MASHSTEPTABLE: forgetPurged( allMashSteps, keys ); break;
+      case Brewtarget::MISCTABLE: forgetPurged( allMiscs, keys ); break;
+      case Brewtarget::RECTABLE: forgetPurged( allRecipes, keys ); break;
+      case Brewtarget::STYLETABLE: forgetPurged( allStyles, keys ); break;
+      case Brewtarget::WATERTABLE: forgetPurged( allWaters, keys ); break;
+      case Brewtarget::YEASTTABLE: forgetPurged( allYeasts, keys ); break;
+      default: break;
+   }
+}
+
 Database& Database::instance()
 {
 
@@ -673,8 +1246,8 @@ void Database::dropInstance()
 
 bool Database::backupToDir(QString dir,QString filename)
 {
-   // Make sure the singleton exists.
-   instance();
+   // Make sure the singleton exists, and that the file holds everything.
+   instance().flush();
 
    bool success = true;
    QString prefix = dir + "/";
@@ -687,6 +1260,14 @@ bool Database::backupToDir(QString dir,QString filename)
       newDbFileName = prefix + filename;
    }
 
+   // While the database is open, let SQLite make the copy so it is
+   // consistent even if someone writes to it part way through.
+   QSqlDatabase sqldb = QSqlDatabase::database( dbConName, false );
+   if ( sqldb.isOpen() && DatabaseBackup::isAvailable(sqldb) ) {
+      DatabaseBackup backup(sqldb, newDbFileName, -1);
+      return backup.start() && backup.finish();
+   }
+
    // Remove the files if they already exist so that
    // the copy() operation will succeed.
    QFile::remove(newDbFileName);
@@ -710,9 +1291,17 @@ bool Database::restoreFromFile(QString newDbFileStr)
    if( !newDbFile.exists() )
       return false;
 
-   success &= newDbFile.copy(QString("%1.new").arg(dbFile.fileName()));
+   // Incremental backups have to be put back together from their pages.
+   if ( BackupStore::isManifest(newDbFileStr) )
+      success &= BackupStore::restore(newDbFileStr, QString("%1.new").arg(dbFile.fileName()));
+   else
+      success &= newDbFile.copy(QString("%1.new").arg(dbFile.fileName()));
    QFile::setPermissions( newDbFile.fileName(), QFile::ReadOwner | QFile::WriteOwner | QFile::ReadGroup );
 
+   // Nothing we have cached can be trusted once the file is swapped in.
+   if ( success && dbInstance )
+      dbInstance->invalidateRowCache();
+
    return success;
 }
 
@@ -725,7 +1314,7 @@ void Database::removeIngredientFromRecipe( Recipe* rec, BeerXMLElement* ing )
    int ndx = meta->indexOfClassInfo("signal");
    QString propName, relTableName, ingKeyName, childTableName;
 
-   sqlDatabase().transaction();
+   TransactionScope scope;
    QSqlQuery q(sqlDatabase());
 
    try {
@@ -756,16 +1345,16 @@ void Database::removeIngredientFromRecipe( Recipe* rec, BeerXMLElement* ing )
                                  .arg(ing->_key);
       q.setForwardOnly(true);
 
-      if ( ! q.exec(deleteFromInRecipe) )
+      if ( ! execProfiled(q, deleteFromInRecipe) )
          throw QString("failed to delete in_recipe.");
 
       // I don't really like this, but I can't think of a better solution. Of
       // all the ingredients, instructions don't have a _children table. Given
       // that it is only one table, I will try the easy way first
-      if ( tableName != "instruction" && ! q.exec( deleteFromChildren ) )
+      if ( tableName != "instruction" && ! execProfiled(q, deleteFromChildren ) )
          throw QString("failed to delete children.");
 
-      if ( ! q.exec( deleteIngredient ) )
+      if ( ! execProfiled(q, deleteIngredient ) )
          throw QString("failed to delete ingredient.");
 
    }
@@ -775,17 +1364,19 @@ void Database::removeIngredientFromRecipe( Recipe* rec, BeerXMLElement* ing )
                            .arg(e)
                            .arg(q.lastQuery())
                            .arg(q.lastError().text()));
-      sqlDatabase().rollback();
       q.finish();
       throw QString("%1 %2 %3 %4").arg(Q_FUNC_INFO).arg(e).arg(q.lastQuery()).arg(q.lastError().text());
 
    }
 
+   invalidateRowCache( classNameToTable[ing->metaObject()->className()], ing->_key );
+   recipeIndexRemove( classNameToTable[ing->metaObject()->className()], rec->_key, ing->_key );
+   setParentID( classNameToTable[ing->metaObject()->className()], ing->_key, 0 );
    rec->recalcAll();
-   sqlDatabase().commit();
-
    q.finish();
-   emit rec->changed( rec->metaProperty(propName), QVariant() );
+   scope.commit();
+
+   notifyChanged( rec, rec->metaProperty(propName), QVariant() );
 }
 
 void Database::removeFromRecipe( Recipe* rec, Instruction* ins )
@@ -822,12 +1413,17 @@ void Database::removeFrom( Mash* mash, MashStep* step )
 Recipe* Database::getParentRecipe( BrewNote const* note )
 {
    int key;
+
+   // Every loaded note knows its recipe already.
+   if ( _brewNoteRecipe.contains(note->_key) )
+      return allRecipes.value( _brewNoteRecipe.value(note->_key) );
+
    QString query = QString("SELECT recipe_id FROM brewnote WHERE id = %1").arg(note->_key);
 
    QSqlQuery q(sqlDatabase());
 
    try {
-      if ( ! q.exec(query) )
+      if ( ! execProfiled(q, query) )
          throw QString("could not find recipe id");
    }
    catch ( QString e ) {
@@ -863,7 +1459,7 @@ void Database::swapMashStepOrder(MashStep* m1, MashStep* m2)
    QSqlQuery q(sqlDatabase() );
 
    try {
-      if ( !q.exec(update) )
+      if ( !execProfiled(q, update) )
          throw QString("failed to swap steps");
    }
    catch ( QString e ) {
@@ -877,9 +1473,11 @@ void Database::swapMashStepOrder(MashStep* m1, MashStep* m2)
    }
 
    q.finish();
+   invalidateRowCache( Brewtarget::MASHSTEPTABLE, m1->_key );
+   invalidateRowCache( Brewtarget::MASHSTEPTABLE, m2->_key );
 
-   emit m1->changed( m1->metaProperty("stepNumber") );
-   emit m2->changed( m2->metaProperty("stepNumber") );
+   notifyChanged( m1, m1->metaProperty("stepNumber") );
+   notifyChanged( m2, m2->metaProperty("stepNumber") );
 }
 
 void Database::swapInstructionOrder(Instruction* in1, Instruction* in2)
@@ -897,7 +1495,7 @@ void Database::swapInstructionOrder(Instruction* in1, Instruction* in2)
    QSqlQuery q( sqlDatabase());
 
    try {
-      if ( !q.exec(update) )
+      if ( !execProfiled(q, update) )
          throw QString("failed to swap steps");
    }
    catch ( QString e ) {
@@ -912,8 +1510,8 @@ void Database::swapInstructionOrder(Instruction* in1, Instruction* in2)
 
    q.finish();
 
-   emit in1->changed( in1->metaProperty("instructionNumber") );
-   emit in2->changed( in2->metaProperty("instructionNumber") );
+   notifyChanged( in1, in1->metaProperty("instructionNumber") );
+   notifyChanged( in2, in2->metaProperty("instructionNumber") );
 }
 
 void Database::insertInstruction(Instruction* in, int pos)
@@ -923,12 +1521,12 @@ void Database::insertInstruction(Instruction* in, int pos)
                    .arg(in->_key);
    QString update;
 
-   sqlDatabase().transaction();
+   TransactionScope scope;
 
    QSqlQuery q(sqlDatabase());
 
    try {
-      if ( !q.exec(query) )
+      if ( !execProfiled(q, query) )
          throw QString("failed to find recipe");
 
       q.next();
@@ -942,7 +1540,7 @@ void Database::insertInstruction(Instruction* in, int pos)
             "WHERE recipe_id=%1 AND instruction_number>=%2")
          .arg(parentRecipeKey).arg(pos);
 
-      if ( !q.exec(update) )
+      if ( !execProfiled(q, update) )
          throw QString("failed to renumber instructions recipe");
 
       // This is sort of spooky action at a distance -- the emit should really be
@@ -950,14 +1548,14 @@ void Database::insertInstruction(Instruction* in, int pos)
       query = QString("SELECT instruction_id as id, instruction_number as pos FROM instruction_in_recipe WHERE recipe_id=%1 and instruction_number>%2")
          .arg(parentRecipeKey).arg(pos);
 
-      if ( !q.exec(query) )
+      if ( !execProfiled(q, query) )
          throw QString("failed to find renumbered instructions");
 
       while( q.next() ) {
          Instruction* inst = allInstructions[ q.record().value("id").toInt() ];
          int newPos = q.record().value("pos").toInt();
 
-         emit inst->changed( inst->metaProperty("instructionNumber"),newPos );
+         notifyChanged( inst, inst->metaProperty("instructionNumber"),newPos );
       }
 
       // Change in's position to pos.
@@ -967,7 +1565,7 @@ void Database::insertInstruction(Instruction* in, int pos)
             "WHERE instruction_id=%2"
          ).arg(pos).arg(in->_key);
 
-      if ( !q.exec(update) )
+      if ( !execProfiled(q, update) )
          throw QString("failed to insert new instruction recipe");
    }
    catch ( QString e ) {
@@ -977,74 +1575,209 @@ void Database::insertInstruction(Instruction* in, int pos)
                            .arg(q.lastQuery())
                            .arg(q.lastError().text()));
       q.finish();
-      sqlDatabase().rollback();
       throw;
    }
 
-   sqlDatabase().commit();
    q.finish();
+   scope.commit();
 
-   emit in->changed( in->metaProperty("instructionNumber"), pos );
+   notifyChanged( in, in->metaProperty("instructionNumber"), pos );
 }
 
 QList<BrewNote*> Database::brewNotes(Recipe const* parent)
 {
    QList<BrewNote*> ret;
-   QString filterString = QString("recipe_id = %1 AND deleted = %2").arg(parent->_key).arg(Brewtarget::dbFalse());
 
-   getElements(ret, filterString, Brewtarget::BREWNOTETABLE, allBrewNotes);
+   foreach( int key, loadBrewNotes(parent->_key) )
+      ret.append( allBrewNotes.value(key) );
 
    return ret;
 }
 
-QList<Fermentable*> Database::fermentables(Recipe const* parent)
+int Database::brewNoteCount(Recipe const* parent)
 {
-   QList<Fermentable*> ret;
-   QString filter = QString("recipe_id = %1").arg(parent->_key);
+   if ( _brewNotePages.contains(parent->_key) )
+      return _brewNotePages.value(parent->_key).size();
+   return _brewNoteCounts.value(parent->_key, 0);
+}
 
-   getElements(ret,filter, Brewtarget::FERMINRECTABLE, allFermentables, "fermentable_id");
+void Database::holdBrewNotes(Recipe const* parent)
+{
+   if ( parent )
+      ++_brewNoteHolds[parent->_key];
+}
 
-   return ret;
+void Database::releaseBrewNotes(Recipe const* parent)
+{
+   if ( ! parent || ! _brewNoteHolds.contains(parent->_key) )
+      return;
+
+   if ( --_brewNoteHolds[parent->_key] <= 0 )
+      _brewNoteHolds.remove(parent->_key);
+   if ( _brewNoteBytes > _brewNoteBudget )
+      _brewNoteEvictTimer.start();
 }
 
-QList<Hop*> Database::hops(Recipe const* parent)
+void Database::populateBrewNoteCounts()
 {
-   QList<Hop*> ret;
-   QString filter = QString("recipe_id = %1").arg(parent->_key);
+   _brewNoteCounts.clear();
+   flushForRead(Brewtarget::BREWNOTETABLE);
 
-   getElements(ret,filter, Brewtarget::HOPINRECTABLE, allHops, "hop_id");
+   QSqlQuery q = preparedQuery( QString("SELECT recipe_id, COUNT(*) FROM brewnote WHERE deleted = %1 GROUP BY recipe_id")
+                                   .arg(Brewtarget::dbFalse()) );
+   try {
+      if ( ! execPrepared(q, QVariantList(), true) )
+         throw QString("%1 %2").arg(q.lastQuery()).arg(q.lastError().text());
+   }
+   catch (QString e) {
+      Brewtarget::logE( QString("%1 %2").arg(Q_FUNC_INFO).arg(e));
+      q.finish();
+      throw;
+   }
 
-   return ret;
+   while ( q.next() )
+      _brewNoteCounts.insert( q.value(0).toInt(), q.value(1).toInt() );
+   q.finish();
 }
 
-QList<Misc*> Database::miscs(Recipe const* parent)
+QList<int> const& Database::loadBrewNotes( int recipeKey )
 {
-   QList<Misc*> ret;
-   QString filter = QString("recipe_id = %1").arg(parent->_key);
+   QHash< int, QList<int> >::iterator page = _brewNotePages.find(recipeKey);
+   if ( page != _brewNotePages.end() ) {
+      _brewNoteLru.removeOne(recipeKey);
+      _brewNoteLru.append(recipeKey);
+      return *page;
+   }
+
+   // One query for the whole recipe, every column, straight into the row
+   // cache. The notes' getters then never go back to the database.
+   QSqlQuery q = preparedQuery( QString("SELECT * FROM brewnote WHERE recipe_id = ? AND deleted = %1 ORDER BY id")
+                                   .arg(Brewtarget::dbFalse()) );
+   try {
+      if ( ! execPrepared(q, QVariantList() << recipeKey, true) )
+         throw QString("%1 %2").arg(q.lastQuery()).arg(q.lastError().text());
+   }
+   catch (QString e) {
+      Brewtarget::logE( QString("%1 %2").arg(Q_FUNC_INFO).arg(e));
+      q.finish();
+      throw;
+   }
+
+   QList<int> keys;
+   qint64 bytes = 0;
+   while ( q.next() ) {
+      QSqlRecord rec = q.record();
+      int key = rec.value("id").toInt();
+
+      cacheRow(Brewtarget::BREWNOTETABLE, key, rec);
+      if ( ! allBrewNotes.contains(key) )
+         allBrewNotes.insert(key, new BrewNote(Brewtarget::BREWNOTETABLE, key));
+      _brewNoteRecipe.insert(key, recipeKey);
+      keys.append(key);
+
+      // A rough guess is all the budget needs: the object, plus the cached
+      // row with a hash node per column.
+      bytes += sizeof(BrewNote);
+      for( int i = 0; i < rec.count(); ++i ) {
+         QVariant v = rec.value(i);
+         bytes += 32 + (v.type() == QVariant::String ? 2 * v.toString().size() : 8);
+      }
+   }
+   profileRows(q, keys.size());
+   q.finish();
 
+   ++_brewNotePageLoads;
+   _brewNoteCounts.remove(recipeKey);
+   _brewNotePageBytes.insert(recipeKey, bytes);
+   _brewNoteBytes += bytes;
+   _brewNoteLru.append(recipeKey);
 
-   getElements(ret,filter, Brewtarget::MISCINRECTABLE, allMiscs, "misc_id");
+   if ( _brewNoteBytes > _brewNoteBudget )
+      _brewNoteEvictTimer.start();
 
-   return ret;
+   return _brewNotePages.insert(recipeKey, keys).value();
 }
 
-Equipment* Database::equipment(Recipe const* parent)
+void Database::adoptBrewNote( int recipeKey, BrewNote* note )
 {
-   int id = get( Brewtarget::RECTABLE, parent->key(), "equipment_id" ).toInt();
+   // Load the rest first, so the page is complete when the new one joins it.
+   loadBrewNotes(recipeKey);
+   if ( ! _brewNotePages[recipeKey].contains(note->_key) )
+      _brewNotePages[recipeKey].append(note->_key);
+   _brewNoteRecipe.insert(note->_key, recipeKey);
 
-   if( allEquipments.contains(id) )
-      return allEquipments[id];
-   else
-      return 0;
+   // The note itself goes with forgetOnRollback().
+   int noteKey = note->_key;
+   TransactionScope::onRollback( [this, recipeKey, noteKey]() {
+      if ( _brewNotePages.contains(recipeKey) )
+         _brewNotePages[recipeKey].removeOne(noteKey);
+      _brewNoteRecipe.remove(noteKey);
+   });
 }
 
-Style* Database::style(Recipe const* parent)
+void Database::evictBrewNotes()
 {
-   int id = get( Brewtarget::RECTABLE, parent->key(), "style_id").toInt();
+   // Notes with writes still held back must get them out before they go.
+   flush();
 
-   if( allStyles.contains(id) )
-      return allStyles[id];
-   else
+   QList<int> lru = _brewNoteLru;
+   foreach( int recipeKey, lru ) {
+      if ( _brewNoteBytes <= _brewNoteBudget )
+         break;
+      if ( _brewNoteHolds.contains(recipeKey) )
+         continue;
+
+      emit brewNotesUnloading( allRecipes.value(recipeKey) );
+
+      QList<int> keys = _brewNotePages.take(recipeKey);
+      // Notes deleted since the page was loaded are no longer on it.
+      QList<int> notes = _brewNoteRecipe.keys(recipeKey);
+      foreach( int key, notes ) {
+         _brewNoteRecipe.remove(key);
+         invalidateRowCache(Brewtarget::BREWNOTETABLE, key);
+         delete allBrewNotes.take(key);
+      }
+
+      if ( ! keys.isEmpty() )
+         _brewNoteCounts.insert(recipeKey, keys.size());
+      _brewNoteBytes -= _brewNotePageBytes.take(recipeKey);
+      _brewNoteLru.removeOne(recipeKey);
+      ++_brewNotePageEvictions;
+   }
+}
+
+QList<Fermentable*> Database::fermentables(Recipe const* parent)
+{
+   return recipeIndexLookup( Brewtarget::FERMTABLE, parent->_key, allFermentables );
+}
+
+QList<Hop*> Database::hops(Recipe const* parent)
+{
+   return recipeIndexLookup( Brewtarget::HOPTABLE, parent->_key, allHops );
+}
+
+QList<Misc*> Database::miscs(Recipe const* parent)
+{
+   return recipeIndexLookup( Brewtarget::MISCTABLE, parent->_key, allMiscs );
+}
+
+Equipment* Database::equipment(Recipe const* parent)
+{
+   int id = get( Brewtarget::RECTABLE, parent->key(), "equipment_id" ).toInt();
+
+   if( allEquipments.contains(id) )
+      return allEquipments[id];
+   else
+      return 0;
+}
+
+Style* Database::style(Recipe const* parent)
+{
+   int id = get( Brewtarget::RECTABLE, parent->key(), "style_id").toInt();
+
+   if( allStyles.contains(id) )
+      return allStyles[id];
+   else
       return 0;
 }
 
@@ -1061,9 +1794,9 @@ Mash* Database::mash( Recipe const* parent )
 QList<MashStep*> Database::mashSteps(Mash const* parent)
 {
    QList<MashStep*> ret;
-   QString filterString = QString("mash_id = %1 AND deleted = %2 order by step_number").arg(parent->_key).arg(Brewtarget::dbFalse());
+   QString filterString = QString("mash_id = ? AND deleted = %1 order by step_number").arg(Brewtarget::dbFalse());
 
-   getElements(ret, filterString, Brewtarget::MASHSTEPTABLE, allMashSteps);
+   getElements(ret, filterString, Brewtarget::MASHSTEPTABLE, allMashSteps, "", QVariantList() << parent->_key);
 
    return ret;
 }
@@ -1071,31 +1804,21 @@ QList<MashStep*> Database::mashSteps(Mash const* parent)
 QList<Instruction*> Database::instructions( Recipe const* parent )
 {
    QList<Instruction*> ret;
-   QString filter = QString("recipe_id = %1 ORDER BY instruction_number ASC").arg(parent->_key);
+   QString filter("recipe_id = ? ORDER BY instruction_number ASC");
 
-   getElements(ret,filter,Brewtarget::INSTINRECTABLE,allInstructions,"instruction_id");
+   getElements(ret,filter,Brewtarget::INSTINRECTABLE,allInstructions,"instruction_id", QVariantList() << parent->_key);
 
    return ret;
 }
 
 QList<Water*> Database::waters(Recipe const* parent)
 {
-   QList<Water*> ret;
-   QString filter = QString("recipe_id = %1").arg(parent->_key);
-
-   getElements(ret,filter,Brewtarget::WATERINRECTABLE,allWaters,"water_id");
-
-   return ret;
+   return recipeIndexLookup( Brewtarget::WATERTABLE, parent->_key, allWaters );
 }
 
 QList<Yeast*> Database::yeasts(Recipe const* parent)
 {
-   QList<Yeast*> ret;
-   QString filter = QString("recipe_id = %1").arg(parent->_key);
-
-   getElements(ret,filter,Brewtarget::YEASTINRECTABLE,allYeasts,"yeast_id");
-
-   return ret;
+   return recipeIndexLookup( Brewtarget::YEASTTABLE, parent->_key, allYeasts );
 }
 
 // Named constructors =========================================================
@@ -1105,6 +1828,11 @@ BrewNote* Database::newBrewNote(BrewNote* other, bool signal)
    BrewNote* tmp = copy<BrewNote>(other, &allBrewNotes);
 
    if ( tmp ) {
+      // The copy stays with the same recipe.
+      Recipe* parent = getParentRecipe(other);
+      if ( parent )
+         adoptBrewNote(parent->_key, tmp);
+
       if ( signal )
       {
          emit changed( metaProperty("brewNotes"), QVariant() );
@@ -1119,7 +1847,7 @@ BrewNote* Database::newBrewNote(Recipe* parent, bool signal)
 {
    BrewNote* tmp;
 
-   sqlDatabase().transaction();
+   TransactionScope scope;
 
    try {
       tmp = newIngredient(&allBrewNotes);
@@ -1131,11 +1859,11 @@ BrewNote* Database::newBrewNote(Recipe* parent, bool signal)
    }
    catch (QString e) {
       Brewtarget::logE( QString("%1 %2").arg(Q_FUNC_INFO).arg(e));
-      sqlDatabase().rollback();
       throw;
    }
 
-   sqlDatabase().commit();
+   scope.commit();
+   adoptBrewNote(parent->_key, tmp);
    if ( signal )
    {
       emit changed( metaProperty("brewNotes"), QVariant() );
@@ -1212,23 +1940,22 @@ Instruction* Database::newInstruction(Recipe* rec)
    // TODO: encapsulate in QUndoCommand.
    Instruction* tmp;
 
-   sqlDatabase().transaction();
+   TransactionScope scope;
 
    try {
       tmp = newIngredient(&allInstructions);
 
-      // Add without copying to "instruction_in_recipe". We already have a
-      // transaction open, so tell addIng to not worry about it
-      tmp = addIngredientToRecipe<Instruction>(rec,tmp,true,0,false,false);
+      // Add without copying to "instruction_in_recipe". Inside our scope,
+      // that is only a savepoint.
+      tmp = addIngredientToRecipe<Instruction>(rec,tmp,true,0,false);
    }
    catch ( QString e ) {
       Brewtarget::logE( QString("%1 %2").arg(Q_FUNC_INFO).arg(e));
-      sqlDatabase().rollback();
       throw;
    }
 
    // Database's instructions have changed.
-   sqlDatabase().commit();
+   scope.commit();
    emit changed( metaProperty("instructions"), QVariant() );
 
    return tmp;
@@ -1253,9 +1980,7 @@ Mash* Database::newMash(Mash* other, bool displace)
 {
    Mash* tmp;
 
-   if ( other ) {
-      sqlDatabase().transaction();
-   }
+   TransactionScope scope;
 
    try {
       if ( other )
@@ -1279,25 +2004,21 @@ Mash* Database::newMash(Mash* other, bool displace)
       }
    }
    catch (QString e) {
-      if ( other )
-         sqlDatabase().rollback();
       throw;
    }
 
-   if ( other )
-      sqlDatabase().commit();
+   scope.commit();
    emit changed( metaProperty("mashs"), QVariant() );
    emit newMashSignal(tmp);
 
    return tmp;
 }
 
-Mash* Database::newMash(Recipe* parent, bool transact)
+Mash* Database::newMash(Recipe* parent)
 {
    Mash* tmp;
 
-   if ( transact )
-      sqlDatabase().transaction();
+   TransactionScope scope;
 
    try {
       tmp = newIngredient(&allMashs);
@@ -1309,13 +2030,10 @@ Mash* Database::newMash(Recipe* parent, bool transact)
    }
    catch (QString e) {
       Brewtarget::logE( QString("%1 %2").arg(Q_FUNC_INFO).arg(e));
-      if ( transact )
-         sqlDatabase().rollback();
       throw;
    }
 
-   if ( transact )
-      sqlDatabase().commit();
+   scope.commit();
 
    emit changed( metaProperty("mashs"), QVariant() );
    emit newMashSignal(tmp);
@@ -1337,7 +2055,7 @@ MashStep* Database::newMashStep(Mash* mash, bool connected)
                         .arg(Brewtarget::dbFalse())
                         .arg(mash->_key);
 
-   sqlDatabase().transaction();
+   TransactionScope scope;
 
    QSqlQuery q(sqlDatabase());
    q.setForwardOnly(true);
@@ -1360,11 +2078,10 @@ MashStep* Database::newMashStep(Mash* mash, bool connected)
    }
    catch (QString e) {
       Brewtarget::logE( QString("%1 %2").arg(Q_FUNC_INFO).arg(e));
-      sqlDatabase().rollback();
       throw;
    }
 
-   sqlDatabase().commit();
+   scope.commit();
 
    if ( connected )
       connect( tmp, SIGNAL(changed(QMetaProperty,QVariant)), mash, SLOT(acceptMashStepChange(QMetaProperty,QVariant)) );
@@ -1400,58 +2117,187 @@ Recipe* Database::newRecipe()
 {
    Recipe* tmp;
 
-   sqlDatabase().transaction();
+   TransactionScope scope;
 
    try {
       tmp = newIngredient(&allRecipes);
 
-      newMash(tmp,false);
+      newMash(tmp);
    }
    catch (QString e ) {
       Brewtarget::logE( QString("%1 %2").arg(Q_FUNC_INFO).arg(e));
-      sqlDatabase().rollback();
       throw;
    }
 
-   sqlDatabase().commit();
+   scope.commit();
    emit changed( metaProperty("recipes"), QVariant() );
    emit newRecipeSignal(tmp);
 
    return tmp;
 }
 
-// TODO: Oh my. This the entire thing should be transacted. It took some work
-// to get all the addToRecipe methods to play nice.
-//
+// Copies the recipe a table at a time, with INSERT...SELECT, instead of an
+// ingredient at a time. Nothing is announced until the whole copy is in.
 Recipe* Database::newRecipe(Recipe* other)
 {
    Recipe* tmp;
+   Equipment* oldEquip = other->equipment();
+   Style* oldStyle = other->style();
+   Mash* oldMash = other->mash();
+   QVariantList fromOther = QVariantList() << other->_key;
+
+   // Like addToRecipe(), the copies of ingredients are hidden.
+   QHash<QString,QString> hidden;
+   hidden.insert("display", Brewtarget::dbFalse());
+   QHash<QString,QString> recipeCols;
+   recipeCols.insert("display", Brewtarget::dbTrue());
+
+   int recKey = 0;
+   int equipKey = 0;
+   int styleKey = 0;
+   int mashKey = 0;
+   QList<int> stepKeys, instructionKeys;
+   QHash< Brewtarget::DBTable, QList<int> > ingKeys, ingParents;
+
+   TransactionScope scope;
+   QSqlQuery q(sqlDatabase());
+
+   // Links the copies in keys to the new recipe, in the order given, which
+   // is the order they were made in.
+   auto linkCopies = [&]( QString const& linkTable, QString const& ingTable, QList<int> const& keys ) {
+      QVariantList ingIds, recipeIds;
+      foreach( int key, keys ) {
+         ingIds.append(key);
+         recipeIds.append(recKey);
+      }
+
+      q = preparedQuery( QString("INSERT INTO %1 (%2_id, recipe_id) VALUES (?, ?)")
+                            .arg(linkTable)
+                            .arg(ingTable) );
+      q.addBindValue(ingIds);
+      q.addBindValue(recipeIds);
+      if ( ! q.execBatch() )
+         throw QString("%1 %2").arg(q.lastQuery()).arg(q.lastError().text());
+      q.finish();
+   };
 
-   sqlDatabase().transaction();
    try {
-      tmp = copy<Recipe>(other, &allRecipes);
-
-      // Copy fermentables, hops, miscs and yeasts. We've the convenience
-      // methods, so use them? And now I have to instruct all of them to not do
-      // transactions either. -4 SAN points!
-      addToRecipe( tmp, other->fermentables(), false);
-      addToRecipe( tmp, other->hops(), false);
-      addToRecipe( tmp, other->miscs(), false);
-      addToRecipe( tmp, other->yeasts(), false);
-
-      // Copy style/mash/equipment
-      // Style or equipment might be non-existent but these methods handle that.
-      addToRecipe( tmp, other->equipment(), false, false);
-      addToRecipe( tmp, other->mash(), false, false);
-      addToRecipe( tmp, other->style(), false, false);
+      // Equipment, style and mash first, so the recipe row can point at the
+      // copies as it is written.
+      if ( oldEquip ) {
+         equipKey = copyRows( Brewtarget::EQUIPTABLE, "WHERE t.id=?", QVariantList() << oldEquip->_key, hidden ).first();
+         recipeCols.insert("equipment_id", QString::number(equipKey));
+      }
+      if ( oldStyle ) {
+         styleKey = copyRows( Brewtarget::STYLETABLE, "WHERE t.id=?", QVariantList() << oldStyle->_key, hidden ).first();
+         recipeCols.insert("style_id", QString::number(styleKey));
+      }
+      if ( oldMash ) {
+         mashKey = copyRows( Brewtarget::MASHTABLE, "WHERE t.id=?", QVariantList() << oldMash->_key, hidden ).first();
+         recipeCols.insert("mash_id", QString::number(mashKey));
+
+         QHash<QString,QString> stepCols;
+         stepCols.insert("mash_id", QString::number(mashKey));
+         stepKeys = copyRows( Brewtarget::MASHSTEPTABLE,
+                              QString("WHERE t.mash_id=? AND t.deleted=%1 ORDER BY t.step_number").arg(Brewtarget::dbFalse()),
+                              QVariantList() << oldMash->_key, stepCols );
+      }
+
+      recKey = copyRows( Brewtarget::RECTABLE, "WHERE t.id=?", fromOther, recipeCols ).first();
+
+      // Each copy keeps the parent of what it was copied from, which is where
+      // the inventory is.
+      foreach( Brewtarget::DBTable table, indexedInRecipeTables.keys() )
+      {
+         QString ingTable = tableNames[table];
+         QString linkTable = tableNames[indexedInRecipeTables[table]];
+         QList<int> origins;
+         QList<int> keys = copyRows( table,
+                                     QString("JOIN %1 r ON r.%2_id = t.id WHERE r.recipe_id=? ORDER BY r.id")
+                                        .arg(linkTable)
+                                        .arg(ingTable),
+                                     fromOther, hidden, &origins );
+         if ( keys.isEmpty() )
+            continue;
+
+         linkCopies( linkTable, ingTable, keys );
+
+         QVariantList parents, children;
+         for( int i = 0; i < keys.size(); ++i ) {
+            int parent = getParentID(table, origins.at(i));
+            ingParents[table].append(parent);
+            parents.append(parent);
+            children.append(keys.at(i));
+         }
+
+         q = preparedQuery( QString("INSERT INTO %1_children (parent_id, child_id) VALUES (?, ?)")
+                               .arg(ingTable) );
+         q.addBindValue(parents);
+         q.addBindValue(children);
+         if ( ! q.execBatch() )
+            throw QString("%1 %2").arg(q.lastQuery()).arg(q.lastError().text());
+         q.finish();
+
+         ingKeys.insert(table, keys);
+      }
+
+      // Linked in order, the trigger numbers the copies like the originals.
+      instructionKeys = copyRows( Brewtarget::INSTRUCTIONTABLE,
+                                  "JOIN instruction_in_recipe r ON r.instruction_id = t.id WHERE r.recipe_id=? ORDER BY r.instruction_number",
+                                  fromOther );
+      if ( ! instructionKeys.isEmpty() )
+         linkCopies( tableNames[Brewtarget::INSTINRECTABLE], tableNames[Brewtarget::INSTRUCTIONTABLE], instructionKeys );
    }
    catch (QString e) {
       Brewtarget::logE( QString("%1 %2").arg(Q_FUNC_INFO).arg(e));
-      sqlDatabase().rollback();
+      q.finish();
       throw;
    }
 
-   sqlDatabase().commit();
+   q.finish();
+   scope.commit();
+
+   // The rows are there for good. Now they get their objects, indexes and
+   // connections, the way load() would have made them.
+   tmp = adoptCopies( &allRecipes, Brewtarget::RECTABLE, QList<int>() << recKey ).first();
+
+   if ( equipKey ) {
+      Equipment* newEquip = adoptCopies( &allEquipments, Brewtarget::EQUIPTABLE, QList<int>() << equipKey ).first();
+      connect( newEquip, &BeerXMLElement::changed, tmp, &Recipe::acceptEquipChange );
+      connect( newEquip, &Equipment::changedBoilSize_l, tmp, &Recipe::setBoilSize_l);
+      connect( newEquip, &Equipment::changedBoilTime_min, tmp, &Recipe::setBoilTime_min);
+   }
+
+   if ( styleKey )
+      adoptCopies( &allStyles, Brewtarget::STYLETABLE, QList<int>() << styleKey );
+
+   if ( mashKey ) {
+      Mash* newMash = adoptCopies( &allMashs, Brewtarget::MASHTABLE, QList<int>() << mashKey ).first();
+      connect( newMash, SIGNAL(changed(QMetaProperty,QVariant)), tmp, SLOT(acceptMashChange(QMetaProperty,QVariant)) );
+      foreach( MashStep* step, adoptCopies( &allMashSteps, Brewtarget::MASHSTEPTABLE, stepKeys ) )
+         connect( step, &BeerXMLElement::changed, newMash, &Mash::acceptMashStepChange );
+   }
+
+   adoptCopies( &allInstructions, Brewtarget::INSTRUCTIONTABLE, instructionKeys );
+
+   foreach( Brewtarget::DBTable table, ingKeys.keys() )
+   {
+      QList<int> const& keys = ingKeys[table];
+      for( int i = 0; i < keys.size(); ++i ) {
+         recipeIndexAdd( table, recKey, keys.at(i) );
+         setParentID( table, keys.at(i), ingParents[table].at(i) );
+      }
+   }
+
+   foreach( Fermentable* ferm, adoptCopies( &allFermentables, Brewtarget::FERMTABLE, ingKeys.value(Brewtarget::FERMTABLE) ) )
+      connect( ferm, SIGNAL(changed(QMetaProperty,QVariant)), tmp, SLOT(acceptFermChange(QMetaProperty,QVariant)) );
+   foreach( Hop* hop, adoptCopies( &allHops, Brewtarget::HOPTABLE, ingKeys.value(Brewtarget::HOPTABLE) ) )
+      connect( hop, SIGNAL(changed(QMetaProperty,QVariant)), tmp, SLOT(acceptHopChange(QMetaProperty,QVariant)) );
+   foreach( Yeast* yeast, adoptCopies( &allYeasts, Brewtarget::YEASTTABLE, ingKeys.value(Brewtarget::YEASTTABLE) ) )
+      connect( yeast, SIGNAL(changed(QMetaProperty,QVariant)), tmp, SLOT(acceptYeastChange(QMetaProperty,QVariant)) );
+   adoptCopies( &allMiscs, Brewtarget::MISCTABLE, ingKeys.value(Brewtarget::MISCTABLE) );
+   adoptCopies( &allWaters, Brewtarget::WATERTABLE, ingKeys.value(Brewtarget::WATERTABLE) );
+
    emit changed( metaProperty("recipes"), QVariant() );
    emit newRecipeSignal(tmp);
 
@@ -1470,7 +2316,6 @@ Style* Database::newStyle(Style* other)
    }
    catch (QString e) {
       Brewtarget::logE( QString("%1 %2").arg(Q_FUNC_INFO).arg(e));
-      sqlDatabase().rollback();
       throw;
    }
 
@@ -1492,7 +2337,6 @@ Water* Database::newWater(Water* other)
    }
    catch (QString e) {
       Brewtarget::logE( QString("%1 %2").arg(Q_FUNC_INFO).arg(e));
-      sqlDatabase().rollback();
       throw;
    }
 
@@ -1514,7 +2358,6 @@ Yeast* Database::newYeast(Yeast* other)
    }
    catch (QString e) {
       Brewtarget::logE( QString("%1 %2").arg(Q_FUNC_INFO).arg(e));
-      sqlDatabase().rollback();
       throw;
    }
 
@@ -1539,6 +2382,19 @@ void Database::deleteRecord( Brewtarget::DBTable table, BeerXMLElement* object )
       throw;
    }
 
+   // Drop it from its recipe's page, which only lists live notes.
+   if ( table == Brewtarget::BREWNOTETABLE && _brewNoteRecipe.contains(object->_key) ) {
+      int recipeKey = _brewNoteRecipe.value(object->_key);
+      int noteKey = object->_key;
+      if ( _brewNotePages[recipeKey].removeOne(noteKey) ) {
+         TransactionScope::onRollback( [this, recipeKey, noteKey]() {
+            // Unless the page was let go meanwhile, the note is back on it.
+            if ( _brewNotePages.contains(recipeKey) && ! _brewNotePages[recipeKey].contains(noteKey) )
+               _brewNotePages[recipeKey].append(noteKey);
+         });
+      }
+   }
+
 }
 
 // NOTE: This really should be in a transaction, but I am going to leave that
@@ -1589,41 +2445,274 @@ void Database::updateEntry( Brewtarget::DBTable table, int key, const char* col_
    // Assumes the table has a column called 'deleted'.
    QString tableName = tableNames[table];
 
-   if ( transact )
-      sqlDatabase().transaction();
+   // The library is read-only. Its row gets copied into ours first.
+   if ( key < 0 && object && object->_table == table && object->_key == key ) {
+      materialize(object);
+      key = object->_key;
+   }
 
-   try {
-      QSqlQuery update( sqlDatabase() );
-      QString command = QString("UPDATE %1 set %2=:value where id=%3")
-                           .arg(tableName)
-                           .arg(col_name)
-                           .arg(key);
+   // Only the owning thread can hold writes back; the timer lives there.
+   if ( thread() == QThread::currentThread() ) {
+      _pendingWrites[table][key][col_name] = value;
+
+      if ( transact )
+         flush();
+      else if ( ! _flushTimer.isActive() )
+         _flushTimer.start();
+   }
+   else {
+      // A thread with a scope of its own gets a savepoint in it.
+      TransactionScope scope;
 
-      update.prepare( command );
-      update.bindValue(":value", value);
+      try {
+         QString command = QString("UPDATE %1 set %2=? where id=?")
+                              .arg(tableName)
+                              .arg(col_name);
+         QSqlQuery update = preparedQuery(command);
+
+         if ( ! execPrepared(update, QVariantList() << value << key) )
+            throw QString("Could not update %1.%2 to %3: %4 %5")
+                     .arg( tableName )
+                     .arg( col_name )
+                     .arg( value.toString() )
+                     .arg( update.lastQuery() )
+                     .arg( update.lastError().text() );
 
-      if ( ! update.exec() )
-         throw QString("Could not update %1.%2 to %3: %4 %5")
-                  .arg( tableName )
-                  .arg( col_name )
-                  .arg( value.toString() )
-                  .arg( update.lastQuery() )
-                  .arg( update.lastError().text() );
+      }
+      catch (QString e) {
+         Brewtarget::logE( QString("%1 %2").arg(Q_FUNC_INFO).arg(e) );
+         throw;
+      }
+
+      scope.commit();
+   }
+
+   writeRowCache(table, key, col_name, value);
+
+   if ( notify )
+      notifyChanged(object, prop, value);
+
+}
+
+void Database::flush()
+{
+   flushPendingWrites(true);
+}
+
+void Database::beginNotificationBatch()
+{
+   if ( thread() == QThread::currentThread() )
+      ++_batchDepth;
+}
+
+void Database::endNotificationBatch()
+{
+   if ( thread() != QThread::currentThread() || _batchDepth == 0 || --_batchDepth > 0 )
+      return;
+
+   QList<BatchedChange> changes = _batchedChanges;
+   _batchedChanges.clear();
+   _batchedChangeIndex.clear();
+
+   // Whatever the listeners change while we deliver goes straight out.
+   _deliveringBatch = true;
+   foreach( BatchedChange const& change, changes )
+      emit change.object->changed(change.prop, change.value);
+
+   // Deferred calls can defer more calls, so walk the list as it grows.
+   for( int i = 0; i < _deferredCalls.size(); ++i ) {
+      QObject* receiver = _deferredCalls.at(i).first;
+      if ( receiver )
+         QMetaObject::invokeMethod( receiver, _deferredCalls.at(i).second.constData() );
+   }
+   bool deferred = ! _deferredCalls.isEmpty();
+   _deferredCalls.clear();
+   _deliveringBatch = false;
+
+   if ( ! changes.isEmpty() || deferred )
+      emit changedBatch(changes);
+}
+
+bool Database::deliveringBatch() const
+{
+   return _deliveringBatch;
+}
+
+void Database::notifyChanged( BeerXMLElement* object, QMetaProperty prop, QVariant value )
+{
+   if ( _batchDepth == 0 || thread() != QThread::currentThread() ) {
+      emit object->changed(prop, value);
+      return;
+   }
+
+   // Only the last value of each property is worth telling anyone about.
+   QPair<BeerXMLElement*,int> key(object, prop.propertyIndex());
+   if ( _batchedChangeIndex.contains(key) )
+      _batchedChanges[_batchedChangeIndex.value(key)].value = value;
+   else {
+      BatchedChange change = { object, prop, value };
+      _batchedChangeIndex.insert(key, _batchedChanges.size());
+      _batchedChanges.append(change);
+   }
+}
+
+bool Database::deferToBatchEnd( QObject* receiver, char const* slot )
+{
+   if ( (_batchDepth == 0 && ! _deliveringBatch) || thread() != QThread::currentThread() )
+      return false;
 
+   QByteArray name(slot);
+   for( int i = 0; i < _deferredCalls.size(); ++i ) {
+      if ( _deferredCalls.at(i).first == receiver && _deferredCalls.at(i).second == name )
+         return true;
+   }
+   _deferredCalls.append( qMakePair( QPointer<QObject>(receiver), name ) );
+   return true;
+}
+
+void Database::flushOnIdle()
+{
+   try {
+      flush();
+      _writeFailureReported = false;
    }
    catch (QString e) {
-      Brewtarget::logE( QString("%1 %2").arg(Q_FUNC_INFO).arg(e) );
-      if ( transact )
-         sqlDatabase().rollback();
-      throw;
+      Brewtarget::logE( QString("%1 %2").arg(Q_FUNC_INFO).arg(e));
+
+      // The rows are kept, and go again with the next flush. Say so once,
+      // not every time the timer fires.
+      if ( ! _writeFailureReported ) {
+         _writeFailureReported = true;
+         emit writesFailed(e);
+      }
+   }
+}
+
+void Database::flushPendingWrites( bool transact )
+{
+   QSqlDatabase db = sqlDatabase();
+
+   // An open TransactionScope will commit the writes along with its own, or
+   // throw them away with its own.
+   bool inScope = TransactionScope::active(db);
+   if ( inScope )
+      transact = false;
+
+   // Take the writes first, so nothing run from here adds to what we are
+   // working through. Earlier failures go again underneath anything newer.
+   QHash< Brewtarget::DBTable, QHash< int, QHash<QString,QVariant> > > pending = _pendingWrites;
+   _pendingWrites.clear();
+   if ( ! inScope ) {
+      QHash< Brewtarget::DBTable, QHash< int, QHash<QString,QVariant> > >::const_iterator t;
+      for( t = _failedWrites.constBegin(); t != _failedWrites.constEnd(); ++t ) {
+         QHash< int, QHash<QString,QVariant> >::const_iterator row;
+         for( row = t.value().constBegin(); row != t.value().constEnd(); ++row ) {
+            QHash<QString,QVariant>& cols = pending[t.key()][row.key()];
+            QHash<QString,QVariant>::const_iterator col;
+            for( col = row.value().constBegin(); col != row.value().constEnd(); ++col ) {
+               if ( ! cols.contains(col.key()) )
+                  cols.insert(col.key(), col.value());
+            }
+         }
+      }
+      _failedWrites.clear();
+   }
+
+   if ( pending.isEmpty() )
+      return;
+   _flushTimer.stop();
+
+   QStringList errors;
+
+   if ( transact && _walMode ) {
+      // Take the write lock up front, so we know how long we waited for it.
+      QElapsedTimer waited;
+      waited.start();
+      QSqlQuery begin(db);
+      if ( ! begin.exec("BEGIN IMMEDIATE") )
+         Brewtarget::logW( QString("%1 : could not take the write lock: %2").arg(Q_FUNC_INFO).arg(begin.lastError().text()));
+
+      QMutexLocker locker(&_waitMutex);
+      _writerWait_ms += waited.elapsed();
+   }
+   else if ( transact )
+      db.transaction();
+
+   QHash< Brewtarget::DBTable, QHash< int, QHash<QString,QVariant> > >::const_iterator t;
+   for( t = pending.constBegin(); t != pending.constEnd(); ++t )
+   {
+      QHash< int, QHash<QString,QVariant> >::const_iterator row;
+      for( row = t.value().constBegin(); row != t.value().constEnd(); ++row )
+      {
+         QStringList cols = row.value().keys();
+         QStringList setVals;
+         foreach( QString col, cols )
+            setVals.append( QString("%1=?").arg(col) );
+
+         // Rows tend to be dirty in the same few column sets, so these
+         // statements come back out of the cache.
+         QSqlQuery update = preparedQuery( QString("UPDATE %1 set %2 where id=?")
+                                              .arg(tableNames[t.key()])
+                                              .arg(setVals.join(", ")) );
+         QVariantList values;
+         foreach( QString col, cols )
+            values.append( row.value().value(col) );
+         values.append( row.key() );
+
+         if ( ! execPrepared(update, values) ) {
+            errors.append( QString("Could not update %1 %2: %3 %4")
+                              .arg( tableNames[t.key()] )
+                              .arg( row.key() )
+                              .arg( update.lastQuery() )
+                              .arg( update.lastError().text() ) );
+            // The scope goes down, and takes the row with it. Otherwise the
+            // row waits for another try, and the cache keeps showing it.
+            if ( inScope )
+               invalidateRowCache( t.key(), row.key() );
+            else
+               _failedWrites[t.key()].insert( row.key(), row.value() );
+         }
+         else if ( _failedWrites.contains(t.key()) && _failedWrites[t.key()].contains(row.key()) ) {
+            // Older values that failed must not come back over these.
+            QHash<QString,QVariant>& failed = _failedWrites[t.key()][row.key()];
+            foreach( QString col, cols )
+               failed.remove(col);
+            if ( failed.isEmpty() )
+               _failedWrites[t.key()].remove(row.key());
+         }
+      }
    }
 
    if ( transact )
-      sqlDatabase().commit();
+      db.commit();
 
-   if ( notify )
-      emit object->changed(prop,value);
+   if ( ! errors.isEmpty() ) {
+      Brewtarget::logE( QString("%1 %2").arg(Q_FUNC_INFO).arg(errors.join("; ")) );
+      throw errors.join("; ");
+   }
+}
+
+void Database::flushForRead( Brewtarget::DBTable table )
+{
+   if ( thread() != QThread::currentThread() || ! _pendingWrites.contains(table) )
+      return;
+
+   try {
+      flushPendingWrites(true);
+   }
+   catch (QString e) {
+      Brewtarget::logW( QString("%1 : %2").arg(Q_FUNC_INFO).arg(e));
+   }
+}
 
+void Database::discardPendingWrites()
+{
+   QHash< Brewtarget::DBTable, QHash< int, QHash<QString,QVariant> > >::const_iterator t;
+   for( t = _pendingWrites.constBegin(); t != _pendingWrites.constEnd(); ++t ) {
+      foreach( int key, t.value().keys() )
+         invalidateRowCache( t.key(), key );
+   }
+   _pendingWrites.clear();
 }
 
 void Database::updateColumns(Brewtarget::DBTable table, int key, const QVariantMap& colValMap)
@@ -1658,7 +2747,7 @@ void Database::updateColumns(Brewtarget::DBTable table, int key, const QVariantM
       }
 
 
-      if ( ! query.exec() )
+      if ( ! execProfiled(query) )
          throw QString("Could not update %1: %4 %5")
                   .arg( tableName )
                   .arg( query.lastQuery() )
@@ -1670,163 +2759,622 @@ void Database::updateColumns(Brewtarget::DBTable table, int key, const QVariantM
       throw;
    }
 
+   QVariantMap::const_iterator i;
+   for( i = colValMap.constBegin(); i != colValMap.constEnd(); ++i )
+      writeRowCache(table, key, i.key(), i.value());
+
    /*if ( notify )
       emit object->changed(prop,value);*/
 }
 
-// Inventory functions ========================================================
-
-//This links ingredients with the same name.
-//The first displayed ingredient in the database is assumed to be the parent.
-void Database::populateChildTablesByName(Brewtarget::DBTable table){
-   Brewtarget::logW( "Populating Children Ingredient Links" );
+QVariant Database::get( Brewtarget::DBTable table, int key, const char* col_name )
+{
+   // Column names are case insensitive in both SQLite and PostgreSQL, and
+   // PostgreSQL hands them back in lower case.
+   QString col = QString(col_name).toLower();
 
-   try {
-      QString queryString = QString("SELECT DISTINCT name FROM %1").arg(tableNames[table]);
-
-      QSqlQuery nameq( queryString, sqlDatabase() );
-
-      if ( ! nameq.isActive() )
-         throw QString("%1 %2").arg(nameq.lastQuery()).arg(nameq.lastError().text());
-
-      while (nameq.next()) {
-         QString name = nameq.record().value(0).toString();
-         queryString = QString( "SELECT id FROM %1 WHERE ( name=:name AND display=%2 ) ORDER BY id ASC LIMIT 1")
-                     .arg(tableNames[table])
-                     .arg(Brewtarget::dbTrue());
-         QSqlQuery parentq( sqlDatabase() );
-
-         parentq.prepare(queryString);
-         parentq.bindValue(":name", name);
-         parentq.exec();
-
-         if ( !parentq.isActive() )
-            throw QString("%1 %2").arg(parentq.lastQuery()).arg(parentq.lastError().text());
-
-         parentq.first();
-         QString parentID = parentq.record().value("id").toString();
-
-         queryString = QString( "SELECT id FROM %1 WHERE ( name=:name AND display=%2 ) ORDER BY id ASC")
-                     .arg(tableNames[table])
-                     .arg(Brewtarget::dbFalse());
-         QSqlQuery childrenq( sqlDatabase() );
-         childrenq.prepare(queryString);
-         childrenq.bindValue(":name", name);
-         childrenq.exec();
-
-         if ( !childrenq.isActive() )
-            throw QString("%1 %2").arg(childrenq.lastQuery()).arg(childrenq.lastError().text());
-         // Postgres uses a more verbose upsert syntax. I don't like this, but
-         // I'm not seeing a better way yet.
-         while (childrenq.next()) {
-            QString childID = childrenq.record().value("id").toString();
-            switch( Brewtarget::dbType() ) {
-               case Brewtarget::PGSQL:
-                  queryString = QString("INSERT INTO %1 (parent_id, child_id) VALUES (%2, %3) ON CONFLICT(child_id) DO UPDATE set parent_id = EXCLUDED.parent_id")
-                        .arg(tableNames[tableToChildTable[table]])
-                        .arg(parentID)
-                        .arg(childID);
-                  break;
-               default:
-                  queryString = QString("INSERT OR REPLACE INTO %1 (parent_id, child_id) VALUES (%2, %3)")
-                              .arg(tableNames[tableToChildTable[table]])
-                              .arg(parentID)
-                              .arg(childID);
-            }
-            QSqlQuery insertq( queryString, sqlDatabase() );
-            if ( !insertq.isActive() )
-               throw QString("%1 %2").arg(insertq.lastQuery()).arg(insertq.lastError().text());
-         }
+   {
+      QMutexLocker locker(&_rowCacheMutex);
+
+      QHash< int, QHash<QString,QVariant> > const& rows = _rowCache[table];
+      QHash< int, QHash<QString,QVariant> >::const_iterator row = rows.constFind(key);
+      if ( row != rows.constEnd() ) {
+         ++_rowCacheHits;
+         if ( ! row->contains(col) )
+            Brewtarget::logE( QString("Database::get(): no column %1 in %2").arg(col_name).arg(tableNames[table]));
+         return row->value(col);
       }
+
+      ++_rowCacheMisses;
    }
-   catch (QString e) {
-      Brewtarget::logE( QString("%1 %2").arg(Q_FUNC_INFO).arg(e));
-      throw QString("%1 %2").arg(Q_FUNC_INFO).arg(e);
-   }
-}
-// populate ingredient tables
-void Database::populateChildTablesByName(){
 
-   try {
-      // I really dislike this. It counts as spooky action at a distance, but
-      // the populateChildTablesByName methods need these hashes populated
-      // early and there is no easy way to untangle them. Yes, this results in
-      // the work being done twice. Such is life.
-      Database::tableNames = tableNamesHash();
-      Database::classNameToTable = classNameToTableHash();
+   QElapsedTimer timer;
+   timer.start();
 
-      populateChildTablesByName(Brewtarget::FERMTABLE);
-      populateChildTablesByName(Brewtarget::HOPTABLE);
-      populateChildTablesByName(Brewtarget::MISCTABLE);
-      populateChildTablesByName(Brewtarget::YEASTTABLE);
-   }
-   catch (QString e) {
-      Brewtarget::logE( QString("%1 %2").arg(Q_FUNC_INFO).arg(e));
-      throw;
-   }
-}
+   // Negative keys are library rows, see materialize().
+   QString source = key < 0 ? QString("library.%1").arg(tableNames[table]) : tableNames[table];
+   QSqlQuery q = preparedQuery( QString("SELECT * from %1 WHERE id=?").arg(source) );
 
-//Returns the key of the parent ingredient
-int Database::getParentID(Brewtarget::DBTable table, int childKey){
-   int ret;
-   //child_id is expected to be unique in table
-   QString queryString = QString(
-      "SELECT parent_id FROM %1 WHERE child_id = %2 LIMIT 1"
-   ).arg(tableNames[tableToChildTable[table]]).arg(childKey);
-
-   QSqlQuery q( queryString, sqlDatabase() );
-   q.first();
-   ret = q.record().value("parent_id").toInt();
-   if(ret==0){
-      return childKey;
-   }else{
-      return ret;
+   execPrepared(q, QVariantList() << qAbs(key), true);
+   if( !q.next() )
+   {
+      Brewtarget::logE( QString("Database::get(): %1 (%2) %3").arg(q.lastQuery()).arg(col_name).arg(q.lastError().text()));
+      q.finish();
+      return QVariant();
    }
-}
-//Returns the key to the inventory table for a given ingredient
-int Database::getInventoryID(Brewtarget::DBTable table, int key){
-   int ret;
-   QString queryString = QString(
-      "SELECT id FROM %1 WHERE %2_id = %3 LIMIT 1"
-   ).arg(tableNames[tableToInventoryTable[table]]).arg(tableNames[table]).arg(getParentID(table, key));
-   QSqlQuery q( queryString, sqlDatabase() );
-   q.first();
-   ret = q.record().value("id").toInt();
-   return ret;
-}
-//Returns the parent table number from the hash
-Brewtarget::DBTable Database::getChildTable(Brewtarget::DBTable table){
-   return tableToChildTable[table];
-}
-//Returns the inventory table number from the hash
-Brewtarget::DBTable Database::getInventoryTable(Brewtarget::DBTable table) {
-   return tableToInventoryTable[table];
-}
-//create a new inventory row
-void Database::newInventory(Brewtarget::DBTable invForTable, int invForID) {
-   QString invTable = tableNames[tableToInventoryTable[invForTable]];
 
-   QString queryString;
+   QSqlRecord rec = q.record();
+   rec.setValue("id", key);
+   profileRows(q, 1);
+   q.finish();
 
-   switch(Brewtarget::dbType())
-   {
-      case Brewtarget::PGSQL:
-         queryString = QString("INSERT INTO %1 (%2_id) VALUES(%3) ON CONFLICT(%2_id) DO UPDATE set %2_id = EXCLUDED.%2_id")
-                     .arg(invTable)
-                     .arg(tableNames[invForTable])
-                     .arg(getParentID(invForTable, invForID));
-         break;
-      default:
-         queryString = QString("INSERT OR REPLACE INTO %1 (%2_id) VALUES (%3)")
-                     .arg(invTable)
-                     .arg(tableNames[invForTable])
-                     .arg(getParentID(invForTable, invForID));
+   // Writes we are still holding back win over what is on disk. Only the
+   // owning thread holds any.
+   if ( thread() == QThread::currentThread() ) {
+      QList< QHash<QString,QVariant> > held;
+      held << _failedWrites.value(table).value(key) << _pendingWrites.value(table).value(key);
+      foreach( QHash<QString,QVariant> const& cols, held ) {
+         QHash<QString,QVariant>::const_iterator c;
+         for( c = cols.constBegin(); c != cols.constEnd(); ++c )
+            rec.setValue(c.key(), c.value());
+      }
    }
+   cacheRow(table, key, rec);
 
-   QSqlQuery q( queryString, sqlDatabase() );
+   QMutexLocker locker(&_rowCacheMutex);
+   _rowCacheMissTime_ms += timer.elapsed();
+   return rec.value(col);
 }
 
-QMap<int, double> Database::getInventory(const Brewtarget::DBTable table) const
+void Database::cacheRow( Brewtarget::DBTable table, int key, QSqlRecord const& rec )
+{
+   QHash<QString,QVariant> values;
+   for( int i = 0; i < rec.count(); ++i )
+      values.insert( rec.fieldName(i).toLower(), rec.value(i) );
+
+   TransactionScope::touch(table, key);
+
+   QMutexLocker locker(&_rowCacheMutex);
+   _rowCache[table].insert(key, values);
+}
+
+void Database::writeRowCache( Brewtarget::DBTable table, int key, QString const& col_name, QVariant const& value )
+{
+   TransactionScope::touch(table, key);
+
+   QMutexLocker locker(&_rowCacheMutex);
+
+   QHash< int, QHash<QString,QVariant> >::iterator row = _rowCache[table].find(key);
+   if ( row != _rowCache[table].end() )
+      row->insert( col_name.toLower(), value );
+}
+
+void Database::invalidateRowCache()
+{
+   QMutexLocker locker(&_rowCacheMutex);
+   _rowCache.clear();
+}
+
+void Database::invalidateRowCache( Brewtarget::DBTable table )
+{
+   QMutexLocker locker(&_rowCacheMutex);
+   _rowCache.remove(table);
+}
+
+bool Database::libraryAttached() const
+{
+   return _libraryAttached;
+}
+
+void Database::attachLibraryTo( QSqlDatabase db )
+{
+   // mode=ro keeps SQLite itself from writing to it, whatever we get wrong.
+   QString uri = QString("%1?mode=ro").arg( QUrl::fromLocalFile(_libraryFileName).toString(QUrl::FullyEncoded) );
+   QSqlQuery q(db);
+
+   if ( ! q.prepare("ATTACH DATABASE ? AS library") )
+      throw QString("could not prepare the attach: %1").arg(q.lastError().text());
+   q.addBindValue(uri);
+   if ( ! q.exec() )
+      throw QString("could not attach %1 : %2").arg(_libraryFileName).arg(q.lastError().text());
+}
+
+void Database::attachLibrary( QString const& fileName )
+{
+   QList<Brewtarget::DBTable> tables;
+   tables << Brewtarget::EQUIPTABLE << Brewtarget::FERMTABLE << Brewtarget::HOPTABLE
+          << Brewtarget::MISCTABLE << Brewtarget::STYLETABLE << Brewtarget::WATERTABLE
+          << Brewtarget::YEASTTABLE;
+
+   QElapsedTimer timer;
+   timer.start();
+
+   QSqlDatabase db = sqlDatabase();
+   _libraryFileName = fileName;
+   attachLibraryTo(db);
+
+   // Only copy what both sides know about. The library may be older or
+   // newer than our schema.
+   _libraryColumns.clear();
+   foreach( Brewtarget::DBTable table, tables )
+   {
+      QSqlRecord ours = db.record(tableNames[table]);
+      QStringList columns;
+      QSqlQuery q(db);
+
+      if ( ! execProfiled(q, QString("PRAGMA library.table_info(%1)").arg(tableNames[table]) ) )
+         throw QString("could not read the columns of library.%1 : %2").arg(tableNames[table]).arg(q.lastError().text());
+      while ( q.next() )
+      {
+         QString name = q.value("name").toString();
+         if ( name.toLower() != "id" && ours.contains(name) )
+            columns.append(name);
+      }
+      q.finish();
+
+      if ( columns.contains("name") && columns.contains("display") && columns.contains("deleted") )
+         _libraryColumns.insert(table, columns);
+   }
+
+   // Every connection opened from now on gets it too.
+   _connectionPool.setOpenHook( [this](QSqlDatabase con) { attachLibraryTo(con); } );
+   _libraryAttached = true;
+
+   _libraryRows = 0;
+   if ( _libraryColumns.contains(Brewtarget::EQUIPTABLE) )
+      _libraryRows += populateLibrary( allEquipments, Brewtarget::EQUIPTABLE );
+   if ( _libraryColumns.contains(Brewtarget::FERMTABLE) )
+      _libraryRows += populateLibrary( allFermentables, Brewtarget::FERMTABLE );
+   if ( _libraryColumns.contains(Brewtarget::HOPTABLE) )
+      _libraryRows += populateLibrary( allHops, Brewtarget::HOPTABLE );
+   if ( _libraryColumns.contains(Brewtarget::MISCTABLE) )
+      _libraryRows += populateLibrary( allMiscs, Brewtarget::MISCTABLE );
+   if ( _libraryColumns.contains(Brewtarget::STYLETABLE) )
+      _libraryRows += populateLibrary( allStyles, Brewtarget::STYLETABLE );
+   if ( _libraryColumns.contains(Brewtarget::WATERTABLE) )
+      _libraryRows += populateLibrary( allWaters, Brewtarget::WATERTABLE );
+   if ( _libraryColumns.contains(Brewtarget::YEASTTABLE) )
+      _libraryRows += populateLibrary( allYeasts, Brewtarget::YEASTTABLE );
+
+   Brewtarget::log.info( QString("%1 : serving %2 library rows from %3 (%4 ms)")
+                           .arg(Q_FUNC_INFO)
+                           .arg(_libraryRows)
+                           .arg(fileName)
+                           .arg(timer.elapsed()));
+}
+
+void Database::materialize( BeerXMLElement* object )
+{
+   if ( object == 0 || object->_key >= 0 )
+      return;
+
+   Brewtarget::DBTable table = object->_table;
+   int oldKey = object->_key;
+   int newKey;
+
+   // The all* hashes belong to the GUI thread.
+   if ( thread() != QThread::currentThread() )
+      throw QString("%1: library rows can only be copied from the main thread").arg(Q_FUNC_INFO);
+   if ( ! _libraryColumns.contains(table) )
+      throw QString("%1: %2 has no library").arg(Q_FUNC_INFO).arg(tableNames[table]);
+
+   TransactionScope scope;
+   try {
+      QString columns = _libraryColumns.value(table).join(",");
+      QSqlQuery q = preparedQuery( QString("INSERT INTO %1 (%2) SELECT %2 FROM library.%1 WHERE id=?")
+                                      .arg(tableNames[table])
+                                      .arg(columns) );
+
+      if ( ! execPrepared(q, QVariantList() << -oldKey) || q.numRowsAffected() != 1 )
+         throw QString("%1 : %2").arg(q.lastQuery()).arg(q.lastError().text());
+      newKey = q.lastInsertId().toInt();
+      q.finish();
+
+      // If this, or a scope around it, rolls back, the new row is gone and
+      // the object has to be the library's again.
+      rekeyObject(object, newKey);
+      QPointer<BeerXMLElement> ptr(object);
+      TransactionScope::onRollback( [this, ptr, oldKey]() {
+         if ( ptr )
+            rekeyObject(ptr.data(), oldKey);
+      });
+
+      scope.commit();
+   }
+   catch (QString e) {
+      Brewtarget::logE( QString("%1 %2").arg(Q_FUNC_INFO).arg(e));
+      throw;
+   }
+
+   ++_libraryCopies;
+}
+
+void Database::rekeyObject( BeerXMLElement* object, int newKey )
+{
+   Brewtarget::DBTable table = object->_table;
+   int oldKey = object->_key;
+
+   object->_key = newKey;
+
+   {
+      QMutexLocker locker(&_rowCacheMutex);
+      QHash< int, QHash<QString,QVariant> >& rows = _rowCache[table];
+      if ( rows.contains(oldKey) ) {
+         QHash<QString,QVariant> row = rows.take(oldKey);
+         row.insert("id", newKey);
+         rows.insert(newKey, row);
+      }
+   }
+
+   switch ( table )
+   {
+      case Brewtarget::EQUIPTABLE: rekey( allEquipments, oldKey, newKey ); break;
+      case Brewtarget::FERMTABLE: rekey( allFermentables, oldKey, newKey ); break;
+      case Brewtarget::HOPTABLE: rekey( allHops, oldKey, newKey ); break;
+      case Brewtarget::MISCTABLE: rekey( allMiscs, oldKey, newKey ); break;
+      case Brewtarget::STYLETABLE: rekey( allStyles, oldKey, newKey ); break;
+      case Brewtarget::WATERTABLE: rekey( allWaters, oldKey, newKey ); break;
+      case Brewtarget::YEASTTABLE: rekey( allYeasts, oldKey, newKey ); break;
+      default: break;
+   }
+}
+
+void Database::invalidateRowCache( Brewtarget::DBTable table, int key )
+{
+   QMutexLocker locker(&_rowCacheMutex);
+   if ( _rowCache.contains(table) )
+      _rowCache[table].remove(key);
+}
+
+quint64 Database::rowCacheHits() const
+{
+   QMutexLocker locker(&_rowCacheMutex);
+   return _rowCacheHits;
+}
+
+quint64 Database::rowCacheMisses() const
+{
+   QMutexLocker locker(&_rowCacheMutex);
+   return _rowCacheMisses;
+}
+
+QSqlQuery Database::preparedQuery( QString const& sql, QSqlDatabase db )
+{
+   if ( ! db.isValid() )
+      db = sqlDatabase();
+   QMutexLocker locker(&_statementCacheMutex);
+
+   QHash<QString,QSqlQuery>& statements = _statementCache[db.connectionName()];
+   QHash<QString,QSqlQuery>::const_iterator i = statements.constFind(sql);
+   if ( i != statements.constEnd() )
+      return i.value();
+
+   QSqlQuery q(db);
+   q.setForwardOnly(true);
+   if ( ! q.prepare(sql) )
+      Brewtarget::logE( QString("%1 could not prepare %2: %3").arg(Q_FUNC_INFO).arg(sql).arg(q.lastError().text()));
+   ++_statementPrepares;
+   statements.insert(sql, q);
+   return q;
+}
+
+bool Database::execPrepared( QSqlQuery& q, QVariantList const& values, bool idempotent )
+{
+   for( int i = 0; i < values.size(); ++i )
+      q.bindValue(i, values.at(i));
+
+   {
+      QMutexLocker locker(&_statementCacheMutex);
+      ++_statementExecs;
+   }
+
+   QElapsedTimer timer;
+   timer.start();
+   bool ret = q.exec();
+   profileQuery(q, timer.nsecsElapsed(), false);
+
+   // The server went away. Get the connection back, and try again if the
+   // caller says it is safe to. A write may have been part of a transaction
+   // that is gone now, so that one stays failed. Only the calling thread's
+   // own connection is reopened, and asking which one that is must not open it.
+   QString conName;
+   if ( ! ret && q.lastError().type() == QSqlError::ConnectionError &&
+        Brewtarget::dbType() == Brewtarget::PGSQL )
+      conName = _connectionPool.connectionName();
+
+   if ( ! conName.isEmpty() &&
+        q.driver() == QSqlDatabase::database(conName, false).driver() &&
+        _connectionPool.reconnect() )
+   {
+      Brewtarget::logW( QString("%1 : reconnected to the server").arg(Q_FUNC_INFO));
+      if ( idempotent ) {
+         q = preparedQuery( q.lastQuery(), _connectionPool.connection() );
+         for( int i = 0; i < values.size(); ++i )
+            q.bindValue(i, values.at(i));
+         ret = q.exec();
+      }
+   }
+   return ret;
+}
+
+bool Database::execProfiled( QSqlQuery& q, QString const& sql )
+{
+   QElapsedTimer timer;
+   timer.start();
+   bool ret = sql.isEmpty() ? q.exec() : q.exec(sql);
+   profileQuery(q, timer.nsecsElapsed(), true);
+   return ret;
+}
+
+void Database::profileQuery( QSqlQuery const& q, qint64 elapsed_ns, bool literal )
+{
+   // SQLite cannot count the rows of a SELECT until they are read.
+   int rows = q.isSelect() ? q.size() : q.numRowsAffected();
+   _queryProfile.record( literal ? QueryProfile::normalized(q.lastQuery()) : q.lastQuery(), elapsed_ns / 1000, rows );
+
+   if ( _slowQuery_ms > 0 && elapsed_ns / 1000000 >= _slowQuery_ms )
+      Brewtarget::log.warn( QString("Slow query, %1 ms%2: %3")
+                              .arg(elapsed_ns / 1000000)
+                              .arg(rows >= 0 ? QString(", %1 rows").arg(rows) : QString())
+                              .arg(q.lastQuery()));
+}
+
+void Database::profileRows( QSqlQuery const& q, int rows, bool literal )
+{
+   if ( ! q.driver()->hasFeature(QSqlDriver::QuerySize) )
+      _queryProfile.addRows( literal ? QueryProfile::normalized(q.lastQuery()) : q.lastQuery(), rows );
+}
+
+QueryProfile const& Database::queryProfile() const
+{
+   return _queryProfile;
+}
+
+void Database::setProfileFile( QString const& fileName )
+{
+   _profileFileName = fileName;
+}
+
+quint64 Database::statementPrepares() const
+{
+   QMutexLocker locker(&_statementCacheMutex);
+   return _statementPrepares;
+}
+
+quint64 Database::statementExecs() const
+{
+   QMutexLocker locker(&_statementCacheMutex);
+   return _statementExecs;
+}
+
+// Inventory functions ========================================================
+
+//This links ingredients with the same name.
+//The first displayed ingredient in the database is assumed to be the parent.
+void Database::populateChildTablesByName(Brewtarget::DBTable table){
+   Brewtarget::logW( "Populating Children Ingredient Links" );
+
+   QString tableName = tableNames[table];
+   QString childTableName = tableNames[tableToChildTable[table]];
+
+   // Every hidden ingredient, paired with the first displayed one of the
+   // same name. This still reads every name in the table; it is the writes
+   // that are limited, since links that are already right are left out.
+   QString links = QString(
+         "FROM %1 c JOIN ( SELECT name, MIN(id) AS parent_id FROM %1 WHERE display=%2 GROUP BY name ) p "
+         "ON p.name = c.name "
+         "WHERE c.display=%3 "
+         "AND NOT EXISTS ( SELECT 1 FROM %4 l WHERE l.child_id = c.id AND l.parent_id = p.parent_id )")
+      .arg(tableName)
+      .arg(Brewtarget::dbTrue())
+      .arg(Brewtarget::dbFalse())
+      .arg(childTableName);
+
+   try {
+      QSqlQuery q( sqlDatabase() );
+      QList< QPair<int,int> > changed;
+
+      if ( ! execProfiled(q, QString("SELECT c.id, p.parent_id %1").arg(links) ) )
+         throw QString("%1 %2").arg(q.lastQuery()).arg(q.lastError().text());
+      while ( q.next() )
+         changed.append( qMakePair(q.value(0).toInt(), q.value(1).toInt()) );
+
+      if ( changed.isEmpty() )
+         return;
+
+      // Postgres uses a more verbose upsert syntax. I don't like this, but
+      // I'm not seeing a better way yet.
+      QString queryString;
+      switch( Brewtarget::dbType() ) {
+         case Brewtarget::PGSQL:
+            queryString = QString("INSERT INTO %1 (parent_id, child_id) SELECT p.parent_id, c.id %2 "
+                                  "ON CONFLICT(child_id) DO UPDATE set parent_id = EXCLUDED.parent_id")
+                  .arg(childTableName)
+                  .arg(links);
+            break;
+         default:
+            queryString = QString("INSERT OR REPLACE INTO %1 (parent_id, child_id) SELECT p.parent_id, c.id %2")
+                  .arg(childTableName)
+                  .arg(links);
+      }
+      if ( ! execProfiled(q, queryString) )
+         throw QString("%1 %2").arg(q.lastQuery()).arg(q.lastError().text());
+
+      for( int i = 0; i < changed.size(); ++i )
+         setParentID( table, changed.at(i).first, changed.at(i).second );
+
+      Brewtarget::log.info( QString("%1 : relinked %2 %3 ingredients")
+                              .arg(Q_FUNC_INFO)
+                              .arg(changed.size())
+                              .arg(tableName));
+   }
+   catch (QString e) {
+      Brewtarget::logE( QString("%1 %2").arg(Q_FUNC_INFO).arg(e));
+      throw QString("%1 %2").arg(Q_FUNC_INFO).arg(e);
+   }
+}
+// populate ingredient tables
+void Database::populateChildTablesByName(){
+
+   try {
+      // I really dislike this. It counts as spooky action at a distance, but
+      // the populateChildTablesByName methods need these hashes populated
+      // early and there is no easy way to untangle them. Yes, this results in
+      // the work being done twice. Such is life.
+      Database::tableNames = tableNamesHash();
+      Database::classNameToTable = classNameToTableHash();
+
+      populateChildTablesByName(Brewtarget::FERMTABLE);
+      populateChildTablesByName(Brewtarget::HOPTABLE);
+      populateChildTablesByName(Brewtarget::MISCTABLE);
+      populateChildTablesByName(Brewtarget::YEASTTABLE);
+   }
+   catch (QString e) {
+      Brewtarget::logE( QString("%1 %2").arg(Q_FUNC_INFO).arg(e));
+      throw;
+   }
+}
+
+//Returns the key of the parent ingredient
+int Database::getParentID(Brewtarget::DBTable table, int childKey){
+   QMutexLocker locker(&_inventoryIndexMutex);
+   //child_id is expected to be unique in table
+   return _parentOf.value(table).value(childKey, childKey);
+}
+//Returns the key to the inventory table for a given ingredient
+int Database::getInventoryID(Brewtarget::DBTable table, int key){
+   int parentKey = getParentID(table, key);
+
+   QMutexLocker locker(&_inventoryIndexMutex);
+   return _inventoryOf.value(table).value(parentKey, 0);
+}
+//Returns the parent table number from the hash
+Brewtarget::DBTable Database::getChildTable(Brewtarget::DBTable table){
+   return tableToChildTable[table];
+}
+//Returns the inventory table number from the hash
+Brewtarget::DBTable Database::getInventoryTable(Brewtarget::DBTable table) {
+   return tableToInventoryTable[table];
+}
+//create a new inventory row
+void Database::newInventory(Brewtarget::DBTable invForTable, int invForID) {
+   QString invTable = tableNames[tableToInventoryTable[invForTable]];
+   int parentKey = getParentID(invForTable, invForID);
+
+   QString queryString;
+
+   switch(Brewtarget::dbType())
+   {
+      case Brewtarget::PGSQL:
+         queryString = QString("INSERT INTO %1 (%2_id) VALUES(?) ON CONFLICT(%2_id) DO UPDATE set %2_id = EXCLUDED.%2_id")
+                     .arg(invTable)
+                     .arg(tableNames[invForTable]);
+         break;
+      default:
+         queryString = QString("INSERT OR REPLACE INTO %1 (%2_id) VALUES (?)")
+                     .arg(invTable)
+                     .arg(tableNames[invForTable]);
+   }
+
+   QSqlQuery q = preparedQuery(queryString);
+   if ( ! execPrepared(q, QVariantList() << parentKey) ) {
+      Brewtarget::logE( QString("%1 %2 %3").arg(Q_FUNC_INFO).arg(q.lastQuery()).arg(q.lastError().text()));
+      return;
+   }
+   q.finish();
+
+   // A replace hands out a new id, and an upsert may not report one at all.
+   // Ask for it.
+   q = preparedQuery( QString("SELECT id FROM %1 WHERE %2_id = ?").arg(invTable).arg(tableNames[invForTable]) );
+   if ( execPrepared(q, QVariantList() << parentKey, true) && q.next() ) {
+      int invKey = q.record().value("id").toInt();
+      QMutexLocker locker(&_inventoryIndexMutex);
+      undoInventoryIndexOnRollback(&_inventoryOf, invForTable, parentKey);
+      _inventoryOf[invForTable].insert(parentKey, invKey);
+   }
+   q.finish();
+}
+
+void Database::setParentID( Brewtarget::DBTable table, int childKey, int parentKey )
+{
+   if ( ! tableToChildTable.contains(table) )
+      return;
+
+   QMutexLocker locker(&_inventoryIndexMutex);
+   undoInventoryIndexOnRollback(&_parentOf, table, childKey);
+   // A zero parent means no parent, as far as getParentID() cares.
+   if ( parentKey == 0 )
+      _parentOf[table].remove(childKey);
+   else
+      _parentOf[table].insert(childKey, parentKey);
+}
+
+void Database::undoInventoryIndexOnRollback( QHash< Brewtarget::DBTable, QHash<int,int> >* index, Brewtarget::DBTable table, int key )
+{
+   // Called with _inventoryIndexMutex held, before the change.
+   bool had = index->value(table).contains(key);
+   int before = index->value(table).value(key);
+   TransactionScope::onRollback( [this, index, table, key, had, before]() {
+      QMutexLocker locker(&_inventoryIndexMutex);
+      if ( had )
+         (*index)[table].insert(key, before);
+      else
+         (*index)[table].remove(key);
+   });
+}
+
+void Database::populateInventoryIndex()
+{
+   foreach( Brewtarget::DBTable table, tableToChildTable.values() + tableToInventoryTable.values() )
+      flushForRead(table);
+
+   QSqlQuery q(sqlDatabase());
+   q.setForwardOnly(true);
+
+   QMutexLocker locker(&_inventoryIndexMutex);
+   _parentOf.clear();
+   _inventoryOf.clear();
+
+   try {
+      foreach( Brewtarget::DBTable table, tableToChildTable.keys() )
+      {
+         QHash<int,int>& parents = _parentOf[table];
+         if ( ! execProfiled(q, QString("SELECT child_id, parent_id FROM %1").arg(tableNames[tableToChildTable[table]]) ) )
+            throw QString("%1 %2").arg(q.lastQuery()).arg(q.lastError().text());
+
+         while ( q.next() ) {
+            int parentKey = q.record().value("parent_id").toInt();
+            // A zero parent means no parent, as far as getParentID() cares.
+            if ( parentKey != 0 )
+               parents.insert( q.record().value("child_id").toInt(), parentKey );
+         }
+         q.finish();
+      }
+
+      foreach( Brewtarget::DBTable table, tableToInventoryTable.keys() )
+      {
+         QHash<int,int>& inventory = _inventoryOf[table];
+         QString ingKeyName = QString("%1_id").arg(tableNames[table]);
+         if ( ! execProfiled(q, QString("SELECT id, %1 FROM %2").arg(ingKeyName).arg(tableNames[tableToInventoryTable[table]]) ) )
+            throw QString("%1 %2").arg(q.lastQuery()).arg(q.lastError().text());
+
+         while ( q.next() ) {
+            // The old query took the first match, so keep the first one.
+            int ingKey = q.record().value(ingKeyName).toInt();
+            if ( ! inventory.contains(ingKey) )
+               inventory.insert( ingKey, q.record().value("id").toInt() );
+         }
+         q.finish();
+      }
+   }
+   catch (QString e) {
+      Brewtarget::logE( QString("%1 %2").arg(Q_FUNC_INFO).arg(e));
+      q.finish();
+      throw;
+   }
+}
+
+QMap<int, double> Database::getInventory(const Brewtarget::DBTable table) const
 {
    QMap<int, double> result;
 
@@ -1862,8 +3410,7 @@ void Database::addToRecipe( Recipe* rec, Equipment* e, bool noCopy, bool transac
    if( e == 0 )
       return;
 
-   if ( transact )
-      sqlDatabase().transaction();
+   TransactionScope scope;
 
    try {
       // Make a copy of equipment.
@@ -1878,16 +3425,11 @@ void Database::addToRecipe( Recipe* rec, Equipment* e, bool noCopy, bool transac
 
    }
    catch (QString e ) {
-      if ( transact )
-         sqlDatabase().rollback();
       throw;
    }
 
-   // This is likely illadvised. But if you are telling me to not transact it,
-   // it is up to you to commit the changes
-   if ( transact ) {
-      sqlDatabase().commit();
-   }
+   // Inside a caller's scope, this only hands the changes up to it.
+   scope.commit();
    // NOTE: need to disconnect the recipe's old equipment?
    connect( newEquip, &BeerXMLElement::changed, rec, &Recipe::acceptEquipChange );
    // NOTE: If we don't reconnect these signals, bad things happen when
@@ -1896,7 +3438,7 @@ void Database::addToRecipe( Recipe* rec, Equipment* e, bool noCopy, bool transac
    connect( newEquip, &Equipment::changedBoilTime_min, rec, &Recipe::setBoilTime_min);
 
    // Emit a changed signal.
-   emit rec->changed( rec->metaProperty("equipment"), BeerXMLElement::qVariantFromPtr(newEquip) );
+   notifyChanged( rec, rec->metaProperty("equipment"), BeerXMLElement::qVariantFromPtr(newEquip) );
 
    // If we are already wrapped in a transaction boundary, do not call
    // recaclAll(). Weirdness ensues. But I want this after all the signals are
@@ -1911,7 +3453,7 @@ void Database::addToRecipe( Recipe* rec, Fermentable* ferm, bool noCopy, bool tr
       return;
 
    try {
-      Fermentable* newFerm = addIngredientToRecipe<Fermentable>(rec,ferm,noCopy,&allFermentables,true,transact );
+      Fermentable* newFerm = addIngredientToRecipe<Fermentable>(rec,ferm,noCopy,&allFermentables,true );
       connect( newFerm, SIGNAL(changed(QMetaProperty,QVariant)), rec, SLOT(acceptFermChange(QMetaProperty,QVariant)) );
    }
    catch (QString e) {
@@ -1929,26 +3471,21 @@ void Database::addToRecipe( Recipe* rec, QList<Fermentable*>ferms, bool transact
    if ( ferms.size() == 0 )
       return;
 
-   if ( transact ) {
-      sqlDatabase().transaction();
-   }
+   TransactionScope scope;
 
    try {
       foreach (Fermentable* ferm, ferms )
       {
-         Fermentable* newFerm = addIngredientToRecipe<Fermentable>(rec,ferm,false,&allFermentables,true,false);
+         Fermentable* newFerm = addIngredientToRecipe<Fermentable>(rec,ferm,false,&allFermentables,true);
          connect( newFerm, SIGNAL(changed(QMetaProperty,QVariant)), rec, SLOT(acceptFermChange(QMetaProperty,QVariant)) );
       }
    }
    catch ( QString(e) ) {
-      if ( transact ) {
-         sqlDatabase().rollback();
-      }
       throw;
    }
 
+   scope.commit();
    if ( transact ) {
-      sqlDatabase().commit();
       rec->recalcAll();
    }
 }
@@ -1956,11 +3493,11 @@ void Database::addToRecipe( Recipe* rec, QList<Fermentable*>ferms, bool transact
 void Database::addToRecipe( Recipe* rec, Hop* hop, bool noCopy, bool transact )
 {
    try {
-      Hop* newHop = addIngredientToRecipe<Hop>( rec, hop, noCopy, &allHops, true, transact );
+      Hop* newHop = addIngredientToRecipe<Hop>( rec, hop, noCopy, &allHops, true );
       // it's slightly dirty pool to put this all in the try block. Sue me.
       connect( newHop, SIGNAL(changed(QMetaProperty,QVariant)), rec, SLOT(acceptHopChange(QMetaProperty,QVariant)));
       if ( transact ) {
-         rec->recalcIBU();
+         rec->recalcFrom(Recipe::HopsInput);
       }
    }
    catch (QString e) {
@@ -1973,27 +3510,23 @@ void Database::addToRecipe( Recipe* rec, QList<Hop*>hops, bool transact )
    if ( hops.size() == 0 )
       return;
 
-   if ( transact )
-      sqlDatabase().transaction();
+   TransactionScope scope;
 
    try {
       foreach (Hop* hop, hops )
       {
-         Hop* newHop = addIngredientToRecipe<Hop>( rec, hop, false, &allHops, true, false );
+         Hop* newHop = addIngredientToRecipe<Hop>( rec, hop, false, &allHops, true );
          connect( newHop, SIGNAL(changed(QMetaProperty,QVariant)), rec, SLOT(acceptHopChange(QMetaProperty,QVariant)));
       }
    }
    catch (QString e) {
       Brewtarget::logE( QString("%1 %2").arg(Q_FUNC_INFO).arg(e));
-      if ( transact ) {
-         sqlDatabase().rollback();
-      }
       throw;
    }
 
+   scope.commit();
    if ( transact ) {
-      sqlDatabase().commit();
-      rec->recalcIBU();
+      rec->recalcFrom(Recipe::HopsInput);
    }
 }
 
@@ -2001,8 +3534,7 @@ void Database::addToRecipe( Recipe* rec, Mash* m, bool noCopy, bool transact )
 {
    Mash* newMash = m;
 
-   if ( transact )
-      sqlDatabase().transaction();
+   TransactionScope scope;
    // Make a copy of mash.
    // Making a copy of the mash isn't enough. We need a copy of the mashsteps
    // too.
@@ -2020,16 +3552,12 @@ void Database::addToRecipe( Recipe* rec, Mash* m, bool noCopy, bool transact )
    }
    catch (QString e) {
       Brewtarget::logE( QString("%1 %2").arg(Q_FUNC_INFO).arg(e));
-      if ( transact )
-         sqlDatabase().rollback();
       throw;
    }
 
-   if ( transact ) {
-      sqlDatabase().commit();
-   }
+   scope.commit();
    connect( newMash, SIGNAL(changed(QMetaProperty,QVariant)), rec, SLOT(acceptMashChange(QMetaProperty,QVariant)));
-   emit rec->changed( rec->metaProperty("mash"), BeerXMLElement::qVariantFromPtr(newMash) );
+   notifyChanged( rec, rec->metaProperty("mash"), BeerXMLElement::qVariantFromPtr(newMash) );
    // And let the recipe recalc all?
    if ( !noCopy && transact )
       rec->recalcAll();
@@ -2038,7 +3566,7 @@ void Database::addToRecipe( Recipe* rec, Mash* m, bool noCopy, bool transact )
 void Database::addToRecipe( Recipe* rec, Misc* m, bool noCopy, bool transact )
 {
    try {
-      addIngredientToRecipe( rec, m, noCopy, &allMiscs, true, transact );
+      addIngredientToRecipe( rec, m, noCopy, &allMiscs, true );
    }
    catch (QString e) {
       throw;
@@ -2054,24 +3582,20 @@ void Database::addToRecipe( Recipe* rec, QList<Misc*>miscs, bool transact )
    if ( miscs.size() == 0 )
       return;
 
-   if ( transact )
-      sqlDatabase().transaction();
+   TransactionScope scope;
 
    try {
       foreach (Misc* misc, miscs )
       {
-         addIngredientToRecipe( rec, misc, false, &allMiscs,true,false );
+         addIngredientToRecipe( rec, misc, false, &allMiscs,true );
       }
    }
    catch (QString e) {
       Brewtarget::logE( QString("%1 %2").arg(Q_FUNC_INFO).arg(e));
-      if ( transact ) {
-         sqlDatabase().rollback();
-      }
       throw;
    }
+   scope.commit();
    if ( transact ) {
-      sqlDatabase().commit();
       rec->recalcAll();
    }
 }
@@ -2080,7 +3604,7 @@ void Database::addToRecipe( Recipe* rec, Water* w, bool noCopy, bool transact )
 {
 
    try {
-      addIngredientToRecipe( rec, w, noCopy, &allWaters,true,transact );
+      addIngredientToRecipe( rec, w, noCopy, &allWaters,true );
    }
    catch (QString e) {
       throw;
@@ -2098,8 +3622,7 @@ void Database::addToRecipe( Recipe* rec, Style* s, bool noCopy, bool transact )
    if ( s == 0 )
       return;
 
-   if ( transact )
-      sqlDatabase().transaction();
+   TransactionScope scope;
 
    try {
       if ( ! noCopy )
@@ -2111,28 +3634,21 @@ void Database::addToRecipe( Recipe* rec, Style* s, bool noCopy, bool transact )
    }
    catch (QString e) {
       Brewtarget::logE( QString("%1 %2").arg(Q_FUNC_INFO).arg(e));
-      if ( transact )
-         sqlDatabase().rollback();
       throw;
    }
 
-   if ( transact ) {
-      sqlDatabase().commit();
-   }
+   scope.commit();
    // Emit a changed signal.
-   emit rec->changed( rec->metaProperty("style"), BeerXMLElement::qVariantFromPtr(newStyle) );
+   notifyChanged( rec, rec->metaProperty("style"), BeerXMLElement::qVariantFromPtr(newStyle) );
 }
 
 void Database::addToRecipe( Recipe* rec, Yeast* y, bool noCopy, bool transact )
 {
    try {
-      Yeast* newYeast = addIngredientToRecipe<Yeast>( rec, y, noCopy, &allYeasts, true, transact );
+      Yeast* newYeast = addIngredientToRecipe<Yeast>( rec, y, noCopy, &allYeasts, true );
       connect( newYeast, SIGNAL(changed(QMetaProperty,QVariant)), rec, SLOT(acceptYeastChange(QMetaProperty,QVariant)));
       if ( transact && ! noCopy )
-      {
-         rec->recalcOgFg();
-         rec->recalcABV_pct();
-      }
+         rec->recalcFrom(Recipe::YeastsInput);
    }
    catch (QString e) {
       throw;
@@ -2144,33 +3660,85 @@ void Database::addToRecipe( Recipe* rec, QList<Yeast*>yeasts, bool transact )
    if ( yeasts.size() == 0 )
       return;
 
-   if ( transact )
-      sqlDatabase().transaction();
+   TransactionScope scope;
 
    try {
       foreach (Yeast* yeast, yeasts )
       {
-         Yeast* newYeast = addIngredientToRecipe( rec, yeast, false, &allYeasts,true,false );
+         Yeast* newYeast = addIngredientToRecipe( rec, yeast, false, &allYeasts,true );
          connect( newYeast, SIGNAL(changed(QMetaProperty,QVariant)), rec, SLOT(acceptYeastChange(QMetaProperty,QVariant)));
       }
    }
    catch (QString e) {
       Brewtarget::logE( QString("%1 %2").arg(Q_FUNC_INFO).arg(e));
-      if ( transact )
-         sqlDatabase().rollback();
       throw;
    }
 
-   if ( transact ) {
-      sqlDatabase().commit();
-      rec->recalcOgFg();
-      rec->recalcABV_pct();
-   }
+   scope.commit();
+   if ( transact )
+      rec->recalcFrom(Recipe::YeastsInput);
 }
 
 //+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+QList<int> Database::copyRows( Brewtarget::DBTable table, QString const& from, QVariantList const& binds,
+                               QHash<QString,QString> const& overrides, QList<int>* oldKeys )
+{
+   QString tName = tableNames[table];
+   QSqlRecord record = sqlDatabase().record(tName);
+   QStringList cols, values;
+   QList<int> origins, ret;
+
+   for( int i = 0; i < record.count(); ++i )
+   {
+      QString name = record.fieldName(i);
+      if ( name == "id" )
+         continue;
+      cols.append(name);
+      values.append( overrides.contains(name) ? overrides.value(name) : QString("t.%1").arg(name) );
+   }
+
+   QSqlQuery q = preparedQuery( QString("SELECT t.id FROM %1 t %2").arg(tName).arg(from) );
+   if ( ! execPrepared(q, binds, true) )
+      throw QString("%1 %2").arg(q.lastQuery()).arg(q.lastError().text());
+   while ( q.next() )
+      origins.append( q.value(0).toInt() );
+   q.finish();
+
+   if ( origins.isEmpty() )
+      return ret;
+
+   // One insert per origin, so every copy's key comes back with the row that
+   // made it. PostgreSQL's lastInsertId() is an OID, so ask it for the id.
+   bool returning = Brewtarget::dbType() == Brewtarget::PGSQL;
+   q = preparedQuery( QString("INSERT INTO %1 (%2) SELECT %3 FROM %1 t WHERE t.id=?%4")
+                         .arg(tName)
+                         .arg(cols.join(","))
+                         .arg(values.join(","))
+                         .arg(returning ? " RETURNING id" : "") );
+   foreach( int origin, origins )
+   {
+      if ( ! execPrepared(q, QVariantList() << origin) || q.numRowsAffected() != 1 )
+         throw QString("%1 %2").arg(q.lastQuery()).arg(q.lastError().text());
+      if ( returning ) {
+         if ( ! q.next() )
+            throw QString("%1 returned no id for %2").arg(q.lastQuery()).arg(origin);
+         ret.append( q.value(0).toInt() );
+      }
+      else
+         ret.append( q.lastInsertId().toInt() );
+      q.finish();
+   }
+
+   if ( oldKeys )
+      *oldKeys = origins;
+   return ret;
+}
+
 void Database::sqlUpdate( Brewtarget::DBTable table, QString const& setClause, QString const& whereClause )
 {
+   // What we hold back goes first, or it would land on top of this later.
+   flushForRead(table);
+
    QString update = QString("UPDATE %1 SET %2 WHERE %3")
                 .arg(tableNames[table])
                 .arg(setClause)
@@ -2178,7 +3746,7 @@ void Database::sqlUpdate( Brewtarget::DBTable table, QString const& setClause, Q
 
    QSqlQuery q(sqlDatabase());
    try {
-      if ( ! q.exec(update) )
+      if ( ! execProfiled(q, update) )
          throw QString("Could not execute update %1 : %2").arg(update).arg(q.lastError().text());
    }
    catch (QString e) {
@@ -2188,17 +3756,26 @@ void Database::sqlUpdate( Brewtarget::DBTable table, QString const& setClause, Q
    }
 
    q.finish();
+   // Most callers update a single row by id. Otherwise we cannot tell which
+   // rows the where clause hit.
+   QRegExp byId("^\\s*id\\s*=\\s*(\\d+)\\s*$");
+   if ( byId.exactMatch(whereClause) )
+      invalidateRowCache(table, byId.cap(1).toInt());
+   else
+      invalidateRowCache(table);
 }
 
 void Database::sqlDelete( Brewtarget::DBTable table, QString const& whereClause )
 {
+   flushForRead(table);
+
    QString del = QString("DELETE FROM %1 WHERE %2")
                 .arg(tableNames[table])
                 .arg(whereClause);
 
    QSqlQuery q(sqlDatabase());
    try {
-      if ( ! q.exec(del) )
+      if ( ! execProfiled(q, del) )
          throw QString("Could not delete %1 : %2").arg(del).arg(q.lastError().text());
    }
    catch (QString e) {
@@ -2208,6 +3785,16 @@ void Database::sqlDelete( Brewtarget::DBTable table, QString const& whereClause
    }
 
    q.finish();
+   invalidateRowCache(table);
+
+   // Writes that would not go are for rows that may be gone now.
+   QRegExp byId("^\\s*id\\s*=\\s*(\\d+)\\s*$");
+   if ( thread() == QThread::currentThread() && _failedWrites.contains(table) ) {
+      if ( byId.exactMatch(whereClause) )
+         _failedWrites[table].remove(byId.cap(1).toInt());
+      else
+         _failedWrites.remove(table);
+   }
 }
 
 /*
@@ -2279,11 +3866,105 @@ QHash<Brewtarget::DBTable,Brewtarget::DBTable> Database::tableToInventoryTableHa
    return tmp;
 }
 
+// Instructions are left out on purpose: their order lives in
+// instruction_in_recipe and gets renumbered behind our back.
+QHash<Brewtarget::DBTable,Brewtarget::DBTable> Database::indexedInRecipeTablesHash()
+{
+   QHash<Brewtarget::DBTable,Brewtarget::DBTable> tmp;
+
+   tmp[Brewtarget::FERMTABLE] = Brewtarget::FERMINRECTABLE;
+   tmp[Brewtarget::HOPTABLE] = Brewtarget::HOPINRECTABLE;
+   tmp[Brewtarget::MISCTABLE] = Brewtarget::MISCINRECTABLE;
+   tmp[Brewtarget::WATERTABLE] = Brewtarget::WATERINRECTABLE;
+   tmp[Brewtarget::YEASTTABLE] = Brewtarget::YEASTINRECTABLE;
+
+   return tmp;
+}
+
+void Database::populateRecipeIndex()
+{
+   foreach( Brewtarget::DBTable table, indexedInRecipeTables.values() )
+      flushForRead(table);
+
+   QSqlQuery q(sqlDatabase());
+   q.setForwardOnly(true);
+
+   QMutexLocker locker(&_recipeIndexMutex);
+   _recipeIndex.clear();
+
+   try {
+      foreach( Brewtarget::DBTable table, indexedInRecipeTables.keys() )
+      {
+         QHash< int, QList<int> >& links = _recipeIndex[table];
+         QString ingKeyName = QString("%1_id").arg(tableNames[table]);
+         QString select = QString("SELECT recipe_id, %1 FROM %2 ORDER BY id")
+                              .arg(ingKeyName)
+                              .arg(tableNames[indexedInRecipeTables[table]]);
+
+         if ( ! execProfiled(q, select) )
+            throw QString("%1 %2").arg(q.lastQuery()).arg(q.lastError().text());
+
+         while ( q.next() )
+            links[ q.record().value("recipe_id").toInt() ].append( q.record().value(ingKeyName).toInt() );
+
+         q.finish();
+      }
+   }
+   catch (QString e) {
+      Brewtarget::logE( QString("%1 %2").arg(Q_FUNC_INFO).arg(e));
+      q.finish();
+      throw;
+   }
+}
+
+void Database::recipeIndexAdd( Brewtarget::DBTable table, int recKey, int ingKey )
+{
+   if ( ! indexedInRecipeTables.contains(table) )
+      return;
+
+   QMutexLocker locker(&_recipeIndexMutex);
+   undoRecipeIndexOnRollback(table, recKey);
+   _recipeIndex[table][recKey].append(ingKey);
+}
+
+void Database::recipeIndexRemove( Brewtarget::DBTable table, int recKey, int ingKey )
+{
+   if ( ! indexedInRecipeTables.contains(table) )
+      return;
+
+   QMutexLocker locker(&_recipeIndexMutex);
+   undoRecipeIndexOnRollback(table, recKey);
+   QHash< int, QList<int> >& links = _recipeIndex[table];
+   links[recKey].removeAll(ingKey);
+   if ( links[recKey].isEmpty() )
+      links.remove(recKey);
+}
+
+void Database::undoRecipeIndexOnRollback( Brewtarget::DBTable table, int recKey )
+{
+   // Called with _recipeIndexMutex held, before the change.
+   QList<int> before = _recipeIndex.value(table).value(recKey);
+   TransactionScope::onRollback( [this, table, recKey, before]() {
+      QMutexLocker locker(&_recipeIndexMutex);
+      if ( before.isEmpty() )
+         _recipeIndex[table].remove(recKey);
+      else
+         _recipeIndex[table].insert(recKey, before);
+   });
+}
+
 QList<BrewNote*> Database::brewNotes()
 {
    QList<BrewNote*> tmp;
 
-   getElements( tmp, QString("deleted=%1").arg(Brewtarget::dbFalse()), Brewtarget::BREWNOTETABLE, allBrewNotes );
+   foreach( int recipeKey, _brewNoteCounts.keys() )
+      loadBrewNotes(recipeKey);
+
+   QHash< int, QList<int> >::const_iterator page;
+   for( page = _brewNotePages.constBegin(); page != _brewNotePages.constEnd(); ++page ) {
+      foreach( int key, page.value() )
+         tmp.append( allBrewNotes.value(key) );
+   }
    return tmp;
 }
 
@@ -2291,6 +3972,7 @@ QList<Equipment*> Database::equipments()
 {
    QList<Equipment*> tmp;
    getElements( tmp, QString("deleted=%1").arg(Brewtarget::dbFalse()), Brewtarget::EQUIPTABLE, allEquipments);
+   appendLibraryRows( tmp, allEquipments );
    return tmp;
 }
 
@@ -2298,6 +3980,7 @@ QList<Fermentable*> Database::fermentables()
 {
    QList<Fermentable*> tmp;
    getElements( tmp, QString("deleted=%1").arg(Brewtarget::dbFalse()), Brewtarget::FERMTABLE, allFermentables);
+   appendLibraryRows( tmp, allFermentables );
    return tmp;
 }
 
@@ -2305,6 +3988,7 @@ QList<Hop*> Database::hops()
 {
    QList<Hop*> tmp;
    getElements( tmp, QString("deleted=%1").arg(Brewtarget::dbFalse()), Brewtarget::HOPTABLE, allHops);
+   appendLibraryRows( tmp, allHops );
    return tmp;
 }
 
@@ -2327,6 +4011,7 @@ QList<Misc*> Database::miscs()
 {
    QList<Misc*> tmp;
    getElements( tmp, QString("deleted=%1").arg(Brewtarget::dbFalse()), Brewtarget::MISCTABLE, allMiscs );
+   appendLibraryRows( tmp, allMiscs );
    return tmp;
 }
 
@@ -2342,6 +4027,7 @@ QList<Style*> Database::styles()
 {
    QList<Style*> tmp;
    getElements( tmp, QString("deleted=%1").arg(Brewtarget::dbFalse()), Brewtarget::STYLETABLE, allStyles );
+   appendLibraryRows( tmp, allStyles );
    return tmp;
 }
 
@@ -2349,6 +4035,7 @@ QList<Water*> Database::waters()
 {
    QList<Water*> tmp;
    getElements( tmp, QString("deleted=%1").arg(Brewtarget::dbFalse()), Brewtarget::WATERTABLE, allWaters );
+   appendLibraryRows( tmp, allWaters );
    return tmp;
 }
 
@@ -2356,9 +4043,214 @@ QList<Yeast*> Database::yeasts()
 {
    QList<Yeast*> tmp;
    getElements( tmp, QString("deleted=%1").arg(Brewtarget::dbFalse()), Brewtarget::YEASTTABLE, allYeasts );
+   appendLibraryRows( tmp, allYeasts );
    return tmp;
 }
 
+QFuture< QList<BrewNote*> > Database::brewNotesAsync()
+{
+   QFutureInterface< QList<BrewNote*> > done;
+   done.reportStarted();
+
+   // Notes are unloaded once over budget, so the worker only gets to see
+   // keys, and the loaded pages stay put until the result is out.
+   QList<int> held = _brewNotePages.keys();
+   foreach( int recipeKey, held )
+      ++_brewNoteHolds[recipeKey];
+   _asyncBrewNoteHolds.append(held);
+
+   QFuture< QList<int> > found = runAsync< QList<int> >( [this]() {
+      ReadSnapshot snapshot;
+      QSqlQuery q = preparedQuery( QString("SELECT id FROM brewnote WHERE deleted = %1").arg(Brewtarget::dbFalse()),
+                                   snapshot.database() );
+      if ( ! execPrepared(q, QVariantList(), true) )
+         throw QString("%1 %2").arg(q.lastQuery()).arg(q.lastError().text());
+
+      QList<int> keys;
+      while ( q.next() )
+         keys.append( q.value(0).toInt() );
+      profileRows(q, keys.size());
+      q.finish();
+      return keys;
+   });
+
+   whenFinished( found, this, [this, done](QList<int> keys) mutable {
+      QList<BrewNote*> notes;
+      foreach( int key, keys ) {
+         if ( allBrewNotes.contains(key) )
+            notes.append( allBrewNotes.value(key) );
+      }
+      done.reportResult(notes);
+      done.reportFinished();
+      // Whoever waits on the result was just posted its turn. Let go after it.
+      QMetaObject::invokeMethod( this, "releaseAsyncBrewNotes", Qt::QueuedConnection );
+   });
+
+   return done.future();
+}
+
+void Database::releaseAsyncBrewNotes()
+{
+   if ( _asyncBrewNoteHolds.isEmpty() )
+      return;
+
+   foreach( int recipeKey, _asyncBrewNoteHolds.takeFirst() ) {
+      if ( --_brewNoteHolds[recipeKey] <= 0 )
+         _brewNoteHolds.remove(recipeKey);
+   }
+   if ( _brewNoteBytes > _brewNoteBudget )
+      _brewNoteEvictTimer.start();
+}
+
+QFuture< QList<Equipment*> > Database::equipmentsAsync()
+{
+   return elementsAsync( QString("deleted=%1").arg(Brewtarget::dbFalse()), Brewtarget::EQUIPTABLE, allEquipments );
+}
+
+QFuture< QList<Fermentable*> > Database::fermentablesAsync()
+{
+   return elementsAsync( QString("deleted=%1").arg(Brewtarget::dbFalse()), Brewtarget::FERMTABLE, allFermentables );
+}
+
+QFuture< QList<Hop*> > Database::hopsAsync()
+{
+   return elementsAsync( QString("deleted=%1").arg(Brewtarget::dbFalse()), Brewtarget::HOPTABLE, allHops );
+}
+
+QFuture< QList<Mash*> > Database::mashsAsync()
+{
+   return elementsAsync( QString("deleted=%1").arg(Brewtarget::dbFalse()), Brewtarget::MASHTABLE, allMashs );
+}
+
+QFuture< QList<MashStep*> > Database::mashStepsAsync()
+{
+   return elementsAsync( QString("deleted=%1 order by step_number").arg(Brewtarget::dbFalse()), Brewtarget::MASHSTEPTABLE, allMashSteps );
+}
+
+QFuture< QList<Misc*> > Database::miscsAsync()
+{
+   return elementsAsync( QString("deleted=%1").arg(Brewtarget::dbFalse()), Brewtarget::MISCTABLE, allMiscs );
+}
+
+QFuture< QList<Recipe*> > Database::recipesAsync()
+{
+   return elementsAsync( QString("deleted=%1").arg(Brewtarget::dbFalse()), Brewtarget::RECTABLE, allRecipes );
+}
+
+QFuture< QList<Style*> > Database::stylesAsync()
+{
+   return elementsAsync( QString("deleted=%1").arg(Brewtarget::dbFalse()), Brewtarget::STYLETABLE, allStyles );
+}
+
+QFuture< QList<Water*> > Database::watersAsync()
+{
+   return elementsAsync( QString("deleted=%1").arg(Brewtarget::dbFalse()), Brewtarget::WATERTABLE, allWaters );
+}
+
+QFuture< QList<Yeast*> > Database::yeastsAsync()
+{
+   return elementsAsync( QString("deleted=%1").arg(Brewtarget::dbFalse()), Brewtarget::YEASTTABLE, allYeasts );
+}
+
+QFuture<RecipeStatsTable> Database::recipeStatsAsync()
+{
+   // The options come from the settings, so they are read here.
+   RecipeSnapshot options;
+   options.readOptions();
+
+   return runAsync<RecipeStatsTable>( [options]() {
+      ReadSnapshot snapshot;
+      RecipeStatsTable table;
+      table.calculate( snapshot.database(), &options );
+      return table;
+   });
+}
+
+QFuture<bool> Database::updateEntryAsync( Brewtarget::DBTable table, int key, const char* col_name, QVariant value, QMetaProperty prop, BeerXMLElement* object, bool notify )
+{
+   QFutureInterface<bool> done;
+   done.reportStarted();
+
+   // The caller's string may be gone by the time the worker gets to it.
+   QByteArray col(col_name);
+   // Off the GUI thread, updateEntry() writes straight away. Listeners are
+   // told below, on the GUI thread.
+   QFuture<bool> written = runAsync<bool>( [this, table, key, col, value, prop, object]() {
+      updateEntry( table, key, col.constData(), value, prop, object, false );
+      return true;
+   }, false );
+
+   QPointer<BeerXMLElement> ptr(object);
+   whenFinished( written, this, [this, done, ptr, prop, value, notify](bool ok) mutable {
+      if ( ok && notify && ptr )
+         notifyChanged( ptr.data(), prop, value );
+      done.reportResult(ok);
+      done.reportFinished();
+   });
+
+   return done.future();
+}
+
+QFuture<bool> Database::importFromXMLAsync( QString const& filename )
+{
+   QFutureInterface<bool> done;
+   done.reportStarted();
+
+   // Reading, parsing and writing the rows all happen on the worker, with its
+   // own connection.
+   QFuture< QList<ImportedRows> > imported = runAsync< QList<ImportedRows> >( [this, filename]() {
+      QDomDocument xmlDoc;
+      if ( ! loadXml(filename, xmlDoc) )
+         return QList<ImportedRows>();
+      return importRows(xmlDoc);
+   });
+
+   // Everything we create belongs to the GUI thread, so make it there once
+   // the rows are committed.
+   whenFinished( imported, this, [this, done](QList<ImportedRows> results) mutable {
+      done.reportResult( adoptImported(results) );
+      done.reportFinished();
+   });
+
+   return done.future();
+}
+
+QFuture<bool> Database::backupToDirAsync( QString dir, QString filename )
+{
+   QFutureInterface<bool> done;
+   done.reportStarted();
+   QFuture<bool> ret = done.future();
+
+   // The backup already steps through the event loop; we only need to know
+   // when it is over.
+   QMetaObject::Connection* finished = new QMetaObject::Connection;
+   *finished = connect( this, &Database::backupFinished, this, [done, finished](bool success, QString) mutable {
+      QObject::disconnect(*finished);
+      delete finished;
+      done.reportResult(success);
+      done.reportFinished();
+   });
+
+   if ( ! startBackup(dir, filename) ) {
+      disconnect(*finished);
+      delete finished;
+      done.reportResult(false);
+      done.reportFinished();
+   }
+
+   return ret;
+}
+
+QFuture<bool> Database::convertDatabaseAsync( QString const& Hostname, QString const& DbName,
+                                              QString const& Username, QString const& Password,
+                                              int Portnum, Brewtarget::DBTypes newType )
+{
+   return runAsync<bool>( [this, Hostname, DbName, Username, Password, Portnum, newType]() {
+      convertDatabase( Hostname, DbName, Username, Password, Portnum, newType );
+      return true;
+   }, false );
+}
+
 bool Database::updateSchema(bool* err)
 {
    int currentVersion = DatabaseSchemaHelper::currentVersion( sqlDatabase() );
@@ -2377,7 +4269,7 @@ bool Database::updateSchema(bool* err)
       }
    }
 
-   sqlDatabase().transaction();
+   TransactionScope scope;
 
    try {
       //populate ingredient links
@@ -2399,27 +4291,20 @@ bool Database::updateSchema(bool* err)
    }
    catch (QString e ) {
       Brewtarget::logE( QString("%1 %2").arg(Q_FUNC_INFO).arg(e));
-      sqlDatabase().rollback();
       throw;
    }
 
-   sqlDatabase().commit();
+   scope.commit();
 
    return doUpdate;
 }
 
-bool Database::importFromXML(const QString& filename)
+bool Database::loadXml( QString const& filename, QDomDocument& xmlDoc )
 {
-   unsigned int count;
    int line, col;
-   QDomDocument xmlDoc;
-   QDomElement root;
-   QDomNodeList list;
    QString err;
    QFile inFile;
-   QStringList tags = QStringList() << "EQUIPMENT" << "FERMENTABLE" << "HOP" << "MISC" << "STYLE" << "YEAST" << "WATER" << "MASHS";
    inFile.setFileName(filename);
-   bool ret = true;
 
    if( ! inFile.open(QIODevice::ReadOnly) )
    {
@@ -2430,108 +4315,29 @@ bool Database::importFromXML(const QString& filename)
    if( ! xmlDoc.setContent(&inFile, false, &err, &line, &col) )
       Brewtarget::logW(QString("Database::importFromXML: Bad document formatting in %1 %2:%3. %4").arg(filename).arg(line).arg(col).arg(err) );
 
-   list = xmlDoc.elementsByTagName("RECIPE");
-   if ( list.count() )
-   {
-      for(int i = 0; i < list.count(); ++i )
-      {
-         Recipe* temp = recipeFromXml( list.at(i) );
-         if ( ! temp->isValid() )
-            ret = false;
-      }
-   }
-   else
-   {
-      foreach (QString tag, tags)
-      {
-         list = xmlDoc.elementsByTagName(tag);
-         count = list.size();
+   return true;
+}
 
-         if ( count > 0 )
-         {
-            // Tell how many there were in the status bar.
-            //statusBar()->showMessage( tr("Found %1 %2.").arg(count).arg(tag.toLower()), 5000 );
+bool Database::importFromXML(const QString& filename)
+{
+   QDomDocument xmlDoc;
 
-            if (tag == "RECIPE")
-            {
-            }
-            else if ( tag == "EQUIPMENT" )
-            {
-               for(int i = 0; i < list.count(); ++i )
-               {
-                  Equipment* temp = equipmentFromXml( list.at(i) );
-                  if ( ! temp->isValid() )
-                     ret = false;
-               }
-            }
-            else if( tag == "FERMENTABLE" )
-            {
-               for( int i = 0; i < list.count(); ++i )
-               {
-                  Fermentable* temp = fermentableFromXml( list.at(i) );
-                  if ( ! temp->isValid() )
-                     ret = false;
-               }
+   if ( ! loadXml(filename, xmlDoc) )
+      return false;
 
-            }
-            else if (tag == "HOP")
-            {
-               for(int i = 0; i < list.count(); ++i )
-               {
-                  Hop* temp = hopFromXml( list.at(i) );
-                  if ( ! temp->isValid() )
-                     ret = false;
-               }
-            }
-            else if (tag == "MISC")
-            {
-               for(int i = 0; i < list.count(); ++i )
-               {
-                  Misc* temp = miscFromXml( list.at(i) );
-                  if ( ! temp->isValid() )
-                     ret = false;
-               }
-            }
-            else if( tag == "STYLE" )
-            {
-               for( int i = 0; i < list.count(); ++i )
-               {
-                  Style* temp = styleFromXml( list.at(i) );
-                  if ( ! temp->isValid() )
-                     ret = false;
-               }
-            }
-            else if (tag == "YEAST")
-            {
-               for(int i = 0; i < list.count(); ++i )
-               {
-                  Yeast* temp = yeastFromXml( list.at(i) );
-                  if ( ! temp->isValid() )
-                     ret = false;
-               }
-            }
-            else if( tag == "WATER" )
-            {
-               for( int i = 0; i < list.count(); ++i )
-               {
-                  Water* temp = waterFromXml( list.at(i) );
-                  if ( ! temp->isValid() )
-                     ret = false;
-               }
-            }
-            else if( tag == "MASHS" )
-            {
-               for( int i = 0; i < list.count(); ++i )
-               {
-                  Mash* temp = mashFromXml( list.at(i) );
-                  if ( ! temp->isValid() )
-                     ret = false;
-               }
-            }
-         }
-      }
-   }
-   return ret;
+   return importFromXML(xmlDoc);
+}
+
+bool Database::importFromXML(QDomDocument const& xmlDoc)
+{
+   // The rows are written on the worker, the same as importFromXMLAsync()
+   // does. We only wait for them here.
+   QFuture< QList<ImportedRows> > imported = runAsync< QList<ImportedRows> >( [this, xmlDoc]() {
+      return importRows(xmlDoc);
+   });
+   imported.waitForFinished();
+
+   return adoptImported( imported.result() );
 }
 
 void Database::toXml( BrewNote* a, QDomDocument& doc, QDomNode& parent )
@@ -3823,180 +5629,6 @@ void Database::fromXml(BeerXMLElement* element, QHash<QString,QString> const& xm
 
 }
 
-// Brewnotes can never be created w/ a recipe, so we will always assume the
-// calling method has the transactions
-BrewNote* Database::brewNoteFromXml( QDomNode const& node, Recipe* parent )
-{
-   BrewNote* ret = newBrewNote(parent);
-
-   try {
-      if ( ! ret )
-         throw QString("Could not create new brewnote");
-
-      // Need to tell the brewnote not to perform the calculations
-      ret->setLoading(true);
-      fromXml( ret, BrewNote::tagToProp, node);
-      if ( ! ret->isValid() )
-         throw QString("Error loading brewnote from XML");
-
-      ret->setLoading(false);
-   }
-   catch (QString e) {
-      Brewtarget::logE(QString("%1 %2").arg(Q_FUNC_INFO).arg(e));
-      throw;
-   }
-
-   return ret;
-}
-
-Equipment* Database::equipmentFromXml( QDomNode const& node, Recipe* parent )
-{
-   // When loading from XML, we need to delay the signals until after
-   // everything is done. This should significantly speed up the load times
-   blockSignals(true);
-
-   Equipment* ret;
-   QList<Equipment*> matchingEquips;
-   QDomNode n;
-   bool createdNew = true;
-
-   try {
-      // If we are just importing an equip by itself, need to do some dupe-checking.
-      if( parent == 0 )
-      {
-         // No parent means we handle the transaction
-         sqlDatabase().transaction();
-         // Check to see if there is a hop already in the DB with the same name.
-         n = node.firstChildElement("NAME");
-         QString name = n.firstChild().toText().nodeValue();
-
-         getElements<Equipment>( matchingEquips, QString("name='%1'").arg(name), Brewtarget::EQUIPTABLE, allEquipments );
-
-         if( matchingEquips.length() > 0 )
-         {
-            createdNew = false;
-            ret = matchingEquips.first();
-         }
-         else
-            ret = newEquipment();
-      }
-      else
-         ret = newEquipment();
-
-      if ( ! ret )
-         throw QString("Could not create new equipment profile");
-
-      fromXml( ret, Equipment::tagToProp, node );
-      if ( ! ret->isValid() )
-         throw QString("There was an error loading equipment profile from XML");
-
-      // If we are importing one of our beerXML files, the utilization is always
-      // 0%. We need to fix that.
-      if ( ret->hopUtilization_pct() == 0.0 )
-         ret->setHopUtilization_pct(100.0);
-
-      if( parent )
-      {
-         ret->setDisplay(false);
-         addToRecipe( parent, ret, true );
-      }
-   }
-   catch (QString e) {
-      if ( ! parent )
-         sqlDatabase().rollback();
-      Brewtarget::logE(QString("%1 %2").arg(Q_FUNC_INFO).arg(e));
-      blockSignals(false);
-      throw;
-   }
-
-   blockSignals(false);
-   if ( ! parent )
-      sqlDatabase().commit();
-
-   if( createdNew )
-   {
-      emit changed( metaProperty("equipments"), QVariant() );
-      emit newEquipmentSignal(ret);
-   }
-
-   return ret;
-}
-
-Fermentable* Database::fermentableFromXml( QDomNode const& node, Recipe* parent )
-{
-   QDomNode n;
-   Fermentable* ret;
-   bool createdNew = true;
-   blockSignals(true);
-
-   try {
-      // If we are just importing a ferm by itself, need to do some dupe-checking.
-      if( parent == 0 )
-      {
-         // Check to see if there is a ferm already in the DB with the same name.
-         sqlDatabase().transaction();
-         n = node.firstChildElement("NAME");
-         QString name = n.firstChild().toText().nodeValue();
-         QList<Fermentable*> matchingFerms;
-         getElements<Fermentable>( matchingFerms, QString("name='%1'").arg(name), Brewtarget::FERMTABLE, allFermentables );
-
-         if( matchingFerms.length() > 0 )
-         {
-            createdNew = false;
-            ret = matchingFerms.first();
-         }
-         else
-            ret = newFermentable();
-      }
-      else
-         ret = newFermentable();
-
-      if ( ! ret )
-         throw QString("Could not create new fermentable");
-
-      fromXml( ret, Fermentable::tagToProp, node );
-      if ( ! ret->isValid() )
-         throw QString("Error reading fermentable from XML");
-
-
-      // Handle enums separately.
-      n = node.firstChildElement("TYPE");
-      if ( n.firstChild().isNull() )
-         ret->invalidate();
-      else {
-         int ndx = Fermentable::types.indexOf( n.firstChild().toText().nodeValue());
-         if ( ndx != -1 )
-            ret->setType( static_cast<Fermentable::Type>(ndx));
-         else
-            ret->invalidate();
-      }
-
-      if ( ! ret->isValid() )
-         throw QString("Could not change the type of the fermentable");
-
-      if( parent )
-         addToRecipe( parent, ret, true );
-   }
-   catch (QString e) {
-      if ( ! parent )
-         sqlDatabase().rollback();
-      Brewtarget::logE(QString("%1 %2").arg(Q_FUNC_INFO).arg(e));
-      throw;
-   }
-
-   if ( ! parent )
-      sqlDatabase().commit();
-
-   blockSignals(false);
-   if( createdNew )
-   {
-      emit changed( metaProperty("fermentables"), QVariant() );
-      emit newFermentableSignal(ret);
-   }
-
-   return ret;
-}
-
 int Database::getQualifiedHopTypeIndex(QString type, Hop* hop)
 {
   if ( Hop::types.indexOf(type) < 0 )
@@ -4049,254 +5681,6 @@ int Database::getQualifiedHopUseIndex(QString use, Hop* hop)
   }
 }
 
-Hop* Database::hopFromXml( QDomNode const& node, Recipe* parent )
-{
-   QDomNode n;
-   Hop* ret;
-   bool createdNew = true;
-   blockSignals(true);
-
-   try {
-      // If we are just importing a hop by itself, need to do some dupe-checking.
-      if( parent == 0 )
-      {
-         // as always, start the transaction if no parent
-         sqlDatabase().transaction();
-         // Check to see if there is a hop already in the DB with the same name.
-         n = node.firstChildElement("NAME");
-         QString name = n.firstChild().toText().nodeValue();
-         QList<Hop*> matchingHops;
-         getElements<Hop>( matchingHops, QString("name='%1'").arg(name), Brewtarget::HOPTABLE, allHops );
-
-         if( matchingHops.length() > 0 )
-         {
-            createdNew = false;
-            ret = matchingHops.first();
-         }
-         else
-            ret = newHop();
-      }
-      else
-         ret = newHop();
-
-      fromXml( ret, Hop::tagToProp, node );
-
-      // Handle enums separately.
-      n = node.firstChildElement("USE");
-      if ( n.firstChild().isNull() )
-         ret->invalidate();
-      else {
-         int ndx = getQualifiedHopUseIndex(n.firstChild().toText().nodeValue(), ret);
-         if ( ndx != -1 )
-            ret->setUse( static_cast<Hop::Use>(ndx));
-         else
-            ret->invalidate();
-      }
-
-      n = node.firstChildElement("TYPE");
-      if ( n.firstChild().isNull() )
-         ret->invalidate();
-      else {
-         int ndx = getQualifiedHopTypeIndex(n.firstChild().toText().nodeValue(), ret);
-         if ( ndx != -1 )
-            ret->setType( static_cast<Hop::Type>(ndx) );
-         else
-            ret->invalidate();
-      }
-
-      n = node.firstChildElement("FORM");
-      if ( n.firstChild().isNull() )
-         ret->invalidate();
-      else {
-         int ndx = Hop::forms.indexOf(n.firstChild().toText().nodeValue());
-         if ( ndx != -1 )
-            ret->setForm( static_cast<Hop::Form>(ndx));
-         else
-            ret->invalidate();
-      }
-
-      if ( ! ret->isValid() )
-      {
-         QString name = ret->name();
-         QList<Hop*> matching;
-         getElements<Hop>( matching, QString("name like '%1'").arg(name), Brewtarget::HOPTABLE, allHops );
-
-         if( matching.length() > 0 )
-         {
-            createdNew = false;
-            Hop* temp = ret;
-            ret = matching.first();
-            ret->setAmount_kg(temp->amount_kg());
-         }
-      }
-
-      if( parent )
-         addToRecipe( parent, ret, true );
-   }
-   catch (QString e) {
-      Brewtarget::logE( QString("%1 %2").arg(Q_FUNC_INFO).arg(e) );
-      blockSignals(false);
-      if ( ! parent )
-         sqlDatabase().rollback();
-
-      throw;
-   }
-
-   if ( ! parent )
-      sqlDatabase().commit();
-
-   blockSignals(false);
-   if( createdNew )
-   {
-      emit changed( metaProperty("hops"), QVariant() );
-      emit newHopSignal(ret);
-   }
-   return ret;
-}
-
-// like brewnotes, we will assume here that the caller has the transaction
-// block
-Instruction* Database::instructionFromXml( QDomNode const& node, Recipe* parent )
-{
-
-   blockSignals(true);
-   try {
-      Instruction* ret = newInstruction(parent);
-
-      fromXml( ret, Instruction::tagToProp, node );
-
-      blockSignals(false);
-      emit changed( metaProperty("instructions"), QVariant() );
-      return ret;
-   }
-   catch (QString e) {
-      Brewtarget::logE( QString("%1 %2").arg(Q_FUNC_INFO).arg(e) );
-      blockSignals(false);
-      throw;
-   }
-}
-
-Mash* Database::mashFromXml( QDomNode const& node, Recipe* parent )
-{
-   QDomNode n;
-
-   blockSignals(true);
-   Mash* ret;
-
-   // Mashes are weird. We need to know if this is a duplicate, but we need to
-   // make a copy of it anyway.
-   n = node.firstChildElement("NAME");
-   QString name = n.firstChild().toText().nodeValue();
-
-   try {
-      if( parent )
-         ret = newMash(parent);
-      else {
-         sqlDatabase().transaction();
-         ret = newMash();
-      }
-
-      // If the mash has a name
-      if ( ! name.isEmpty() )
-      {
-         QList<Mash*> matchingMash;
-         getElements<Mash>( matchingMash, QString("name='%1'").arg(name), Brewtarget::MASHTABLE, allMashs );
-
-         // If there are no other matches in the database
-         if( matchingMash.isEmpty() )
-            ret->setDisplay(true);
-      }
-      // First, get all the standard properties.
-      fromXml( ret, Mash::tagToProp, node );
-
-      // Now, get the individual mash steps.
-      n = node.firstChildElement("MASH_STEPS");
-      if( n.isNull() )
-         return ret;
-
-      // Iterate through all the mash steps.
-      for( n = n.firstChild(); !n.isNull(); n = n.nextSibling() )
-      {
-         MashStep* temp = mashStepFromXml( n, ret );
-         if ( ! temp->isValid() )
-            throw;
-      }
-   }
-   catch (QString e) {
-      Brewtarget::logE( QString("%1 %2").arg(Q_FUNC_INFO).arg(e));
-      blockSignals(false);
-      if ( ! parent )
-         sqlDatabase().rollback();
-      throw;
-   }
-
-   if ( ! parent )
-      sqlDatabase().commit();
-
-   blockSignals(false);
-
-   emit changed( metaProperty("mashs"), QVariant() );
-   emit newMashSignal(ret);
-   emit ret->mashStepsChanged();
-
-   return ret;
-}
-
-// mashsteps don't exist without a mash. It is up to mashFromXml or
-// recipeFromXml to deal with the transaction
-MashStep* Database::mashStepFromXml( QDomNode const& node, Mash* parent )
-{
-   QDomNode n;
-   QString str;
-   bool blocked = signalsBlocked();
-
-   if (! blocked )
-      blockSignals(true);
-
-   try {
-      MashStep* ret = newMashStep(parent);
-      // I am only doing this on mashsteps because they cause all sorts of
-      // expensive recalculations to happen
-      ret->blockSignals(true);
-
-      fromXml(ret,MashStep::tagToProp,node);
-
-      // Handle enums separately.
-      n = node.firstChildElement("TYPE");
-      if ( n.firstChild().isNull() )
-         ret->invalidate();
-      else {
-         //Try to make sure incoming format matches
-         //e.g. convert INFUSION to Infusion
-         str = n.firstChild().toText().nodeValue();
-         str = str.toLower();
-         str[0] = str.at(0).toTitleCase();
-         int ndx =  MashStep::types.indexOf(str);
-
-         if ( ndx != -1 )
-            ret->setType( static_cast<MashStep::Type>(ndx) );
-         else
-            ret->invalidate();
-      }
-
-      ret->blockSignals(false);
-      if (! blocked )
-      {
-         blockSignals(false);
-         emit changed( metaProperty("mashs"), QVariant() );
-         emit parent->mashStepsChanged();
-      }
-      return ret;
-   }
-   catch (QString e) {
-      Brewtarget::logE( QString("%1 %2").arg(Q_FUNC_INFO).arg(e));
-      if (! blocked )
-         blockSignals(false);
-      throw;
-   }
-
-}
-
 int Database::getQualifiedMiscTypeIndex(QString type, Misc* misc)
 {
   if ( Misc::types.indexOf(type) < 0 )
@@ -4349,429 +5733,572 @@ int Database::getQualifiedMiscUseIndex(QString use, Misc* misc)
   }
 }
 
-Misc* Database::miscFromXml( QDomNode const& node, Recipe* parent )
+void Database::extrasFromXml( Equipment* equip, QDomNode const& node )
 {
-   QDomNode n;
-   bool createdNew = true;
-   blockSignals(true);
-   Misc* ret;
+   Q_UNUSED(node);
 
-   try {
-      // If we are just importing a misc by itself, need to do some dupe-checking.
-      if( parent == 0 )
-      {
-         // Check to see if there is a hop already in the DB with the same name.
-         sqlDatabase().transaction();
+   // If we are importing one of our beerXML files, the utilization is always
+   // 0%. We need to fix that.
+   if ( equip->hopUtilization_pct() == 0.0 )
+      equip->setHopUtilization_pct(100.0);
+}
 
-         n = node.firstChildElement("NAME");
-         QString name = n.firstChild().toText().nodeValue();
-         QList<Misc*> matchingMiscs;
-         getElements<Misc>( matchingMiscs, QString("name='%1'").arg(name), Brewtarget::MISCTABLE, allMiscs );
+void Database::extrasFromXml( Fermentable* ferm, QDomNode const& node )
+{
+   QDomNode n = node.firstChildElement("TYPE");
+   if ( n.firstChild().isNull() )
+      ferm->invalidate();
+   else {
+      int ndx = Fermentable::types.indexOf( n.firstChild().toText().nodeValue());
+      if ( ndx != -1 )
+         ferm->setType( static_cast<Fermentable::Type>(ndx));
+      else
+         ferm->invalidate();
+   }
+}
 
-         if( matchingMiscs.length() > 0 )
-         {
-            createdNew = false;
-            ret = matchingMiscs.first();
-         }
-         else
-            ret = newMisc();
-      }
+void Database::extrasFromXml( Hop* hop, QDomNode const& node )
+{
+   QDomNode n = node.firstChildElement("USE");
+   if ( n.firstChild().isNull() )
+      hop->invalidate();
+   else {
+      int ndx = getQualifiedHopUseIndex(n.firstChild().toText().nodeValue(), hop);
+      if ( ndx != -1 )
+         hop->setUse( static_cast<Hop::Use>(ndx));
       else
-         ret = newMisc();
+         hop->invalidate();
+   }
 
-      fromXml( ret, Misc::tagToProp, node );
+   n = node.firstChildElement("TYPE");
+   if ( n.firstChild().isNull() )
+      hop->invalidate();
+   else {
+      int ndx = getQualifiedHopTypeIndex(n.firstChild().toText().nodeValue(), hop);
+      if ( ndx != -1 )
+         hop->setType( static_cast<Hop::Type>(ndx) );
+      else
+         hop->invalidate();
+   }
 
-      // Handle enums separately.
-      n = node.firstChildElement("TYPE");
-      // Assuming these return anything is a bad idea. So far, several other brewing programs are not generating
-      // valid XML.
-      if ( n.firstChild().isNull() )
-         ret->invalidate();
+   n = node.firstChildElement("FORM");
+   if ( n.firstChild().isNull() )
+      hop->invalidate();
+   else {
+      int ndx = Hop::forms.indexOf(n.firstChild().toText().nodeValue());
+      if ( ndx != -1 )
+         hop->setForm( static_cast<Hop::Form>(ndx));
       else
-         ret->setType( static_cast<Misc::Type>(getQualifiedMiscTypeIndex(n.firstChild().toText().nodeValue(), ret)));
+         hop->invalidate();
+   }
+}
 
-      n = node.firstChildElement("USE");
-      if ( n.firstChild().isNull() )
-         ret->invalidate();
+void Database::extrasFromXml( MashStep* step, QDomNode const& node )
+{
+   QDomNode n = node.firstChildElement("TYPE");
+   if ( n.firstChild().isNull() )
+      step->invalidate();
+   else {
+      //Try to make sure incoming format matches
+      //e.g. convert INFUSION to Infusion
+      QString str = n.firstChild().toText().nodeValue();
+      str = str.toLower();
+      str[0] = str.at(0).toTitleCase();
+      int ndx =  MashStep::types.indexOf(str);
+
+      if ( ndx != -1 )
+         step->setType( static_cast<MashStep::Type>(ndx) );
       else
-         ret->setUse(static_cast<Misc::Use>(getQualifiedMiscUseIndex(n.firstChild().toText().nodeValue(), ret)));
+         step->invalidate();
+   }
+}
 
-      if ( ! ret->isValid() )
-      {
-         QString name = ret->name();
-         QList<Misc*> matching;
-         getElements<Misc>( matching, QString("name like '%1'").arg(name), Brewtarget::MISCTABLE, allMiscs );
+void Database::extrasFromXml( Misc* misc, QDomNode const& node )
+{
+   QDomNode n = node.firstChildElement("TYPE");
+   // Assuming these return anything is a bad idea. So far, several other brewing programs are not generating
+   // valid XML.
+   if ( n.firstChild().isNull() )
+      misc->invalidate();
+   else
+      misc->setType( static_cast<Misc::Type>(getQualifiedMiscTypeIndex(n.firstChild().toText().nodeValue(), misc)));
+
+   n = node.firstChildElement("USE");
+   if ( n.firstChild().isNull() )
+      misc->invalidate();
+   else
+      misc->setUse(static_cast<Misc::Use>(getQualifiedMiscUseIndex(n.firstChild().toText().nodeValue(), misc)));
+}
+
+void Database::extrasFromXml( Style* style, QDomNode const& node )
+{
+   QDomNode n = node.firstChildElement("TYPE");
+   if ( n.firstChild().isNull() )
+      style->invalidate();
+   else {
+      int ndx = Style::types.indexOf( n.firstChild().toText().nodeValue());
+      if ( ndx != -1 )
+         style->setType(static_cast<Style::Type>(ndx));
+      else
+         style->invalidate();
+   }
+}
+
+void Database::extrasFromXml( Yeast* yeast, QDomNode const& node )
+{
+   QDomNode n = node.firstChildElement("TYPE");
+   if ( n.firstChild().isNull() )
+      yeast->invalidate();
+   else {
+      int ndx = Yeast::types.indexOf( n.firstChild().toText().nodeValue());
+      if ( ndx != -1)
+         yeast->setType( static_cast<Yeast::Type>(ndx) );
+      else
+         yeast->invalidate();
+   }
+
+   n = node.firstChildElement("FORM");
+   if ( n.firstChild().isNull() )
+      yeast->invalidate();
+   else {
+      int ndx = Yeast::forms.indexOf( n.firstChild().toText().nodeValue());
+      if ( ndx != -1 )
+         yeast->setForm( static_cast<Yeast::Form>(ndx) );
+      else
+         yeast->invalidate();
+   }
 
-         if( matching.length() > 0 )
+   n = node.firstChildElement("FLOCCULATION");
+   if ( n.firstChild().isNull() )
+      yeast->invalidate();
+   else {
+      int ndx = Yeast::flocculations.indexOf( n.firstChild().toText().nodeValue());
+      if (ndx != -1)
+         yeast->setFlocculation( static_cast<Yeast::Flocculation>(ndx) );
+      else
+         yeast->invalidate();
+   }
+}
+
+// Import from BeerXML ========================================================
+
+QList<Database::ImportedRows> Database::importRows( QDomDocument const& xmlDoc )
+{
+   QList<ImportedRows> ret;
+   QDomNodeList list = xmlDoc.elementsByTagName("RECIPE");
+
+   // The worker's own connection, so the GUI thread is never kept waiting.
+   TransactionScope scope;
+
+   try {
+      if ( list.count() )
+      {
+         for( int i = 0; i < list.count(); ++i )
+         {
+            ImportedRows rows;
+            importRecipeRows( list.at(i), rows );
+            ret.append(rows);
+         }
+      }
+      else
+      {
+         // Equipment first, then the ingredients, then the mashes.
+         QList< QPair<QString,Brewtarget::DBTable> > tags;
+         tags << qMakePair(QString("EQUIPMENT"), Brewtarget::EQUIPTABLE)
+              << qMakePair(QString("FERMENTABLE"), Brewtarget::FERMTABLE)
+              << qMakePair(QString("HOP"), Brewtarget::HOPTABLE)
+              << qMakePair(QString("MISC"), Brewtarget::MISCTABLE)
+              << qMakePair(QString("STYLE"), Brewtarget::STYLETABLE)
+              << qMakePair(QString("YEAST"), Brewtarget::YEASTTABLE)
+              << qMakePair(QString("WATER"), Brewtarget::WATERTABLE)
+              << qMakePair(QString("MASHS"), Brewtarget::MASHTABLE);
+
+         for( int t = 0; t < tags.size(); ++t )
          {
-            createdNew = false;
-            Misc* temp = ret;
-            ret = matching.first();
-            ret->setAmount( temp->amount() );
+            list = xmlDoc.elementsByTagName(tags.at(t).first);
+            for( int i = 0; i < list.count(); ++i )
+            {
+               ImportedRows rows;
+               if ( tags.at(t).second == Brewtarget::MASHTABLE )
+                  importMashRows( list.at(i), rows );
+               else
+                  importRow( tags.at(t).second, list.at(i), rows );
+               ret.append(rows);
+            }
          }
       }
-
-      if( parent )
-         addToRecipe( parent, ret, true );
    }
    catch (QString e) {
-      Brewtarget::logE(QString("%1 %2").arg(Q_FUNC_INFO).arg(e));
-      if ( ! parent )
-         sqlDatabase().rollback();
-      blockSignals(false);
+      Brewtarget::logE( QString("%1 %2").arg(Q_FUNC_INFO).arg(e));
       throw;
    }
 
-   blockSignals(false);
-   if( createdNew )
-   {
-      emit changed( metaProperty("miscs"), QVariant() );
-      emit newMiscSignal(ret);
-   }
+   scope.commit();
    return ret;
 }
 
-Recipe* Database::recipeFromXml( QDomNode const& node )
+void Database::importRecipeRows( QDomNode const& node, ImportedRows& rows )
 {
    QDomNode n;
+   int key = insertDefaultRow(Brewtarget::RECTABLE);
 
-   try {
-      // I was wrong. We need to block signals here. Weird things happen if you don't.
-      blockSignals(true);
-
-      // This is all one long, gnarly transaction.
-      sqlDatabase().transaction();
-
-      // This works, strangely enough.
-      Recipe* ret = newIngredient(&allRecipes);
-
-      // Get standard properties.
-      fromXml( ret, Recipe::tagToProp, node);
-
-      // Get style. Note: styleFromXml requires the entire node, not just the
-      // firstchild of the node.
-      n = node.firstChildElement("STYLE");
-      styleFromXml(n, ret);
-      if ( ! ret->style()->isValid())
-         ret->invalidate();
-
-      // Get equipment. equipmentFromXml requires the entire node, not just the
-      // first child
-      n = node.firstChildElement("EQUIPMENT");
-      equipmentFromXml(n, ret);
-      if ( !ret->equipment()->isValid() )
-         ret->invalidate();
-
-      // Get hops.
-      n = node.firstChildElement("HOPS");
-      for( n = n.firstChild(); !n.isNull(); n = n.nextSibling() )
-      {
-         Hop* temp = hopFromXml(n, ret);
-         if ( ! temp->isValid() )
-            ret->invalidate();
-      }
+   rows.recipe = key;
+   rows.created[Brewtarget::RECTABLE].append(key);
 
-      // Get ferms.
-      n = node.firstChildElement("FERMENTABLES");
-      for( n = n.firstChild(); !n.isNull(); n = n.nextSibling() )
-      {
-         Fermentable* temp = fermentableFromXml(n, ret);
-         if ( ! temp->isValid() )
-            ret->invalidate();
-      }
+   // Get standard properties. The ingredients the calculations need are not
+   // in yet, so do not try.
+   {
+      Recipe tmp(Brewtarget::RECTABLE, key);
+      tmp.blockSignals(true);
+      tmp.setLoading(true);
+      fromXml( &tmp, Recipe::tagToProp, node );
+      if ( ! tmp.isValid() )
+         rows.valid = false;
+   }
+
+   // The recipe gets a hidden copy of the style, like addToRecipe() makes.
+   n = node.firstChildElement("STYLE");
+   int style = importRow( Brewtarget::STYLETABLE, n, rows, key );
+   QHash<QString,QString> hidden;
+   hidden.insert("display", Brewtarget::dbFalse());
+   QList<int> styleCopy = copyRows( Brewtarget::STYLETABLE, "WHERE t.id=?", QVariantList() << style, hidden );
+   if ( styleCopy.isEmpty() )
+      throw QString("Could not copy style %1").arg(style);
+   rows.created[Brewtarget::STYLETABLE].append(styleCopy.first());
+   sqlUpdate( Brewtarget::RECTABLE, QString("style_id=%1").arg(styleCopy.first()), QString("id=%1").arg(key) );
+
+   // The equipment goes in as it is, but hidden.
+   n = node.firstChildElement("EQUIPMENT");
+   int equip = importRow( Brewtarget::EQUIPTABLE, n, rows, key );
+   sqlUpdate( Brewtarget::EQUIPTABLE, QString("display=%1").arg(Brewtarget::dbFalse()), QString("id=%1").arg(equip) );
+   sqlUpdate( Brewtarget::RECTABLE, QString("equipment_id=%1").arg(equip), QString("id=%1").arg(key) );
+
+   n = node.firstChildElement("HOPS");
+   for( n = n.firstChild(); !n.isNull(); n = n.nextSibling() )
+      importRow( Brewtarget::HOPTABLE, n, rows, key );
+
+   n = node.firstChildElement("FERMENTABLES");
+   for( n = n.firstChild(); !n.isNull(); n = n.nextSibling() )
+      importRow( Brewtarget::FERMTABLE, n, rows, key );
+
+   // There is only one mash per recipe, so this needs the entire node.
+   importMashRows( node.firstChildElement("MASH"), rows, key );
+
+   n = node.firstChildElement("MISCS");
+   for( n = n.firstChild(); !n.isNull(); n = n.nextSibling() )
+      importRow( Brewtarget::MISCTABLE, n, rows, key );
+
+   n = node.firstChildElement("YEASTS");
+   for( n = n.firstChild(); !n.isNull(); n = n.nextSibling() )
+      importRow( Brewtarget::YEASTTABLE, n, rows, key );
+
+   n = node.firstChildElement("WATERS");
+   for( n = n.firstChild(); !n.isNull(); n = n.nextSibling() )
+      importRow( Brewtarget::WATERTABLE, n, rows, key );
+
+   n = node.firstChildElement("INSTRUCTIONS");
+   for( n = n.firstChild(); !n.isNull(); n = n.nextSibling() )
+      importRow( Brewtarget::INSTRUCTIONTABLE, n, rows, key );
+
+   // Brew notes are loaded with their recipe's page, so they only need
+   // counting.
+   n = node.firstChildElement("BREWNOTES");
+   for( n = n.firstChild(); !n.isNull(); n = n.nextSibling() )
+   {
+      int note = insertDefaultRow(Brewtarget::BREWNOTETABLE);
+      sqlUpdate( Brewtarget::BREWNOTETABLE, QString("recipe_id=%1").arg(key), QString("id=%1").arg(note) );
+
+      BrewNote tmp(Brewtarget::BREWNOTETABLE, note);
+      tmp.blockSignals(true);
+      // Need to tell the brewnote not to perform the calculations
+      tmp.setLoading(true);
+      fromXml( &tmp, BrewNote::tagToProp, n );
+      if ( ! tmp.isValid() )
+         throw QString("Error loading brewnote from XML");
+      ++rows.brewNotes;
+   }
+}
 
-      // get mashes. There is only one mash per recipe, so this needs the entire
-      // node.
-      n = node.firstChildElement("MASH");
-      mashFromXml(n, ret);
-      if ( ! ret->mash()->isValid() )
-         ret->invalidate();
+int Database::importRow( Brewtarget::DBTable table, QDomNode const& node, ImportedRows& rows, int recipeKey )
+{
+   QString name = node.firstChildElement("NAME").firstChild().toText().nodeValue();
+   int key = 0;
+   bool valid;
 
-      // Get miscs.
-      n = node.firstChildElement("MISCS");
-      for( n = n.firstChild(); !n.isNull(); n = n.nextSibling() )
-      {
-         Misc* temp = miscFromXml(n, ret);
-         if (! temp->isValid())
-            ret->invalidate();
-      }
+   // An element imported by itself goes over the one of the same name.
+   if ( recipeKey == 0 )
+      key = rowByName(table, name);
+   bool createdNew = key == 0;
+   if ( createdNew )
+      key = insertDefaultRow(table);
+
+   switch( table )
+   {
+      case Brewtarget::EQUIPTABLE:       valid = fillRow<Equipment>(key, node); break;
+      case Brewtarget::FERMTABLE:        valid = fillRow<Fermentable>(key, node); break;
+      case Brewtarget::HOPTABLE:         valid = fillRow<Hop>(key, node); break;
+      case Brewtarget::INSTRUCTIONTABLE: valid = fillRow<Instruction>(key, node); break;
+      case Brewtarget::MISCTABLE:        valid = fillRow<Misc>(key, node); break;
+      case Brewtarget::STYLETABLE:       valid = fillRow<Style>(key, node); break;
+      case Brewtarget::WATERTABLE:       valid = fillRow<Water>(key, node); break;
+      case Brewtarget::YEASTTABLE:       valid = fillRow<Yeast>(key, node); break;
+      default:
+         throw QString("Cannot import %1 from XML").arg(tableNames[table]);
+   }
+
+   if ( ! valid )
+   {
+      if ( table == Brewtarget::EQUIPTABLE )
+         throw QString("There was an error loading equipment profile from XML");
+      if ( table == Brewtarget::FERMTABLE )
+         throw QString("Could not change the type of the fermentable");
+
+      // Use what is in the database under that name instead. Hops and miscs
+      // keep the amount they were imported with.
+      int match = 0;
+      if ( table == Brewtarget::HOPTABLE || table == Brewtarget::MISCTABLE || table == Brewtarget::YEASTTABLE )
+         match = rowByName(table, name, true);
+      else if ( table == Brewtarget::STYLETABLE )
+         match = rowByName(table, name);
 
-      // Get yeasts.
-      n = node.firstChildElement("YEASTS");
-      for( n = n.firstChild(); !n.isNull(); n = n.nextSibling() )
+      if ( match && match != key )
       {
-         Yeast* temp = yeastFromXml(n, ret);
-         if ( !temp->isValid() )
-            ret->invalidate();
+         if ( table != Brewtarget::YEASTTABLE && table != Brewtarget::STYLETABLE )
+            sqlUpdate( table,
+                       QString("amount=(SELECT amount FROM %1 WHERE id=%2)").arg(tableNames[table]).arg(key),
+                       QString("id=%1").arg(match) );
+         if ( createdNew )
+         {
+            QSqlQuery q = preparedQuery( QString("DELETE FROM %1 WHERE id=?").arg(tableNames[table]) );
+            if ( ! execPrepared(q, QVariantList() << key) )
+               throw QString("%1 %2").arg(q.lastQuery()).arg(q.lastError().text());
+            q.finish();
+         }
+         key = match;
+         createdNew = false;
       }
+      if ( match )
+         valid = true;
+   }
 
-      // Get waters. Odd. Waters don't invalidate.
-      n = node.firstChildElement("WATERS");
-      for( n = n.firstChild(); !n.isNull(); n = n.nextSibling() )
-         waterFromXml(n, ret);
+   if ( ! valid && table != Brewtarget::WATERTABLE && table != Brewtarget::INSTRUCTIONTABLE )
+      rows.valid = false;
+   if ( createdNew )
+      rows.created[table].append(key);
 
-      /* That ends the beerXML defined objects. I'm not going to do the
-      * validation for these last two. We write em, and we had better be
-      * writing them properly
-      */
-      // Get instructions.
-      n = node.firstChildElement("INSTRUCTIONS");
-      for( n = n.firstChild(); !n.isNull(); n = n.nextSibling() )
-         instructionFromXml(n, ret);
+   // Equipment and style hang off the recipe row instead.
+   if ( recipeKey && table != Brewtarget::EQUIPTABLE && table != Brewtarget::STYLETABLE )
+      linkImportedRow( table, recipeKey, key, rows );
 
-      // Get brew notes
-      n = node.firstChildElement("BREWNOTES");
-      for( n = n.firstChild(); !n.isNull(); n = n.nextSibling() )
-         brewNoteFromXml(n, ret);
+   return key;
+}
 
-      // If we get here, commit
-      sqlDatabase().commit();
+int Database::importMashRows( QDomNode const& node, ImportedRows& rows, int recipeKey )
+{
+   QString name = node.firstChildElement("NAME").firstChild().toText().nodeValue();
+   // Mashes are weird. A new one is made even when the name is taken, but
+   // then it stays out of the list.
+   bool display = ! name.isEmpty() && rowByName(Brewtarget::MASHTABLE, name) == 0;
+   int key = insertDefaultRow(Brewtarget::MASHTABLE);
 
-      // Recalc everything, just for grins and giggles.
-      ret->recalcAll();
-      blockSignals(false);
+   rows.created[Brewtarget::MASHTABLE].append(key);
+   if ( recipeKey )
+      sqlUpdate( Brewtarget::RECTABLE, QString("mash_id=%1").arg(key), QString("id=%1").arg(recipeKey) );
+   if ( display )
+      sqlUpdate( Brewtarget::MASHTABLE, QString("display=%1").arg(Brewtarget::dbTrue()), QString("id=%1").arg(key) );
 
-      emit newRecipeSignal(ret);
+   if ( ! fillRow<Mash>(key, node) )
+      rows.valid = false;
 
-      return ret;
-   }
+   // Same numbering as newMashStep().
+   QString coalesce = QString( "step_number = (SELECT COALESCE(MAX(step_number)+1,0) FROM %1 WHERE deleted=%2 AND mash_id=%3 )")
+                        .arg(tableNames[Brewtarget::MASHSTEPTABLE])
+                        .arg(Brewtarget::dbFalse())
+                        .arg(key);
 
-   catch (QString e) {
-      Brewtarget::logE(QString("%1 %2").arg(Q_FUNC_INFO).arg(e));
-      sqlDatabase().rollback();
-      blockSignals(false);
-      throw;
+   QDomNode n = node.firstChildElement("MASH_STEPS");
+   for( n = n.firstChild(); !n.isNull(); n = n.nextSibling() )
+   {
+      int step = insertDefaultRow(Brewtarget::MASHSTEPTABLE);
+      sqlUpdate( Brewtarget::MASHSTEPTABLE, QString("mash_id=%1 ").arg(key), QString("id=%1").arg(step) );
+      sqlUpdate( Brewtarget::MASHSTEPTABLE, coalesce, QString("id=%1").arg(step) );
+
+      if ( ! fillRow<MashStep>(step, n) )
+         throw QString("Could not read a step of mash %1").arg(name);
+      rows.created[Brewtarget::MASHSTEPTABLE].append(step);
    }
+
+   return key;
 }
 
-Style* Database::styleFromXml( QDomNode const& node, Recipe* parent )
+void Database::linkImportedRow( Brewtarget::DBTable table, int recipeKey, int key, ImportedRows& rows )
 {
-   QDomNode n;
-   bool createdNew = true;
-   blockSignals(true);
-   Style* ret;
-   QString name;
-   QList<Style*> matching;
+   QString ingTable = tableNames[table];
 
-   try {
-      // If we are just importing a style by itself, need to do some dupe-checking.
-      if( parent == 0 )
-      {
-         // Check to see if there is a hop already in the DB with the same name.
-         sqlDatabase().transaction();
-         n = node.firstChildElement("NAME");
-         name = n.firstChild().toText().nodeValue();
-         getElements<Style>( matching, QString("name='%1'").arg(name), Brewtarget::STYLETABLE, allStyles );
+   QSqlQuery q = preparedQuery( QString("INSERT INTO %1_in_recipe (%1_id, recipe_id) VALUES (?, ?)").arg(ingTable) );
+   if ( ! execPrepared(q, QVariantList() << key << recipeKey) )
+      throw QString("%1 %2").arg(q.lastQuery()).arg(q.lastError().text());
+   q.finish();
 
-         if( matching.length() > 0 )
-         {
-            createdNew = false;
-            ret = matching.first();
-         }
-         else
-            ret = newStyle();
-      }
-      else
-         ret = newStyle();
+   // Instructions are the only thing in a recipe that shows in the lists.
+   if ( table == Brewtarget::INSTRUCTIONTABLE )
+   {
+      sqlUpdate( table, QString("display=%1").arg(Brewtarget::dbTrue()), QString("id=%1").arg(key) );
+      return;
+   }
+   sqlUpdate( table, QString("display=%1").arg(Brewtarget::dbFalse()), QString("id=%1").arg(key) );
 
-      fromXml( ret, Style::tagToProp, node );
+   // The row is its own parent, unless it is somebody's child already.
+   int parent = key;
+   q = preparedQuery( QString("SELECT parent_id FROM %1_children WHERE child_id=?").arg(ingTable) );
+   if ( execPrepared(q, QVariantList() << key, true) && q.next() )
+      parent = q.value(0).toInt();
+   q.finish();
 
-      // Handle enums separately.
-      n = node.firstChildElement("TYPE");
-      if ( n.firstChild().isNull() )
-         ret->invalidate();
-      else {
-         int ndx = Style::types.indexOf( n.firstChild().toText().nodeValue());
-         if ( ndx != -1 )
-            ret->setType(static_cast<Style::Type>(ndx));
-         else
-            ret->invalidate();
-      }
+   q = preparedQuery( QString("INSERT INTO %1_children (parent_id, child_id) VALUES (?, ?)").arg(ingTable) );
+   if ( ! execPrepared(q, QVariantList() << parent << key) )
+      throw QString("%1 %2").arg(q.lastQuery()).arg(q.lastError().text());
+   q.finish();
 
-      // let's see if I can be clever and find this style in our db
-      if (! ret->isValid() )
-      {
-         name = ret->name();
-         getElements<Style>( matching, QString("name='%1'").arg(name), Brewtarget::STYLETABLE ,allStyles);
-         // If we find a match, discard what we just built and use what's in teh DB instead
-         if( matching.length() > 0 )
-         {
-            createdNew = false;
-            ret = matching.first();
-         }
+   rows.linked[table].append(key);
+   rows.parents[table].append(parent);
+}
 
-      }
-      if( parent )
-         addToRecipe( parent, ret );
-   }
-   catch (QString e) {
-      Brewtarget::logE(QString("%1 %2").arg(Q_FUNC_INFO).arg(e));
-      if ( ! parent )
-         sqlDatabase().rollback();
-      blockSignals(false);
-      throw;
-   }
+int Database::insertDefaultRow( Brewtarget::DBTable table )
+{
+   QSqlQuery q = preparedQuery( QString("INSERT INTO %1 DEFAULT VALUES").arg(tableNames[table]) );
+   if ( ! execPrepared(q) )
+      throw QString("could not insert a record into %1: %2").arg(tableNames[table]).arg(q.lastError().text());
 
-   blockSignals(false);
-   if( createdNew )
-   {
-      emit changed( metaProperty("styles"), QVariant() );
-      emit newStyleSignal(ret);
-   }
+   int key = q.lastInsertId().toInt();
+   q.finish();
+   return key;
+}
 
-   return ret;
+int Database::rowByName( Brewtarget::DBTable table, QString const& name, bool like )
+{
+   QSqlQuery q = preparedQuery( QString("SELECT id FROM %1 WHERE name %2 ? AND deleted=%3 ORDER BY id")
+                                   .arg(tableNames[table])
+                                   .arg( like ? "like" : "=" )
+                                   .arg(Brewtarget::dbFalse()) );
+   if ( ! execPrepared(q, QVariantList() << name, true) )
+      throw QString("%1 %2").arg(q.lastQuery()).arg(q.lastError().text());
+
+   int key = q.next() ? q.value(0).toInt() : 0;
+   q.finish();
+   return key;
 }
 
-Water* Database::waterFromXml( QDomNode const& node, Recipe* parent )
+bool Database::adoptImported( QList<ImportedRows> const& results )
 {
-   blockSignals(true);
-   bool createdNew = true;
-   Water* ret;
-   QDomNode n;
+   bool ret = ! results.isEmpty();
 
    try {
-      // If we are just importing a style by itself, need to do some dupe-checking.
-      if( parent == 0 )
-      {
-         // Check to see if there is a hop already in the DB with the same name.
-         n = node.firstChildElement("NAME");
-         QString name = n.firstChild().toText().nodeValue();
-         QList<Water*> matching;
-         getElements<Water>( matching, QString("name='%1'").arg(name), Brewtarget::WATERTABLE, allWaters );
-
-         if( matching.length() > 0 )
-         {
-            createdNew = false;
-            ret = matching.first();
-         }
-         else
-            ret = newWater();
+      foreach( ImportedRows const& rows, results ) {
+         adoptImported(rows);
+         if ( ! rows.valid )
+            ret = false;
       }
-      else
-         ret = newWater();
-
-      fromXml( ret, Water::tagToProp, node );
-      if( parent )
-         addToRecipe( parent, ret, true );
    }
    catch (QString e) {
-      Brewtarget::logE(QString("%1 %2").arg(Q_FUNC_INFO).arg(e));
-      if ( ! parent )
-         sqlDatabase().rollback();
-      blockSignals(false);
-      throw;
-   }
-
-   blockSignals(false);
-   if( createdNew )
-   {
-      emit changed( metaProperty("waters"), QVariant() );
-      emit newWaterSignal(ret);
+      Brewtarget::logE( QString("%1 %2").arg(Q_FUNC_INFO).arg(e));
+      ret = false;
    }
 
    return ret;
 }
 
-Yeast* Database::yeastFromXml( QDomNode const& node, Recipe* parent )
+void Database::adoptImported( ImportedRows const& rows )
 {
-   QDomNode n;
-   blockSignals(true);
-   bool createdNew = true;
-   Yeast* ret;
-   QString name;
-   QList<Yeast*> matching;
+   // The rows are there for good. Now they get their objects, indexes and
+   // connections, the way load() would have made them.
+   QList<Equipment*> equips = adoptCopies( &allEquipments, Brewtarget::EQUIPTABLE, rows.created.value(Brewtarget::EQUIPTABLE) );
+   QList<Fermentable*> ferms = adoptCopies( &allFermentables, Brewtarget::FERMTABLE, rows.created.value(Brewtarget::FERMTABLE) );
+   QList<Hop*> hops = adoptCopies( &allHops, Brewtarget::HOPTABLE, rows.created.value(Brewtarget::HOPTABLE) );
+   QList<Misc*> miscs = adoptCopies( &allMiscs, Brewtarget::MISCTABLE, rows.created.value(Brewtarget::MISCTABLE) );
+   QList<Style*> styles = adoptCopies( &allStyles, Brewtarget::STYLETABLE, rows.created.value(Brewtarget::STYLETABLE) );
+   QList<Water*> waters = adoptCopies( &allWaters, Brewtarget::WATERTABLE, rows.created.value(Brewtarget::WATERTABLE) );
+   QList<Yeast*> yeasts = adoptCopies( &allYeasts, Brewtarget::YEASTTABLE, rows.created.value(Brewtarget::YEASTTABLE) );
+   QList<Mash*> mashs = adoptCopies( &allMashs, Brewtarget::MASHTABLE, rows.created.value(Brewtarget::MASHTABLE) );
+   adoptCopies( &allMashSteps, Brewtarget::MASHSTEPTABLE, rows.created.value(Brewtarget::MASHSTEPTABLE) );
+   QList<Instruction*> instructions = adoptCopies( &allInstructions, Brewtarget::INSTRUCTIONTABLE, rows.created.value(Brewtarget::INSTRUCTIONTABLE) );
 
-   try {
-      // If we are just importing a yeast by itself, need to do some dupe-checking.
-      if( parent == 0 )
-      {
-         // Check to see if there is a hop already in the DB with the same name.
-         sqlDatabase().transaction();
-         n = node.firstChildElement("NAME");
-         name = n.firstChild().toText().nodeValue();
-         getElements<Yeast>( matching, QString("name='%1'").arg(name), Brewtarget::YEASTTABLE, allYeasts );
+   Recipe* rec = 0;
+   if ( rows.recipe )
+   {
+      rec = adoptCopies( &allRecipes, Brewtarget::RECTABLE, QList<int>() << rows.recipe ).first();
 
-         if( matching.length() > 0 )
-         {
-            createdNew = false;
-            ret = matching.first();
+      // The index has to be current before anybody hears about the recipe.
+      foreach( Brewtarget::DBTable table, rows.linked.keys() )
+      {
+         QList<int> const& keys = rows.linked[table];
+         for( int i = 0; i < keys.size(); ++i ) {
+            recipeIndexAdd( table, rows.recipe, keys.at(i) );
+            setParentID( table, keys.at(i), rows.parents[table].at(i) );
          }
-         else
-            ret = newYeast();
       }
-      else
-         ret = newYeast();
 
-      fromXml( ret, Yeast::tagToProp, node );
+      if ( rows.brewNotes )
+         _brewNoteCounts.insert( rows.recipe, rows.brewNotes );
+   }
 
-      // Handle enums separately.
-      n = node.firstChildElement("TYPE");
-      if ( n.firstChild().isNull() )
-         ret->invalidate();
-      else {
-         int ndx = Yeast::types.indexOf( n.firstChild().toText().nodeValue());
-         if ( ndx != -1)
-            ret->setType( static_cast<Yeast::Type>(ndx) );
-         else
-            ret->invalidate();
-      }
-      // Handle enums separately.
-      n = node.firstChildElement("FORM");
-      if ( n.firstChild().isNull() )
-         ret->invalidate();
-      else {
-         int ndx = Yeast::forms.indexOf( n.firstChild().toText().nodeValue());
-         if ( ndx != -1 )
-            ret->setForm( static_cast<Yeast::Form>(ndx) );
-         else
-            ret->invalidate();
-      }
-      // Handle enums separately.
-      n = node.firstChildElement("FLOCCULATION");
-      if ( n.firstChild().isNull() )
-         ret->invalidate();
-      else {
-         int ndx = Yeast::flocculations.indexOf( n.firstChild().toText().nodeValue());
-         if (ndx != -1)
-            ret->setFlocculation( static_cast<Yeast::Flocculation>(ndx) );
-         else
-            ret->invalidate();
-      }
+   foreach( Mash* mash, mashs )
+      connectMash(mash);
+   if ( rec )
+      connectRecipe(rec);
 
-      // If we cannot import the yeast, we find the nearest possible match in
-      // the database and just use that? With absolutely no feed back to the
-      // user saying "Hey! That didn't work!"? No sir, I don't like it.
-      if ( ! ret->isValid() )
-      {
-         name = ret->name();
-         getElements<Yeast>( matching, QString("name like '%1'").arg(name), Brewtarget::YEASTTABLE, allYeasts );
+   if ( ! equips.isEmpty() )
+      emit changed( metaProperty("equipments"), QVariant() );
+   foreach( Equipment* equip, equips )
+      emit newEquipmentSignal(equip);
 
-         if( matching.length() > 0 )
-         {
-            createdNew = false;
-            ret = matching.first();
-         }
-      }
+   if ( ! ferms.isEmpty() )
+      emit changed( metaProperty("fermentables"), QVariant() );
+   foreach( Fermentable* ferm, ferms )
+      emit newFermentableSignal(ferm);
 
-      if( parent )
-         addToRecipe( parent, ret, true );
-   }
-   catch (QString e) {
-      Brewtarget::logE(QString("%1 %2").arg(Q_FUNC_INFO).arg(e));
-      if ( ! parent )
-         sqlDatabase().rollback();
-      blockSignals(false);
-      throw;
-   }
+   if ( ! hops.isEmpty() )
+      emit changed( metaProperty("hops"), QVariant() );
+   foreach( Hop* hop, hops )
+      emit newHopSignal(hop);
 
-   blockSignals(false);
-   if( createdNew )
-   {
+   if ( ! miscs.isEmpty() )
+      emit changed( metaProperty("miscs"), QVariant() );
+   foreach( Misc* misc, miscs )
+      emit newMiscSignal(misc);
+
+   if ( ! styles.isEmpty() )
+      emit changed( metaProperty("styles"), QVariant() );
+   foreach( Style* style, styles )
+      emit newStyleSignal(style);
+
+   if ( ! waters.isEmpty() )
+      emit changed( metaProperty("waters"), QVariant() );
+   foreach( Water* water, waters )
+      emit newWaterSignal(water);
+
+   if ( ! yeasts.isEmpty() )
       emit changed( metaProperty("yeasts"), QVariant() );
-      emit newYeastSignal(ret);
+   foreach( Yeast* yeast, yeasts )
+      emit newYeastSignal(yeast);
+
+   if ( ! mashs.isEmpty() )
+      emit changed( metaProperty("mashs"), QVariant() );
+   foreach( Mash* mash, mashs ) {
+      emit newMashSignal(mash);
+      emit mash->mashStepsChanged();
    }
 
-   return ret;
+   if ( ! instructions.isEmpty() )
+      emit changed( metaProperty("instructions"), QVariant() );
+
+   if ( rec )
+   {
+      // Recalc everything, just for grins and giggles.
+      rec->recalcAll();
+      emit changed( metaProperty("recipes"), QVariant() );
+      emit newRecipeSignal(rec);
+   }
 }
 
 //+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
@@ -4790,7 +6317,11 @@ QList<TableParams> Database::makeTableParams()
       "evap_rate" << "real_evap_rate" << "boil_time" << "calc_boil_volume" <<
       "lauter_deadspace" << "top_up_kettle" << "hop_utilization" <<
       "notes";
-   tmp.newElement = [&]() { return this->newEquipment(); };
+   tmp.adoptElement = [this](int key) {
+      Equipment* element = adoptIngredient(&allEquipments, key);
+      emit changed( metaProperty("equipments"), QVariant() );
+      emit newEquipmentSignal(element);
+   };
 
    ret.append(tmp);
    //==============================Fermentables================================
@@ -4801,17 +6332,24 @@ QList<TableParams> Database::makeTableParams()
       "add_after_boil" << "origin" << "supplier" << "notes" <<
       "coarse_fine_diff" << "moisture" << "diastatic_power" << "protein" <<
       "max_in_batch" << "recommend_mash" << "ibu_gal_per_lb";
-   tmp.newElement = [&]() { return this->newFermentable(); };
+   tmp.adoptElement = [this](int key) {
+      Fermentable* element = adoptIngredient(&allFermentables, key);
+      emit changed( metaProperty("fermentables"), QVariant() );
+      emit newFermentableSignal(element);
+   };
 
+   ret.append(tmp);
    //==============================Hops=============================
    tmp.tableName = "hop";
    tmp.propName = QStringList() <<
       "name" << "alpha" << "amount" << "use" << "time" << "notes" << "htype" <<
       "form" << "beta" << "hsi" << "origin" << "substitutes" << "humulene" <<
-      "caryophyllene" << "cohumulone" << "myrcene",
-   // First cast specifies which newHop() I want, since it is overloaded.
-   // Second cast is to force the conversion of the function pointer.
-   tmp.newElement = [&]() { return this->newHop(); };
+      "caryophyllene" << "cohumulone" << "myrcene";
+   tmp.adoptElement = [this](int key) {
+      Hop* element = adoptIngredient(&allHops, key);
+      emit changed( metaProperty("hops"), QVariant() );
+      emit newHopSignal(element);
+   };
 
    ret.append(tmp);
 
@@ -4821,7 +6359,11 @@ QList<TableParams> Database::makeTableParams()
    tmp.propName = QStringList() <<
       "name" << "mtype" << "use" << "time" << "amount" << "amount_is_weight" <<
       "use_for" << "notes";
-   tmp.newElement = [&]() { return this->newMisc(); };
+   tmp.adoptElement = [this](int key) {
+      Misc* element = adoptIngredient(&allMiscs, key);
+      emit changed( metaProperty("miscs"), QVariant() );
+      emit newMiscSignal(element);
+   };
 
    ret.append(tmp);
    //==================================Styles==================================
@@ -4833,7 +6375,11 @@ QList<TableParams> Database::makeTableParams()
       "fg_max" << "ibu_min" << "ibu_max" << "color_min" << "color_max" <<
       "abv_min" << "abv_max" << "carb_min" << "carb_max" << "notes" <<
       "profile" << "ingredients" << "examples";
-   tmp.newElement = [&]() { return this->newStyle(); };
+   tmp.adoptElement = [this](int key) {
+      Style* element = adoptIngredient(&allStyles, key);
+      emit changed( metaProperty("styles"), QVariant() );
+      emit newStyleSignal(element);
+   };
 
    ret.append(tmp);
 
@@ -4845,7 +6391,11 @@ QList<TableParams> Database::makeTableParams()
       "laboratory" << "product_id" << "min_temperature" << "max_temperature" <<
       "flocculation" << "attenuation" << "notes" << "best_for" <<
       "times_cultured" << "max_reuse" << "add_to_secondary";
-   tmp.newElement = [&]() { return this->newYeast(); };
+   tmp.adoptElement = [this](int key) {
+      Yeast* element = adoptIngredient(&allYeasts, key);
+      emit changed( metaProperty("yeasts"), QVariant() );
+      emit newYeastSignal(element);
+   };
 
    ret.append(tmp);
 
@@ -4855,172 +6405,281 @@ QList<TableParams> Database::makeTableParams()
    tmp.propName = QStringList() <<
       "name" << "amount" << "calcium" << "bicarbonate" << "sulfate" <<
       "chloride" << "sodium" << "magnesium" << "ph" << "notes";
-   tmp.newElement = [&]() { return this->newWater(); };
+   tmp.adoptElement = [this](int key) {
+      Water* element = adoptIngredient(&allWaters, key);
+      emit changed( metaProperty("waters"), QVariant() );
+      emit newWaterSignal(element);
+   };
 
    ret.append(tmp);
 
    return ret;
 }
 
-void Database::updateDatabase(QString const& filename)
+//! \returns true if two column values mean the same thing, whichever driver read them.
+static bool sameValue( QVariant const& a, QVariant const& b )
+{
+   if ( a.isNull() || b.isNull() )
+      return a.isNull() == b.isNull();
+
+   bool aNum, bNum;
+   double aDbl = a.toDouble(&aNum);
+   double bDbl = b.toDouble(&bNum);
+   if ( aNum && bNum )
+      return aDbl == bDbl;
+
+   return a.toString() == b.toString();
+}
+
+QList<MergeReport> Database::updateDatabase(QString const& filename, bool dryRun)
 {
    // In the naming here "old" means our local database, and
    // "new" means the database coming from 'filename'.
-
-   QVariant btid, newid, oldid;
-   QVariant zero(0);
    QList<TableParams> tableParams = makeTableParams();
-
-   QList<QVariant> propVal;
-   QStringList varAndHolder;
+   QList<MergeReport> reports;
+
+   // For each table, the rows that need writing. The first value of each is
+   // the bt_ id, the second the local id (null for a new row), the rest are
+   // the new values of propName.
+   QList< QList<QVariantList> > changes;
+   // For each table, the keys of the rows the merge added.
+   QList< QList<int> > created;
+
+   QSqlDatabase sqldb = sqlDatabase();
+   QString newCon("newSqldbCon");
+   // SQLite can see both databases through one connection, so the
+   // comparison is a join. Otherwise the new database gets its own
+   // connection, and we join in memory.
+   bool attach = Brewtarget::dbType() == Brewtarget::SQLITE;
+   bool attached = false;
+   QString error;
 
    try {
-      QString newCon("newSqldbCon");
-      QSqlDatabase newSqldb = QSqlDatabase::addDatabase("QSQLITE", newCon);
-      newSqldb.setDatabaseName(filename);
-      if( ! newSqldb.open() )
-      {
-         QMessageBox::critical(0,
-                              QObject::tr("Database Failure"),
-                              QString(QObject::tr("Failed to open the database '%1'.").arg(filename)));
-         throw QString("Could not open %1 for reading.\n%2").arg(filename).arg(newSqldb.lastError().text());
+      QSqlQuery q(sqldb);
+      QSqlDatabase newSqldb;
+
+      if ( attach ) {
+         q.prepare("ATTACH DATABASE ? AS incoming");
+         q.addBindValue(filename);
+         if ( ! execProfiled(q) )
+            throw QString("Could not attach %1: %2").arg(filename).arg(q.lastError().text());
+         attached = true;
+      }
+      else {
+         newSqldb = QSqlDatabase::addDatabase("QSQLITE", newCon);
+         newSqldb.setDatabaseName(filename);
+         if( ! newSqldb.open() )
+         {
+            if ( Brewtarget::isInteractive() )
+               QMessageBox::critical(0,
+                                    QObject::tr("Database Failure"),
+                                    QString(QObject::tr("Failed to open the database '%1'.").arg(filename)));
+            throw QString("Could not open %1 for reading.\n%2").arg(filename).arg(newSqldb.lastError().text());
+         }
       }
 
-      // This is the basic gist...
-      // For each (id, hop_id) in newSqldb.bt_hop...
-
-      // Call this newRecord
-      // SELECT * FROM newSqldb.hop WHERE id=<hop_id>
-
-      // UPDATE hop SET name=:name, alpha=:alpha,... WHERE id=(SELECT hop_id FROM bt_hop WHERE id=:bt_id)
-
-      // Bind :bt_id from <id>
-      // Bind :name, :alpha, ..., from newRecord.
-
-      // Execute.
-
-      foreach( TableParams tp, tableParams)
+      //========================Work out what changes========================
+      foreach( TableParams tp, tableParams )
       {
-         QSqlQuery qNewBtIng(
-            QString("SELECT * FROM bt_%1").arg(tp.tableName),
-            newSqldb );
-
-         QSqlQuery qNewIng( newSqldb );
-         qNewIng.prepare(QString("SELECT * FROM %1 WHERE id=:id").arg(tp.tableName));
-
-         // Construct the big update query.
-         QSqlQuery qUpdateOldIng( sqlDatabase() );
-         QString updateString = QString("UPDATE %1 SET ").arg(tp.tableName);
-         varAndHolder.clear();
-         foreach( QString pn, tp.propName)
-            varAndHolder.append(QString("%1=:%2").arg(pn).arg(pn));
-         updateString.append(varAndHolder.join(", "));
-
-         // Un-delete it if it is somehow deleted.
-         updateString.append(", deleted=:zero WHERE id=:id");
-         qUpdateOldIng.prepare(updateString);
-         qUpdateOldIng.bindValue( ":zero", Brewtarget::dbFalse() );
-
-         QSqlQuery qOldBtIng( sqlDatabase() );
-         qOldBtIng.prepare( QString("SELECT * FROM bt_%1 WHERE id=:btid").arg(tp.tableName) );
-
-         QSqlQuery qOldBtIngInsert( sqlDatabase() );
-         qOldBtIngInsert.prepare(
-            QString("INSERT INTO bt_%1 (id,%1_id) values (:id,:%1_id)").arg(tp.tableName) );
-
-         // Resize propVal appropriately for current table.
-         propVal.clear();
-         foreach( QString pn, tp.propName )
-            propVal.append(QVariant());
-
-         while( qNewBtIng.next() )
-         {
-            btid = qNewBtIng.record().value("id");
-            newid = qNewBtIng.record().value(QString("%1_id").arg(tp.tableName));
+         MergeReport report;
+         report.tableName = tp.tableName;
+         report.unchanged = 0;
+         QList<QVariantList> tableChanges;
+         QString idCol = QString("%1_id").arg(tp.tableName);
 
-            qNewIng.bindValue(":id", newid);
-            if ( ! qNewIng.exec() )
-               throw QString("Could not retrieve new ingredient: %1 %2").arg(qNewIng.lastQuery()).arg(qNewIng.lastError().text());
-            if( !qNewIng.next() )
-               throw QString("Could not advance query: %1 %2").arg(qNewIng.lastQuery()).arg(qNewIng.lastError().text());
+         QStringList newCols;
+         foreach( QString pn, tp.propName )
+            newCols.append( QString("ni.%1").arg(pn) );
 
-            QList<QVariant>::iterator it = propVal.begin();
+         int total = 0;
+         if ( attach ) {
+            // Only the rows that are new, changed or deleted locally come back.
+            QStringList differs;
             foreach( QString pn, tp.propName )
-            {
-               // Get new value.
-               *it = qNewIng.record().value(pn);
-               // Bind it to the old ingredient.
-               qUpdateOldIng.bindValue(
-                  QString(":%1").arg(pn),
-                  *it );
-               ++it;
+               differs.append( QString("li.%1 IS NOT ni.%1").arg(pn) );
+
+            QString incoming = QString("FROM incoming.bt_%1 nb JOIN incoming.%1 ni ON ni.id = nb.%2")
+                                 .arg(tp.tableName).arg(idCol);
+            QString select = QString("SELECT nb.id, lb.%1, %2 %3 "
+                                     "LEFT JOIN main.bt_%4 lb ON lb.id = nb.id "
+                                     "LEFT JOIN main.%4 li ON li.id = lb.%1 "
+                                     "WHERE li.id IS NULL OR li.deleted != %5 OR %6")
+                                 .arg(idCol)
+                                 .arg(newCols.join(", "))
+                                 .arg(incoming)
+                                 .arg(tp.tableName)
+                                 .arg(Brewtarget::dbFalse())
+                                 .arg(differs.join(" OR "));
+
+            if ( ! execProfiled(q, QString("SELECT count(*) %1").arg(incoming)) || ! q.next() )
+               throw QString("Could not count new rows: %1 %2").arg(q.lastQuery()).arg(q.lastError().text());
+            total = q.value(0).toInt();
+
+            if ( ! execProfiled(q, select) )
+               throw QString("Could not compare %1: %2 %3").arg(tp.tableName).arg(q.lastQuery()).arg(q.lastError().text());
+
+            while ( q.next() ) {
+               QVariantList row;
+               for( int i = 0; i < tp.propName.size() + 2; ++i )
+                  row.append( q.value(i) );
+               tableChanges.append(row);
+            }
+         }
+         else {
+            // Hash what we have by bt_ id, then probe it with each new row.
+            QStringList oldCols;
+            foreach( QString pn, tp.propName )
+               oldCols.append( QString("li.%1").arg(pn) );
+
+            QHash<int,QVariantList> local;
+            QString selectOld = QString("SELECT lb.id, lb.%1, li.id, li.deleted, %2 FROM bt_%3 lb LEFT JOIN %3 li ON li.id = lb.%1")
+                                   .arg(idCol).arg(oldCols.join(", ")).arg(tp.tableName);
+            if ( ! execProfiled(q, selectOld) )
+               throw QString("Could not read %1: %2 %3").arg(tp.tableName).arg(q.lastQuery()).arg(q.lastError().text());
+            while ( q.next() ) {
+               QVariantList row;
+               for( int i = 1; i < tp.propName.size() + 4; ++i )
+                  row.append( q.value(i) );
+               local.insert( q.value(0).toInt(), row );
             }
 
-            // Done retrieving new ingredient data.
-            qNewIng.finish();
+            QSqlQuery qNew(newSqldb);
+            QString selectNew = QString("SELECT nb.id, %1 FROM bt_%2 nb JOIN %2 ni ON ni.id = nb.%3")
+                                   .arg(newCols.join(", ")).arg(tp.tableName).arg(idCol);
+            if ( ! execProfiled(qNew, selectNew) )
+               throw QString("Could not read new %1: %2 %3").arg(tp.tableName).arg(qNew.lastQuery()).arg(qNew.lastError().text());
+
+            while ( qNew.next() ) {
+               ++total;
+               QVariantList old = local.value( qNew.value(0).toInt() );
+               // old is: local id, the id it joined to, deleted, then the values.
+               bool same = ! old.isEmpty() && ! old.at(1).isNull() && ! old.at(2).toBool();
+               for( int i = 0; same && i < tp.propName.size(); ++i )
+                  same = sameValue( old.at(i+3), qNew.value(i+1) );
+               if ( same )
+                  continue;
+
+               QVariantList row;
+               row.append( qNew.value(0) );
+               row.append( old.isEmpty() ? QVariant() : old.at(0) );
+               for( int i = 0; i < tp.propName.size(); ++i )
+                  row.append( qNew.value(i+1) );
+               tableChanges.append(row);
+            }
+         }
 
-            // Find the bt_<ingredient> record in the local table.
-            qOldBtIng.bindValue( ":btid", btid );
-            if ( ! qOldBtIng.exec() )
-               throw QString("Could not find btID (%1): %2 %3")
-                        .arg(btid.toInt())
-                        .arg(qOldBtIng.lastQuery())
-                        .arg(qOldBtIng.lastError().text());
+         // The name is always the first property.
+         foreach( QVariantList row, tableChanges ) {
+            if ( row.at(1).isNull() )
+               report.added.append( row.at(2).toString() );
+            else
+               report.changed.append( row.at(2).toString() );
+         }
+         report.unchanged = total - tableChanges.size();
 
-            // If the btid exists in the old bt_hop table, do an update.
-            if( qOldBtIng.next() )
-            {
-               oldid = qOldBtIng.record().value( QString("%1_id").arg(tp.tableName) );
-               qOldBtIng.finish();
+         reports.append(report);
+         changes.append(tableChanges);
+      }
 
-               qUpdateOldIng.bindValue( ":id", oldid );
+      //=========================Apply the changes===========================
+      if ( ! dryRun ) {
+         TransactionScope scope;
 
-               if ( ! qUpdateOldIng.exec() )
-                  throw QString("Could not update old btID (%1): %2 %3")
-                           .arg(oldid.toInt())
-                           .arg(qUpdateOldIng.lastQuery())
-                           .arg(qUpdateOldIng.lastError().text());
+         for( int t = 0; t < tableParams.size(); ++t ) {
+            TableParams tp = tableParams.at(t);
+            QList<int> tableCreated;
 
-            }
-            // If the btid doesn't exist in the old bt_hop table, do an insert into
-            // the old hop table, then into the old bt_hop table.
-            else
-            {
-               // Create a new ingredient.
-               oldid = tp.newElement()->_key;
+            // New rows only get their objects once the merge has committed.
+            QSqlQuery qNewIng(sqldb);
+            qNewIng.setForwardOnly(true);
+
+            // Un-delete it if it is somehow deleted.
+            QStringList varAndHolder;
+            foreach( QString pn, tp.propName )
+               varAndHolder.append( QString("%1=?").arg(pn) );
+            QSqlQuery qUpdateOldIng(sqldb);
+            qUpdateOldIng.prepare( QString("UPDATE %1 SET %2, deleted=? WHERE id=?")
+                                      .arg(tp.tableName).arg(varAndHolder.join(", ")) );
+
+            QSqlQuery qOldBtIngInsert(sqldb);
+            qOldBtIngInsert.prepare( QString("INSERT INTO bt_%1 (id,%1_id) values (?,?)").arg(tp.tableName) );
+
+            foreach( QVariantList row, changes.at(t) ) {
+               QVariant btid = row.at(0);
+               QVariant oldid = row.at(1);
+
+               // If the btid doesn't exist in the old bt_ table, create a new
+               // ingredient and point a new bt_ row at it.
+               if ( oldid.isNull() ) {
+                  if ( ! execProfiled(qNewIng, QString("INSERT INTO %1 DEFAULT VALUES").arg(tp.tableName) ) )
+                     throw QString("Could not insert a new %1: %2").arg(tp.tableName).arg(qNewIng.lastError().text());
+                  oldid = qNewIng.lastInsertId();
+                  qNewIng.finish();
+                  tableCreated.append( oldid.toInt() );
+
+                  qOldBtIngInsert.addBindValue(btid);
+                  qOldBtIngInsert.addBindValue(oldid);
+                  if ( !  execProfiled(qOldBtIngInsert) )
+                     throw QString("Could not insert btID (%1): %2 %3")
+                              .arg(btid.toInt())
+                              .arg(qOldBtIngInsert.lastQuery())
+                              .arg(qOldBtIngInsert.lastError().text());
+               }
 
-               // Copy in the new data.
-               qUpdateOldIng.bindValue( ":id", oldid );
+               for( int i = 2; i < row.size(); ++i )
+                  qUpdateOldIng.addBindValue( row.at(i) );
+               qUpdateOldIng.addBindValue( Brewtarget::dbFalse() );
+               qUpdateOldIng.addBindValue( oldid );
 
-               if ( ! qUpdateOldIng.exec() )
-                  throw QString("Could not insert new btID (%1): %2 %3")
+               if ( ! execProfiled(qUpdateOldIng) )
+                  throw QString("Could not update old btID (%1): %2 %3")
                            .arg(oldid.toInt())
                            .arg(qUpdateOldIng.lastQuery())
                            .arg(qUpdateOldIng.lastError().text());
-
-
-               // Insert an entry into our bt_<ingredient> table.
-               qOldBtIngInsert.bindValue( ":id", btid );
-               qOldBtIngInsert.bindValue( QString(":%1_id").arg(tp.tableName), oldid );
-
-               if ( !  qOldBtIngInsert.exec() )
-                  throw QString("Could not insert btID (%1): %2 %3")
-                           .arg(btid.toInt())
-                           .arg(qOldBtIngInsert.lastQuery())
-                           .arg(qOldBtIngInsert.lastError().text());
             }
+            created.append(tableCreated);
          }
+
+         scope.commit();
       }
-      // If we, by some miracle, get here, commit
-      sqlDatabase().commit();
-      // I think
    }
    catch (QString e) {
+      // A scope that did not commit has already rolled back.
       Brewtarget::logE(QString("%1 %2").arg(Q_FUNC_INFO).arg(e));
-      sqlDatabase().rollback();
-      blockSignals(false);
-      throw;
+      error = e;
+   }
+
+   // Neither of these can happen inside the transaction.
+   if ( attached )
+      QSqlQuery(sqldb).exec("DETACH DATABASE incoming");
+   if ( ! attach ) {
+      QSqlDatabase::database(newCon, false).close();
+      QSqlDatabase::removeDatabase(newCon);
+   }
+
+   if ( ! error.isEmpty() )
+      throw error;
+
+   foreach( MergeReport report, reports )
+      Brewtarget::log.info( QString("%1 : %2 %3 added, %4 changed, %5 unchanged%6")
+                              .arg(Q_FUNC_INFO)
+                              .arg(report.tableName)
+                              .arg(report.added.size())
+                              .arg(report.changed.size())
+                              .arg(report.unchanged)
+                              .arg(dryRun ? " (dry run)" : ""));
+
+   // The merge wrote straight to the tables.
+   if ( ! dryRun )
+      invalidateRowCache();
+
+   // The rows are there for good now, so they can have their objects.
+   for( int t = 0; t < created.size(); ++t ) {
+      foreach( int key, created.at(t) )
+         tableParams.at(t).adoptElement(key);
    }
+
+   return reports;
 }
 
 bool Database::verifyDbConnection(Brewtarget::DBTypes testDb, QString const& hostname, int portnum, QString const& schema,
@@ -5211,98 +6870,213 @@ QStringList Database::allTablesInOrder(QSqlQuery q)
    QString query = "SELECT name FROM bt_alltables ORDER BY table_id";
    QStringList tmp;
 
-   q.exec(query);
+   execProfiled(q, query);
    while ( q.next() ) {
       tmp.append( q.value("name").toString());
    }
    return tmp;
 }
 
-void Database::copyDatabase( Brewtarget::DBTypes oldType, Brewtarget::DBTypes newType, QSqlDatabase newDb)
+QList<QStringList> Database::copyWaves( QSqlDatabase newDb, Brewtarget::DBTypes newType, QStringList const& tables )
 {
-   QSqlDatabase oldDb = sqlDatabase();
-   QSqlQuery readOld(oldDb);
+   QList<QStringList> waves;
 
-   QStringList tables = allTablesInOrder(readOld);
+   // One writer at a time is all a SQLite file can take.
+   if ( newType != Brewtarget::PGSQL ) {
+      foreach( QString table, tables )
+         waves.append( QStringList() << table );
+      return waves;
+   }
+
+   // Which tables each table refers to.
+   QHash< QString, QSet<QString> > references;
+   QSqlQuery q(newDb);
+   QString fkQuery = "SELECT tc.table_name, ccu.table_name FROM information_schema.table_constraints tc "
+                     "JOIN information_schema.constraint_column_usage ccu ON tc.constraint_name = ccu.constraint_name "
+                     "WHERE tc.constraint_type = 'FOREIGN KEY'";
+   if ( ! execProfiled(q, fkQuery) )
+      throw QString("Could not read the foreign keys : %1").arg(q.lastError().text());
+   while ( q.next() )
+      references[q.value(0).toString()].insert(q.value(1).toString());
 
-   // There are a lot of tables to process
+   // The tables come in an order that already satisfies the foreign keys.
+   // A table can go as soon as everything it refers to is done, which puts
+   // it one wave after the last of those.
+   int maxThreads = Brewtarget::option("convertThreads", qMax(2, QThread::idealThreadCount())).toInt();
+   QHash<QString,int> waveOf;
    foreach( QString table, tables ) {
-      QSqlField field;
-      bool mustPrepare = true;
-      int maxid = -1;
-
-      // bt_alltables don't get copied; metatables are created
-      // when the database is. I used to say this about settings. I was wrong
-      // about settings
-      if ( table == "bt_alltables" )
-         continue;
+      int wave = 0;
+      foreach( QString ref, references.value(table) ) {
+         if ( ref != table && waveOf.contains(ref) )
+            wave = qMax( wave, waveOf.value(ref) + 1 );
+      }
+      // Keep the number of connections to the server down.
+      while ( wave < waves.size() && waves.at(wave).size() >= maxThreads )
+         ++wave;
+      while ( waves.size() <= wave )
+         waves.append( QStringList() );
 
-      QString findAllQuery = QString("SELECT * FROM %1").arg(table);
-      try {
+      waves[wave].append(table);
+      waveOf.insert(table, wave);
+   }
+   return waves;
+}
+
+TableCopier* Database::readForCopy( QString const& table, QSqlDatabase const& oldDb, QSqlDatabase const& newDb,
+                                    Brewtarget::DBTypes newType, QString* error )
+{
+   QString conName = QString("reader_%1_0x%2").arg(table).arg(reinterpret_cast<quintptr>(QThread::currentThread()), 0, 16);
+   TableCopier* copier = 0;
 
-         if (! readOld.exec(findAllQuery) )
-            throw QString("Could not execute %1 : %2").arg(readOld.lastQuery()).arg(readOld.lastError().text());
+   {
+      QSqlDatabase db = QSqlDatabase::addDatabase(oldDb.driverName(), conName);
+      db.setHostName(oldDb.hostName());
+      db.setDatabaseName(oldDb.databaseName());
+      db.setUserName(oldDb.userName());
+      db.setPassword(oldDb.password());
+      db.setPort(oldDb.port());
+      db.setConnectOptions(oldDb.connectOptions());
+
+      if ( ! db.open() )
+         *error = QString("Could not open %1 : %2").arg(oldDb.databaseName()).arg(db.lastError().text());
+      else {
+         QSqlQuery readOld(db);
+         readOld.setForwardOnly(true);
 
-         newDb.transaction();
+         QString findAllQuery = QString("SELECT * FROM %1").arg(table);
+         if (! execProfiled(readOld, findAllQuery) )
+            *error = QString("Could not execute %1 : %2").arg(readOld.lastQuery()).arg(readOld.lastError().text());
 
-         QSqlQuery upsertNew(newDb); // we will prepare this in a bit
+         QList<QVariantList> batch;
+         int rowsRead = 0;
 
          // Start reading the records from the old db
-         while(readOld.next()) {
-            int idx;
+         while( error->isEmpty() && readOld.next() ) {
             QSqlRecord here = readOld.record();
-            QString upsertQuery;
+            ++rowsRead;
+
+            // The writer is made with the first row, as it needs the columns.
+            if ( ! copier ) {
+               int idx = here.indexOf("id");
+               bool isSettings = table == QStringLiteral("settings");
+               QString upsertQuery = isSettings ? makeUpdateString(here,table,here.value(idx).toInt())
+                                                : makeInsertString(here,table);
+               copier = new TableCopier(newDb, table, upsertQuery, here.count(), ! isSettings, idx);
+               // Whoever waits for it will also delete it.
+               copier->moveToThread(thread());
+               copier->start();
+            }
 
-            idx = here.indexOf("id");
+            QVariantList row;
+            for(int i=0; i < here.count(); ++i)
+               row.append( convertValue(newType, here.field(i)) );
+            batch.append(row);
 
-            // We are going to need this for resetting the indexes later. We only
-            // need it for copying to postgresql, but .. meh, not worth the extra
-            // work
-            if ( idx != -1 && here.value(idx).toInt() > maxid ) {
-               maxid = here.value(idx).toInt();
+            if ( batch.size() >= copier->batchRows() ) {
+               // If the writer gave up, there is no point reading on.
+               if ( ! copier->push(batch) )
+                  break;
+               batch.clear();
             }
+         }
 
-            // Prepare the insert for this table if required
-            if ( mustPrepare ) {
-               if ( table == QStringLiteral("settings") ) {
-                  upsertQuery = makeUpdateString(here,table,here.value(idx).toInt());
-               }
-               else {
-                  upsertQuery = makeInsertString(here,table);
-               }
-               upsertNew.prepare(upsertQuery);
-               // but do it only once for this table
-               mustPrepare = false;
-            }
-            // All that's left is to bind
-            for(int i=0; i < here.count(); ++i) {
-               upsertNew.bindValue(i,
-                        convertValue(newType, here.field(i)),
-                        QSql::In
-               );
-            }
+         profileRows(readOld, rowsRead, true);
 
-            // and execute
-            if ( ! upsertNew.exec() )
-               throw QString("Could not insert new row %1 : %2").arg(upsertNew.lastQuery()).arg(upsertNew.lastError().text());
-         }
-         // We need to manually reset the sequences
-         if ( newType == Brewtarget::PGSQL && maxid > 0 ) {
-            QString seq = QString("SELECT setval('%1_id_seq',%2)").arg(table).arg(maxid);
-            QSqlQuery updateSeq(seq, newDb);
-
-            if ( ! updateSeq.exec(seq) )
-               throw QString("Could not reset the sequences: %1 %2")
-                  .arg(seq).arg(updateSeq.lastError().text());
+         if ( copier ) {
+            if ( ! batch.isEmpty() )
+               copier->push(batch);
+            copier->close();
          }
       }
-      catch (QString e) {
-         Brewtarget::logE( QString("%1 %2").arg(Q_FUNC_INFO).arg(e));
-         newDb.rollback();
-         throw;
+      db.close();
+   } // db goes out of scope before removeDatabase()
+
+   QSqlDatabase::removeDatabase(conName);
+   return copier;
+}
+
+void Database::copyDatabase( Brewtarget::DBTypes oldType, Brewtarget::DBTypes newType, QSqlDatabase newDb)
+{
+   Q_UNUSED(oldType);
+   QSqlDatabase oldDb = sqlDatabase();
+   QSqlQuery readOld(oldDb);
+   readOld.setForwardOnly(true);
+
+   QStringList tables = allTablesInOrder(readOld);
+   readOld.finish();
+   // bt_alltables don't get copied; metatables are created
+   // when the database is. I used to say this about settings. I was wrong
+   // about settings
+   tables.removeAll("bt_alltables");
+
+   int totalRows = 0;
+   QElapsedTimer totalTimer;
+   totalTimer.start();
+
+   // Tables in the same wave do not refer to each other, so they are copied
+   // side by side. Each gets a reader with its own connection to the old
+   // database, feeding a writer with its own connection to the new one.
+   foreach( QStringList wave, copyWaves(newDb, newType, tables) ) {
+      QList<TableCopier*> copiers;
+      QString error;
+
+      QThreadPool readers;
+      readers.setMaxThreadCount(wave.size());
+      QVector<QString> readErrors(wave.size());
+      QList< QFuture<TableCopier*> > reads;
+
+      for( int i = 0; i < wave.size(); ++i ) {
+         QString table = wave.at(i);
+         QString* readError = &readErrors[i];
+         // Each reader holds a lease while it feeds its writer. The writers
+         // take none, or a reader holding a slot could block on a writer
+         // waiting for one.
+         AsyncJob<TableCopier*>* job = new AsyncJob<TableCopier*>( [this, table, oldDb, newDb, newType, readError]() {
+            ConnectionLease lease(_connectionPool);
+            return readForCopy(table, oldDb, newDb, newType, readError);
+         });
+         reads.append( job->future() );
+         readers.start(job);
+      }
+
+      foreach( QFuture<TableCopier*> read, reads ) {
+         read.waitForFinished();
+         if ( read.result() )
+            copiers.append( read.result() );
+      }
+      foreach( QString const& readError, readErrors ) {
+         if ( ! readError.isEmpty() )
+            error = readError;
       }
 
-      newDb.commit();
+      foreach( TableCopier* copier, copiers ) {
+         copier->wait();
+
+         if ( ! copier->error().isEmpty() ) {
+            error = copier->error();
+            continue;
+         }
+
+         totalRows += copier->rowsWritten();
+         Brewtarget::log.info( QString("%1 : %2 copied %3 rows in %4 ms (%5 rows/s)")
+                                 .arg(Q_FUNC_INFO)
+                                 .arg(copier->table())
+                                 .arg(copier->rowsWritten())
+                                 .arg(copier->elapsed_ms())
+                                 .arg( 1000.0 * copier->rowsWritten() / qMax(Q_INT64_C(1), copier->elapsed_ms()), 0, 'f', 0 ));
+      }
+      qDeleteAll(copiers);
+
+      // Tables already written stay written, as they always have.
+      if ( ! error.isEmpty() ) {
+         Brewtarget::logE( QString("%1 %2").arg(Q_FUNC_INFO).arg(error));
+         throw error;
+      }
    }
+
+   Brewtarget::log.info( QString("%1 : copied %2 rows in %3 ms")
+                           .arg(Q_FUNC_INFO)
+                           .arg(totalRows)
+                           .arg(totalTimer.elapsed()));
 }
 
@@ -41,11 +41,23 @@ class Database;
 #include <QUndoStack>
 #include <QObject>
 #include <QPair>
+#include <QPointer>
 #include <QTableView>
 #include <QSqlError>
 #include <QDebug>
 #include <QRegExp>
 #include <QMap>
+#include <QMutex>
+#include <QSemaphore>
+#include <QTimer>
+#include <QFuture>
+#include <QThread>
+#include <QThreadPool>
+#include "AsyncJob.h"
+#include "ConnectionPool.h"
+#include "QueryProfile.h"
+#include "ReadSnapshot.h"
+#include "TransactionScope.h"
 #include "BeerXMLElement.h"
 #include "brewtarget.h"
 #include "recipe.h"
@@ -64,16 +76,33 @@ class Style;
 class Water;
 class Yeast;
 class QThread;
+class DatabaseBackup;
+class DatabasePurge;
+class RecipeStatsTable;
 
 typedef struct
 {
    QString tableName; // Name of the table.
    QStringList propName; // List of BeerXML column names.
-   std::function<BeerXMLElement*()> newElement;
-
-   // BeerXMLElement* (Database::*newElement)(int); // Function to make a new ingredient in this table.
+   // Makes the object for a row already in this table, and announces it.
+   std::function<void(int)> adoptElement;
 } TableParams;
 
+typedef struct
+{
+   QString tableName;
+   QStringList added;   // Names of the rows the merge adds.
+   QStringList changed; // Names of the rows the merge updates.
+   int unchanged;       // How many rows are already up to date.
+} MergeReport;
+
+typedef struct
+{
+   BeerXMLElement* object;
+   QMetaProperty prop;
+   QVariant value;      // The last value it was given inside the batch.
+} BatchedChange;
+
 /*!
  * \class Database
  * \author Philip G. Lee
@@ -91,6 +120,9 @@ class Database : public QObject
    Q_OBJECT
 
    friend class BtSqlQuery; // This class needs the _thread instance.
+   friend class Testing;
+   friend class ReadSnapshot; // Takes and gives back the reader connections.
+   friend class TransactionScope; // Flushes and drops our caches around its transaction.
 public:
 
    //! This should be the ONLY way you get an instance.
@@ -106,6 +138,23 @@ public:
    //! backs up database to 'dir' in chosen directory
    static bool backupToDir(QString dir, QString filename="");
 
+   /*! \brief Starts an online backup of the database to 'dir'.
+    *
+    * The copy is made a few pages at a time while the app keeps running.
+    * Progress is reported by backupProgress() and the end by backupFinished().
+    * \returns false if the backup could not be started, or if another one
+    * is still running. backupFinished() is not emitted in that case.
+    */
+   bool startBackup(QString dir, QString filename="");
+
+   /*! \brief Starts removing soft-deleted rows for good and compacting the database.
+    *
+    * Works a few rows at a time while the app keeps running, picking up
+    * where an earlier run was stopped. The end is reported by purgeFinished().
+    * \returns false if the purge could not be started, or is already running.
+    */
+   bool startPurge();
+
    //! \brief Reverts database to that of chosen file.
    static bool restoreFromFile(QString newDbFileStr);
 
@@ -120,39 +169,87 @@ public:
    /*! update an entry, and call the notification when complete.
     * NOTE: This cannot be simplified without a bit more work. The inventory
     * needs to specify a table other than the one named by the beerXML element
+    *
+    * Writes from the GUI thread are held back and merged by (table, key,
+    * column). get() sees them right away. They reach the database when the
+    * idle timer fires, when a TransactionScope begins or commits, or when
+    * flush() is called. \b transact forces the write, and anything pending,
+    * out immediately.
     */
    void updateEntry( Brewtarget::DBTable table, int key, const char* col_name, QVariant value, QMetaProperty prop, BeerXMLElement* object, bool notify = true, bool transact = false );
 
-   //! \brief Get the contents of the cell specified by table/key/col_name.
-   QVariant get( Brewtarget::DBTable table, int key, const char* col_name )
-   {
-      QSqlQuery q;
-      QString index = QString("%1_%2").arg(tableNames[table]).arg(col_name);
-
-      if ( ! selectSome.contains(index) ) {
-         QString query = QString("SELECT %1 from %2 WHERE id=:id")
-                           .arg(col_name)
-                           .arg(tableNames[table]);
-         q = QSqlQuery( sqlDatabase() );
-         q.prepare(query);
-         selectSome.insert(index,q);
-      }
-
-      q = selectSome.value(index);
-      q.bindValue(":id", key);
+   /*! \brief Get the contents of the cell specified by table/key/col_name.
+    *
+    * The first read of a row loads every column of it into the row cache.
+    * Later reads of any column in that row are served from memory.
+    */
+   QVariant get( Brewtarget::DBTable table, int key, const char* col_name );
 
-      q.exec();
-      if( !q.next() )
-      {
-         Brewtarget::logE( QString("Database::get(): %1 (%2) %3").arg(q.lastQuery()).arg(col_name).arg(q.lastError().text()));
-         q.finish();
-         return QVariant();
-      }
+   /*! \brief Gives a library ingredient a row of its own in the user database.
+    *
+    * Library rows have negative keys and are read straight from the attached
+    * library. The first write to one, or adding it to a recipe, copies the
+    * row over and gives \b object the new key. Does nothing to user rows.
+    * Throws a QString if the copy fails.
+    */
+   void materialize( BeerXMLElement* object );
+   //! \returns true if the shipped ingredients are served from the attached library.
+   bool libraryAttached() const;
 
-      QVariant ret( q.record().value(col_name) );
-      q.finish();
-      return ret;
-   }
+   /*! \brief Writes everything held back by updateEntry() in one transaction.
+    *
+    * Rows that fail to write are kept and tried again by the next flush().
+    * Throws a QString naming them.
+    */
+   void flush();
+
+   //! \brief Drops every cached row. Use after writes that bypass updateEntry().
+   void invalidateRowCache();
+   //! \brief Drops every cached row of \b table.
+   void invalidateRowCache( Brewtarget::DBTable table );
+   //! \brief Drops the cached row \b key of \b table.
+   void invalidateRowCache( Brewtarget::DBTable table, int key );
+   //! \returns how many get() calls were answered from the row cache.
+   quint64 rowCacheHits() const;
+   //! \returns how many get() calls had to load their row from the database.
+   quint64 rowCacheMisses() const;
+   //! \returns how many statements the statement cache has prepared.
+   quint64 statementPrepares() const;
+   //! \returns how many times statements from the statement cache were run.
+   quint64 statementExecs() const;
+   /*! \returns the calls, time and rows of the statements run so far.
+    * Connection setup, BEGIN and COMMIT, and what the purge, backup and
+    * stats helpers run on their own are left out.
+    */
+   QueryProfile const& queryProfile() const;
+   //! \brief Writes the query profile to \b fileName as JSON when the database is unloaded.
+   static void setProfileFile( QString const& fileName );
+
+   //! \returns true if the SQLite database runs with a write-ahead log.
+   bool walMode() const;
+   //! \returns the time background readers spent waiting for a snapshot, in milliseconds.
+   qint64 readerWait_ms() const;
+   //! \returns the time flushes spent waiting for the write lock, in milliseconds.
+   qint64 writerWait_ms() const;
+
+   /*! \brief Holds back changed() notifications until the matching
+    * endNotificationBatch(). Batches nest; only the outermost one delivers.
+    * Use a NotificationBatch rather than calling these directly.
+    */
+   void beginNotificationBatch();
+   /*! \brief Delivers what the batch held back: each changed property once,
+    * with its last value, then changedBatch().
+    */
+   void endNotificationBatch();
+   //! \returns true while a batch delivers its held back notifications.
+   bool deliveringBatch() const;
+   //! \brief Emits \b object's changed(), or holds it back inside a batch.
+   void notifyChanged( BeerXMLElement* object, QMetaProperty prop, QVariant value = QVariant() );
+   /*! \brief Inside a batch, calls \b slot on \b receiver once, after the
+    * notifications are delivered and before changedBatch().
+    * \returns false outside a batch, where the caller should just do the work.
+    */
+   bool deferToBatchEnd( QObject* receiver, char const* slot );
 
    //! Get a table view.
    QTableView* createView( Brewtarget::DBTable table );
@@ -182,8 +279,15 @@ public:
          throw; // rethrow the error until somebody cares
       }
 
+      return adoptIngredient(all, key);
+   }
+
+   //! Makes the object for row \b key, which is already in the table.
+   template<class T> T* adoptIngredient(QHash<int,T*>* all, int key) {
+      Brewtarget::DBTable table = classNameToTable[ T::classNameStr() ];
       T* tmp = new T(table, key);
       all->insert(tmp->_key,tmp);
+      forgetOnRollback(all, tmp);
 
       return tmp;
    }
@@ -195,7 +299,7 @@ public:
    MashStep* newMashStep(Mash* parent, bool connected = true);
 
    Mash* newMash(Mash* other = 0, bool displace = true);
-   Mash* newMash(Recipe* parent, bool transaction = true);
+   Mash* newMash(Recipe* parent);
 
    Recipe* newRecipe();
    //++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
@@ -206,7 +310,7 @@ public:
    Equipment* newEquipment(Equipment* other = 0);
    Fermentable* newFermentable(Fermentable* other = 0);
    Hop* newHop(Hop* other = 0);
-   //! \returns a copy of the given recipe.
+   //! \returns a copy of the given recipe, and of everything in it, made in one transaction.
    Recipe* newRecipe(Recipe* other);
    /*! \returns a copy of the given mash. Displaces the mash currently in the
     * parent recipe unless \b displace is false.
@@ -219,6 +323,7 @@ public:
    //++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
    /* This links ingredients with the same name.
    * The first displayed ingredient in the database is assumed to be the parent.
+   * Only links that are missing or point at the wrong parent are written.
    */
    void populateChildTablesByName(Brewtarget::DBTable table);
    // Runs populateChildTablesByName for each
@@ -242,6 +347,8 @@ public:
    void duplicateMashSteps(Mash *oldMash, Mash *newMash);
    //! Import ingredients from BeerXML documents.
    bool importFromXML(const QString& filename);
+   //! Import ingredients from an already parsed BeerXML document.
+   bool importFromXML(QDomDocument const& xmlDoc);
 
    //! Get anything by key value.
    Recipe* recipe(int key);
@@ -256,6 +363,8 @@ public:
    // signal corresponding to the appropriate QList
    // of ingredients in rec. If noCopy is true, then don't copy, and set
    // the ingredient's display parameter to 0 (don't display in lists).
+   // Each runs in its own TransactionScope. transact false leaves the
+   // recalculation to the caller, who is adding more.
    void addToRecipe( Recipe* rec, Equipment* e, bool noCopy = false, bool transact = true );
    void addToRecipe( Recipe* rec, Hop* hop, bool noCopy = false, bool transact = true);
    void addToRecipe( Recipe* rec, Fermentable* ferm, bool noCopy = false, bool transact = true);
@@ -369,7 +478,9 @@ public:
    Q_PROPERTY( QList<Water*> waters READ waters /*WRITE*/ NOTIFY changed STORED false )
    Q_PROPERTY( QList<Yeast*> yeasts READ yeasts /*WRITE*/ NOTIFY changed STORED false )
 
-   // Returns non-deleted BeerXMLElements.
+   /* Returns non-deleted BeerXMLElements. Brew notes are loaded one recipe
+    * at a time, so brewNotes() loads every recipe's notes. Avoid it.
+    */
    QList<BrewNote*> brewNotes();
    QList<Equipment*> equipments();
    QList<Fermentable*> fermentables();
@@ -382,8 +493,16 @@ public:
    QList<Water*> waters();
    QList<Yeast*> yeasts();
 
-   //! \b returns a list of the brew notes in a recipe.
+   //! \b returns a list of the brew notes in a recipe, loading them if needed.
    QList<BrewNote*> brewNotes(Recipe const* parent);
+   //! \returns how many brew notes \b parent has, without loading them.
+   int brewNoteCount(Recipe const* parent);
+   /*! Keep the brew notes of \b parent loaded until releaseBrewNotes().
+    * Anything that holds on to brew note pointers past the current event
+    * needs this, since unused notes are unloaded once over budget.
+    */
+   void holdBrewNotes(Recipe const* parent);
+   void releaseBrewNotes(Recipe const* parent);
    //! Return a list of all the fermentables in a recipe.
    QList<Fermentable*> fermentables(Recipe const* parent);
    //! Return a list of all the hops in a recipe.
@@ -425,9 +544,13 @@ public:
 
    /*!
     * Updates the brewtarget-provided ingredients from the given sqlite
-    * database file.
+    * database file. The changes are worked out per table with one join,
+    * then applied in a single transaction.
+    *
+    * \param dryRun if true, only work out what would change.
+    * \returns what changed, or would change, in each table.
     */
-   void updateDatabase(QString const& filename);
+   QList<MergeReport> updateDatabase(QString const& filename, bool dryRun = false);
    void convertFromXml();
 
    bool isConverted();
@@ -440,6 +563,46 @@ public:
 
    void updateColumns(Brewtarget::DBTable table, int key, const QVariantMap& colValMap);
 
+   // Asynchronous variants ====================================================
+   /* These return right away. The work runs on the database worker thread,
+    * which has its own connection. Use whenFinished() to pick the result up
+    * on the GUI thread.
+    */
+   /*! Only sees the brew notes already loaded. They stay loaded until the
+    * result has been delivered, and the worker never sees the notes themselves.
+    */
+   QFuture< QList<BrewNote*> > brewNotesAsync();
+   QFuture< QList<Equipment*> > equipmentsAsync();
+   QFuture< QList<Fermentable*> > fermentablesAsync();
+   QFuture< QList<Hop*> > hopsAsync();
+   QFuture< QList<Mash*> > mashsAsync();
+   QFuture< QList<MashStep*> > mashStepsAsync();
+   QFuture< QList<Misc*> > miscsAsync();
+   QFuture< QList<Recipe*> > recipesAsync();
+   QFuture< QList<Style*> > stylesAsync();
+   QFuture< QList<Water*> > watersAsync();
+   QFuture< QList<Yeast*> > yeastsAsync();
+   /*! The stats of every recipe, read from a snapshot of the database and
+    * calculated on the thread pool. The table is empty if it failed.
+    */
+   QFuture<RecipeStatsTable> recipeStatsAsync();
+
+   /*! \returns false if the write failed. The write is never held back.
+    * \b object hears about it on the GUI thread, before the future finishes.
+    */
+   QFuture<bool> updateEntryAsync( Brewtarget::DBTable table, int key, const char* col_name, QVariant value, QMetaProperty prop, BeerXMLElement* object, bool notify = true );
+   /*! The file is read, parsed and written to the database on the worker,
+    * in one transaction. The objects for the new rows are made back on the
+    * GUI thread, which owns them, and announced from there.
+    */
+   QFuture<bool> importFromXMLAsync( QString const& filename );
+   //! Finishes when the online backup started by startBackup() does.
+   QFuture<bool> backupToDirAsync( QString dir, QString filename="" );
+   //! \returns false if the conversion failed.
+   QFuture<bool> convertDatabaseAsync( QString const& Hostname, QString const& DbName,
+                                       QString const& Username, QString const& Password,
+                                       int Portnum, Brewtarget::DBTypes newType );
+
 signals:
    void changed(QMetaProperty prop, QVariant value);
    void newEquipmentSignal(Equipment*);
@@ -469,9 +632,40 @@ signals:
    // MashSteps need signals too
    void newMashStepSignal(MashStep*);
 
+   //! Emitted as an online backup progresses.
+   void backupProgress(int pagesDone, int pageCount);
+   //! Emitted when an online backup has completed or failed.
+   void backupFinished(bool success, QString fileName);
+
+   //! Emitted as a purge progresses.
+   void purgeProgress(int stepsDone, int stepCount);
+   //! Emitted when a purge has completed or failed, with the rows removed and bytes given back.
+   void purgeFinished(bool success, int rows, qint64 bytes);
+
+   //! Emitted the first time held-back writes fail to save. They are kept and tried again.
+   void writesFailed(QString error);
+
+   //! Emitted just before the brew notes of \b parent are unloaded and deleted.
+   void brewNotesUnloading(Recipe* parent);
+
+   //! Emitted once per NotificationBatch, with everything that changed in it.
+   void changedBatch(QList<BatchedChange> changes);
+
 private slots:
    //! Load database from file.
    bool load();
+   //! Writes pending updates once the app has been idle for a moment.
+   void flushOnIdle();
+   //! Runs a backup every "interval" minutes while the app is open.
+   void scheduledBackup();
+   //! Starts the purge that load() found due.
+   void scheduledPurge();
+   //! Moves the write-ahead log into the database, if nothing was written since last time.
+   void checkpointOnIdle();
+   //! Unloads the least recently used brew notes until we are within budget.
+   void evictBrewNotes();
+   //! Lets go of the pages the oldest finished brewNotesAsync() held.
+   void releaseAsyncBrewNotes();
 
 private:
    static Database* dbInstance; // The singleton object
@@ -504,9 +698,14 @@ private:
    static QHash<Brewtarget::DBTable,Brewtarget::DBTable> tableToInventoryTableHash();
    static QHash<QThread*,QString> threadToDbCon; // Each thread should use a distinct database connection.
 
-   // Each thread should have its own connection to QSqlDatabase.
-   static QHash< QThread*, QString > _threadToConnection;
+   // Each thread should have its own connection to QSqlDatabase. The pool
+   // closes them as their threads exit. The mutex holds everybody off until
+   // load() has opened the first one.
+   static ConnectionPool _connectionPool;
    static QMutex _threadToConnectionMutex;
+   // The read-only connections handed out by ReadSnapshot, also one per
+   // thread. Guarded by _threadToConnectionMutex.
+   static QHash< QThread*, QString > _threadToReader;
 
    // Instance variables.
    bool loadWasSuccessful;
@@ -519,6 +718,30 @@ private:
    bool loadPgSQL();
 
    QHash< int, BrewNote* > allBrewNotes;
+   /* Brew notes are loaded per recipe. _brewNotePages maps a loaded recipe to
+    * its live notes, and _brewNoteLru lists the loaded recipes, least
+    * recently used first. Recipes not loaded only have a count. All of this
+    * belongs to the GUI thread, which owns the notes.
+    */
+   QHash< int, QList<int> > _brewNotePages;
+   QHash< int, qint64 > _brewNotePageBytes;
+   QHash< int, int > _brewNoteRecipe;
+   QHash< int, int > _brewNoteCounts;
+   QHash< int, int > _brewNoteHolds;
+   // The recipes each running brewNotesAsync() holds, oldest job first.
+   QList< QList<int> > _asyncBrewNoteHolds;
+   QList<int> _brewNoteLru;
+   qint64 _brewNoteBytes;
+   qint64 _brewNoteBudget;
+   QTimer _brewNoteEvictTimer;
+   quint64 _brewNotePageLoads;
+   quint64 _brewNotePageEvictions;
+   //! Counts the live brew notes of every recipe, without loading any.
+   void populateBrewNoteCounts();
+   //! \returns the brew notes of recipe \b recipeKey, loading them if needed.
+   QList<int> const& loadBrewNotes( int recipeKey );
+   //! Files the new brew note \b note under recipe \b recipeKey.
+   void adoptBrewNote( int recipeKey, BrewNote* note );
    QHash< int, Equipment* > allEquipments;
    QHash< int, Fermentable* > allFermentables;
    QHash< int, Hop* > allHops;
@@ -531,17 +754,317 @@ private:
    QHash< int, Water* > allWaters;
    QHash< int, Yeast* > allYeasts;
 //   QHash<Brewtarget::DBTable,QSqlQuery> selectAll;
-   QHash<QString,QSqlQuery> selectSome;
+   /* Prepared statements, keyed by connection name and then by the statement
+    * text. Statements only ever hold identifiers in their text; values are
+    * bound, so one entry serves every key.
+    */
+   QHash< QString, QHash<QString,QSqlQuery> > _statementCache;
+   mutable QMutex _statementCacheMutex;
+   quint64 _statementPrepares;
+   quint64 _statementExecs;
+   /*! \returns \b sql prepared on the calling thread's connection, or on
+    * \b db if given. It is only prepared the first time the connection sees it.
+    */
+   QSqlQuery preparedQuery( QString const& sql, QSqlDatabase db = QSqlDatabase() );
+   /*! Binds \b values in order and runs \b q, which came from preparedQuery().
+    * If the server went away, the connection is reopened, and an
+    * \b idempotent query, such as a read, is run again on it.
+    */
+   bool execPrepared( QSqlQuery& q, QVariantList const& values = QVariantList(), bool idempotent = false );
+   //! Runs \b sql, or \b q itself if empty, and profiles it. For text with its values written in.
+   bool execProfiled( QSqlQuery& q, QString const& sql = QString() );
+
+   // Every statement run through the above, and where to write it at the end.
+   QueryProfile _queryProfile;
+   static QString _profileFileName;
+   // Statements slower than this go to the log.
+   int _slowQuery_ms;
+   //! Records a run of \b q. \b literal if its text has values in it.
+   void profileQuery( QSqlQuery const& q, qint64 elapsed_ns, bool literal );
+   /*! Adds the \b rows read from \b q, for drivers that cannot tell
+    * beforehand. \b literal as for the profileQuery() that ran it.
+    */
+   void profileRows( QSqlQuery const& q, int rows, bool literal = false );
+
+   // Row cache used by get(). Maps table -> key -> lower case column name -> value.
+   QHash< Brewtarget::DBTable, QHash< int, QHash<QString,QVariant> > > _rowCache;
+   mutable QMutex _rowCacheMutex;
+   quint64 _rowCacheHits;
+   quint64 _rowCacheMisses;
+   // Writes held back by updateEntry(). Maps table -> key -> column -> value.
+   // Only touched from the thread that owns the Database.
+   QHash< Brewtarget::DBTable, QHash< int, QHash<QString,QVariant> > > _pendingWrites;
+   /* Writes that failed outside any TransactionScope. Only flush() tries
+    * them again, so one bad row cannot sink a scope it has nothing to do
+    * with. get() still sees them, since they are what the user typed.
+    */
+   QHash< Brewtarget::DBTable, QHash< int, QHash<QString,QVariant> > > _failedWrites;
+   // True once flushOnIdle() has told the user about _failedWrites.
+   bool _writeFailureReported;
+   QTimer _flushTimer;
+   /*! Runs the pending writes. Each row becomes a single UPDATE.
+    * \param transact if true, wrap them in their own transaction. False
+    *        when we may already be inside a caller's transaction.
+    *
+    * Inside a TransactionScope, rows that fail are dropped with the scope.
+    * Outside one, they go to _failedWrites, and those are tried again too.
+    */
+   void flushPendingWrites( bool transact );
+   //! Throws away the pending writes, and the cached rows they went into.
+   void discardPendingWrites();
+   /*! Writes what is held back for \b table before a query reads it. Rows
+    * that fail are logged and kept, so the read itself never throws for them.
+    */
+   void flushForRead( Brewtarget::DBTable table );
+
+   // Runs the asynchronous calls. It has a single thread that never expires,
+   // so the connection sqlDatabase() gives it is kept for the next job.
+   QThreadPool _executor;
+   //! Queue \b job on the worker thread. If it throws, the future gets \b failed.
+   template<class T> QFuture<T> runAsync( std::function<T()> job, T const& failed = T() )
+   {
+      // The worker has to see the writes we are holding back. The rows that
+      // will not go are still there for the next flush.
+      if ( QThread::currentThread() == thread() ) {
+         try {
+            flush();
+         }
+         catch (QString e) {
+            Brewtarget::logW( QString("%1 : %2").arg(Q_FUNC_INFO).arg(e));
+         }
+      }
+
+      // Jobs hold a lease while they run, so only so many at a time keep
+      // connections busy.
+      AsyncJob<T>* asyncJob = new AsyncJob<T>( [job]() {
+         ConnectionLease lease(_connectionPool);
+         return job();
+      }, failed);
+      QFuture<T> future = asyncJob->future();
+      _executor.start(asyncJob);
+      return future;
+   }
+   //! Async getElements(). \b allElements is copied here, so the worker never reads the live hash.
+   template<class T> QFuture< QList<T*> > elementsAsync( QString filter, Brewtarget::DBTable table, QHash<int,T*> const& allElements )
+   {
+      QHash<int,T*> all = allElements;
+      return runAsync< QList<T*> >( [this, filter, table, all]() {
+         ReadSnapshot snapshot;
+         QList<T*> tmp;
+         getElements( tmp, filter, table, all, QString(), QVariantList(), snapshot.database() );
+         appendLibraryRows( tmp, all );
+         return tmp;
+      });
+   }
+   //! Closes the calling thread's connections. Used to let the worker go.
+   static void releaseConnection();
+
+   /* Write-ahead log mode. Only ever on for SQLite. Background threads read
+    * through at most _readerSlots read-only connections at a time, and the
+    * log is checkpointed by _checkpointTimer once writes have stopped.
+    */
+   bool _walMode;
+   QSemaphore _readerSlots;
+   QTimer _checkpointTimer;
+   quint64 _execsAtLastCheckpoint;
+   mutable QMutex _waitMutex;
+   qint64 _readerWait_ms;
+   qint64 _writerWait_ms;
+   quint64 _snapshots;
+   quint64 _checkpoints;
+   /*! \returns the calling thread's read-only connection, inside a read
+    * transaction so it stays on one snapshot. Blocks while every reader is
+    * taken. Only for WAL mode.
+    */
+   QSqlDatabase acquireReader();
+   //! Ends the snapshot on \b reader and lets the next thread have it.
+   void releaseReader( QSqlDatabase reader );
+   //! Runs a wal_checkpoint in \b mode. \returns false if it could not finish.
+   bool checkpoint( QString const& mode );
+
+   // Notifications held back by beginNotificationBatch(). Only touched from
+   // the thread that owns the Database.
+   int _batchDepth;
+   bool _deliveringBatch;
+   QList<BatchedChange> _batchedChanges;
+   // (object, property index) -> position in _batchedChanges.
+   QHash< QPair<BeerXMLElement*,int>, int > _batchedChangeIndex;
+   QList< QPair< QPointer<QObject>, QByteArray > > _deferredCalls;
+   //! Reads and parses a BeerXML file. \returns false if it cannot be read.
+   static bool loadXml( QString const& filename, QDomDocument& xmlDoc );
+
+   // The online backup in progress, if any, and the timer that schedules them.
+   DatabaseBackup* _runningBackup;
+   QTimer _backupTimer;
+   // The purge in progress, if any.
+   DatabasePurge* _runningPurge;
+   //! \returns a file name ending in \b suffix that no other backup in \b backupDir is using.
+   static QString uniqueBackupName( QString const& backupDir, QString const& suffix = QString() );
+   //! Adds the database file \b fileName to the incremental store in \b backupDir and logs the savings.
+   static bool storeBackup( QString const& backupDir, QString const& fileName, QString const& manifestName );
+
+   /*! Splits \b tables into waves for copyDatabase(). No table refers to
+    * another in its own wave or a later one, so a wave can be written in
+    * parallel once the waves before it are done.
+    */
+   QList<QStringList> copyWaves( QSqlDatabase newDb, Brewtarget::DBTypes newType, QStringList const& tables );
+   /*! Reads \b table through a connection of its own, opened like \b oldDb,
+    * and hands the rows to a TableCopier writing into \b newDb. Meant for a
+    * worker thread, so the tables of a wave are read side by side.
+    * \returns the copier, closed and still writing, or 0 if there were no
+    *          rows. A failed read goes into \b error.
+    */
+   TableCopier* readForCopy( QString const& table, QSqlDatabase const& oldDb, QSqlDatabase const& newDb,
+                             Brewtarget::DBTypes newType, QString* error );
+   //! Adds \b newName to the list of backups, deleting the oldest beyond \b maxBackups.
+   static void recordBackup( QString const& backupDir, QString const& newName, int maxBackups );
+
+   // Time spent loading rows on a cache miss, in milliseconds.
+   qint64 _rowCacheMissTime_ms;
+   //! Puts every column of \b rec into the row cache as row \b key of \b table.
+   void cacheRow( Brewtarget::DBTable table, int key, QSqlRecord const& rec );
+   //! Writes \b value into the cached row, if that row is cached.
+   void writeRowCache( Brewtarget::DBTable table, int key, QString const& col_name, QVariant const& value );
+
+   /* Recipe to ingredient adjacency index. Maps an ingredient table to
+    * recipe key -> ingredient keys, in the order they were added. Only the
+    * tables in indexedInRecipeTables are kept here.
+    */
+   QHash< Brewtarget::DBTable, QHash< int, QList<int> > > _recipeIndex;
+   mutable QMutex _recipeIndexMutex;
+   static QHash<Brewtarget::DBTable,Brewtarget::DBTable> indexedInRecipeTables;
+   static QHash<Brewtarget::DBTable,Brewtarget::DBTable> indexedInRecipeTablesHash();
+   //! Reads every *_in_recipe table into the adjacency index.
+   void populateRecipeIndex();
+   //! Links \b ingKey in \b table to recipe \b recKey in the index.
+   void recipeIndexAdd( Brewtarget::DBTable table, int recKey, int ingKey );
+   //! Unlinks \b ingKey in \b table from recipe \b recKey in the index.
+   void recipeIndexRemove( Brewtarget::DBTable table, int recKey, int ingKey );
+   //! Puts \b recKey's links in \b table back as they are now, if the scope rolls back.
+   void undoRecipeIndexOnRollback( Brewtarget::DBTable table, int recKey );
+
+   //! Looks up the ingredients of \b table in recipe \b recKey. No SQL involved.
+   template <class T> QList<T*> recipeIndexLookup( Brewtarget::DBTable table, int recKey, QHash<int,T*> const& allElements ) const
+   {
+      QList<T*> ret;
+      QMutexLocker locker(&_recipeIndexMutex);
+
+      foreach( int key, _recipeIndex.value(table).value(recKey) )
+      {
+         if ( allElements.contains(key) )
+            ret.append( allElements[key] );
+      }
+      return ret;
+   }
+
+   /* Inventory lookups. _parentOf maps an ingredient table to child key ->
+    * parent key, mirroring the *_children tables. _inventoryOf maps it to
+    * parent key -> inventory row key, mirroring the *_in_inventory tables.
+    */
+   QHash< Brewtarget::DBTable, QHash<int,int> > _parentOf;
+   QHash< Brewtarget::DBTable, QHash<int,int> > _inventoryOf;
+   mutable QMutex _inventoryIndexMutex;
+   //! Reads the children and inventory tables into the inventory lookups.
+   void populateInventoryIndex();
+
+   /* The ingredient library. With the ingredientLibrary option, the shipped
+    * database is attached read-only to every connection as "library",
+    * instead of being copied into the user's. _libraryColumns lists, per
+    * ingredient table, the columns both have. Library rows are served with
+    * key -(library id), unless the user has a row of the same name.
+    */
+   bool _libraryAttached;
+   QString _libraryFileName;
+   QHash< Brewtarget::DBTable, QStringList > _libraryColumns;
+   quint64 _libraryRows;
+   quint64 _libraryCopies;
+   //! Attaches \b fileName as the library and loads its rows. Throws a QString if it cannot.
+   void attachLibrary( QString const& fileName );
+   //! Attaches the library to \b db. Throws a QString if it cannot.
+   void attachLibraryTo( QSqlDatabase db );
+
+   //! Adds the library rows of \b table not hidden by one of ours to \b hash. \returns how many.
+   template <class T> int populateLibrary( QHash<int,T*>& hash, Brewtarget::DBTable table )
+   {
+      int rows = 0;
+      QSqlQuery q(sqlDatabase());
+      q.setForwardOnly(true);
+      // A row of ours with the same name, even a deleted one, hides it.
+      QString queryString = QString("SELECT l.* FROM library.%1 l WHERE l.display=%2 AND l.deleted=%3 "
+                                    "AND NOT EXISTS ( SELECT 1 FROM %1 u WHERE u.name = l.name )")
+                               .arg(tableNames[table])
+                               .arg(Brewtarget::dbTrue())
+                               .arg(Brewtarget::dbFalse());
+
+      try {
+         if ( ! q.exec(queryString) )
+            throw QString("%1 %2").arg(queryString).arg(q.lastError().text());
+      }
+      catch (QString e) {
+         Brewtarget::logE( QString("%1 %2").arg(Q_FUNC_INFO).arg(e));
+         q.finish();
+         throw;
+      }
+
+      while( q.next() )
+      {
+         QSqlRecord rec = q.record();
+         int key = -rec.value("id").toInt();
+         rec.setValue("id", key);
+         ++rows;
+
+         cacheRow(table, key, rec);
+         if( ! hash.contains(key) )
+            hash.insert(key, new T(table, key));
+      }
+
+      q.finish();
+      return rows;
+   }
+
+   /*! Appends the library rows in \b allElements to \b list. They are never
+    * deleted: deleting one writes to it, which gives it a row of ours.
+    */
+   template <class T> static void appendLibraryRows( QList<T*>& list, QHash<int,T*> const& allElements )
+   {
+      typename QHash<int,T*>::const_iterator i;
+      for( i = allElements.constBegin(); i != allElements.constEnd(); ++i )
+      {
+         if ( i.key() < 0 )
+            list.append( i.value() );
+      }
+   }
+
+   //! Moves the object at \b oldKey in \b hash to \b newKey.
+   template <class T> void rekey( QHash<int,T*>& hash, int oldKey, int newKey )
+   {
+      T* obj = hash.take(oldKey);
+      if ( obj )
+         hash.insert(newKey, obj);
+   }
+   //! Moves \b object, its cached row and its all* entry over to \b newKey.
+   void rekeyObject( BeerXMLElement* object, int newKey );
+   //! Records \b parentKey as the parent of \b childKey in \b table.
+   void setParentID( Brewtarget::DBTable table, int childKey, int parentKey );
+   //! Puts \b key's entry for \b table in \b index back as it is now, if the scope rolls back.
+   void undoInventoryIndexOnRollback( QHash< Brewtarget::DBTable, QHash<int,int> >* index, Brewtarget::DBTable table, int key );
 
    //! Get the right database connection for the calling thread.
    static QSqlDatabase sqlDatabase();
 
-   //! Helper to populate all* hashes. T should be a BeerXMLElement subclass.
-   template <class T> void populateElements( QHash<int,T*>& hash, Brewtarget::DBTable table )
+   /*! Helper to populate all* hashes. T should be a BeerXMLElement subclass.
+    * \param hydrate if true, read every column in the same pass and put
+    *        each row into the row cache.
+    * \returns the number of rows read.
+    */
+   template <class T> int populateElements( QHash<int,T*>& hash, Brewtarget::DBTable table, bool hydrate = false )
    {
+      int rows = 0;
       QSqlQuery q(sqlDatabase());
       q.setForwardOnly(true);
-      QString queryString = QString("SELECT id FROM %1").arg(tableNames[table]);
+      QString queryString = QString("SELECT %1 FROM %2")
+                               .arg( hydrate ? "*" : "id" )
+                               .arg(tableNames[table]);
       q.prepare( queryString );
 
       try {
@@ -556,21 +1079,27 @@ private:
 
       while( q.next() )
       {
-         int key = q.record().value("id").toInt();
+         QSqlRecord rec = q.record();
+         int key = rec.value("id").toInt();
+         ++rows;
+
+         if ( hydrate )
+            cacheRow(table, key, rec);
 
-         T* e = new T(table, key);
          if( ! hash.contains(key) )
-            hash.insert(key, e);
+            hash.insert(key, new T(table, key));
       }
 
       q.finish();
+      return rows;
    }
 
-   //! Helper to populate the list using the given filter.
-   template <class T> bool getElements( QList<T*>& list, QString filter, Brewtarget::DBTable table, QHash<int,T*> allElements, QString id=QString("") )
+   /*! Helper to populate the list using the given filter.
+    * \param bindValues are bound, in order, to the ? placeholders in \b filter.
+    * \param db is the connection to read from, if not the thread's own.
+    */
+   template <class T> bool getElements( QList<T*>& list, QString filter, Brewtarget::DBTable table, QHash<int,T*> allElements, QString id=QString(""), QVariantList const& bindValues = QVariantList(), QSqlDatabase db = QSqlDatabase() )
    {
-      QSqlQuery q(sqlDatabase());
-      q.setForwardOnly(true);
       QString queryString;
 
       if ( id.isEmpty() )
@@ -581,8 +1110,14 @@ private:
       else
          queryString = QString("SELECT %1 as id FROM %2").arg(id).arg(tableNames[table]);
 
+      // The filter reads the table itself, so it has to see what we hold back.
+      if ( ! db.isValid() )
+         flushForRead(table);
+
+      QSqlQuery q = preparedQuery(queryString, db);
+
       try {
-         if ( ! q.exec(queryString) )
+         if ( ! execPrepared(q, bindValues, true) )
             throw QString("could not execute query: %2 : %3").arg(queryString).arg(q.lastError().text());
       }
       catch (QString e) {
@@ -591,13 +1126,16 @@ private:
          throw;
       }
 
+      int rows = 0;
       while( q.next() )
       {
          int key = q.record().value("id").toInt();
          if( allElements.contains(key) )
             list.append( allElements[key] );
+         ++rows;
       }
 
+      profileRows(q, rows);
       q.finish();
       return true;
    }
@@ -611,18 +1149,68 @@ private:
    void fromXml(BeerXMLElement* element, QHash<QString,QString> const& xmlTagsToProperties, QDomNode const& elementNode);
 
    // Import from BeerXML =====================================================
-   BrewNote* brewNoteFromXml( QDomNode const& node, Recipe* parent );
-   Equipment* equipmentFromXml( QDomNode const& node, Recipe* parent = 0 );
-   Fermentable* fermentableFromXml( QDomNode const& node, Recipe* parent = 0 );
-   Hop* hopFromXml( QDomNode const& node, Recipe* parent = 0 );
-   Instruction* instructionFromXml( QDomNode const& node, Recipe* parent );
-   Mash* mashFromXml( QDomNode const& node, Recipe* parent = 0 );
-   MashStep* mashStepFromXml( QDomNode const& node, Mash* parent );
-   Misc* miscFromXml( QDomNode const& node, Recipe* parent = 0 );
-   Recipe* recipeFromXml( QDomNode const& node );
-   Style* styleFromXml( QDomNode const& node, Recipe* parent = 0 );
-   Water* waterFromXml( QDomNode const& node, Recipe* parent = 0 );
-   Yeast* yeastFromXml( QDomNode const& node, Recipe* parent = 0 );
+   /*! What fromXml() cannot do by itself, like the enums. fillRow() runs
+    * these after it.
+    */
+   void extrasFromXml( Equipment* equip, QDomNode const& node );
+   void extrasFromXml( Fermentable* ferm, QDomNode const& node );
+   void extrasFromXml( Hop* hop, QDomNode const& node );
+   void extrasFromXml( MashStep* step, QDomNode const& node );
+   void extrasFromXml( Misc* misc, QDomNode const& node );
+   void extrasFromXml( Style* style, QDomNode const& node );
+   void extrasFromXml( Yeast* yeast, QDomNode const& node );
+   template<class T> void extrasFromXml( T*, QDomNode const& ) {}
+
+   /* There is one import. importFromXML() and importFromXMLAsync() both run
+    * importRows() on the worker, which writes rows only, on its own
+    * connection. Once the rows are committed, adoptImported() makes the
+    * objects on the GUI thread, the way newRecipe(Recipe*) does for its
+    * copies.
+    */
+   struct ImportedRows
+   {
+      ImportedRows() : recipe(0), brewNotes(0), valid(true) {}
+
+      //! New rows, which need objects.
+      QHash< Brewtarget::DBTable, QList<int> > created;
+      //! The new recipe, or 0 for an element imported by itself.
+      int recipe;
+      //! Rows put into the recipe's *_in_recipe tables, and their parents.
+      QHash< Brewtarget::DBTable, QList<int> > linked;
+      QHash< Brewtarget::DBTable, QList<int> > parents;
+      int brewNotes;
+      bool valid;
+   };
+   //! One entry per recipe, or per element when there are no recipes.
+   QList<ImportedRows> importRows( QDomDocument const& xmlDoc );
+   void importRecipeRows( QDomNode const& node, ImportedRows& rows );
+   //! \returns the row \b node went into, which may be an old one.
+   int importRow( Brewtarget::DBTable table, QDomNode const& node, ImportedRows& rows, int recipeKey = 0 );
+   int importMashRows( QDomNode const& node, ImportedRows& rows, int recipeKey = 0 );
+   //! Puts \b key in \b recipeKey the way addToRecipe() does with noCopy.
+   void linkImportedRow( Brewtarget::DBTable table, int recipeKey, int key, ImportedRows& rows );
+   int insertDefaultRow( Brewtarget::DBTable table );
+   //! \returns the first row called \b name that is not deleted, or 0.
+   int rowByName( Brewtarget::DBTable table, QString const& name, bool like = false );
+   //! \returns false if there was nothing, or any of it was not valid.
+   bool adoptImported( QList<ImportedRows> const& results );
+   void adoptImported( ImportedRows const& rows );
+   //! Hooks \b rec up to the changes of its ingredients, equipment and mash.
+   void connectRecipe( Recipe* rec );
+   //! Hooks \b m up to the changes of its steps.
+   void connectMash( Mash* m );
+   /*! Fills row \b key from \b node. The element's own setters do the
+    * converting, on a stand-in that is never registered and never signals.
+    * \returns false if the element was not valid.
+    */
+   template<class T> bool fillRow( int key, QDomNode const& node )
+   {
+      T tmp( classNameToTable.value(T::classNameStr()), key );
+      tmp.blockSignals(true);
+      fromXml( &tmp, T::tagToProp, node );
+      extrasFromXml( &tmp, node );
+      return tmp.isValid();
+   }
    //++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
 
    //! Hidden constructor.
@@ -660,18 +1248,20 @@ private:
     *               add the ingredient directly.
     * \param keyHash if not null, add the new (key, \c ing) pair to it
     * \param doNotDisplay if true (default), calls \c setDisplay(\c false) on the new ingredient
-    * \returns the new ingredient.
+    * \returns the new ingredient. Runs in its own TransactionScope, so
+    *          callers wanting several of these to stick together open one
+    *          of their own around them.
     */
    template<class T> T* addIngredientToRecipe(
       Recipe* rec,
       BeerXMLElement* ing,
       bool noCopy = false,
       QHash<int,T*>* keyHash = 0,
-      bool doNotDisplay = true,
-      bool transact = true
+      bool doNotDisplay = true
    )
    {
       T* newIng = 0;
+      bool indexed = false;
       QString propName, relTableName, ingKeyName, childTableName;
       const QMetaObject* meta = ing->metaObject();
       int ndx = meta->indexOfClassInfo("signal");
@@ -679,10 +1269,12 @@ private:
       if( rec == 0 || ing == 0 )
          return 0;
 
-      // TRANSACTION BEGIN, but only if requested. Yeah. Had to go there.
-      if ( transact ) {
-         sqlDatabase().transaction();
-      }
+      // Recipes only ever point at rows of ours.
+      materialize(ing);
+
+      // Inside a caller's scope this is only a savepoint, so we can always
+      // have our own.
+      TransactionScope scope;
       // Queries have to be created inside transactional boundaries
 
       QSqlQuery q(sqlDatabase());
@@ -697,12 +1289,11 @@ private:
          else
             throw QString("could not locate classInfo for signal on %2").arg(meta->className());
          // Ensure this ingredient is not already in the recipe.
-         QString select = QString("SELECT recipe_id from %1 WHERE %2=%3 AND recipe_id=%4")
+         QString select = QString("SELECT recipe_id from %1 WHERE %2=? AND recipe_id=?")
                               .arg(relTableName)
-                              .arg(ingKeyName)
-                              .arg(ing->_key)
-                              .arg(reinterpret_cast<BeerXMLElement*>(rec)->_key);
-         if (! q.exec(select) )
+                              .arg(ingKeyName);
+         q = preparedQuery(select);
+         if (! execPrepared(q, QVariantList() << ing->_key << reinterpret_cast<BeerXMLElement*>(rec)->_key) )
             throw QString("Couldn't execute search");
 
          if( q.next() )
@@ -726,19 +1317,18 @@ private:
          }
 
          // Put this (ing,rec) pair in the <ing_type>_in_recipe table.
-         q.setForwardOnly(true);
-
-         QString insert = QString("INSERT INTO %1 (%2, recipe_id) VALUES (:ingredient, :recipe)")
+         QString insert = QString("INSERT INTO %1 (%2, recipe_id) VALUES (?, ?)")
                   .arg(relTableName)
                   .arg(ingKeyName);
 
-         q.prepare(insert);
-         q.bindValue(":ingredient", newIng->key());
-         q.bindValue(":recipe", rec->_key);
-
-         if ( ! q.exec() )
+         q = preparedQuery(insert);
+         if ( ! execPrepared(q, QVariantList() << newIng->key() << rec->_key) )
             throw QString("%2 : %1.").arg(q.lastQuery()).arg(q.lastError().text());
 
+         // The index has to be current before anybody hears about the change.
+         recipeIndexAdd( classNameToTable[meta->className()], rec->_key, newIng->key() );
+         indexed = true;
+
          emit rec->changed( rec->metaProperty(propName), QVariant() );
 
          q.finish();
@@ -758,24 +1348,21 @@ private:
              *   Else if fails due to a foreign key constrain.
              */
             int key = ing->key();
-            q.prepare(QString("SELECT parent_id FROM %1 WHERE child_id=%2")
-                  .arg(childTableName)
-                  .arg(key));
-            if (q.exec() && q.next())
+            q = preparedQuery(QString("SELECT parent_id FROM %1 WHERE child_id=?")
+                  .arg(childTableName));
+            if (execPrepared(q, QVariantList() << key, true) && q.next())
             {
                key = q.record().value("parent_id").toInt();
             }
             q.finish();
 
-            insert = QString("INSERT INTO %1 (parent_id, child_id) VALUES (:parent, :child)")
+            insert = QString("INSERT INTO %1 (parent_id, child_id) VALUES (?, ?)")
                   .arg(childTableName);
 
-            q.prepare(insert);
-            q.bindValue(":parent", key);
-            q.bindValue(":child", newIng->key());
-
-            if ( ! q.exec() )
+            q = preparedQuery(insert);
+            if ( ! execPrepared(q, QVariantList() << key << newIng->key()) )
                throw QString("%1 %2.").arg(q.lastQuery()).arg(q.lastError().text());
+            setParentID( classNameToTable[meta->className()], newIng->key(), key );
 
             emit rec->changed( rec->metaProperty(propName), QVariant() );
          }
@@ -783,13 +1370,12 @@ private:
       catch (QString e) {
          Brewtarget::logE( QString("%1 %2").arg(QString("Q_FUNC_INFO")).arg(e));
          q.finish();
-         if ( transact )
-            sqlDatabase().rollback();
+         if ( indexed )
+            recipeIndexRemove( classNameToTable[meta->className()], rec->_key, newIng->key() );
          throw;
       }
       q.finish();
-      if ( transact )
-         sqlDatabase().commit();
+      scope.commit();
 
       return newIng;
    }
@@ -815,12 +1401,17 @@ private:
 
       QString tName = tableNames[t];
 
+      // The copy gets the original as its parent, so that has to be ours.
+      // Only the key changes, which is why a const object will do.
+      if ( object->_key < 0 )
+         materialize( const_cast<BeerXMLElement*>(object) );
+
       QSqlQuery q(sqlDatabase());
 
       try {
          QString select = QString("SELECT * FROM %1 WHERE id = %2").arg(tName).arg(object->_key);
 
-         if( !q.exec(select) )
+         if( !execProfiled(q, select) )
             throw QString("%1 %2").arg(q.lastQuery()).arg(q.lastError().text());
          else 
             q.next();
@@ -867,7 +1458,7 @@ private:
                insert.bindValue(QString(":%1").arg(name), val);
          }
 
-         if (! insert.exec() )
+         if (! execProfiled(insert) )
             throw QString("could not execute %1 : %2").arg(insert.lastQuery()).arg(insert.lastError().text());
 
          newKey = insert.lastInsertId().toInt();
@@ -886,6 +1477,69 @@ private:
       return newOne;
    }
 
+   /*!
+    * \brief Copy rows of \b table, one INSERT...SELECT per row.
+    * \param from follows "FROM <table> t". It picks the rows to copy, in
+    *        order, and is bound to \b binds.
+    * \param overrides maps a column to the SQL the copies get for it,
+    *        instead of the original's value.
+    * \param oldKeys if not null, gets the keys of the rows copied.
+    * \returns the key of each copy, paired by position with the row it was
+    *          copied from.
+    */
+   QList<int> copyRows( Brewtarget::DBTable table, QString const& from, QVariantList const& binds,
+                        QHash<QString,QString> const& overrides = QHash<QString,QString>(),
+                        QList<int>* oldKeys = 0 );
+
+   //! Make objects for the rows \b keys of \b table, which copyRows() wrote.
+   template<class T> QList<T*> adoptCopies( QHash<int,T*>* all, Brewtarget::DBTable table, QList<int> const& keys )
+   {
+      QList<T*> ret;
+      foreach( int key, keys )
+      {
+         T* tmp = new T(table, key);
+         all->insert(key, tmp);
+         forgetOnRollback(all, tmp);
+         ret.append(tmp);
+      }
+      return ret;
+   }
+
+   /*! If the scope that made \b obj rolls back, its row is gone, so take it
+    * out of \b all again and let everybody know.
+    */
+   template<class T> void forgetOnRollback( QHash<int,T*>* all, T* obj )
+   {
+      QPointer<T> ptr(obj);
+      TransactionScope::onRollback( [this, all, ptr]() {
+         if ( ! ptr )
+            return;
+         if ( all->value(ptr->_key) == ptr )
+            all->remove(ptr->_key);
+         emitDeleted(ptr.data());
+         ptr->deleteLater();
+      });
+   }
+   template<class T> void emitDeleted( T* obj ) { emit deletedSignal(obj); }
+   // Nobody listens for instructions going away.
+   void emitDeleted( Instruction* ) {}
+
+   //! Drops everything kept about the rows \b keys of \b table, which the purge removed.
+   void forgetPurged( Brewtarget::DBTable table, QList<int> const& keys );
+   //! Lets everybody know the objects for \b keys are gone, then deletes them.
+   template<class T> void forgetPurged( QHash<int,T*>& all, QList<int> const& keys )
+   {
+      foreach( int key, keys )
+      {
+         T* obj = all.value(key);
+         if ( ! obj )
+            continue;
+         emitDeleted(obj);
+         all.remove(key);
+         obj->deleteLater();
+      }
+   }
+
    // Do an sql update.
    void sqlUpdate( Brewtarget::DBTable table, QString const& setClause, QString const& whereClause );
 
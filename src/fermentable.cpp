@@ -289,10 +289,15 @@ void Fermentable::setIbuGalPerLb( double num )
 
 double Fermentable::equivSucrose_kg() const
 {
-   double ret = amount_kg() * yield_pct() * (1.0-moisture_pct()/100.0) / 100.0;
+   return equivSucrose_kg( type(), amount_kg(), yield_pct(), moisture_pct(), isMashed() );
+}
+
+double Fermentable::equivSucrose_kg( Type type, double amount_kg, double yield_pct, double moisture_pct, bool isMashed )
+{
+   double ret = amount_kg * yield_pct * (1.0-moisture_pct/100.0) / 100.0;
    
    // If this is a steeped grain...
-   if( type() == Grain && !isMashed() )
+   if( type == Grain && !isMashed )
       return 0.60 * ret; // Reduce the yield by 60%.
    else
       return ret;
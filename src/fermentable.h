@@ -142,6 +142,8 @@ public:
    const QString additionTimeStringTr() const;
    // Calculated getters.
    double equivSucrose_kg() const;
+   //! \brief equivSucrose_kg() for a fermentable we only have the columns of.
+   static double equivSucrose_kg( Type type, double amount_kg, double yield_pct, double moisture_pct, bool isMashed );
    bool isExtract() const;
    bool isSugar() const;
 
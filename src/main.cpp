@@ -58,13 +58,18 @@ int main(int argc, char **argv)
     * from QSettings.
     */
    const QCommandLineOption userDirectoryOption("user-dir", "Overwrite the directory used by the application with <directory>", "directory", QString());
+   //! \brief Writes how often each SQL statement ran, and how long it took, to <file> as JSON at exit.
+   const QCommandLineOption profileSqlOption("profile-sql", "Writes a JSON profile of the SQL statements run to <file> at exit", "file");
 
    parser.addOption(importFromXmlOption);
    parser.addOption(createBlankDBOption);
    parser.addOption(userDirectoryOption);
+   parser.addOption(profileSqlOption);
 
    parser.process(app);
 
+   if (parser.isSet(profileSqlOption)) Database::setProfileFile(parser.value(profileSqlOption));
+
    if (parser.isSet(importFromXmlOption)) importFromXml(parser.value(importFromXmlOption));
    if (parser.isSet(createBlankDBOption)) createBlankDb(parser.value(createBlankDBOption));
 
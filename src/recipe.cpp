@@ -44,10 +44,9 @@
 #include "water.h"
 #include "PreInstruction.h"
 #include "Algorithms.h"
-#include "IbuMethods.h"
-#include "ColorMethods.h"
 #include "HeatCalculations.h"
 #include "PhysicalConstants.h"
+#include "RecipeCalculator.h"
 #include "QueuedMethod.h"
 
 
@@ -215,12 +214,24 @@ Recipe::Recipe(Brewtarget::DBTable table, int key)
      _SRMColor(255,255,0),
      _og(1.000),
      _fg(1.000),
-     _uninitializedCalcs(true)
+     _uninitializedCalcs(true),
+     _loading(false),
+     _dirtyNodes(AllNodes),
+     _lastRecalcNodes(0),
+     _totalRecalcNodes(0),
+     _staleInputs(0)
 {
    setObjectName("Recipe"); 
 }
 
-Recipe::Recipe( Recipe const& other ) : BeerXMLElement(other)
+Recipe::Recipe( Recipe const& other )
+   : BeerXMLElement(other),
+     _uninitializedCalcs(true),
+     _loading(false),
+     _dirtyNodes(AllNodes),
+     _lastRecalcNodes(0),
+     _totalRecalcNodes(0),
+     _staleInputs(0)
 {
    setObjectName("Recipe"); 
 }
@@ -535,7 +546,12 @@ PreInstruction Recipe::boilFermentablesPre(double timeRemaining)
 
 bool Recipe::isFermentableSugar(Fermentable *fermy)
 {
-  if (fermy->type() == Fermentable::Sugar && fermy->name() == "Milk Sugar (Lactose)" )
+  return isFermentableSugar(fermy->type(), fermy->name());
+}
+
+bool Recipe::isFermentableSugar(Fermentable::Type type, QString const& name)
+{
+  if (type == Fermentable::Sugar && name == "Milk Sugar (Lactose)" )
     return false;
   else
     return true;
@@ -924,10 +940,9 @@ void Recipe::setBatchSize_l( double var )
 
    set( kBatchSizeProp, kBatchSize, tmp );
    
-   // NOTE: this is bad, but we have to call recalcAll(), because the estimated
-   // boil/batch volumes depend on the target volumes when there are no mash
-   // steps to actually provide an estimate for the volumes.
-   recalcAll();
+   // The estimated boil/batch volumes depend on the target volumes when
+   // there are no mash steps to actually provide an estimate for them.
+   recalcFrom(BatchSizeInput);
 }
 
 void Recipe::setBoilSize_l( double var )
@@ -945,10 +960,9 @@ void Recipe::setBoilSize_l( double var )
 
    set( kBoilSizeProp, kBoilSize, tmp );
    
-   // NOTE: this is bad, but we have to call recalcAll(), because the estimated
-   // boil/batch volumes depend on the target volumes when there are no mash
-   // steps to actually provide an estimate for the volumes.
-   recalcAll();
+   // The estimated boil/batch volumes depend on the target volumes when
+   // there are no mash steps to actually provide an estimate for them.
+   recalcFrom(BoilSizeInput);
 }
 
 void Recipe::setBoilTime_min( double var )
@@ -983,10 +997,9 @@ void Recipe::setEfficiency_pct( double var )
 
    set( kEfficiencyProp, kEfficiency, tmp );
 
-   // If you change the efficency, you really should recalc. And I'm afraid it
-   // means recalc all, since og and fg will change, which means your ratios
-   // change
-   recalcAll();
+   // If you change the efficency, og and fg will change, which means your
+   // ratios change.
+   recalcFrom(EfficiencyInput);
 }
 
 void Recipe::setAsstBrewer( const QString &var )
@@ -1226,120 +1239,103 @@ void Recipe::setKegPrimingFactor( double var )
 
 double Recipe::og()
 {
-   if( _uninitializedCalcs )
-      recalcAll();
+   pull(OgFgNode);
    return _og;
 }
 
 double Recipe::fg()
 {
-   if( _uninitializedCalcs )
-      recalcAll();
+   pull(OgFgNode);
    return _fg;
 }
 
 double Recipe::color_srm()
 {
-   if( _uninitializedCalcs )
-      recalcAll();
+   pull(ColorNode);
    return _color_srm;
 }
 
 double Recipe::ABV_pct()
 {
-   if( _uninitializedCalcs )
-      recalcAll();
+   pull(ABVNode);
    return _ABV_pct;
 }
 
 double Recipe::IBU()
 {
-   if( _uninitializedCalcs )
-      recalcAll();
+   pull(IBUNode);
    return _IBU;
 }
 
 QList<double> Recipe::IBUs()
 {
-   if( _uninitializedCalcs )
-      recalcAll();
+   pull(IBUNode);
    return _ibus;
 }
 
 double Recipe::boilGrav()
 {
-   if( _uninitializedCalcs )
-      recalcAll();
+   pull(BoilGravNode);
    return _boilGrav;
 }
 
 double Recipe::calories12oz()
 {
-   if( _uninitializedCalcs )
-      recalcAll();
+   pull(CaloriesNode);
    return _calories;
 }
 
 double Recipe::calories33cl()
 {
-   if( _uninitializedCalcs )
-      recalcAll();
+   pull(CaloriesNode);
    return _calories*3.3/3.55;
 }
 
 double Recipe::wortFromMash_l()
 {
-   if( _uninitializedCalcs )
-      recalcAll();
+   pull(VolumesNode);
    return _wortFromMash_l;
 }
 
 double Recipe::boilVolume_l()
 {
-   if( _uninitializedCalcs )
-      recalcAll();
+   pull(VolumesNode);
    return _boilVolume_l;
 }
 
 double Recipe::postBoilVolume_l()
 {
-   if( _uninitializedCalcs )
-      recalcAll();
+   pull(VolumesNode);
    return _postBoilVolume_l;
 }
 
 double Recipe::finalVolume_l()
 {
-   if( _uninitializedCalcs )
-      recalcAll();
+   pull(VolumesNode);
    return _finalVolume_l;
 }
 
 QColor Recipe::SRMColor()
 {
-   if( _uninitializedCalcs )
-      recalcAll();
+   pull(SRMColorNode);
    return _SRMColor;
 }
 
 double Recipe::grainsInMash_kg()
 {
-   if( _uninitializedCalcs )
-      recalcAll();
+   pull(GrainsInMashNode);
    return _grainsInMash_kg;
 }
 
 double Recipe::grains_kg()
 {
-   if( _uninitializedCalcs )
-      recalcAll();
+   pull(GrainsNode);
    return _grains_kg;
 }
 
 double Recipe::points()
 {
-   if( _uninitializedCalcs )
-      recalcAll();
+   pull(OgFgNode);
    return (_og-1.0)*1e3;
 }
 
@@ -1538,16 +1534,6 @@ void Recipe::remove( BeerXMLElement *var )
       Database::instance().removeIngredientFromRecipe( this, var );
 }
 
-double Recipe::batchSizeNoLosses_l()
-{
-   double ret = batchSize_l();
-   Equipment* e = equipment();
-   if( e )
-      ret += e->trubChillerLoss_l();
-   
-   return ret;
-}
-
 //==============================Recalculators==================================
 
 void Recipe::recalcAll()
@@ -1563,30 +1549,243 @@ void Recipe::recalcAll()
    if( !_recalcMutex.tryLock() )
       return;
    
-   // Times are in seconds, and are cumulative.
-   recalcGrainsInMash_kg(); // 0.01
-   recalcGrains_kg(); // 0.03
-   recalcVolumeEstimates(); // 0.06
-   recalcColor_srm(); // 0.08
-   recalcSRMColor(); // 0.08
-   recalcOgFg(); // 0.11
-   recalcABV_pct(); // 0.12
-   recalcBoilGrav(); // 0.14
-   recalcIBU(); // 0.15
-   recalcCalories();
+   _snapshot.fill(this);
+   _staleInputs = 0;
+   _staleHop = 0;
+   _dirtyNodes = AllNodes;
+   _hopIbus.clear();
+   _lastRecalcNodes = 0;
+
+   // The nodes are numbered so each comes after everything it reads.
+   for( int node = GrainsInMashNode; node <= CaloriesNode; node <<= 1 )
+      evaluate(node);
    
    _uninitializedCalcs = false;
    
    _recalcMutex.unlock();
 }
 
-void Recipe::recalcABV_pct()
+void Recipe::recalcDirty()
 {
-   double ret;
+   if( _uninitializedCalcs )
+   {
+      recalcAll();
+      return;
+   }
+
+   if( !_recalcMutex.tryLock() )
+      return;
+
+   refreshSnapshot();
+   _lastRecalcNodes = 0;
+   for( int node = GrainsInMashNode; node <= CaloriesNode; node <<= 1 )
+      evaluate(node);
+
+   _recalcMutex.unlock();
+}
+
+void Recipe::refreshSnapshot()
+{
+   if( _staleInputs & FermentablesInput )
+      _snapshot.setFermentables( fermentables() );
+   if( _staleInputs & HopsInput )
+   {
+      int i = 0;
+      // Just the one hop, if it is still there.
+      if( _staleHop )
+      {
+         while( i < _snapshot.hops.size() && _snapshot.hops.at(i).key != _staleHop->key() )
+            ++i;
+      }
+      if( _staleHop && i < _snapshot.hops.size() )
+         _snapshot.hops[i] = RecipeSnapshot::hopParams(_staleHop);
+      else
+         _snapshot.setHops( hops() );
+   }
+   if( _staleInputs & YeastsInput )
+      _snapshot.setYeasts( yeasts() );
+   if( _staleInputs & MashInput )
+      _snapshot.setMash( mash() );
+   if( _staleInputs & EquipmentInput )
+      _snapshot.setEquipment( equipment() );
+   if( _staleInputs & (EfficiencyInput | BatchSizeInput | BoilSizeInput) )
+      _snapshot.setTargets(this);
+   if( _staleInputs )
+      _snapshot.readOptions();
+
+   _staleInputs = 0;
+   _staleHop = 0;
+}
+
+RecipeSnapshot const& Recipe::currentSnapshot()
+{
+   if( _uninitializedCalcs )
+   {
+      recalcAll();
+      return _snapshot;
+   }
+
+   // Somebody up the stack is recalculating already. They get what we have.
+   if( _recalcMutex.tryLock() )
+   {
+      refreshSnapshot();
+      _recalcMutex.unlock();
+   }
+   return _snapshot;
+}
+
+void Recipe::setLoading(bool flag) { _loading = flag; }
+
+void Recipe::recalcFrom( int inputs, Hop* hop )
+{
+   // A row still being filled in has nothing to recalculate from.
+   if ( _loading )
+      return;
+
+   markDirty(inputs, hop);
+
+   // Inside a NotificationBatch, the changes pile up and are evaluated once.
+   if ( ! Database::instance().deferToBatchEnd(this, "recalcDirty") )
+      recalcDirty();
+}
+
+int Recipe::dependenciesOf( int node )
+{
+   switch( node )
+   {
+      case VolumesNode:  return GrainsInMashNode;
+      case ColorNode:    return VolumesNode;
+      case SRMColorNode: return ColorNode;
+      case OgFgNode:     return VolumesNode;
+      case ABVNode:      return OgFgNode;
+      case IBUNode:      return OgFgNode | VolumesNode;
+      case CaloriesNode: return OgFgNode;
+      default:           return 0;
+   }
+}
+
+int Recipe::readersOf( int inputs )
+{
+   int nodes = 0;
+
+   if( inputs & FermentablesInput )
+      nodes |= GrainsInMashNode | GrainsNode | VolumesNode | ColorNode | OgFgNode | BoilGravNode | IBUNode;
+   if( inputs & HopsInput )
+      nodes |= IBUNode;
+   if( inputs & YeastsInput )
+      nodes |= OgFgNode;
+   if( inputs & MashInput )
+      nodes |= VolumesNode;
+   if( inputs & EquipmentInput )
+      nodes |= VolumesNode | OgFgNode | IBUNode;
+   if( inputs & EfficiencyInput )
+      nodes |= OgFgNode | BoilGravNode;
+   if( inputs & BatchSizeInput )
+      nodes |= VolumesNode | IBUNode;
+   if( inputs & BoilSizeInput )
+      nodes |= VolumesNode | BoilGravNode;
+
+   return nodes;
+}
+
+void Recipe::markDirty( int inputs, Hop* hop )
+{
+   int dirty = readersOf(inputs);
+   int before;
+
+   // Follow the edges downstream until nothing new turns up.
+   do
+   {
+      before = dirty;
+      for( int node = GrainsInMashNode; node <= CaloriesNode; node <<= 1 )
+      {
+         if( dependenciesOf(node) & dirty )
+            dirty |= node;
+      }
+   } while( dirty != before );
+
+   // Every hop's IBUs depend on the og, the volumes and the equipment. When
+   // only one hop changed, only it needs doing again.
+   if( (dirty & (OgFgNode | VolumesNode)) || (inputs & EquipmentInput) )
+      _hopIbus.clear();
+   else if( hop )
+      _hopIbus.remove(hop->key());
+
+   // The same goes for copying them into the snapshot.
+   if( inputs & HopsInput )
+   {
+      bool onlyThisHop = hop && ( !(_staleInputs & HopsInput) || _staleHop == hop );
+      _staleHop = onlyThisHop ? hop : 0;
+   }
+   _staleInputs |= inputs;
+
+   _dirtyNodes |= dirty;
+}
+
+void Recipe::evaluate( int node )
+{
+   if( !(_dirtyNodes & node) )
+      return;
+
+   int dependencies = dependenciesOf(node);
+   for( int other = GrainsInMashNode; other < node; other <<= 1 )
+   {
+      if( dependencies & other )
+         evaluate(other);
+   }
+
+   // Clean before it runs, so whoever hears its signals does not start it again.
+   _dirtyNodes &= ~node;
+
+   switch( node )
+   {
+      case GrainsInMashNode: recalcGrainsInMash_kg(); break;
+      case GrainsNode:       recalcGrains_kg(); break;
+      case VolumesNode:      recalcVolumeEstimates(); break;
+      case ColorNode:        recalcColor_srm(); break;
+      case SRMColorNode:     recalcSRMColor(); break;
+      case OgFgNode:         recalcOgFg(); break;
+      case ABVNode:          recalcABV_pct(); break;
+      case BoilGravNode:     recalcBoilGrav(); break;
+      case IBUNode:          recalcIBU(); break;
+      case CaloriesNode:     recalcCalories(); break;
+      default: break;
+   }
+
+   ++_lastRecalcNodes;
+   ++_totalRecalcNodes;
+}
+
+void Recipe::pull( int node )
+{
+   if( _uninitializedCalcs )
+   {
+      recalcAll();
+      return;
+   }
+
+   // Somebody up the stack is recalculating already. They get what we have.
+   if( !(_dirtyNodes & node) || !_recalcMutex.tryLock() )
+      return;
 
-   // The complex formula, and variations comes from Ritchie Products Ltd, (Zymurgy, Summer 1995, vol. 18, no. 2)
-   // Michael L. Hall’s article Brew by the Numbers: Add Up What’s in Your Beer, and Designing Great Beers by Daniels.
-   ret = (76.08 * (_og_fermentable - _fg_fermentable) / (1.775 - _og_fermentable)) * (_fg_fermentable / 0.794);
+   refreshSnapshot();
+   evaluate(node);
+   _recalcMutex.unlock();
+}
+
+int Recipe::lastRecalcNodes() const
+{
+   return _lastRecalcNodes;
+}
+
+quint64 Recipe::totalRecalcNodes() const
+{
+   return _totalRecalcNodes;
+}
+
+void Recipe::recalcABV_pct()
+{
+   double ret = RecipeCalculator::ABV_pct(_og_fermentable, _fg_fermentable);
   
    if ( ret != _ABV_pct ) 
    {
@@ -1600,20 +1799,7 @@ void Recipe::recalcABV_pct()
 
 void Recipe::recalcColor_srm()
 {
-   Fermentable *ferm;
-   double mcu = 0.0;
-   double ret;
-   unsigned int i;
-
-   QList<Fermentable*> ferms = fermentables();
-   for( i = 0; static_cast<int>(i) < ferms.size(); ++i )
-   {
-      ferm = ferms[i];
-      // Conversion factor for lb/gal to kg/l = 8.34538.
-      mcu += ferm->color_srm()*8.34538 * ferm->amount_kg()/_finalVolumeNoLosses_l;
-   }
-
-   ret = ColorMethods::mcuToSrm(mcu);
+   double ret = RecipeCalculator::color_srm(_snapshot, _finalVolumeNoLosses_l);
  
    if ( _color_srm != ret ) 
    {
@@ -1628,29 +1814,33 @@ void Recipe::recalcColor_srm()
 
 void Recipe::recalcIBU()
 {
-   unsigned int i;
    double ibus = 0.0;
    double tmp = 0.0;
    
-   // Bitterness due to hops...
+   // Bitterness due to hops. Those not changed since last time keep their IBUs.
+   QHash<int,double> hopIbus;
    _ibus.clear();
-   QList<Hop*> hhops = hops();
-   for( i = 0; static_cast<int>(i) < hhops.size(); ++i )
+   for( int i = 0; i < _snapshot.hops.size(); ++i )
    {
-      tmp = ibuFromHop(hhops[i]);
+      HopParams const& hop = _snapshot.hops.at(i);
+      QHash<int,double>::const_iterator cached = _hopIbus.constFind(hop.key);
+      if( cached != _hopIbus.constEnd() )
+         tmp = cached.value();
+      else
+      {
+         tmp = RecipeCalculator::hopIbu(_snapshot, hop, _og, _finalVolumeNoLosses_l);
+         ++_lastRecalcNodes;
+         ++_totalRecalcNodes;
+      }
+      hopIbus.insert(hop.key, tmp);
       _ibus.append(tmp);
       ibus += tmp;
    }
+   // Removed hops drop out here.
+   _hopIbus = hopIbus;
 
    // Bitterness due to hopped extracts...
-   QList<Fermentable*> ferms = fermentables();
-   for( i = 0; static_cast<int>(i) < ferms.size(); ++i )
-   {
-      // Conversion factor for lb/gal to kg/l = 8.34538.
-      ibus +=
-              ferms[i]->ibuGalPerLb() *
-              (ferms[i]->amount_kg() / batchSize_l()) / 8.34538;
-   }
+   ibus += RecipeCalculator::extractIbu(_snapshot);
 
    if ( ibus != _IBU ) 
    {
@@ -1664,106 +1854,41 @@ void Recipe::recalcIBU()
 
 void Recipe::recalcVolumeEstimates()
 {
-   double waterAdded_l;
-   double absorption_lKg;
-   double tmp = 0.0;
-   double tmp_wfm = 0.0;
-   double tmp_bv = 0.0;
-   double tmp_fv = 0.0;
-   double tmp_pbv = 0.0;
-
-   // wortFromMash_l ==========================
-   if( mash() == 0 )
-      _wortFromMash_l = 0.0;
-   else
-   {
-      waterAdded_l = mash()->totalMashWater_l();
-      if( equipment() != 0 )
-         absorption_lKg = equipment()->grainAbsorption_LKg();
-      else
-         absorption_lKg = PhysicalConstants::grainAbsorption_Lkg;
+   RecipeStats stats;
+   RecipeCalculator::volumes(_snapshot, _grainsInMash_kg, stats);
 
-      tmp_wfm = (waterAdded_l - absorption_lKg * _grainsInMash_kg);
-   }
-   
-   // boilVolume_l ==============================
-   
-   if( equipment() != 0 )
-      tmp = tmp_wfm - equipment()->lauterDeadspace_l() + equipment()->topUpKettle_l();
-   else
-      tmp = tmp_wfm;
-   
-   // Need to account for extract/sugar volume also.
-   QList<Fermentable*> ferms = fermentables();
-   foreach( Fermentable* f, ferms )
-   {
-      Fermentable::Type type = f->type();
-      if( type == Fermentable::Extract )
-         tmp += f->amount_kg() / PhysicalConstants::liquidExtractDensity_kgL;
-      else if( type == Fermentable::Sugar )
-         tmp += f->amount_kg() / PhysicalConstants::sucroseDensity_kgL;
-      else if( type == Fermentable::Dry_Extract )
-         tmp += f->amount_kg() / PhysicalConstants::dryExtractDensity_kgL;
-   }
-   
-   if( tmp <= 0.0 )
-      tmp = boilSize_l(); // Give up.
- 
-   tmp_bv = tmp;
-   
-   // finalVolume_l ==============================
-   
-   // NOTE: the following figure is not based on the other volume estimates
-   // since we want to show og,fg,ibus,etc. as if the collected wort is correct.
-   _finalVolumeNoLosses_l = batchSizeNoLosses_l();
-   if( equipment() != 0 )
-   {
-      //_finalVolumeNoLosses_l = equipment()->wortEndOfBoil_l(tmp_bv) + equipment()->topUpWater_l();
-      tmp_fv = equipment()->wortEndOfBoil_l(tmp_bv) + equipment()->topUpWater_l() - equipment()->trubChillerLoss_l();
-   }
-   else
-   {
-      _finalVolume_l = tmp_bv - 4.0; // This is just shooting in the dark. Can't do much without an equipment.
-      //_finalVolumeNoLosses_l = _finalVolume_l;
-   }
-   
-   // postBoilVolume_l ===========================
+   _finalVolumeNoLosses_l = stats.finalVolumeNoLosses_l;
 
-   if( equipment() != 0 )
-      tmp_pbv = equipment()->wortEndOfBoil_l( tmp_bv );
-   else
-      tmp_pbv = batchSize_l(); // Give up.
-
-   if ( tmp_wfm != _wortFromMash_l )
+   if ( stats.wortFromMash_l != _wortFromMash_l )
    {
-      _wortFromMash_l = tmp_wfm;
+      _wortFromMash_l = stats.wortFromMash_l;
       if (!_uninitializedCalcs)
       {
         emit changed( metaProperty("wortFromMash_l"), _wortFromMash_l );
       }
    }
 
-   if ( tmp_bv != _boilVolume_l )
+   if ( stats.boilVolume_l != _boilVolume_l )
    {
-      _boilVolume_l = tmp_bv;
+      _boilVolume_l = stats.boilVolume_l;
       if (!_uninitializedCalcs)
       {
         emit changed( metaProperty("boilVolume_l"), _boilVolume_l );
       }
    }
    
-   if ( tmp_fv != _finalVolume_l )
+   if ( stats.finalVolume_l != _finalVolume_l )
    {
-      _finalVolume_l = tmp_fv;
+      _finalVolume_l = stats.finalVolume_l;
       if (!_uninitializedCalcs)
       {
         emit changed( metaProperty("finalVolume_l"), _finalVolume_l );
       }
    }
 
-   if ( tmp_pbv != _postBoilVolume_l )
+   if ( stats.postBoilVolume_l != _postBoilVolume_l )
    {
-      _postBoilVolume_l = tmp_pbv;
+      _postBoilVolume_l = stats.postBoilVolume_l;
       if (!_uninitializedCalcs)
       {
         emit changed( metaProperty("postBoilVolume_l"), _postBoilVolume_l );
@@ -1773,19 +1898,7 @@ void Recipe::recalcVolumeEstimates()
 
 void Recipe::recalcGrainsInMash_kg()
 {
-   unsigned int i, size;
-   double ret = 0.0;
-   Fermentable* ferm;
-   
-   QList<Fermentable*> ferms = fermentables();
-   size = ferms.size();
-   for( i = 0; i < size; ++i )
-   {
-      ferm = ferms[i];
-      
-      if( ferm->type() == Fermentable::Grain && ferm->isMashed() )
-         ret += ferm->amount_kg();
-   }
+   double ret = RecipeCalculator::grainsInMash_kg(_snapshot);
 
    if ( ret != _grainsInMash_kg ) 
    {
@@ -1799,13 +1912,7 @@ void Recipe::recalcGrainsInMash_kg()
 
 void Recipe::recalcGrains_kg()
 {
-   unsigned int i, size;
-   double ret = 0.0;
-
-   QList<Fermentable*> ferms = fermentables();
-   size = ferms.size();
-   for( i = 0; i < size; ++i )
-      ret += ferms[i]->amount_kg();
+   double ret = RecipeCalculator::grains_kg(_snapshot);
 
    if ( ret != _grains_kg ) 
    {
@@ -1831,34 +1938,9 @@ void Recipe::recalcSRMColor()
    }
 }
 
-// the formula in here are taken from http://hbd.org/ensmingr/
 void Recipe::recalcCalories()
 {
-   double startPlato, finishPlato, RE, abw, oog, ffg, tmp;
-
-   oog = _og;
-   ffg = _fg;
-
-   // Need to translate OG and FG into plato
-   startPlato  = -463.37 + ( 668.72 * oog ) - (205.35 * oog * oog);
-   finishPlato = -463.37 + ( 668.72 * ffg ) - (205.35 * ffg * ffg);
-
-   // RE (real extract)
-   RE = (0.1808 * startPlato) + (0.8192 * finishPlato);
-
-   // Alcohol by weight?
-   abw = (startPlato-RE)/(2.0665 - (0.010665 * startPlato));
-
-   // The final results of this formular are calories per 100 ml. 
-   // The 3.55 puts it in terms of 12 oz. I really should have stored it
-   // without that adjust.
-   tmp = ((6.9*abw) + 4.0 * (RE-0.1)) * ffg * 3.55;
-
-   //! If there are no fermentables in the recipe, if there is no mash, etc.,
-   //  then the calories/12 oz ends up negative. Since negative doesn't make
-   //  sense, set it to 0
-   if ( tmp < 0 )
-      tmp = 0;
+   double tmp = RecipeCalculator::calories(_og, _fg);
 
    if ( tmp != _calories ) 
    {
@@ -1873,74 +1955,14 @@ void Recipe::recalcCalories()
 // other efficiency calculations need access to the maximum theoretical sugars
 // available. The only way I can see of doing that which doesn't suck is to
 // split that calcuation out of recalcOgFg();
-QHash<QString,double> Recipe::calcTotalPoints()
+RecipeCalculator::Sugars Recipe::calcTotalPoints()
 {
-   int i;
-   double sugar_kg_ignoreEfficiency = 0.0;
-   double sugar_kg                  = 0.0;
-   double nonFermentableSugars_kg    = 0.0;
-   double lateAddition_kg           = 0.0;
-   double lateAddition_kg_ignoreEff = 0.0;
-
-   Fermentable* ferm;
-
-   QList<Fermentable*> ferms = fermentables();
-   QHash<QString,double> ret;
-   
-   for( i = 0; static_cast<int>(i) < ferms.size(); ++i )
-   {
-      ferm = ferms[i];
-
-      // If we have some sort of non-grain, we have to ignore efficiency.
-      if( ferm->isSugar() || ferm->isExtract() )
-      {
-         sugar_kg_ignoreEfficiency += ferm->equivSucrose_kg();
-
-         if (ferm->addAfterBoil())
-            lateAddition_kg_ignoreEff += ferm->equivSucrose_kg();
-
-         if ( !isFermentableSugar(ferm) )
-           nonFermentableSugars_kg += ferm->equivSucrose_kg();
-      }
-      else
-      {
-         sugar_kg += ferm->equivSucrose_kg();
-
-         if (ferm->addAfterBoil())
-            lateAddition_kg += ferm->equivSucrose_kg();
-      }
-   }   
-   
-   ret.insert("sugar_kg", sugar_kg);
-   ret.insert("nonFermentableSugars_kg", nonFermentableSugars_kg);
-   ret.insert("sugar_kg_ignoreEfficiency", sugar_kg_ignoreEfficiency);
-   ret.insert("lateAddition_kg", lateAddition_kg);
-   ret.insert("lateAddition_kg_ignoreEff", lateAddition_kg_ignoreEff);
-
-   return ret;
-
+   return RecipeCalculator::totalPoints( currentSnapshot() );
 }
 
 void Recipe::recalcBoilGrav()
 {
-   double sugar_kg = 0.0;
-   double sugar_kg_ignoreEfficiency = 0.0;
-   double lateAddition_kg           = 0.0;
-   double lateAddition_kg_ignoreEff = 0.0;
-   double ret;
-   QHash<QString,double> sugars;
-
-   sugars = calcTotalPoints();
-   sugar_kg = sugars.value("sugar_kg");
-   sugar_kg_ignoreEfficiency = sugars.value("sugar_kg_ignoreEfficiency");
-   lateAddition_kg = sugars.value("lateAddition_kg");
-   lateAddition_kg_ignoreEff = sugars.value("lateAddition_kg_ignoreEff");
-   
-   // Since the efficiency refers to how much sugar we get into the fermenter,
-   // we need to adjust for that here.
-   sugar_kg = (efficiency_pct()/100.0 * (sugar_kg - lateAddition_kg) + sugar_kg_ignoreEfficiency - lateAddition_kg_ignoreEff);
-
-   ret = Algorithms::PlatoToSG_20C20C( Algorithms::getPlato(sugar_kg, boilSize_l()) );
+   double ret = RecipeCalculator::boilGrav(_snapshot);
  
    if ( ret != _boilGrav )
    {
@@ -1954,21 +1976,8 @@ void Recipe::recalcBoilGrav()
 
 void Recipe::recalcOgFg()
 {
-   unsigned int i;
-   double plato;
-   double sugar_kg = 0;
-   double sugar_kg_ignoreEfficiency = 0.0;
-   double nonFermentableSugars_kg = 0.0;
-   double kettleWort_l = 0.0;
-   double postBoilWort_l = 0.0;
-   double ratio = 0.0;
-   double ferm_kg = 0.0;
-   double attenuation_pct = 0.0;
-   double tmp_og, tmp_fg, tmp_pnts, tmp_ferm_pnts, tmp_nonferm_pnts;
-   Yeast* yeast;
-   QHash<QString,double> sugars;
-  
-   _og_fermentable = _fg_fermentable = 0.0;
+   RecipeStats stats;
+   double tmp_og, tmp_fg;
 
    // The first time through really has to get the _og and _fg from the
    // database, not use the initialized values of 1. I (maf) tried putting
@@ -1984,78 +1993,11 @@ void Recipe::recalcOgFg()
       _fg = Brewtarget::toDouble(this, kFG, "Recipe::recalcOgFg()");
    }
 
-   // Find out how much sugar we have.
-   sugars = calcTotalPoints();
-   sugar_kg                  = sugars.value("sugar_kg");  // Mass of sugar that *is* affected by mash efficiency
-   sugar_kg_ignoreEfficiency = sugars.value("sugar_kg_ignoreEfficiency");  // Mass of sugar that *is not* affected by mash efficiency
-   nonFermentableSugars_kg    = sugars.value("nonFermentableSugars_kg");  // Mass of sugar that is not fermentable (also counted in sugar_kg_ignoreEfficiency)
-
-   // We might lose some sugar in the form of Trub/Chiller loss and lauter deadspace.
-   if( equipment() != 0 )
-   {
-      
-      kettleWort_l = (_wortFromMash_l - equipment()->lauterDeadspace_l()) + equipment()->topUpKettle_l();
-      postBoilWort_l = equipment()->wortEndOfBoil_l(kettleWort_l);
-      ratio = (postBoilWort_l - equipment()->trubChillerLoss_l()) / postBoilWort_l;
-      if( ratio > 1.0 ) // Usually happens when we don't have a mash yet.
-         ratio = 1.0;
-      else if( ratio < 0.0 )
-         ratio = 0.0;
-      else if( Algorithms::isNan(ratio) )
-         ratio = 1.0;
-      // Ignore this again since it should be included in efficiency.
-      //sugar_kg *= ratio;
-      sugar_kg_ignoreEfficiency *= ratio;
-      if ( nonFermentableSugars_kg != 0.0 )
-         nonFermentableSugars_kg *= ratio;
-   }
-
-   // Total sugars after accounting for efficiency and mash losses. Implicitly includes non-fermentable sugars
-   sugar_kg = sugar_kg * efficiency_pct()/100.0 + sugar_kg_ignoreEfficiency;
-   plato = Algorithms::getPlato( sugar_kg, _finalVolumeNoLosses_l);
-
-   tmp_og = Algorithms::PlatoToSG_20C20C( plato );  // og from all sugars
-   tmp_pnts = (tmp_og-1)*1000.0;  // points from all sugars
-   if ( nonFermentableSugars_kg != 0.0 )
-   {
-      ferm_kg = sugar_kg - nonFermentableSugars_kg;  // Mass of only fermentable sugars
-      plato = Algorithms::getPlato( ferm_kg, _finalVolumeNoLosses_l);  // Plato from fermentable sugars
-      _og_fermentable = Algorithms::PlatoToSG_20C20C( plato );  // og from only fermentable sugars
-      plato = Algorithms::getPlato( nonFermentableSugars_kg, _finalVolumeNoLosses_l);  // Plate from non-fermentable sugars 
-      tmp_nonferm_pnts = ((Algorithms::PlatoToSG_20C20C( plato ))-1)*1000.0;  // og points from non-fermentable sugars
-   }
-   else
-   {
-      _og_fermentable = tmp_og;
-      tmp_nonferm_pnts = 0;
-   }
-
-   // Calculage FG
-   QList<Yeast*> yeasties = yeasts();
-   for( i = 0; static_cast<int>(i) < yeasties.size(); ++i )
-   {
-      yeast = yeasties[i];
-      // Get the yeast with the greatest attenuation.
-      if( yeast->attenuation_pct() > attenuation_pct )
-         attenuation_pct = yeast->attenuation_pct();
-   }
-   if( yeasties.size() > 0 && attenuation_pct <= 0.0 ) // This means we have yeast, but they neglected to provide attenuation percentages.
-      attenuation_pct = 75.0; // 75% is an average attenuation.
-   
-   if ( nonFermentableSugars_kg != 0.0 )
-   {
-      tmp_ferm_pnts = (tmp_pnts-tmp_nonferm_pnts) * (1.0 - attenuation_pct/100.0);  // fg points from fermentable sugars
-      tmp_pnts = tmp_ferm_pnts + tmp_nonferm_pnts;  // FG points from both fermentable and non-fermentable sugars
-      //tmp_pnts *= (1.0 - attenuation_pct/100.0);  // WTF, this completely ignores all the calculations about non-fermentable sugars and just converts everything!
-      tmp_fg =  1 + tmp_pnts/1000.0;  // new FG value
-      _fg_fermentable =  1 + tmp_ferm_pnts/1000.0;  // FG from fermentables only
-   }
-   else
-   {
-      tmp_pnts *= (1.0 - attenuation_pct/100.0);
-      tmp_fg =  1 + tmp_pnts/1000.0;
-      _fg_fermentable = tmp_fg;
-   }
+   RecipeCalculator::ogFg(_snapshot, _wortFromMash_l, _finalVolumeNoLosses_l, stats);
+   tmp_og = stats.og;
+   tmp_fg = stats.fg;
+   _og_fermentable = stats.og_fermentable;
+   _fg_fermentable = stats.fg_fermentable;
    
    if ( _og != tmp_og ) 
    {
@@ -2091,63 +2033,17 @@ void Recipe::recalcOgFg()
 
 double Recipe::ibuFromHop(Hop const* hop)
 {
-   Equipment* equip = equipment();
-   double ibus = 0.0;
-   double fwhAdjust = Brewtarget::toDouble(Brewtarget::option("firstWortHopAdjustment", 1.1).toString(), "Recipe::ibmFromHop()");
-   double mashHopAdjust = Brewtarget::toDouble(Brewtarget::option("mashHopAdjustment", 0).toString(), "Recipe::ibmFromHop()");
-   
    if( hop == 0 )
       return 0.0;
-   
-   double AArating = hop->alpha_pct()/100.0;
-   double grams = hop->amount_kg()*1000.0;
-   double minutes = hop->time_min();
-   // Assume 100% utilization until further notice
-   double hopUtilization = 1.0;
-   // Assume 60 min boil until further notice
-   int boilTime = 60;
-
-   // NOTE: we used to carefully calculate the average boil gravity and use it in the
-   // IBU calculations. However, due to John Palmer
-   // (http://homebrew.stackexchange.com/questions/7343/does-wort-gravity-affect-hop-utilization),
-   // it seems more appropriate to just use the OG directly, since it is the total
-   // amount of break material that truly affects the IBUs.
-   
-   if( equip )
-   {
-      hopUtilization = equip->hopUtilization_pct() / 100.0;
-      boilTime = equip->boilTime_min();
-   }
-   
-   if( hop->use() == Hop::Boil)
-      ibus = IbuMethods::getIbus( AArating, grams, _finalVolumeNoLosses_l, _og, minutes );
-   else if( hop->use() == Hop::First_Wort )
-      ibus = fwhAdjust * IbuMethods::getIbus( AArating, grams, _finalVolumeNoLosses_l, _og, boilTime );
-   else if( hop->use() == Hop::Mash && mashHopAdjust > 0.0 )
-      ibus = mashHopAdjust * IbuMethods::getIbus( AArating, grams, _finalVolumeNoLosses_l, _og, boilTime );
-
-   // Adjust for hop form. Tinseth's table was created from whole cone data,
-   // and it seems other formulae are optimized that way as well. So, the
-   // utilization is considered unadjusted for whole cones, and adjusted
-   // up for plugs and pellets.
-   //
-   // - http://www.realbeer.com/hops/FAQ.html
-   // - https://groups.google.com/forum/#!topic/brewtarget-help/mv2qvWBC4sU
-   switch( hop->form() ) {
-   case Hop::Plug:
-      hopUtilization *= 1.02;
-      break;
-   case Hop::Pellet:
-      hopUtilization *= 1.10;
-      break;
-   default:
-      break;
-   }
 
-   // Adjust for hop utilization. 
-   ibus *= hopUtilization;
+   return RecipeCalculator::hopIbu( currentSnapshot(), RecipeSnapshot::hopParams(hop), _og, _finalVolumeNoLosses_l );
+}
 
-   return ibus;
+RecipeSnapshot Recipe::snapshot()
+{
+   RecipeSnapshot snap;
+   snap.fill(this);
+   return snap;
 }
 
 bool Recipe::isValidType( const QString &str )
@@ -2238,41 +2134,42 @@ QList<QString> Recipe::getReagents( QList<MashStep*> msteps )
 
 //==========================Accept changes from ingredients====================
 
+// Each of these only re-evaluates what reads the thing that changed. Inside
+// a NotificationBatch, that happens once, at the end.
 void Recipe::acceptEquipChange(QMetaProperty prop, QVariant val)
 {
-   recalcAll();
+   recalcFrom(EquipmentInput);
 }
 
 void Recipe::acceptFermChange(QMetaProperty prop, QVariant val)
 {
-   recalcAll();
+   recalcFrom(FermentablesInput);
 }
 
 void Recipe::onFermentableChanged()
 {
-   recalcAll();
+   recalcFrom(FermentablesInput);
 }
 
 void Recipe::acceptHopChange(QMetaProperty prop, QVariant val)
 {
-   recalcIBU();
+   // No sender means the list of hops changed, not one of them.
+   recalcFrom(HopsInput, qobject_cast<Hop*>(sender()));
 }
 
 void Recipe::acceptHopChange(Hop* hop) 
 {
-   recalcIBU();
+   recalcFrom(HopsInput, hop);
 }
 
 void Recipe::acceptYeastChange(QMetaProperty prop, QVariant val)
 {
-   recalcOgFg();
-   recalcABV_pct();
+   recalcFrom(YeastsInput);
 }
 
 void Recipe::acceptYeastChange(Yeast* yeast)
 {
-   recalcOgFg();
-   recalcABV_pct();
+   recalcFrom(YeastsInput);
 }
 
 void Recipe::acceptMashChange(QMetaProperty prop, QVariant val)
@@ -2282,13 +2179,13 @@ void Recipe::acceptMashChange(QMetaProperty prop, QVariant val)
    if ( mashSend == 0 )
       return;
    
-   recalcAll();
+   recalcFrom(MashInput);
 }
 
 void Recipe::acceptMashChange(Mash* newMash)
 {
    if ( newMash == mash() )
-      recalcAll();
+      recalcFrom(MashInput);
 }
 
 double Recipe::targetCollectedWortVol_l() {
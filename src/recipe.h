@@ -27,15 +27,19 @@ class Recipe;
 #include <QColor>
 #include <QVariant>
 #include <QList>
+#include <QHash>
 #include <QDomNode>
 #include <QDomDocument>
 #include <QString>
 #include <QDate>
 #include <QMutex>
+#include <QPointer>
 #include "BeerXMLElement.h"
 #include "hop.h" // Dammit! Have to include these for Hop::Use and Misc::Use.
 #include "misc.h"
 #include "brewnote.h"
+#include "RecipeCalculator.h"
+#include "RecipeSnapshot.h"
 
 // Forward declarations.
 //class Hop;
@@ -275,6 +279,14 @@ public:
    double grainsInMash_kg();
    double grains_kg();
    QList<double> IBUs();
+
+   //! \brief Calculations the last recalculation evaluated, hops' IBUs included.
+   int lastRecalcNodes() const;
+   //! \brief Calculations evaluated since the recipe was loaded.
+   quint64 totalRecalcNodes() const;
+
+   //! \brief Everything the calculations read, copied out now. Use it with RecipeCalculator from any thread.
+   RecipeSnapshot snapshot();
    
    // Relational getters
    QList<Hop*> hops() const;
@@ -298,6 +310,7 @@ public:
    bool hasBoilFermentable();
    bool hasBoilExtract();
    static bool isFermentableSugar(Fermentable*);
+   static bool isFermentableSugar(Fermentable::Type type, QString const& name);
    PreInstruction addExtracts(double timeRemaining) const;
    
    // Helpers
@@ -306,10 +319,14 @@ public:
    QList<QString> getReagents( QList<Fermentable*> ferms );
    QList<QString> getReagents( QList<MashStep*> msteps );
    QList<QString> getReagents( QList<Hop*> hops, bool firstWort = false );
-   QHash<QString,double> calcTotalPoints();
+   //! \brief The sugars of the fermentables, from the current snapshot.
+   RecipeCalculator::Sugars calcTotalPoints();
    
    static QString classNameStr();
 
+   //! While true, changes to the inputs do not recalculate anything.
+   void setLoading(bool flag);
+
 signals:
    //! \brief Emitted when \c name() changes.
    void changedName(const QString&);
@@ -387,10 +404,71 @@ private:
    // True when constructed, indicates whether recalcAll has been called.
    bool _uninitializedCalcs;
    QMutex _uninitializedCalcsMutex;
+   bool _loading;
    QMutex _recalcMutex;
-   
-   // Batch size without losses.
-   double batchSizeNoLosses_l();
+
+   /* The calculated properties form a dependency graph. Each node is one of
+    * the recalculators below, and is evaluated after the nodes it reads.
+    * Changing an input marks the nodes reading it dirty, along with
+    * everything downstream of them. Only dirty nodes are evaluated, when a
+    * getter wants their value or at the end of the change.
+    */
+   enum CalcNode
+   {
+      GrainsInMashNode = 0x001,
+      GrainsNode       = 0x002,
+      VolumesNode      = 0x004,
+      ColorNode        = 0x008,
+      SRMColorNode     = 0x010,
+      OgFgNode         = 0x020,
+      ABVNode          = 0x040,
+      BoilGravNode     = 0x080,
+      IBUNode          = 0x100,
+      CaloriesNode     = 0x200,
+      AllNodes         = 0x3ff
+   };
+   // What the calculations read, besides each other.
+   enum CalcInput
+   {
+      FermentablesInput = 0x01,
+      HopsInput         = 0x02,
+      YeastsInput       = 0x04,
+      MashInput         = 0x08,
+      EquipmentInput    = 0x10,
+      EfficiencyInput   = 0x20,
+      BatchSizeInput    = 0x40,
+      BoilSizeInput     = 0x80
+   };
+   int _dirtyNodes;
+   // The IBUs of each hop, by key. Hops not in here are recalculated.
+   QHash<int,double> _hopIbus;
+   int _lastRecalcNodes;
+   quint64 _totalRecalcNodes;
+
+   // What the recalculators read. Inputs in _staleInputs changed since it
+   // was last copied. _staleHop is the only hop that changed, if just one did.
+   RecipeSnapshot _snapshot;
+   int _staleInputs;
+   QPointer<Hop> _staleHop;
+
+   //! \returns the nodes \b node reads.
+   static int dependenciesOf( int node );
+   //! \returns the nodes that read one of \b inputs.
+   static int readersOf( int inputs );
+   //! Marks what reads \b inputs dirty, and everything downstream. \b hop is the one hop that changed, if any.
+   void markDirty( int inputs, Hop* hop = 0 );
+   //! Evaluates \b node, after the nodes it reads, if it is dirty.
+   void evaluate( int node );
+   //! Brings \b node up to date before a getter hands out its value.
+   void pull( int node );
+   //! Recalculates after a change to \b inputs, at the end of the batch if there is one.
+   void recalcFrom( int inputs, Hop* hop = 0 );
+   //! Evaluates every dirty node.
+   Q_INVOKABLE void recalcDirty();
+   //! Copies the stale inputs into _snapshot again.
+   void refreshSnapshot();
+   //! \returns _snapshot, brought up to date unless a recalculation is already using it.
+   RecipeSnapshot const& currentSnapshot();
    
    // Some recalculators for calculated properties.
    
@@ -398,7 +476,7 @@ private:
     * 
     * WARNING: this call took 0.15s in rev 916!
     */
-   void recalcAll();
+   Q_INVOKABLE void recalcAll();
    // Emits changed(ABV_pct). Depends on: _og, _fg
    Q_INVOKABLE void recalcABV_pct();
    // Emits changed(color_srm). Depends on: _finalVolume_l